@@ -3,29 +3,83 @@
 
 #include "stdafx.h"
 #include "cmd.h"
+#include "proc.h"
 #include "parse.h"
 #include "toc.h"
+#include "render.h"
+#include "renderer.h"
+#include "cache.h"
+#include "proxy.h"
+#include "prefetch.h"
+#include "task.h"
+#include "serve.h"
 #include "wkhtmltopdf_cmd.h"
-#include "pdftk_cmd.h"
+#include "merge.h"
 #include "util.h"
 #include "log.h"
 
+struct conversion;
+
+/* The stages of one segment of a conversion */
+struct segment_stage {
+	struct conversion* conv; /* conversion the segment belongs to */
+	size_t index; /* index of the segment in the jobs of conv */
+	struct task* rendered; /* finished once the segment is final */
+};
+
+/* State shared by the stages of a conversion */
+struct conversion {
+	struct pdf_info info; /* info from the main part of the instruction file */
+	struct task_graph graph; /* stages of the conversion */
+	struct child_group group; /* children started for the conversion */
+	FILE* input; /* instruction file while it is read, or NULL */
+	size_t parsed; /* segments whose information was read */
+	int proxied; /* nonzero once open_proxy() was called for info */
+	int shared; /* nonzero if the process runs other jobs too */
+	HANDLE done; /* set when the conversion ends, or NULL */
+	HANDLE watchdog; /* thread enforcing the job deadline, or NULL */
+	FILE* outline_html_file; /* HTML table of contents file, or NULL */
+	struct toc_list toc; /* titles of a TOC typeset without HTML */
+	UINT* merge_files_arr; /* IDs of temp files for each segment */
+	struct render_job* jobs; /* conversion state of each segment */
+	struct segment_stage* stages; /* stages of each segment */
+	struct merge_job* merge; /* merge of segments as they finish, or NULL */
+	struct prefetch* prefetch; /* downloads of segment HTML, or NULL */
+	unsigned long int toc_pages; /* pages of the segments in the TOC */
+	UINT cover_page_id; /* ID of cover page PDF */
+	UINT outline_pdf_id; /* ID of TOC PDF temp file */
+	UINT watermark_id; /* ID of watermark PDF temp file */
+	UINT stamp_ids[kSTAMP_PARTS]; /* IDs of header and footer PDFs, or 0 */
+	TCHAR cover_page_path[MAX_PATH + 1]; /* path to cover page PDF */
+	TCHAR outline_pdf[MAX_PATH + 1]; /* path to TOC PDF */
+};
+
 static void do_get_cover_page(UINT*, const struct pdf_info*);
 static void do_get_watermark(UINT*, const struct pdf_info*);
+static void do_get_stamps(UINT*, const struct pdf_info*);
+static void cover_page_task(void*);
+static void watermark_task(void*);
+static void stamps_task(void*);
+static void segments_task(void*);
+static void segment_ready(struct render_job*, void*);
+static void append_task(void*);
+static void outline_task(void*);
+static void toc_task(void*);
+static void merge_task(void*);
+static enum error_code run_job(LPCTSTR, LPTSTR*);
+static void end_job(struct conversion*, enum error_code);
+static void remove_tmp_id(UINT*);
+static unsigned __stdcall job_deadline(void*);
 
+/*
+ * With a single argument, convert the instruction file it names. With
+ * --serve and a pipe name, accept instruction files over that named
+ * pipe until the process is terminated, running as many at once as the
+ * optional third argument allows.
+ */
 int _tmain(int argc, _TCHAR* argv[])
 {
-	struct pdf_info info; /* info from the main part of the instruction file */
-	FILE* input = NULL; /* instruction file */
-	FILE* outline_html_file = NULL; /* HTML table of contents file */
-	UINT* merge_files_arr = NULL; /* IDs of temp files for each segment */
-	unsigned long int curr_pt = 0; /* current segment number */
-	unsigned long int total_pages = 0;
-	UINT cover_page_id = 0; /* ID of cover page PDF */
-	UINT outline_pdf_id = 0; /* ID of TOC PDF temp file */
-	UINT watermark_id = 0; /* ID of watermark PDF temp file */
-	TCHAR cover_page_path[MAX_PATH + 1] = _T(""); /* path to cover page PDF */
-	TCHAR outline_pdf[MAX_PATH + 1] = _T(""); /* path to TOC PDF */
+	enum error_code ret = E_SUCCESS;
 
 	errorfd = logfd = require_log(NULL);
 	setbuf(errorfd, NULL);
@@ -34,143 +88,579 @@ int _tmain(int argc, _TCHAR* argv[])
 	if(argc < 2)
 		errorout(E_ARG, _T("Instruction file name required"));
 
-	input = require_open_file(argv[1], _T("r"));
+	if(_tcscmp(argv[1], _T("--serve")) == 0) {
+		if(argc < 3)
+			errorout(E_ARG, _T("Pipe name required"));
+
+		serve(argv[2], argc > 3 ? require_strtoul(argv[3], NULL, 10) : 0,
+				run_job);
+	} else {
+		ret = run_job(argv[1], NULL);
+	}
+
+	release_file(logfd);
+	return ret;
+}
+
+/*
+ * Convert the instruction file at the given path. If target is not
+ * NULL, the value it points to is set to a copy of the path of the PDF
+ * that was written, which must be passed to free(). If the conversion
+ * fails, its children are killed, its temp files and memory released
+ * and the error passed on to the error trap of the calling thread, so
+ * that with one only this job fails; without one, execution is
+ * terminated. The value of path must not be NULL.
+ */
+static enum error_code run_job(LPCTSTR path, LPTSTR* target)
+{
+	struct conversion* conv = NULL; /* state of this conversion */
+	struct error_trap trap;
+	struct error_trap* outer = get_error_trap(); /* trap to restore */
+	struct child_group* group = get_child_group(); /* group to restore */
+	struct task* toc = NULL; /* TOC stage */
+	struct task* outline = NULL; /* TOC entries of the last segment */
+	struct task* append = NULL; /* merge of the last segment, or NULL */
+	struct task* watermark = NULL; /* watermark stage, or NULL */
+	struct task* stamps = NULL; /* header and footer stage, or NULL */
+	struct task* merge = NULL; /* merge stage */
+	const struct renderer* renderer = NULL; /* backend of the segments */
+	int stamping = 0; /* nonzero if the merge draws headers and footers */
+	size_t i = 0;
+
+	RT_NOT_NULL(path);
+
+	conv = (struct conversion*) require_cmem(1, sizeof(*conv));
+	conv->shared = outer != NULL;
+	init_task_graph(&conv->graph);
+	init_child_group(&conv->group);
+
+	if(setjmp(trap.env) != 0) {
+		set_child_group(group);
+		end_job(conv, trap.code);
+		set_error_trap(outer);
+		rethrow_error(trap.code);
+	}
+
+	set_error_trap(&trap);
+	set_child_group(&conv->group);
+	conv->input = require_open_file(path, _T("r"));
 
 	/* Retrive main instruction information */
-	get_pdf_info(&info, input);
+	get_pdf_info(&conv->info, conv->input);
+
+	/* Fail before converting anything if the renderer is unknown */
+	renderer = get_renderer(conv->info.renderer);
+
+	/*
+	 * A deadline could only give up on a conversion left running, and
+	 * the losing duplicate of a race could never be stopped.
+	 */
+	if(renderer->unkillable && conv->info.segment_timeout > 0)
+		errorout(E_ARG, _T("The %s renderer cannot stop a hung ")
+				_T("conversion; use another with iSegmentTimeoutSec"),
+				renderer->name);
+
+	if(renderer->unkillable && conv->info.hedge_percent > 0)
+		errorout(E_ARG, _T("The %s renderer cannot stop the loser of a ")
+				_T("race; use another with iHedgePercent"), renderer->name);
+
+	if(renderer->serial && conv->info.parallel_renders > 1)
+		writelog(kNORM, _T("The %s renderer converts one segment at a ")
+				_T("time; iParallelRenders %lu has no effect\n"),
+				renderer->name, conv->info.parallel_renders);
+
+	/* Give up on the whole conversion once its deadline passes */
+	if(conv->info.job_timeout > 0) {
+		conv->done = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+		if(conv->done == NULL)
+			errorout(E_CMD, _T("Failed to create event (%lu)"),
+					GetLastError());
+
+		conv->watchdog = (HANDLE) _beginthreadex(NULL, 0, job_deadline,
+				conv, 0, NULL);
+
+		if(conv->watchdog == 0)
+			errorout(E_CMD, _T("Failed to start deadline thread"));
+	}
 
 	/* Allocate memory for the IDs of the segments' temp files */
-	merge_files_arr = (UINT*) require_cmem(info.segments,
-			sizeof(merge_files_arr[0]));
+	conv->merge_files_arr = (UINT*) require_cmem(conv->info.segments,
+			sizeof(conv->merge_files_arr[0]));
+	conv->jobs = (struct render_job*) require_cmem(conv->info.segments,
+			sizeof(conv->jobs[0]));
+	conv->stages = (struct segment_stage*) require_cmem(conv->info.segments,
+			sizeof(conv->stages[0]));
+	stamping = conv->info.stamp_headers
+			&& conv->info.hf_opts != kPDF_HF_HIDE;
+
+	/* Read the information for each expected segment */
+	for(i = 0; i < conv->info.segments; ++i) {
+		struct render_job* job = &conv->jobs[i];
+		TCHAR outline[MAX_PATH + 1] = _T(""); /* name of the outline file */
+		TCHAR target[MAX_PATH + 1] = _T(""); /* name of the segment PDF */
 
-	/* Download and convert the cover page, if one is present */
-	if(info.cover_page.segment != NULL && info.cover_page.size != NULL
-			&& info.cover_page.orientation != NULL)
-		do_get_cover_page(&cover_page_id, &info);
+		conv->parsed = i + 1;
+		get_pdf_segment_info(&job->segment, conv->input);
+		require_tmp_file(outline, &job->outline_id);
+		require_tmp_file(target, &job->target_id);
+		job->options = kPDF_NORM;
+
+		/*
+		 * With headers and footers drawn by the merge, nothing depends
+		 * on the page offset, so a segment is right wherever it lands.
+		 */
+		if(conv->info.stamp_headers) {
+			job->options &= ~kPDF_OFFSET;
+		} else if(conv->info.hf_opts == kPDF_HF_SHOW
+				|| conv->info.hf_opts == kPDF_HF_SPECIAL) {
+			if(conv->info.header_url != NULL)
+				job->options |= kPDF_HEADER;
+			if(conv->info.footer_url != NULL)
+				job->options |= kPDF_FOOTER;
+		}
+	}
+
+	release_file(conv->input);
+	conv->input = NULL;
 
-	if(info.toc_opts == kPDF_TOC_SHOW)
-		outline_html_file = open_toc_stream(&outline_pdf_id, &info);
+	/* Renderers of this job go through a listener of its own */
+	open_proxy(&conv->info);
+	conv->proxied = 1;
+
+	/* The segments' HTML is downloaded once the render cache is searched */
+	conv->prefetch = start_prefetch(&conv->info, conv->jobs,
+			conv->info.segments);
+	for(i = 0; i < conv->info.segments; ++i)
+		conv->jobs[i].prefetch = conv->prefetch;
+
+	/*
+	 * The TOC is typeset here unless the PDF getter has to draw the
+	 * header and footer HTML on its pages.
+	 */
+	if(conv->info.toc_opts == kPDF_TOC_SHOW && conv->info.native_toc
+			&& (conv->info.stamp_headers
+			|| (conv->info.hf_opts != kPDF_HF_SHOW
+			&& conv->info.hf_opts != kPDF_HF_SPECIAL)
+			|| (conv->info.header_url == NULL
+			&& conv->info.footer_url == NULL)))
+		conv->outline_html_file = NULL;
+	else if(conv->info.toc_opts == kPDF_TOC_SHOW)
+		conv->outline_html_file = open_toc_stream(&conv->outline_pdf_id,
+				&conv->info);
 	else
-		outline_html_file = require_open_file(_T("nul"), _T("w"));
+		conv->outline_html_file = require_open_file(_T("nul"), _T("w"));
 
-	write_toc_start(outline_html_file, info.font_family, info.font_size);
+	if(conv->outline_html_file != NULL)
+		write_toc_start(conv->outline_html_file, conv->info.font_family,
+				conv->info.font_size);
 
 	/*
-	 * For each expected segment, read the segment's information from
-	 * the instruction file, dowload and convert it to a PDF, and save
-	 * the ID of its temp file.
+	 * The cover page and the watermark do not depend on the segments,
+	 * so they are converted while the segments are. Each segment is a
+	 * node of its own, finished by the segments stage once it is final,
+	 * and its titles go into the TOC as soon as it and the segments
+	 * before it are. The TOC needs the page numbers of every segment,
+	 * and so does the end of the merge, which puts the cover page and
+	 * the TOC in front of the segments.
 	 */
-	for(curr_pt = 0; curr_pt < info.segments; ++curr_pt) {
-		struct pdf_segment_info part; /* segment information */
-		unsigned long int pages = 0; /* pages in this segment */
-		FILE* outline_file = NULL; /* temp file for the segment outline dump */
-		unsigned long int dest_page = 0; /* TOC page number for titles */
-		UINT outline_id = 0; /* ID of the outline dump temp file */
-		int options = kPDF_NORM;
-		TCHAR title[BUFSIZ] = _T(""); /* current title for the TOC */
-		TCHAR outline[MAX_PATH + 1] = _T(""); /* name of the outline file */
-		TCHAR target[MAX_PATH + 1] = _T(""); /* name of the segment PDF */
+	add_task(&conv->graph, _T("segments"), segments_task, conv);
+	toc = add_task(&conv->graph, _T("toc"), toc_task, conv);
+	merge = add_task(&conv->graph, _T("merge"), merge_task, conv);
+	add_task_dependency(merge, toc);
 
-		/* Read and initialize the segment information */
-		get_pdf_segment_info(&part, input);
-		require_tmp_file(outline, &outline_id);
-		require_tmp_file(target, &merge_files_arr[curr_pt]);
-		outline_file = require_open_file(outline, _T("r"));
+	/* Download and convert the cover page, if one is present */
+	if(conv->info.cover_page.segment != NULL
+			&& conv->info.cover_page.size != NULL
+			&& conv->info.cover_page.orientation != NULL)
+		add_task_dependency(merge, add_task(&conv->graph, _T("cover page"),
+				cover_page_task, conv));
+
+	if(conv->info.watermark_url != NULL) {
+		watermark = add_task(&conv->graph, _T("watermark"), watermark_task,
+				conv);
+		add_task_dependency(merge, watermark);
+	}
 
-		/* Outline XML is in UTF-8 so set transparent conversion */
-		setmode(fileno(outline_file), _O_U8TEXT);
+	if(stamping) {
+		stamps = add_task(&conv->graph, _T("headers"), stamps_task, conv);
+		add_task_dependency(merge, stamps);
+	}
 
-		if(info.hf_opts == kPDF_HF_SHOW || info.hf_opts == kPDF_HF_SPECIAL) {
-			if(info.header_url != NULL)
-				options |= kPDF_HEADER;
-			if(info.footer_url != NULL)
-				options |= kPDF_FOOTER;
+	for(i = 0; i < conv->info.segments; ++i) {
+		struct segment_stage* stage = &conv->stages[i];
+		struct task* previous = outline;
+
+		stage->conv = conv;
+		stage->index = i;
+		stage->rendered = add_task(&conv->graph, _T("segment"), NULL, NULL);
+		outline = add_task(&conv->graph, _T("outline"), outline_task, stage);
+		add_task_dependency(outline, stage->rendered);
+		add_task_dependency(merge, stage->rendered);
+
+		if(previous != NULL)
+			add_task_dependency(outline, previous);
+
+		if(!conv->info.incremental_merge)
+			continue;
+
+		/*
+		 * Merged as they are converted, segments are appended in order
+		 * once the watermark and the headers the merge lays on every
+		 * page are converted.
+		 */
+		previous = append;
+		append = add_task(&conv->graph, _T("append"), append_task, stage);
+		add_task_dependency(append, stage->rendered);
+		add_task_dependency(merge, append);
+
+		if(previous != NULL) {
+			add_task_dependency(append, previous);
+			continue;
 		}
 
-		/* Execute conversion */
-		do_segment_to_pdf(&merge_files_arr[curr_pt], &outline_id, total_pages,
-				&info, &part, options);
-		destroy_pdf_segment_info(&part);
-
-		/* Determine the number of new pages added by this segment */
-		get_number_of_pages(&pages, target);
-	
-		/* Add each title and page number in this segment to the TOC */
-		do {
-			get_toc_item(title, LENGTHOF(title) - 1, &dest_page, outline_file);
-
-			if(dest_page != total_pages && dest_page != ULONG_MAX)
-				write_toc_item(outline_html_file, title, dest_page);
-		} while(dest_page != ULONG_MAX);
-
-		release_file(outline_file);
-		total_pages += pages;
-		remove_tmp_file(outline);
+		if(watermark != NULL)
+			add_task_dependency(append, watermark);
+
+		if(stamps != NULL)
+			add_task_dependency(append, stamps);
 	}
 
-	write_toc_end(outline_html_file);
+	if(outline != NULL)
+		add_task_dependency(toc, outline);
 
-	/* Close the TOC stream */
-	if(info.toc_opts == kPDF_TOC_SHOW) {
-		int status = _pclose(outline_html_file);
+	run_task_graph(&conv->graph);
 
-		if(status != 0)
-			errorout(E_PDFGETTER, _T("%s exited with status %d"),
-					pdf_getter_exe, status);
+	if(target != NULL)
+		*target = require_dup_str(conv->info.target_path);
 
-		require_tmp_file(outline_pdf, &outline_pdf_id);
-	} else {
-		release_file(outline_html_file);
+	set_error_trap(outer);
+	set_child_group(group);
+	end_job(conv, E_SUCCESS);
+	return E_SUCCESS;
+}
+
+/*
+ * Stop the watchdog of the given conversion and release everything it
+ * holds, then free the structure pointed to by conv. If code is not
+ * E_SUCCESS, the conversion failed with it wherever it was: its
+ * children are killed, and the temp files of its segments, the stages
+ * it was running and the PDF it was merging are removed. Nothing here
+ * calls errorout(), since the caller may already be handling an error.
+ * The value of conv must not be NULL.
+ */
+static void end_job(struct conversion* conv, enum error_code code)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(conv);
+
+	if(conv->watchdog != NULL) {
+		SetEvent(conv->done);
+		WaitForSingleObject(conv->watchdog, INFINITE);
+		CloseHandle(conv->watchdog);
 	}
 
-	release_file(input);
-	require_tmp_file(cover_page_path, &cover_page_id);
+	if(conv->done != NULL)
+		CloseHandle(conv->done);
 
-	if(info.watermark_url != NULL)
-		do_get_watermark(&watermark_id, &info);
+	if(code != E_SUCCESS)
+		cancel_child_group(&conv->group, code);
 
-	/* Merge the PDF segments */
-	do_merge_pdfs(info.target_path, cover_page_path, outline_pdf,
-			info.segments, merge_files_arr, watermark_id);
+	destroy_child_group(&conv->group);
+
+	if(conv->input != NULL)
+		release_file(conv->input);
+
+	/* The TOC stream of a failed conversion is left unfinished */
+	if(conv->outline_html_file != NULL
+			&& conv->info.toc_opts == kPDF_TOC_SHOW)
+		_pclose(conv->outline_html_file);
+	else if(conv->outline_html_file != NULL)
+		release_file(conv->outline_html_file);
+
+	if(conv->merge != NULL)
+		abort_merge_pdfs(conv->merge);
+
+	stop_prefetch(conv->prefetch);
 
-	if(info.header_url != NULL)
-		remove_tmp_file(info.header_url);
+	if(conv->proxied)
+		close_proxy(&conv->info);
 
-	if(info.first_header_url != NULL)
-		remove_tmp_file(info.first_header_url);
+	destroy_task_graph(&conv->graph);
+	destroy_toc_list(&conv->toc);
 
-	if(info.footer_url != NULL)
-		remove_tmp_file(info.footer_url);
+	if(conv->info.header_url != NULL)
+		remove_tmp_file(conv->info.header_url);
 
-	if(info.first_footer_url != NULL)
-		remove_tmp_file(info.first_footer_url);
+	if(conv->info.first_header_url != NULL)
+		remove_tmp_file(conv->info.first_header_url);
 
-	destroy_pdf_info(&info);
+	if(conv->info.footer_url != NULL)
+		remove_tmp_file(conv->info.footer_url);
+
+	if(conv->info.first_footer_url != NULL)
+		remove_tmp_file(conv->info.first_footer_url);
 
 	/* Clean up temporary files and memory */
-	while(--curr_pt < info.segments) {
-		TCHAR target[MAX_PATH + 1] = _T("");
+	for(i = 0; i < conv->parsed; ++i) {
+		struct render_job* job = &conv->jobs[i];
+
+		destroy_pdf_segment_info(&job->segment);
+		remove_tmp_id(&conv->merge_files_arr[i]);
 
-		get_tmp_file(target, &merge_files_arr[curr_pt]);
+		/* A finished conversion has already removed the rest */
+		if(code == E_SUCCESS)
+			continue;
 
-		if(merge_files_arr[curr_pt] != 0)
-			remove_tmp_file(target);
+		remove_tmp_id(&job->target_id);
+		remove_tmp_id(&job->outline_id);
+		remove_tmp_id(&job->spare_target_id);
+		remove_tmp_id(&job->spare_outline_id);
 	}
 
-	if(cover_page_id != 0)
-		remove_tmp_file(cover_page_path);
+	remove_tmp_id(&conv->cover_page_id);
+	remove_tmp_id(&conv->watermark_id);
+
+	for(i = 0; i < kSTAMP_PARTS; ++i)
+		remove_tmp_id(&conv->stamp_ids[i]);
+
+	remove_tmp_id(&conv->outline_pdf_id);
+	destroy_pdf_info(&conv->info);
+	free(conv->merge_files_arr);
+	free(conv->stages);
+	free(conv->jobs);
+	free(conv);
+}
+
+/*
+ * Remove the temporary file with the ID pointed to by id, unless it is
+ * 0, and set the ID to 0. The value of id must not be NULL.
+ */
+static void remove_tmp_id(UINT* id)
+{
+	TCHAR path[MAX_PATH + 1] = _T("");
+
+	RT_NOT_NULL(id);
+
+	if(*id == 0)
+		return;
+
+	get_tmp_file(path, id);
+	remove_tmp_file(path);
+	*id = 0;
+}
+
+/*
+ * Convert the cover page of the conversion structure pointed to by arg.
+ * The value of arg must not be NULL.
+ */
+static void cover_page_task(void* arg)
+{
+	struct conversion* conv = (struct conversion*) arg;
+
+	RT_NOT_NULL(conv);
+
+	do_get_cover_page(&conv->cover_page_id, &conv->info);
+}
+
+/*
+ * Convert the watermark of the conversion structure pointed to by arg.
+ * The value of arg must not be NULL.
+ */
+static void watermark_task(void* arg)
+{
+	struct conversion* conv = (struct conversion*) arg;
+
+	RT_NOT_NULL(conv);
 
-	if(watermark_id != 0) {
-		TCHAR watermark_pdf[MAX_PATH + 1] = _T(""); /* path to watermark PDF */
+	do_get_watermark(&conv->watermark_id, &conv->info);
+}
+
+/*
+ * Convert the header and footer HTML of the conversion structure
+ * pointed to by arg for the merge to draw on every page. The value of
+ * arg must not be NULL.
+ */
+static void stamps_task(void* arg)
+{
+	struct conversion* conv = (struct conversion*) arg;
+
+	RT_NOT_NULL(conv);
+
+	do_get_stamps(conv->stamp_ids, &conv->info);
+}
+
+/*
+ * Download and convert the segments of the conversion structure
+ * pointed to by arg, finishing the node of each segment as soon as it
+ * is final. The value of arg must not be NULL.
+ */
+static void segments_task(void* arg)
+{
+	struct conversion* conv = (struct conversion*) arg;
 
-		get_tmp_file(watermark_pdf, &watermark_id);
-		remove_tmp_file(watermark_pdf);
+	RT_NOT_NULL(conv);
+
+	render_segments(conv->jobs, conv->info.segments, &conv->info,
+			segment_ready, conv);
+}
+
+/*
+ * Take over the PDF of the converted segment pointed to by job, which
+ * is final along with every one before it, and finish its node so that
+ * the stages waiting for it can run. All but the first segment of a
+ * batch have no PDF of their own. The value of job must not be NULL.
+ * The value of arg must point to the conversion structure.
+ */
+static void segment_ready(struct render_job* job, void* arg)
+{
+	struct conversion* conv = (struct conversion*) arg;
+	size_t index = 0;
+
+	RT_NOT_NULL(job);
+	RT_NOT_NULL(conv);
+
+	index = (size_t) (job - conv->jobs);
+	conv->merge_files_arr[index] = job->target_id;
+	job->target_id = 0;
+	finish_task(conv->stages[index].rendered);
+}
+
+/*
+ * Append the final segment of the segment_stage structure pointed to
+ * by arg to the merge of its conversion, starting the merge with the
+ * first segment, and remove its temp file. The segments before it must
+ * have been appended, and the watermark and the header and footer the
+ * merge lays on every page must have been converted. The value of arg
+ * must not be NULL.
+ */
+static void append_task(void* arg)
+{
+	struct segment_stage* stage = (struct segment_stage*) arg;
+	struct conversion* conv = NULL;
+
+	RT_NOT_NULL(stage);
+
+	conv = stage->conv;
+
+	if(conv->merge == NULL)
+		conv->merge = begin_merge_pdfs(conv->watermark_id, conv->stamp_ids,
+				&conv->info);
+
+	merge_segment(conv->merge, &conv->merge_files_arr[stage->index]);
+}
+
+/*
+ * Add the titles of the final segment of the segment_stage structure
+ * pointed to by arg to the TOC of its conversion. The segments before
+ * it must have been added. The value of arg must not be NULL.
+ */
+static void outline_task(void* arg)
+{
+	struct segment_stage* stage = (struct segment_stage*) arg;
+	struct conversion* conv = NULL;
+	struct render_job* job = NULL;
+	FILE* outline_file = NULL; /* temp file for the segment outline dump */
+	unsigned long int dest_page = 0; /* TOC page number for titles */
+	TCHAR title[BUFSIZ] = _T(""); /* current title for the TOC */
+	TCHAR outline[MAX_PATH + 1] = _T(""); /* name of the outline file */
+
+	RT_NOT_NULL(stage);
+
+	conv = stage->conv;
+	job = &conv->jobs[stage->index];
+	require_tmp_file(outline, &job->outline_id);
+	outline_file = require_open_file(outline, _T("r"));
+
+	/* Outline XML is in UTF-8 so set transparent conversion */
+	setmode(fileno(outline_file), _O_U8TEXT);
+
+	/* Add each title and page number in this segment to the TOC */
+	do {
+		get_toc_item(title, LENGTHOF(title) - 1, &dest_page, outline_file);
+
+		if(dest_page != ULONG_MAX)
+			dest_page += job->outline_offset;
+
+		if(dest_page == conv->toc_pages || dest_page == ULONG_MAX)
+			continue;
+
+		if(conv->outline_html_file != NULL)
+			write_toc_item(conv->outline_html_file, title, dest_page);
+		else
+			add_toc_entry(&conv->toc, title, dest_page);
+	} while(dest_page != ULONG_MAX);
+
+	release_file(outline_file);
+	conv->toc_pages += job->pages;
+	remove_tmp_file(outline);
+	job->outline_id = 0;
+}
+
+/*
+ * Finish the TOC of the conversion structure pointed to by arg once the
+ * titles of every segment are in it. The value of arg must not be NULL.
+ */
+static void toc_task(void* arg)
+{
+	struct conversion* conv = (struct conversion*) arg;
+
+	RT_NOT_NULL(conv);
+
+	if(conv->outline_html_file == NULL) {
+		require_tmp_file(conv->outline_pdf, &conv->outline_pdf_id);
+		write_toc_pdf(conv->outline_pdf, &conv->toc, &conv->info);
+		destroy_toc_list(&conv->toc);
+		return;
 	}
 
-	remove_tmp_file(outline_pdf);
-	free(merge_files_arr);
-	release_file(logfd);
-	return E_SUCCESS;
+	write_toc_end(conv->outline_html_file);
+
+	/* Close the TOC stream */
+	if(conv->info.toc_opts == kPDF_TOC_SHOW) {
+		int status = _pclose(conv->outline_html_file);
+
+		conv->outline_html_file = NULL;
+
+		if(status != 0)
+			errorout(E_PDFGETTER, _T("%s exited with status %d"),
+					pdf_getter_exe, status);
+
+		require_tmp_file(conv->outline_pdf, &conv->outline_pdf_id);
+	} else {
+		release_file(conv->outline_html_file);
+		conv->outline_html_file = NULL;
+	}
+}
+
+/*
+ * Merge the PDFs of the conversion structure pointed to by arg into
+ * the target, or finish merging them if the segments were merged as
+ * they were converted. The value of arg must not be NULL.
+ */
+static void merge_task(void* arg)
+{
+	struct conversion* conv = (struct conversion*) arg;
+
+	RT_NOT_NULL(conv);
+
+	require_tmp_file(conv->cover_page_path, &conv->cover_page_id);
+
+	if(conv->info.incremental_merge) {
+		if(conv->merge == NULL)
+			conv->merge = begin_merge_pdfs(conv->watermark_id,
+					conv->stamp_ids, &conv->info);
+
+		end_merge_pdfs(conv->merge, conv->cover_page_path, conv->outline_pdf);
+		conv->merge = NULL;
+		return;
+	}
+
+	/* Merge the PDF segments */
+	do_merge_pdfs(conv->info.target_path, conv->cover_page_path,
+			conv->outline_pdf, conv->info.segments, conv->merge_files_arr,
+			conv->watermark_id, conv->stamp_ids, &conv->info);
 }
 
 /*
@@ -188,12 +678,13 @@ void do_get_cover_page(UINT* cover_page_id, const struct pdf_info* info)
 	RT_NOT_NULL(cover_page_id);
 	RT_NOT_NULL(info);
 
-	if(info->hf_opts == kPDF_HF_SHOW) {
+	/* Stamped headers and footers are drawn by the merge instead */
+	if(info->hf_opts == kPDF_HF_SHOW && !info->stamp_headers) {
 		if(info->header_url != NULL)
 			options |= kPDF_HEADER;
 		if(info->footer_url != NULL)
 			options |= kPDF_FOOTER;
-	} else if(info->hf_opts == kPDF_HF_SPECIAL) {
+	} else if(info->hf_opts == kPDF_HF_SPECIAL && !info->stamp_headers) {
 		if(info->first_header_url != NULL)
 			options |= kPDF_HEADER;
 		if(info->first_footer_url != NULL)
@@ -210,15 +701,20 @@ void do_get_cover_page(UINT* cover_page_id, const struct pdf_info* info)
  * contains the necessary information about the watermark. Neither the
  * value of info nor the value of watermark_id may be NULL. The value
  * pointed to by watermark_id is set to the ID used to generate the name
- * of the temporary file.
+ * of the temporary file. The PDF is taken from the render cache of info
+ * if it is there and published in it otherwise.
  */
 void do_get_watermark(UINT* watermark_id, const struct pdf_info* info)
 {
 	struct wkhtmltopdf_cmd_info cmd_info;
-	FILE* pipe = NULL;
+	struct supervisor sup;
+	struct child child;
+	struct child* reaped = NULL;
+	struct cache_pending* pending = NULL; /* validators for the cache */
+	const struct renderer* renderer = NULL; /* backend of the watermark */
+	unsigned long int pages = 0;
 	LPTSTR source = NULL;
 	LPTSTR session_str = NULL;
-	int status = 0;
 	TCHAR watermark_pdf[MAX_PATH + 1] = _T("");
 
 	RT_NOT_NULL(watermark_id);
@@ -244,13 +740,138 @@ void do_get_watermark(UINT* watermark_id, const struct pdf_info* info)
 	cmd_info.margins.footer = _T("0");
 	cmd_info.size = info->cover_page.size;
 	cmd_info.orientation = info->cover_page.orientation;
+	cmd_info.proxy = get_proxy_url(info);
 	cmd_info.options = kPDF_COVER | kPDF_MARGINS | kPDF_SIZE;
-	do_wkhtmltopdf_execute(&pipe, &cmd_info);
-	status = _pclose(pipe);
+	renderer = get_renderer(NULL);
+
+	if(!fetch_render(info, renderer, &cmd_info, &pages, &pending)) {
+		init_supervisor(&sup);
+		do_wkhtmltopdf_start(&sup, &child, NULL, &cmd_info);
+		reaped = wait_child(&sup, INFINITE);
+
+		/* The validators of a failed conversion are never published */
+		if(reaped != &child || child.status != 0)
+			free_pending(pending);
+
+		if(reaped != &child)
+			errorout(E_CMD, _T("Lost track of %s"), pdf_getter_exe);
+
+		check_child(&child, E_PDFGETTER, pdf_getter_exe);
+		release_child(&child);
+		destroy_supervisor(&sup);
+
+		if(info->render_cache_path != NULL) {
+			get_number_of_pages(&pages, watermark_pdf);
+			publish_render(info, renderer, &cmd_info, pages, pending);
+		}
+	}
+
 	free(source);
 	free(session_str);
+}
+
+/*
+ * Convert the header and footer HTML of the structure pointed to by
+ * info into PDFs for the merge to draw on every page, all at once. The
+ * array pointed to by ids is indexed by merge_stamp_part; the element
+ * of each part that is shown is set to the ID of the temporary file
+ * with its PDF, and the others are left alone. Each PDF is a page of
+ * the size, orientation and side margins of the cover page, without
+ * top or bottom margins, so the part starts at the top of it. Neither
+ * the value of ids nor the value of info may be NULL.
+ */
+static void do_get_stamps(UINT* ids, const struct pdf_info* info)
+{
+	struct wkhtmltopdf_cmd_info cmd_info;
+	struct supervisor sup;
+	struct child children[kSTAMP_PARTS];
+	LPCTSTR urls[kSTAMP_PARTS] = { NULL }; /* HTML of each part, or NULL */
+	size_t count = 0; /* number of children started */
+	size_t i = 0;
+
+	RT_NOT_NULL(ids);
+	RT_NOT_NULL(info);
+
+	if(info->hf_opts == kPDF_HF_SHOW || info->hf_opts == kPDF_HF_SPECIAL) {
+		urls[kSTAMP_HEADER] = info->header_url;
+		urls[kSTAMP_FOOTER] = info->footer_url;
+	}
+
+	if(info->hf_opts == kPDF_HF_SPECIAL) {
+		urls[kSTAMP_FIRST_HEADER] = info->first_header_url;
+		urls[kSTAMP_FIRST_FOOTER] = info->first_footer_url;
+	}
+
+	memset(&cmd_info, 0, sizeof(cmd_info));
+	cmd_info.exe = pdf_getter_exe;
+	cmd_info.margins = info->margins;
+	cmd_info.margins.bottom = _T("0");
+	cmd_info.margins.top = _T("0");
+	cmd_info.margins.header = _T("0");
+	cmd_info.margins.footer = _T("0");
+	cmd_info.size = info->cover_page.size;
+	cmd_info.orientation = info->cover_page.orientation;
+	cmd_info.proxy = get_proxy_url(info);
+	cmd_info.options = kPDF_NO_OUTLINE | kPDF_MARGINS | kPDF_SIZE;
+
+	if(cmd_info.orientation != NULL)
+		cmd_info.options |= kPDF_ORIENTATION;
+
+	init_supervisor(&sup);
+
+	for(i = 0; i < kSTAMP_PARTS; ++i) {
+		TCHAR stamp_pdf[MAX_PATH + 1] = _T("");
+
+		if(urls[i] == NULL)
+			continue;
+
+		require_tmp_file(stamp_pdf, &ids[i]);
+		cmd_info.source = urls[i];
+		cmd_info.target = stamp_pdf;
+		do_wkhtmltopdf_start(&sup, &children[count++], NULL, &cmd_info);
+	}
+
+	/* Every part is reaped before one that failed ends the stage */
+	for(i = 0; i < count; ++i)
+		if(wait_child(&sup, INFINITE) == NULL)
+			errorout(E_CMD, _T("Lost track of %s"), pdf_getter_exe);
+
+	destroy_supervisor(&sup);
+
+	for(i = 0; i < count; ++i) {
+		check_child(&children[i], E_PDFGETTER, pdf_getter_exe);
+		release_child(&children[i]);
+	}
+}
+
+/*
+ * Wait until the conversion structure pointed to by arg ends or its
+ * deadline passes, whichever is first. At the deadline, a process
+ * running that one conversion exits, which closes the job objects of
+ * its children and so kills them and their descendants. A process
+ * shared with other jobs instead cancels the stages of this one and
+ * kills its children, so that it fails with E_TIMEOUT as soon as the
+ * stages already running return. The value of arg must not be NULL.
+ */
+static unsigned __stdcall job_deadline(void* arg)
+{
+	struct conversion* conv = (struct conversion*) arg;
+	unsigned long int seconds = 0;
+
+	RT_NOT_NULL(conv);
+
+	seconds = conv->info.job_timeout;
+
+	if(WaitForSingleObject(conv->done, seconds * 1000) != WAIT_TIMEOUT)
+		return E_SUCCESS;
+
+	if(!conv->shared)
+		errorout(E_TIMEOUT, _T("Conversion exceeded its deadline of %lu ")
+				_T("seconds"), seconds);
 
-	if(status != 0)
-		errorout(E_PDFGETTER, _T("%s exited with status %d"), pdf_getter_exe,
-				status);
+	writelog(kNORM, _T("Conversion of '%s' exceeded its deadline of %lu ")
+			_T("seconds\n"), conv->info.target_path, seconds);
+	cancel_task_graph(&conv->graph, E_TIMEOUT, _T("job deadline"));
+	cancel_child_group(&conv->group, E_TIMEOUT);
+	return E_TIMEOUT;
 }
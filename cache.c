@@ -0,0 +1,941 @@
+#include "stdafx.h"
+#include "cache.h"
+#include "util.h"
+#include "log.h"
+
+/* Changed whenever conversions cached before can no longer be reused */
+#define CACHE_FORMAT 1
+
+/* Length in bytes of a SHA-256 digest */
+#define CACHE_DIGEST_LEN 32
+
+/* Length of a key, which is a digest in hexadecimal */
+#define CACHE_KEY_LEN (2 * CACHE_DIGEST_LEN)
+
+/* Age in 100-nanosecond intervals of an abandoned PDF without an entry */
+#define CACHE_ORPHAN_AGE ((ULONGLONG) 600 * 10000000)
+
+/* Size of the buffer used to hash the header and footer */
+#define CACHE_CHUNK_SIZE 4096
+
+/* Longest line in an entry */
+#define CACHE_LINE_MAX 1024
+
+/* Longest wait in milliseconds for each step of checking a source */
+#define CACHE_CHECK_MS 10000
+
+/* Files making up a cached conversion */
+enum cache_file {
+	kCACHE_PDF, /* the PDF */
+	kCACHE_OUTLINE, /* the outline dump, with kPDF_DUMP */
+	kCACHE_ENTRY, /* the number of pages and validators, written last */
+	kCACHE_FILES
+};
+
+/* Validators of the sources of a conversion which is not cached yet */
+struct cache_pending {
+	TCHAR key[CACHE_KEY_LEN + 1]; /* key of the conversion */
+	LPTSTR* validators; /* validators of each source */
+	size_t count; /* number of elements in validators */
+};
+
+/* A cached conversion considered for eviction */
+struct cache_item {
+	TCHAR key[CACHE_KEY_LEN + 1]; /* name of its files */
+	ULONGLONG used; /* time it was last used, or 0 if abandoned */
+	ULONGLONG size; /* bytes taken by its files */
+};
+
+static BOOL CALLBACK start_cache(PINIT_ONCE, PVOID, PVOID*);
+static void make_key(LPTSTR, const struct renderer*,
+		const struct wkhtmltopdf_cmd_info*);
+static int read_entry(LPCTSTR, unsigned long int*, LPTSTR**, size_t*);
+static int check_sources(LPTSTR*, size_t, LPTSTR*, size_t, DWORD,
+		LPTSTR**);
+static int check_source(LPCTSTR, LPCTSTR, DWORD, LPTSTR*);
+static HINTERNET send_check(LPCTSTR, LPCTSTR, DWORD, HINTERNET*);
+static void free_lines(LPTSTR*, size_t);
+static void hash_text(BCRYPT_HASH_HANDLE, LPCTSTR);
+static void hash_file(BCRYPT_HASH_HANDLE, LPCTSTR);
+static void get_cache_paths(LPTSTR*, LPCTSTR, LPCTSTR);
+static void free_cache_paths(LPTSTR*);
+static void touch_file(LPCTSTR);
+static void evict_renders(LPCTSTR, ULONGLONG);
+static ULONGLONG get_ticks(const FILETIME*);
+static int compare_use(const void*, const void*);
+
+/* Extension of each file of a cached conversion, indexed by cache_file */
+static const LPCTSTR cache_exts[kCACHE_FILES] = {
+	_T("pdf"), _T("xml"), _T("entry")
+};
+
+/* State shared by every thread using the cache */
+static struct {
+	INIT_ONCE once; /* initializes the members below */
+	HINTERNET session; /* WinInet session checking sources, or NULL */
+} cache = { INIT_ONCE_STATIC_INIT };
+
+/*
+ * Look for a conversion of the structure pointed to by cmd_info by the
+ * given backend in the render cache of the structure pointed to by
+ * info. Conversions are the same if their sources, options, size,
+ * orientation, margins, header and footer and page offset are the same
+ * and the backend describes itself the same way; the targets do not
+ * matter. The header and footer are compared by their contents, since
+ * each job writes them to files of its own. If the revalidate_cache
+ * member of info is nonzero, the data behind the sources may have
+ * changed since, so each HTTP source is requested again with the
+ * validators (ETag and Last-Modified) it had then, and a conversion is
+ * only reused if every server answers that nothing changed. A server
+ * gets CACHE_CHECK_MS milliseconds, or the segment deadline of info if
+ * it is shorter, to connect and to answer before the source counts as
+ * changed. If there is one, its PDF is copied to the target of
+ * cmd_info and, with kPDF_DUMP, its outline to the outline target, the
+ * value pointed to by pages is set to the number of pages stored with
+ * it, it becomes the most recently used conversion and nonzero is
+ * returned. Otherwise, zero is returned, and whatever the servers
+ * answered, the value pointed to by pending is set to the validators
+ * the sources have now, which must be passed to publish_render() or
+ * free_pending(). It is set to NULL if nothing was checked or the
+ * conversion is reused. Zero is always returned if the
+ * render_cache_path member of info is NULL. The value of pending may
+ * be NULL if the validators are not needed. The values of info,
+ * renderer, cmd_info and pages must not be NULL.
+ */
+int fetch_render(const struct pdf_info* info,
+		const struct renderer* renderer,
+		const struct wkhtmltopdf_cmd_info* cmd_info, unsigned long int* pages,
+		struct cache_pending** pending)
+{
+	TCHAR key[CACHE_KEY_LEN + 1] = _T("");
+	LPTSTR paths[kCACHE_FILES];
+	LPTSTR* stored = NULL; /* validators cached with each source */
+	LPTSTR* fresh = NULL; /* validators each source has now */
+	LPTSTR* urls = NULL; /* sources */
+	size_t stored_count = 0; /* number of elements in stored */
+	size_t count = 0; /* number of elements in urls and fresh */
+	DWORD timeout = CACHE_CHECK_MS; /* longest wait for a server */
+	int found = 0;
+
+	RT_NOT_NULL(info);
+	RT_NOT_NULL(cmd_info);
+	RT_NOT_NULL(cmd_info->target);
+	RT_NOT_NULL(pages);
+
+	if(pending != NULL)
+		*pending = NULL;
+
+	if(info->render_cache_path == NULL)
+		return 0;
+
+	if(!InitOnceExecuteOnce(&cache.once, start_cache, NULL, NULL))
+		errorout(E_MALLOC, _T("Failed to start the render cache"));
+
+	make_key(key, renderer, cmd_info);
+	get_cache_paths(paths, info->render_cache_path, key);
+	found = read_entry(paths[kCACHE_ENTRY], pages, &stored, &stored_count);
+
+	if(info->segment_timeout > 0
+			&& info->segment_timeout < CACHE_CHECK_MS / 1000)
+		timeout = (DWORD) info->segment_timeout * 1000;
+
+	if(info->revalidate_cache) {
+		urls = split_sources(cmd_info, &count);
+
+		if(!check_sources(urls, count, stored, stored_count, timeout,
+				&fresh))
+			found = 0;
+
+		free_sources(urls, count);
+	}
+
+	/* A conversion evicted since its entry was read is not there */
+	if(found && !CopyFile(paths[kCACHE_PDF], cmd_info->target, FALSE))
+		found = 0;
+
+	if(found && cmd_info->options & kPDF_DUMP) {
+		RT_NOT_NULL(cmd_info->outline_target);
+
+		if(!CopyFile(paths[kCACHE_OUTLINE], cmd_info->outline_target,
+				FALSE))
+			found = 0;
+	}
+
+	if(found) {
+		touch_file(paths[kCACHE_ENTRY]);
+		writelog(kVERBOSE, _T("Reusing cached conversion %s of '%s'\n"), key,
+				cmd_info->source);
+	}
+
+	if(fresh != NULL && !found && pending != NULL) {
+		*pending = (struct cache_pending*) require_cmem(1, sizeof(**pending));
+		_tcscpy((*pending)->key, key);
+		(*pending)->validators = fresh;
+		(*pending)->count = count;
+	} else if(fresh != NULL) {
+		free_lines(fresh, count);
+	}
+
+	free_lines(stored, stored_count);
+	free_cache_paths(paths);
+	return found;
+}
+
+/*
+ * Publish the finished conversion of the structure pointed to by
+ * cmd_info by the given backend, which has the given number of pages,
+ * in the render cache of the structure pointed to by info. It replaces
+ * any conversion with the same key. Its files are written under
+ * temporary names and renamed into place, the entry holding the number
+ * of pages and the validators in the structure pointed to by pending
+ * last, so that the jobs sharing the cache only ever find complete
+ * conversions. Those are the validators fetch_render() gave for this
+ * conversion, which were seen before it started, or for a source the
+ * PDF getter was given a copy of, those replace_validators() set from
+ * the response the copy came from, so they are never newer than the
+ * PDF. The structure is freed; its value may be NULL if there are none.
+ * Afterwards, the least recently used conversions are evicted until the
+ * cache takes at most render_cache_size megabytes, unless that is zero.
+ * A failure to publish is logged but is not fatal. Nothing is done if
+ * the render_cache_path member of info is NULL. The values of info,
+ * renderer and cmd_info must not be NULL.
+ */
+void publish_render(const struct pdf_info* info,
+		const struct renderer* renderer,
+		const struct wkhtmltopdf_cmd_info* cmd_info, unsigned long int pages,
+		struct cache_pending* pending)
+{
+	TCHAR key[CACHE_KEY_LEN + 1] = _T("");
+	LPTSTR paths[kCACHE_FILES];
+	LPTSTR tmp_paths[kCACHE_FILES];
+	LPTSTR* validators = NULL; /* validators of each source, or NULL */
+	FILE* file = NULL;
+	size_t count = 0; /* number of elements in validators */
+	size_t i = 0;
+	int failed = 0;
+
+	RT_NOT_NULL(info);
+	RT_NOT_NULL(cmd_info);
+	RT_NOT_NULL(cmd_info->target);
+
+	if(info->render_cache_path == NULL) {
+		free_pending(pending);
+		return;
+	}
+
+	if(!InitOnceExecuteOnce(&cache.once, start_cache, NULL, NULL))
+		errorout(E_MALLOC, _T("Failed to start the render cache"));
+
+	make_key(key, renderer, cmd_info);
+	get_cache_paths(paths, info->render_cache_path, key);
+
+	if(pending != NULL && _tcscmp(pending->key, key) == 0) {
+		validators = pending->validators;
+		count = pending->count;
+	}
+
+	/* The directory may have been made by another job */
+	CreateDirectory(info->render_cache_path, NULL);
+
+	for(i = 0; i < kCACHE_FILES; ++i)
+		tmp_paths[i] = require_strf(_T("%s.%lu.%lu.tmp"), paths[i],
+				GetCurrentProcessId(), GetCurrentThreadId());
+
+	if(!CopyFile(cmd_info->target, tmp_paths[kCACHE_PDF], FALSE))
+		failed = 1;
+
+	if(!failed && cmd_info->options & kPDF_DUMP) {
+		RT_NOT_NULL(cmd_info->outline_target);
+
+		if(!CopyFile(cmd_info->outline_target, tmp_paths[kCACHE_OUTLINE],
+				FALSE))
+			failed = 1;
+	}
+
+	if(!failed) {
+		file = open_file(tmp_paths[kCACHE_ENTRY], _T("w"));
+
+		if(file == NULL || _ftprintf(file, _T("%lu\n"), pages) < 0)
+			failed = 1;
+
+		for(i = 0; i < count && !failed; ++i)
+			if(_ftprintf(file, _T("%s\n"), validators[i]) < 0)
+				failed = 1;
+
+		if(file != NULL && release_file(file) != 0)
+			failed = 1;
+	}
+
+	/* Until the entry is in place, the other files are never used */
+	for(i = 0; i < kCACHE_FILES && !failed; ++i) {
+		if(i == kCACHE_OUTLINE && !(cmd_info->options & kPDF_DUMP))
+			continue;
+
+		if(!MoveFileEx(tmp_paths[i], paths[i], MOVEFILE_REPLACE_EXISTING))
+			failed = 1;
+	}
+
+	if(failed)
+		writelog(kNORM, _T("Failed to cache the conversion of '%s'\n"),
+				cmd_info->source);
+	else
+		writelog(kVERBOSE, _T("Cached conversion %s of '%s'\n"), key,
+				cmd_info->source);
+
+	/* The files renamed into place are gone already */
+	for(i = 0; i < kCACHE_FILES; ++i) {
+		_tremove(tmp_paths[i]);
+		free(tmp_paths[i]);
+	}
+
+	free_pending(pending);
+	free_cache_paths(paths);
+
+	if(!failed && info->render_cache_size > 0)
+		evict_renders(info->render_cache_path,
+				(ULONGLONG) info->render_cache_size * 1024 * 1024);
+}
+
+/*
+ * Replace the validators kept in the structure pointed to by pending
+ * for the source with the given index, in the order split_sources()
+ * gives them, by the given ETag and Last-Modified date, either of which
+ * may be empty. The PDF getter may be given a copy of a source made
+ * before the cache was searched, and then the validators of the
+ * response the copy came from are the ones that describe the PDF.
+ * Nothing is done if pending is NULL or has no such source. The values
+ * of etag and modified must not be NULL.
+ */
+void replace_validators(struct cache_pending* pending, size_t index,
+		LPCTSTR etag, LPCTSTR modified)
+{
+	LPTSTR line = NULL;
+
+	RT_NOT_NULL(etag);
+	RT_NOT_NULL(modified);
+
+	if(pending == NULL || index >= pending->count)
+		return;
+
+	line = require_strf(_T("%s\t%s"), etag, modified);
+	free(pending->validators[index]);
+	pending->validators[index] = line;
+}
+
+/*
+ * Release the validators pointed to by pending, which fetch_render()
+ * gave for a conversion that is not published, because it failed, was
+ * killed or lost a race. The value of pending may be NULL.
+ */
+void free_pending(struct cache_pending* pending)
+{
+	if(pending == NULL)
+		return;
+
+	free_lines(pending->validators, pending->count);
+	free(pending);
+}
+
+/*
+ * Initialize the state shared by every thread using the cache. If
+ * WinInet cannot be started, every source counts as changed. This is
+ * an InitOnceExecuteOnce() callback; its parameters are unused.
+ */
+static BOOL CALLBACK start_cache(PINIT_ONCE once, PVOID param,
+		PVOID* context)
+{
+	cache.session = InternetOpen(_T("HTMLToPDFHelper"),
+			INTERNET_OPEN_TYPE_PRECONFIG, NULL, NULL, 0);
+
+	if(cache.session == NULL)
+		writelog(kNORM, _T("Failed to start WinInet (%lu); cached ")
+				_T("conversions are not reused\n"), GetLastError());
+
+	return TRUE;
+}
+
+/*
+ * Store in the buffer pointed to by key the key of a conversion of the
+ * structure pointed to by cmd_info by the given backend, which is the
+ * SHA-256 digest of everything that affects its PDF in hexadecimal.
+ * Members of cmd_info are only part of it if its options use them. The
+ * header and footer are temporary files with a new name in each job,
+ * so their contents are part of it rather than their paths. The
+ * buffer pointed to by key is assumed to be at least CACHE_KEY_LEN + 1
+ * in length. The values of key, renderer and cmd_info must not be NULL.
+ */
+static void make_key(LPTSTR key, const struct renderer* renderer,
+		const struct wkhtmltopdf_cmd_info* cmd_info)
+{
+	BCRYPT_ALG_HANDLE sha256 = NULL;
+	BCRYPT_HASH_HANDLE hash = NULL;
+	unsigned char digest[CACHE_DIGEST_LEN];
+	LPTSTR description = NULL; /* build of the backend */
+	LPTSTR numbers = NULL; /* format, options and page offset */
+	int options = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(key);
+	RT_NOT_NULL(renderer);
+	RT_NOT_NULL(cmd_info);
+	RT_NOT_NULL(cmd_info->source);
+
+	options = cmd_info->options;
+	description = renderer->describe();
+	numbers = require_strf(_T("%d %d %lu"), CACHE_FORMAT, options,
+			options & kPDF_OFFSET ? cmd_info->pages : 0);
+
+	if(!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&sha256,
+			BCRYPT_SHA256_ALGORITHM, NULL, 0)))
+		errorout(E_MALLOC, _T("Failed to open the SHA-256 provider"));
+
+	if(!BCRYPT_SUCCESS(BCryptCreateHash(sha256, &hash, NULL, 0, NULL, 0, 0)))
+		errorout(E_MALLOC, _T("Failed to create a SHA-256 hash"));
+
+	hash_text(hash, numbers);
+	hash_text(hash, renderer->name);
+	hash_text(hash, description);
+	hash_text(hash, cmd_info->source);
+	hash_text(hash, options & kPDF_SIZE ? cmd_info->size : NULL);
+	hash_text(hash, options & kPDF_ORIENTATION ? cmd_info->orientation :
+			NULL);
+	hash_file(hash, options & kPDF_HEADER ? cmd_info->header_url : NULL);
+	hash_file(hash, options & kPDF_FOOTER ? cmd_info->footer_url : NULL);
+
+	if(options & kPDF_MARGINS) {
+		hash_text(hash, cmd_info->margins.top);
+		hash_text(hash, cmd_info->margins.bottom);
+		hash_text(hash, cmd_info->margins.left);
+		hash_text(hash, cmd_info->margins.right);
+		hash_text(hash, cmd_info->margins.header);
+		hash_text(hash, cmd_info->margins.footer);
+	}
+
+	if(!BCRYPT_SUCCESS(BCryptFinishHash(hash, digest, sizeof(digest), 0)))
+		errorout(E_MALLOC, _T("Failed to finish a SHA-256 hash"));
+
+	BCryptDestroyHash(hash);
+	BCryptCloseAlgorithmProvider(sha256, 0);
+
+	for(i = 0; i < CACHE_DIGEST_LEN; ++i)
+		_sntprintf(&key[2 * i], 3, _T("%02x"), digest[i]);
+
+	key[CACHE_KEY_LEN] = _T('\0');
+	free(numbers);
+	free(description);
+}
+
+/*
+ * Add the given text to the given hash along with whether it is NULL
+ * and its terminator, so that consecutive texts cannot run together.
+ * The value of text may be NULL.
+ */
+static void hash_text(BCRYPT_HASH_HANDLE hash, LPCTSTR text)
+{
+	UCHAR present = text != NULL;
+
+	if(!BCRYPT_SUCCESS(BCryptHashData(hash, &present, 1, 0)))
+		errorout(E_MALLOC, _T("Failed to compute a SHA-256 hash"));
+
+	if(text != NULL && !BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR) text,
+			(ULONG) ((_tcslen(text) + 1) * sizeof(*text)), 0)))
+		errorout(E_MALLOC, _T("Failed to compute a SHA-256 hash"));
+}
+
+/*
+ * Add the contents of the file at the given path to the given hash
+ * along with whether there is one, like hash_text(). If the file
+ * cannot be read, its path is added instead, so that the conversion is
+ * unlikely to match anything cached. The value of path may be NULL.
+ */
+static void hash_file(BCRYPT_HASH_HANDLE hash, LPCTSTR path)
+{
+	unsigned char* chunk = NULL;
+	FILE* file = NULL;
+	UCHAR present = 2; /* unlike any text, which gives 0 or 1 */
+	size_t read = 0;
+
+	if(path != NULL)
+		file = open_file(path, _T("rb"));
+
+	if(file == NULL) {
+		hash_text(hash, path);
+		return;
+	}
+
+	if(!BCRYPT_SUCCESS(BCryptHashData(hash, &present, 1, 0)))
+		errorout(E_MALLOC, _T("Failed to compute a SHA-256 hash"));
+
+	chunk = (unsigned char*) require_cmem(CACHE_CHUNK_SIZE, 1);
+
+	while((read = fread(chunk, 1, CACHE_CHUNK_SIZE, file)) > 0)
+		if(!BCRYPT_SUCCESS(BCryptHashData(hash, chunk, (ULONG) read, 0)))
+			errorout(E_MALLOC, _T("Failed to compute a SHA-256 hash"));
+
+	free(chunk);
+	release_file(file);
+}
+
+/*
+ * Read the entry of a cached conversion at the given path. Its first
+ * line holds the number of pages, which is stored in the value pointed
+ * to by pages. Each line after it holds the validators of a source,
+ * its ETag and its Last-Modified date separated by a tab, either of
+ * which may be empty. The value pointed to by validators is set to an
+ * array of those lines and the value pointed to by count to their
+ * number. If there is no entry or it is malformed, zero is returned and
+ * the array is empty. Otherwise, nonzero is returned. The values of
+ * path, pages, validators and count must not be NULL. The array must be
+ * passed to free_lines().
+ */
+static int read_entry(LPCTSTR path, unsigned long int* pages,
+		LPTSTR** validators, size_t* count)
+{
+	FILE* file = NULL;
+	LPTSTR line = NULL;
+	int found = 0;
+
+	RT_NOT_NULL(path);
+	RT_NOT_NULL(pages);
+	RT_NOT_NULL(validators);
+	RT_NOT_NULL(count);
+
+	*validators = NULL;
+	*count = 0;
+	file = open_file(path, _T("r"));
+
+	if(file == NULL)
+		return 0;
+
+	line = (LPTSTR) require_cmem(CACHE_LINE_MAX, sizeof(*line));
+	found = _fgetts(line, CACHE_LINE_MAX, file) != NULL
+			&& _stscanf(line, _T("%lu"), pages) == 1;
+
+	while(found && _fgetts(line, CACHE_LINE_MAX, file) != NULL) {
+		LPTSTR end = _tcschr(line, _T('\n'));
+		LPTSTR* lines = NULL;
+
+		if(end == NULL) {
+			found = 0;
+			break;
+		}
+
+		*end = _T('\0');
+		lines = (LPTSTR*) realloc(*validators, (*count + 1) * sizeof(*lines));
+
+		if(lines == NULL)
+			errorout(E_MALLOC, _T("Failed to allocate memory"));
+
+		*validators = lines;
+		(*validators)[(*count)++] = require_dup_str(line);
+	}
+
+	free(line);
+	release_file(file);
+
+	if(!found) {
+		free_lines(*validators, *count);
+		*validators = NULL;
+		*count = 0;
+	}
+
+	return found;
+}
+
+/*
+ * Check whether each of the count URLs in the array pointed to by urls
+ * changed since it had the validators in the same element of the array
+ * of stored_count lines pointed to by stored, waiting at most timeout
+ * milliseconds for each step of each check. Every URL is checked, even
+ * after one changed, and the value pointed to by fresh is set to an
+ * array of the validators each has now. Nonzero is returned if none
+ * changed. The values of urls and fresh must not be NULL. The value of
+ * stored may be NULL if stored_count is zero. The array stored in the
+ * value pointed to by fresh must be passed to free_lines().
+ */
+static int check_sources(LPTSTR* urls, size_t count, LPTSTR* stored,
+		size_t stored_count, DWORD timeout, LPTSTR** fresh)
+{
+	size_t i = 0;
+	int unchanged = 1;
+
+	RT_NOT_NULL(urls);
+	RT_NOT_NULL(fresh);
+
+	*fresh = (LPTSTR*) require_cmem(count, sizeof(**fresh));
+
+	for(i = 0; i < count; ++i)
+		if(!check_source(urls[i], i < stored_count ? stored[i] : NULL,
+				timeout, &(*fresh)[i]))
+			unchanged = 0;
+
+	return unchanged;
+}
+
+/*
+ * Check whether the given URL changed since it had the given
+ * validators, a line of an entry as described by read_entry(), with a
+ * conditional HEAD request, so that the body is never sent, however the
+ * server answers, which waits at most timeout milliseconds to connect,
+ * send or receive. If the server answers 304 Not Modified, or answers
+ * 200 OK with the same ETag, or the same Last-Modified date if there is
+ * no ETag, the URL is unchanged. Any other answer, or none, means it
+ * changed. URLs other than HTTP and HTTPS ones are never checked and
+ * count as unchanged, since nothing but their name can tell whether
+ * they changed. The value pointed to by fresh is set to a line with the
+ * validators the URL has now. Nonzero is returned if the URL is
+ * unchanged. The value of stored may be NULL if the URL has no
+ * validators. The values of url and fresh must not be NULL. The string
+ * stored in the value pointed to by fresh must be passed to free().
+ */
+static int check_source(LPCTSTR url, LPCTSTR stored, DWORD timeout,
+		LPTSTR* fresh)
+{
+	TCHAR etag[CACHE_LINE_MAX] = _T("");
+	TCHAR modified[CACHE_LINE_MAX] = _T("");
+	HINTERNET connect = NULL;
+	HINTERNET request = NULL;
+	LPTSTR old_etag = NULL; /* ETag in the entry, or empty */
+	LPTSTR old_modified = NULL; /* Last-Modified in the entry, or empty */
+	LPTSTR headers = NULL;
+	DWORD status = 0;
+	DWORD size = 0;
+	int unchanged = 0;
+
+	RT_NOT_NULL(url);
+	RT_NOT_NULL(fresh);
+
+	if(_tcsnicmp(url, _T("http://"), 7) != 0
+			&& _tcsnicmp(url, _T("https://"), 8) != 0) {
+		*fresh = require_dup_str(_T("\t"));
+		return 1;
+	}
+
+	old_etag = require_dup_str(stored != NULL ? stored : _T(""));
+	old_modified = _tcschr(old_etag, _T('\t'));
+
+	if(old_modified != NULL)
+		*old_modified++ = _T('\0');
+	else
+		old_modified = old_etag + _tcslen(old_etag);
+
+	headers = require_strf(_T("%s%s%s%s%s%s"),
+			*old_etag != _T('\0') ? _T("If-None-Match: ") : _T(""), old_etag,
+			*old_etag != _T('\0') ? _T("\r\n") : _T(""),
+			*old_modified != _T('\0') ? _T("If-Modified-Since: ") : _T(""),
+			old_modified, *old_modified != _T('\0') ? _T("\r\n") : _T(""));
+
+	request = send_check(url, headers, timeout, &connect);
+
+	if(request != NULL) {
+		size = sizeof(status);
+
+		if(!HttpQueryInfo(request, HTTP_QUERY_STATUS_CODE
+				| HTTP_QUERY_FLAG_NUMBER, &status, &size, NULL))
+			status = 0;
+
+		size = sizeof(etag);
+
+		if(!HttpQueryInfo(request, HTTP_QUERY_ETAG, etag, &size, NULL))
+			etag[0] = _T('\0');
+
+		size = sizeof(modified);
+
+		if(!HttpQueryInfo(request, HTTP_QUERY_LAST_MODIFIED, modified, &size,
+				NULL))
+			modified[0] = _T('\0');
+
+		InternetCloseHandle(request);
+	} else {
+		writelog(kVERBOSE, _T("Failed to check '%s' (%lu)\n"), url,
+				GetLastError());
+	}
+
+	if(connect != NULL)
+		InternetCloseHandle(connect);
+
+	/* A server may ignore the conditions but still show nothing changed */
+	if(status == HTTP_STATUS_NOT_MODIFIED) {
+		unchanged = 1;
+		*fresh = require_strf(_T("%s\t%s"), old_etag, old_modified);
+	} else if(status == HTTP_STATUS_OK) {
+		if(etag[0] != _T('\0'))
+			unchanged = _tcscmp(etag, old_etag) == 0;
+		else
+			unchanged = modified[0] != _T('\0')
+					&& _tcscmp(modified, old_modified) == 0;
+
+		*fresh = require_strf(_T("%s\t%s"), etag, modified);
+	} else {
+		*fresh = require_dup_str(_T("\t"));
+	}
+
+	writelog(kDEBUG, _T("Checked '%s': %lu (%s)\n"), url, status,
+			unchanged ? _T("unchanged") : _T("changed"));
+	free(headers);
+	free(old_etag);
+	return unchanged;
+}
+
+/*
+ * Send a HEAD request for the given HTTP or HTTPS URL with the given
+ * extra headers, which may be empty, and return it, or NULL if it could
+ * not be sent. Connecting, sending the request and each wait for the
+ * answer give up after timeout milliseconds. The value pointed to by
+ * connect is set to the connection the request was opened on, or NULL,
+ * which must be closed once the request is. The request never comes
+ * from the WinInet cache. The values of url, headers and connect must
+ * not be NULL.
+ */
+static HINTERNET send_check(LPCTSTR url, LPCTSTR headers, DWORD timeout,
+		HINTERNET* connect)
+{
+	static const DWORD options[] = { INTERNET_OPTION_CONNECT_TIMEOUT,
+			INTERNET_OPTION_SEND_TIMEOUT, INTERNET_OPTION_RECEIVE_TIMEOUT };
+	TCHAR host[INTERNET_MAX_HOST_NAME_LENGTH + 1] = _T("");
+	URL_COMPONENTS parts;
+	HINTERNET request = NULL;
+	DWORD flags = INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE
+			| INTERNET_FLAG_KEEP_CONNECTION | INTERNET_FLAG_NO_UI;
+	size_t i = 0;
+
+	RT_NOT_NULL(url);
+	RT_NOT_NULL(headers);
+	RT_NOT_NULL(connect);
+
+	*connect = NULL;
+	memset(&parts, 0, sizeof(parts));
+	parts.dwStructSize = sizeof(parts);
+	parts.lpszHostName = host;
+	parts.dwHostNameLength = LENGTHOF(host);
+	parts.dwUrlPathLength = 1; /* point into url */
+
+	if(cache.session == NULL || !InternetCrackUrl(url, 0, 0, &parts))
+		return NULL;
+
+	if(parts.nScheme == INTERNET_SCHEME_HTTPS)
+		flags |= INTERNET_FLAG_SECURE;
+
+	*connect = InternetConnect(cache.session, host, parts.nPort, NULL, NULL,
+			INTERNET_SERVICE_HTTP, 0, 0);
+
+	/* The path points into url, so it is followed by the query */
+	if(*connect != NULL)
+		request = HttpOpenRequest(*connect, _T("HEAD"),
+				parts.dwUrlPathLength > 0 ? parts.lpszUrlPath : _T("/"), NULL,
+				NULL, NULL, flags, 0);
+
+	/* The session is shared, so the limits go on the request alone */
+	for(i = 0; i < LENGTHOF(options) && request != NULL; ++i)
+		InternetSetOption(request, options[i], &timeout, sizeof(timeout));
+
+	if(request != NULL && !HttpSendRequest(request,
+			*headers != _T('\0') ? headers : NULL, (DWORD) -1, NULL, 0)) {
+		InternetCloseHandle(request);
+		request = NULL;
+	}
+
+	return request;
+}
+
+/*
+ * Release the array of count strings pointed to by lines. The value of
+ * lines may be NULL.
+ */
+static void free_lines(LPTSTR* lines, size_t count)
+{
+	size_t i = 0;
+
+	if(lines == NULL)
+		return;
+
+	for(i = 0; i < count; ++i)
+		free(lines[i]);
+
+	free(lines);
+}
+
+/*
+ * Store in the array pointed to by paths the path of each file of the
+ * conversion with the given key in the given cache directory, indexed
+ * by cache_file. The values of paths, dir and key must not be NULL. The
+ * array must be passed to free_cache_paths().
+ */
+static void get_cache_paths(LPTSTR* paths, LPCTSTR dir, LPCTSTR key)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(paths);
+	RT_NOT_NULL(dir);
+	RT_NOT_NULL(key);
+
+	for(i = 0; i < kCACHE_FILES; ++i)
+		paths[i] = require_strf(_T("%s\\%s.%s"), dir, key, cache_exts[i]);
+}
+
+/*
+ * Release the paths stored by get_cache_paths() in the array pointed to
+ * by paths. The value of paths must not be NULL.
+ */
+static void free_cache_paths(LPTSTR* paths)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(paths);
+
+	for(i = 0; i < kCACHE_FILES; ++i)
+		free(paths[i]);
+}
+
+/*
+ * Set the last write time of the file at the given path to now. Not
+ * every volume keeps last access times, so this is how the cache marks
+ * a conversion as used. A failure is ignored. The value of path must
+ * not be NULL.
+ */
+static void touch_file(LPCTSTR path)
+{
+	HANDLE file = NULL;
+	FILETIME now;
+
+	RT_NOT_NULL(path);
+
+	file = CreateFile(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ
+			| FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if(file == INVALID_HANDLE_VALUE)
+		return;
+
+	GetSystemTimeAsFileTime(&now);
+	SetFileTime(file, NULL, NULL, &now);
+	CloseHandle(file);
+}
+
+/*
+ * Delete the least recently used conversions in the given cache
+ * directory until its conversions take at most limit bytes. A PDF
+ * without an entry that is older than CACHE_ORPHAN_AGE was abandoned by
+ * a failed publish and goes first. The entry of a conversion is deleted
+ * before its other files so that it is no longer found. Files another
+ * job has open are left alone. The value of dir must not be NULL.
+ */
+static void evict_renders(LPCTSTR dir, ULONGLONG limit)
+{
+	WIN32_FIND_DATA found;
+	FILETIME now_time;
+	struct cache_item* items = NULL; /* every conversion in the cache */
+	HANDLE find = NULL;
+	LPTSTR pattern = NULL;
+	ULONGLONG total = 0; /* bytes taken by every conversion */
+	ULONGLONG now = 0;
+	size_t count = 0; /* number of elements in items */
+	size_t capacity = 0; /* number of elements allocated for items */
+	size_t evicted = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(dir);
+
+	pattern = require_strf(_T("%s\\*.%s"), dir, cache_exts[kCACHE_PDF]);
+	find = FindFirstFile(pattern, &found);
+	free(pattern);
+
+	if(find == INVALID_HANDLE_VALUE)
+		return;
+
+	GetSystemTimeAsFileTime(&now_time);
+	now = get_ticks(&now_time);
+
+	do {
+		WIN32_FILE_ATTRIBUTE_DATA attrs;
+		struct cache_item* item = NULL;
+		LPTSTR paths[kCACHE_FILES];
+
+		/* Temporary files of a publish in progress are not conversions */
+		if(_tcslen(found.cFileName) != CACHE_KEY_LEN + 1
+				+ _tcslen(cache_exts[kCACHE_PDF]))
+			continue;
+
+		if(count == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 64;
+			items = (struct cache_item*) realloc(items,
+					capacity * sizeof(*items));
+
+			if(items == NULL)
+				errorout(E_MALLOC, _T("Failed to allocate memory"));
+		}
+
+		item = &items[count++];
+		_tcsncpy(item->key, found.cFileName, CACHE_KEY_LEN);
+		item->key[CACHE_KEY_LEN] = _T('\0');
+		item->size = (ULONGLONG) found.nFileSizeHigh << 32
+				| found.nFileSizeLow;
+		item->used = 0;
+		get_cache_paths(paths, dir, item->key);
+
+		if(GetFileAttributesEx(paths[kCACHE_OUTLINE], GetFileExInfoStandard,
+				&attrs))
+			item->size += (ULONGLONG) attrs.nFileSizeHigh << 32
+					| attrs.nFileSizeLow;
+
+		/* A PDF is renamed into place shortly before its entry */
+		if(GetFileAttributesEx(paths[kCACHE_ENTRY], GetFileExInfoStandard,
+				&attrs))
+			item->used = get_ticks(&attrs.ftLastWriteTime);
+		else if(now - get_ticks(&found.ftLastWriteTime) < CACHE_ORPHAN_AGE)
+			item->used = now;
+
+		total += item->size;
+		free_cache_paths(paths);
+	} while(FindNextFile(find, &found));
+
+	FindClose(find);
+
+	if(total > limit)
+		qsort(items, count, sizeof(*items), compare_use);
+
+	for(i = 0; i < count && total > limit; ++i) {
+		LPTSTR paths[kCACHE_FILES];
+
+		get_cache_paths(paths, dir, items[i].key);
+		DeleteFile(paths[kCACHE_ENTRY]);
+		DeleteFile(paths[kCACHE_PDF]);
+		DeleteFile(paths[kCACHE_OUTLINE]);
+		free_cache_paths(paths);
+		total -= items[i].size;
+		++evicted;
+	}
+
+	if(evicted > 0)
+		writelog(kVERBOSE, _T("Evicted %lu conversions from the render ")
+				_T("cache\n"), (unsigned long int) evicted);
+
+	free(items);
+}
+
+/*
+ * Return the given file time as a number of 100-nanosecond intervals.
+ * The value of time must not be NULL.
+ */
+static ULONGLONG get_ticks(const FILETIME* time)
+{
+	RT_NOT_NULL(time);
+
+	return (ULONGLONG) time->dwHighDateTime << 32 | time->dwLowDateTime;
+}
+
+/*
+ * Compare the cache_item structures pointed to by a and b for qsort()
+ * so that the least recently used comes first. The values of a and b
+ * must not be NULL.
+ */
+static int compare_use(const void* a, const void* b)
+{
+	const struct cache_item* item_a = (const struct cache_item*) a;
+	const struct cache_item* item_b = (const struct cache_item*) b;
+
+	if(item_a->used != item_b->used)
+		return item_a->used < item_b->used ? -1 : 1;
+
+	return 0;
+}
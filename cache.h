@@ -0,0 +1,17 @@
+#pragma once
+
+#include "stdafx.h"
+#include "parse.h"
+#include "renderer.h"
+#include "wkhtmltopdf_cmd.h"
+
+struct cache_pending;
+
+int fetch_render(const struct pdf_info*, const struct renderer*,
+		const struct wkhtmltopdf_cmd_info*, unsigned long int*,
+		struct cache_pending**);
+void publish_render(const struct pdf_info*, const struct renderer*,
+		const struct wkhtmltopdf_cmd_info*, unsigned long int,
+		struct cache_pending*);
+void replace_validators(struct cache_pending*, size_t, LPCTSTR, LPCTSTR);
+void free_pending(struct cache_pending*);
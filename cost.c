@@ -0,0 +1,334 @@
+#include "stdafx.h"
+#include "cost.h"
+#include "util.h"
+#include "log.h"
+
+/* Longest line in a cost store file */
+#define COST_LINE_MAX (INTERNET_MAX_URL_LENGTH + 128)
+
+/* Most segments a cost store file keeps */
+#define COST_STORE_MAX 4096
+
+static struct cost_entry* find_entry(const struct cost_store*,
+		const struct pdf_segment_info*);
+static size_t find_slot(const struct cost_store*, LPCTSTR, LPCTSTR,
+		LPCTSTR);
+static void grow_slots(struct cost_store*);
+static int compare_recorded(const void*, const void*);
+
+/*
+ * Initialize the given cost_store structure from the file at the given
+ * path. Each line of the file holds the conversion time in
+ * milliseconds, the number of pages, the paper size, the orientation
+ * and the query string of one segment, separated by tabs, from the
+ * least to the most recently recorded. If the file does not exist, the
+ * store starts empty. Malformed lines are ignored. The values of store
+ * and path must not be NULL. The structure must be passed to
+ * destroy_cost_store().
+ */
+void load_cost_store(struct cost_store* store, LPCTSTR path)
+{
+	FILE* file = NULL;
+	LPTSTR line = NULL;
+
+	RT_NOT_NULL(store);
+	RT_NOT_NULL(path);
+
+	store->entries = NULL;
+	store->count = 0;
+	store->slots = NULL;
+	store->capacity = 0;
+	store->clock = 0;
+	store->path = require_dup_str(path);
+	file = open_file(path, _T("r"));
+
+	if(file == NULL) {
+		writelog(kVERBOSE, _T("Starting a new cost store at '%s'\n"), path);
+		return;
+	}
+
+	line = (LPTSTR) require_cmem(COST_LINE_MAX, sizeof(*line));
+
+	while(_fgetts(line, COST_LINE_MAX, file) != NULL) {
+		struct pdf_segment_info segment;
+		LPTSTR millis = NULL;
+		LPTSTR pages = NULL;
+		LPTSTR end = NULL;
+
+		if(_tcschr(line, _T('\n')) == NULL) {
+			skip_line(file);
+			continue;
+		}
+
+		millis = _tcstok(line, _T("\t"));
+		pages = _tcstok(NULL, _T("\t"));
+		segment.size = _tcstok(NULL, _T("\t"));
+		segment.orientation = _tcstok(NULL, _T("\t"));
+		segment.segment = _tcstok(NULL, _T("\n"));
+
+		if(segment.segment == NULL)
+			continue;
+
+		record_cost(store, &segment, _tcstoul(millis, &end, 10),
+				_tcstoul(pages, &end, 10));
+	}
+
+	free(line);
+	release_file(file);
+	writelog(kDEBUG, _T("Loaded %lu costs from '%s'\n"),
+			(unsigned long int) store->count, path);
+}
+
+/*
+ * Return a pointer to the remembered cost of the given segment, or NULL
+ * if it has none. Segments are the same if their query strings, sizes
+ * and orientations are the same. The values of store and segment must
+ * not be NULL.
+ */
+const struct cost_entry* find_cost(const struct cost_store* store,
+		const struct pdf_segment_info* segment)
+{
+	return find_entry(store, segment);
+}
+
+/*
+ * Remember that converting the given segment took the given number of
+ * milliseconds and produced the given number of pages, as the most
+ * recently recorded cost of the store. The values of store and segment
+ * and its members must not be NULL.
+ */
+void record_cost(struct cost_store* store,
+		const struct pdf_segment_info* segment, unsigned long int millis,
+		unsigned long int pages)
+{
+	struct cost_entry* entry = NULL;
+
+	RT_NOT_NULL(store);
+	RT_NOT_NULL(segment);
+	RT_NOT_NULL(segment->segment);
+	RT_NOT_NULL(segment->size);
+	RT_NOT_NULL(segment->orientation);
+
+	entry = find_entry(store, segment);
+
+	if(entry == NULL) {
+		struct cost_entry* entries = (struct cost_entry*) realloc(
+				store->entries, (store->count + 1) * sizeof(*entries));
+
+		if(entries == NULL)
+			errorout(E_MALLOC, _T("Failed to allocate memory"));
+
+		grow_slots(store);
+		store->entries = entries;
+		entry = &store->entries[store->count++];
+		entry->url = require_dup_str(segment->segment);
+		entry->size = require_dup_str(segment->size);
+		entry->orientation = require_dup_str(segment->orientation);
+		store->slots[find_slot(store, entry->url, entry->size,
+				entry->orientation)] = store->count;
+	}
+
+	entry->millis = millis;
+	entry->pages = pages;
+	entry->recorded = ++store->clock;
+}
+
+/*
+ * Write the given store back to its file, keeping only the
+ * COST_STORE_MAX most recently recorded segments, so that segments
+ * which are not converted again are forgotten. The file is replaced as
+ * a whole so that a reader never sees a partial store. If several
+ * processes or jobs save the same store, the last one wins. A failure
+ * to save is logged but is not fatal. The value of store must not be
+ * NULL.
+ */
+void save_cost_store(const struct cost_store* store)
+{
+	FILE* file = NULL;
+	LPTSTR tmp_path = NULL;
+	const struct cost_entry** order = NULL; /* entries, oldest first */
+	size_t i = 0;
+	int failed = 0;
+
+	RT_NOT_NULL(store);
+
+	order = (const struct cost_entry**) require_cmem(store->count + 1,
+			sizeof(*order));
+
+	for(i = 0; i < store->count; ++i)
+		order[i] = &store->entries[i];
+
+	qsort(order, store->count, sizeof(*order), compare_recorded);
+
+	/* Jobs of a server save from several threads of one process */
+	tmp_path = require_strf(_T("%s.%lu.%lu.tmp"), store->path,
+			GetCurrentProcessId(), GetCurrentThreadId());
+	file = open_file(tmp_path, _T("w"));
+
+	if(file == NULL) {
+		writelog(kNORM, _T("Failed to save cost store '%s'\n"), store->path);
+		free(order);
+		free(tmp_path);
+		return;
+	}
+
+	i = store->count > COST_STORE_MAX ? store->count - COST_STORE_MAX : 0;
+
+	for(; i < store->count && !failed; ++i) {
+		const struct cost_entry* entry = order[i];
+
+		if(_ftprintf(file, _T("%lu\t%lu\t%s\t%s\t%s\n"), entry->millis,
+				entry->pages, entry->size, entry->orientation,
+				entry->url) < 0)
+			failed = 1;
+	}
+
+	if(release_file(file) != 0)
+		failed = 1;
+
+	if(failed || !MoveFileEx(tmp_path, store->path,
+			MOVEFILE_REPLACE_EXISTING)) {
+		writelog(kNORM, _T("Failed to save cost store '%s'\n"), store->path);
+		_tremove(tmp_path);
+	}
+
+	free(order);
+	free(tmp_path);
+}
+
+/*
+ * This procedure destroys the object pointed to by store. An attempt
+ * to use it after calling this procedure results in undefined behavior
+ * unless it is loaded again. The value of store must not be NULL.
+ */
+void destroy_cost_store(struct cost_store* store)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(store);
+
+	for(i = 0; i < store->count; ++i) {
+		free(store->entries[i].url);
+		free(store->entries[i].size);
+		free(store->entries[i].orientation);
+	}
+
+	free(store->entries);
+	free(store->slots);
+	free(store->path);
+	store->entries = NULL;
+	store->slots = NULL;
+	store->count = 0;
+	store->capacity = 0;
+}
+
+/*
+ * Return a pointer to the entry for the given segment in the given
+ * store, or NULL if there is none. The values of store and segment
+ * must not be NULL.
+ */
+static struct cost_entry* find_entry(const struct cost_store* store,
+		const struct pdf_segment_info* segment)
+{
+	size_t index = 0;
+
+	RT_NOT_NULL(store);
+	RT_NOT_NULL(segment);
+
+	if(store->capacity == 0)
+		return NULL;
+
+	index = store->slots[find_slot(store, segment->segment, segment->size,
+			segment->orientation)];
+
+	return index != 0 ? &store->entries[index - 1] : NULL;
+}
+
+/*
+ * Return the slot of the hash table of the given store which holds the
+ * entry with the given query string, size and orientation, or the
+ * empty slot where it belongs if there is none. The table must have
+ * at least one empty slot. The values of store, url, size and
+ * orientation must not be NULL.
+ */
+static size_t find_slot(const struct cost_store* store, LPCTSTR url,
+		LPCTSTR size, LPCTSTR orientation)
+{
+	LPCTSTR parts[3];
+	size_t hash = 2166136261U; /* FNV-1a offset basis */
+	size_t slot = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(store);
+	RT_NOT_NULL(url);
+	RT_NOT_NULL(size);
+	RT_NOT_NULL(orientation);
+
+	parts[0] = url;
+	parts[1] = size;
+	parts[2] = orientation;
+
+	/* Each part is hashed with its terminator, so parts cannot run on */
+	for(i = 0; i < LENGTHOF(parts); ++i) {
+		LPCTSTR c = parts[i];
+
+		do {
+			hash = (hash ^ (size_t) *c) * 16777619U;
+		} while(*c++ != _T('\0'));
+	}
+
+	for(slot = hash & (store->capacity - 1); store->slots[slot] != 0;
+			slot = (slot + 1) & (store->capacity - 1)) {
+		const struct cost_entry* entry = &store->entries[store->slots[slot]
+				- 1];
+
+		if(_tcscmp(entry->url, url) == 0
+				&& _tcscmp(entry->size, size) == 0
+				&& _tcscmp(entry->orientation, orientation) == 0)
+			break;
+	}
+
+	return slot;
+}
+
+/*
+ * Make room in the hash table of the given store for one more entry,
+ * keeping it at most half full. The value of store must not be NULL.
+ */
+static void grow_slots(struct cost_store* store)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(store);
+
+	if(2 * (store->count + 1) <= store->capacity)
+		return;
+
+	free(store->slots);
+	store->capacity = store->capacity > 0 ? store->capacity * 2 : 256;
+	store->slots = (size_t*) require_cmem(store->capacity,
+			sizeof(*store->slots));
+
+	for(i = 0; i < store->count; ++i) {
+		const struct cost_entry* entry = &store->entries[i];
+
+		store->slots[find_slot(store, entry->url, entry->size,
+				entry->orientation)] = i + 1;
+	}
+}
+
+/*
+ * Order the cost entries pointed to by the pointers pointed to by a and
+ * b from the least to the most recently recorded. This is a qsort()
+ * comparison function. The values of a and b must not be NULL.
+ */
+static int compare_recorded(const void* a, const void* b)
+{
+	const struct cost_entry* x = *(const struct cost_entry* const*) a;
+	const struct cost_entry* y = *(const struct cost_entry* const*) b;
+
+	RT_NOT_NULL(x);
+	RT_NOT_NULL(y);
+
+	return x->recorded < y->recorded ? -1 : x->recorded > y->recorded;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "stdafx.h"
+#include "parse.h"
+
+/* Measured cost of converting one segment */
+struct cost_entry {
+	LPTSTR url; /* segment query string */
+	LPTSTR size; /* paper size */
+	LPTSTR orientation; /* page orientation */
+	unsigned long int millis; /* conversion time in milliseconds */
+	unsigned long int pages; /* number of pages produced */
+	unsigned long int recorded; /* clock of the store when last recorded */
+};
+
+/* Conversion costs remembered between runs */
+struct cost_store {
+	struct cost_entry* entries; /* every remembered segment */
+	LPTSTR path; /* file the store is kept in */
+	size_t count; /* number of elements in entries */
+	size_t* slots; /* hash table of indices in entries plus 1, or 0 */
+	size_t capacity; /* number of slots in slots, a power of 2 */
+	unsigned long int clock; /* number of costs recorded */
+};
+
+void load_cost_store(struct cost_store*, LPCTSTR);
+const struct cost_entry* find_cost(const struct cost_store*,
+		const struct pdf_segment_info*);
+void record_cost(struct cost_store*, const struct pdf_segment_info*,
+		unsigned long int, unsigned long int);
+void save_cost_store(const struct cost_store*);
+void destroy_cost_store(struct cost_store*);
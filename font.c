@@ -0,0 +1,372 @@
+#include "stdafx.h"
+#include "font.h"
+#include "util.h"
+#include "log.h"
+
+/* Size at which fonts are measured, so pixels are thousandths of it */
+#define FONT_UNITS 1000
+
+/* Code page of text shown with a pdf_font, WinAnsiEncoding in a PDF */
+#define FONT_CODE_PAGE 1252
+
+/* First and last characters a pdf_font has widths for */
+#define FONT_FIRST_CHAR 32
+#define FONT_LAST_CHAR 255
+
+/* Flags of a PDF font descriptor */
+#define FONT_FIXED_PITCH 1
+#define FONT_SERIF 2
+#define FONT_NONSYMBOLIC 32
+#define FONT_ITALIC 64
+
+static void set_font_name(struct pdf_font*, LPCTSTR);
+
+/*
+ * Fill the structure pointed to by font with the metrics of the
+ * TrueType font of the given family, as installed. If no such font is
+ * installed, GDI picks the closest one and that is the font measured.
+ * The widths are those of the characters of windows-1252, which is how
+ * encode_pdf_text() encodes text. The values of font and family must
+ * not be NULL.
+ */
+void load_pdf_font(struct pdf_font* font, LPCTSTR family)
+{
+	LOGFONT spec; /* the font asked for */
+	OUTLINETEXTMETRIC* metrics = NULL;
+	HDC dc = NULL;
+	HFONT handle = NULL;
+	HGDIOBJ old = NULL; /* font selected into dc before handle */
+	TCHAR face[LF_FACESIZE] = _T(""); /* the font GDI picked */
+	UINT size = 0;
+	int i = 0;
+
+	RT_NOT_NULL(font);
+	RT_NOT_NULL(family);
+
+	memset(font, 0, sizeof(*font));
+	memset(&spec, 0, sizeof(spec));
+	spec.lfHeight = -FONT_UNITS;
+	spec.lfWeight = FW_NORMAL;
+	spec.lfCharSet = ANSI_CHARSET;
+	spec.lfOutPrecision = OUT_TT_ONLY_PRECIS;
+	_tcsncpy(spec.lfFaceName, family, LF_FACESIZE - 1);
+
+	dc = CreateCompatibleDC(NULL);
+
+	if(dc == NULL)
+		errorout(E_FONT, _T("Failed to create a device context (%lu)"),
+				GetLastError());
+
+	handle = CreateFontIndirect(&spec);
+
+	if(handle == NULL)
+		errorout(E_FONT, _T("Failed to create font '%s'"), family);
+
+	old = SelectObject(dc, handle);
+	size = GetOutlineTextMetrics(dc, 0, NULL);
+
+	if(size == 0)
+		errorout(E_FONT, _T("Font '%s' is not a TrueType font"), family);
+
+	metrics = (OUTLINETEXTMETRIC*) require_mem(size);
+
+	if(GetOutlineTextMetrics(dc, size, metrics) == 0
+			|| GetTextFace(dc, LENGTHOF(face), face) == 0)
+		errorout(E_FONT, _T("Failed to measure font '%s'"), family);
+
+	if(_tcsicmp(face, family) != 0)
+		writelog(kNORM, _T("Font '%s' is not installed; using '%s'\n"),
+				family, face);
+
+	for(i = FONT_FIRST_CHAR; i <= FONT_LAST_CHAR; ++i) {
+		char c = (char) i;
+		WCHAR wc = 0;
+
+		/* Bytes windows-1252 leaves undefined get the width of U+FFFD */
+		if(MultiByteToWideChar(FONT_CODE_PAGE, 0, &c, 1, &wc, 1) != 1)
+			wc = 0xfffd;
+
+		if(!GetCharWidth32W(dc, wc, wc, &font->widths[i]))
+			errorout(E_FONT, _T("Failed to measure font '%s'"), face);
+	}
+
+	set_font_name(font, face);
+	font->ascent = metrics->otmAscent;
+	font->descent = metrics->otmDescent;
+	font->cap_height = (int) metrics->otmsCapEmHeight;
+	font->bbox[0] = metrics->otmrcFontBox.left;
+	font->bbox[1] = metrics->otmrcFontBox.bottom;
+	font->bbox[2] = metrics->otmrcFontBox.right;
+	font->bbox[3] = metrics->otmrcFontBox.top;
+	font->italic_angle = metrics->otmItalicAngle / 10;
+	font->flags = FONT_NONSYMBOLIC;
+
+	/* The bit is set for fonts that are not fixed pitch, oddly */
+	if(!(metrics->otmTextMetrics.tmPitchAndFamily & TMPF_FIXED_PITCH))
+		font->flags |= FONT_FIXED_PITCH;
+
+	if((metrics->otmTextMetrics.tmPitchAndFamily & 0xf0) == FF_ROMAN)
+		font->flags |= FONT_SERIF;
+
+	if(metrics->otmTextMetrics.tmItalic)
+		font->flags |= FONT_ITALIC;
+
+	/* PDF has no use for the exact value; this is the usual estimate */
+	font->stem_v = 50 + (int) (metrics->otmTextMetrics.tmWeight / 65.0
+			* (metrics->otmTextMetrics.tmWeight / 65.0));
+
+	free(metrics);
+	SelectObject(dc, old);
+	DeleteObject(handle);
+	DeleteDC(dc);
+}
+
+/*
+ * Set the name member of the structure pointed to by font to the given
+ * face name without the spaces and characters a PDF name cannot hold,
+ * which is how a TrueType font is named in a PDF that does not embed
+ * it. The values of font and face must not be NULL.
+ */
+static void set_font_name(struct pdf_font* font, LPCTSTR face)
+{
+	size_t len = 0;
+
+	RT_NOT_NULL(font);
+	RT_NOT_NULL(face);
+
+	for(; *face != _T('\0') && len < FONT_NAME_LEN - 1; ++face)
+		if(*face > _T(' ') && *face < 0x7f
+				&& _tcschr(_T("()<>[]{}/%#"), *face) == NULL)
+			font->name[len++] = (char) *face;
+
+	if(len == 0)
+		strcpy(font->name, "Font");
+	else
+		font->name[len] = '\0';
+}
+
+/*
+ * Write the font of the structure pointed to by font to the given PDF
+ * and return the object number of its font dictionary. The font is
+ * not embedded; readers use the installed font of the same name, or
+ * one like it laid out with the widths written here. Text shown with
+ * it must be encoded by encode_pdf_text(). The values of writer and
+ * font must not be NULL.
+ */
+unsigned long int write_pdf_font(struct pdf_writer* writer,
+		const struct pdf_font* font)
+{
+	struct pdf_obj* dict = NULL;
+	struct pdf_obj* descriptor = NULL;
+	struct pdf_obj* widths = NULL;
+	struct pdf_obj* bbox = NULL;
+	unsigned long int font_num = 0;
+	unsigned long int descriptor_num = 0;
+	int i = 0;
+
+	RT_NOT_NULL(writer);
+	RT_NOT_NULL(font);
+
+	font_num = reserve_pdf_object(writer);
+	descriptor_num = reserve_pdf_object(writer);
+	widths = new_pdf_object(kPDF_OBJ_ARRAY);
+	bbox = new_pdf_object(kPDF_OBJ_ARRAY);
+
+	for(i = FONT_FIRST_CHAR; i <= FONT_LAST_CHAR; ++i)
+		append_pdf_item(widths, new_pdf_int(font->widths[i]));
+
+	for(i = 0; i < 4; ++i)
+		append_pdf_item(bbox, new_pdf_int(font->bbox[i]));
+
+	dict = new_pdf_object(kPDF_OBJ_DICT);
+	set_pdf_key(dict, "Type", new_pdf_name("Font"));
+	set_pdf_key(dict, "Subtype", new_pdf_name("TrueType"));
+	set_pdf_key(dict, "BaseFont", new_pdf_name(font->name));
+	set_pdf_key(dict, "FirstChar", new_pdf_int(FONT_FIRST_CHAR));
+	set_pdf_key(dict, "LastChar", new_pdf_int(FONT_LAST_CHAR));
+	set_pdf_key(dict, "Widths", widths);
+	set_pdf_key(dict, "Encoding", new_pdf_name("WinAnsiEncoding"));
+	set_pdf_key(dict, "FontDescriptor", new_pdf_ref(descriptor_num));
+	write_pdf_object(writer, font_num, dict);
+	free_pdf_object(dict);
+
+	descriptor = new_pdf_object(kPDF_OBJ_DICT);
+	set_pdf_key(descriptor, "Type", new_pdf_name("FontDescriptor"));
+	set_pdf_key(descriptor, "FontName", new_pdf_name(font->name));
+	set_pdf_key(descriptor, "Flags", new_pdf_int(font->flags));
+	set_pdf_key(descriptor, "FontBBox", bbox);
+	set_pdf_key(descriptor, "ItalicAngle", new_pdf_int(font->italic_angle));
+	set_pdf_key(descriptor, "Ascent", new_pdf_int(font->ascent));
+	set_pdf_key(descriptor, "Descent", new_pdf_int(font->descent));
+	set_pdf_key(descriptor, "CapHeight", new_pdf_int(font->cap_height));
+	set_pdf_key(descriptor, "StemV", new_pdf_int(font->stem_v));
+	write_pdf_object(writer, descriptor_num, descriptor);
+	free_pdf_object(descriptor);
+
+	return font_num;
+}
+
+/*
+ * Return a copy of the given string encoded in windows-1252 for
+ * showing with a pdf_font. Characters it cannot encode become '?'. If
+ * it is not successful, execution is terminated. The value of s must
+ * not be NULL. The pointer returned must be passed to free().
+ */
+char* encode_pdf_text(LPCTSTR s)
+{
+	char* ret = NULL;
+	int len = 0;
+
+	RT_NOT_NULL(s);
+
+#ifdef _UNICODE
+	len = WideCharToMultiByte(FONT_CODE_PAGE, 0, s, -1, NULL, 0, "?", NULL);
+
+	if(len == 0)
+		errorout(E_STR, _T("Failed to convert '%s' to windows-1252"), s);
+
+	ret = (char*) require_mem(len);
+	WideCharToMultiByte(FONT_CODE_PAGE, 0, s, -1, ret, len, "?", NULL);
+#else
+	len = (int) strlen(s) + 1;
+	ret = (char*) require_mem(len);
+	memcpy(ret, s, len);
+#endif
+
+	return ret;
+}
+
+/*
+ * Return the width in points of the first len bytes of the given text,
+ * encoded by encode_pdf_text(), in the font of the structure pointed to
+ * by font at the given size in points. The values of font and text
+ * must not be NULL.
+ */
+double measure_pdf_text(const struct pdf_font* font, const char* text,
+		size_t len, double size)
+{
+	long int width = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(font);
+	RT_NOT_NULL(text);
+
+	for(i = 0; i < len; ++i)
+		width += font->widths[(unsigned char) text[i]];
+
+	return width * size / FONT_UNITS;
+}
+
+/*
+ * Append the first len bytes of the given text to the given buffer as
+ * a PDF string followed by the operator showing it. The values of
+ * buffer and text must not be NULL.
+ */
+void append_pdf_text(struct pdf_buffer* buffer, const char* text, size_t len)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(buffer);
+	RT_NOT_NULL(text);
+
+	append_pdf_buffer(buffer, "(", 1);
+
+	for(i = 0; i < len; ++i) {
+		/* A bare carriage return in a string would read as a newline */
+		if(text[i] == '\r') {
+			append_pdf_buffer(buffer, "\\r", 2);
+			continue;
+		}
+
+		if(text[i] == '(' || text[i] == ')' || text[i] == '\\')
+			append_pdf_buffer(buffer, "\\", 1);
+
+		append_pdf_buffer(buffer, &text[i], 1);
+	}
+
+	append_pdf_buffer(buffer, ") Tj\n", 5);
+}
+
+/*
+ * Return the first family of the given CSS font-family value, without
+ * quotes, with generic families replaced by the fonts Windows shows
+ * them in. If css is NULL, the sans-serif font is returned. The pointer
+ * returned must be passed to free().
+ */
+LPTSTR get_pdf_font_family(LPCTSTR css)
+{
+	LPTSTR family = NULL;
+	LPTSTR start = NULL;
+	LPTSTR end = NULL;
+
+	if(css == NULL)
+		return require_dup_str(_T("Arial"));
+
+	family = require_dup_str(css);
+	end = _tcschr(family, _T(','));
+
+	if(end != NULL)
+		*end = _T('\0');
+
+	for(start = family; *start == _T(' ') || *start == _T('"')
+			|| *start == _T('\''); ++start)
+		continue;
+
+	end = start + _tcslen(start);
+
+	while(end > start && (end[-1] == _T(' ') || end[-1] == _T('"')
+			|| end[-1] == _T('\'')))
+		--end;
+
+	*end = _T('\0');
+	memmove(family, start, (end - start + 1) * sizeof(*family));
+
+	if(_tcsicmp(family, _T("serif")) == 0) {
+		free(family);
+		family = require_dup_str(_T("Times New Roman"));
+	} else if(_tcsicmp(family, _T("monospace")) == 0) {
+		free(family);
+		family = require_dup_str(_T("Courier New"));
+	} else if(family[0] == _T('\0')
+			|| _tcsicmp(family, _T("sans-serif")) == 0) {
+		free(family);
+		family = require_dup_str(_T("Arial"));
+	}
+
+	return family;
+}
+
+/*
+ * Return the given length in points. It is a number followed by mm,
+ * cm, in, pt or px, or by nothing, in which case it is in units of the
+ * given number of points. If s is NULL, the fallback is returned, in
+ * the same units.
+ */
+double read_pdf_length(LPCTSTR s, double fallback, double unit)
+{
+	LPTSTR end = NULL;
+	double value = fallback;
+
+	if(s == NULL)
+		return fallback * unit;
+
+	value = require_strtod(s, &end);
+
+	while(*end == _T(' '))
+		++end;
+
+	if(_tcsicmp(end, _T("mm")) == 0)
+		unit = FONT_MM;
+	else if(_tcsicmp(end, _T("cm")) == 0)
+		unit = FONT_CM;
+	else if(_tcsicmp(end, _T("in")) == 0)
+		unit = FONT_INCH;
+	else if(_tcsicmp(end, _T("pt")) == 0)
+		unit = 1.0;
+	else if(_tcsicmp(end, _T("px")) == 0)
+		unit = FONT_PX;
+	else if(*end != _T('\0'))
+		errorout(E_ARG, _T("Unknown unit of length '%s'"), s);
+
+	return value * unit;
+}
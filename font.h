@@ -0,0 +1,34 @@
+#pragma once
+
+#include "stdafx.h"
+#include "pdf.h"
+
+/* Points in a millimeter, a centimeter, an inch and a CSS pixel */
+#define FONT_MM (72.0 / 25.4)
+#define FONT_CM (72.0 / 2.54)
+#define FONT_INCH 72.0
+#define FONT_PX 0.75
+
+/* Longest name of a font in a PDF, with its terminator */
+#define FONT_NAME_LEN 64
+
+/* A TrueType font measured through GDI, in thousandths of its size */
+struct pdf_font {
+	char name[FONT_NAME_LEN]; /* name of the font, without spaces */
+	int widths[256]; /* advance of each windows-1252 character */
+	int ascent; /* height above the baseline */
+	int descent; /* depth below the baseline, as a negative number */
+	int cap_height; /* height of capital letters */
+	int bbox[4]; /* box enclosing every glyph */
+	int italic_angle; /* slant in degrees counterclockwise from vertical */
+	int flags; /* flags of the PDF font descriptor */
+	int stem_v; /* thickness of vertical stems */
+};
+
+void load_pdf_font(struct pdf_font*, LPCTSTR);
+unsigned long int write_pdf_font(struct pdf_writer*, const struct pdf_font*);
+char* encode_pdf_text(LPCTSTR);
+double measure_pdf_text(const struct pdf_font*, const char*, size_t, double);
+void append_pdf_text(struct pdf_buffer*, const char*, size_t);
+LPTSTR get_pdf_font_family(LPCTSTR);
+double read_pdf_length(LPCTSTR, double, double);
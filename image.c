@@ -0,0 +1,417 @@
+#include "stdafx.h"
+#define COBJMACROS
+#include <wincodec.h>
+#include "image.h"
+#include "util.h"
+#include "log.h"
+
+/* Most pixels in an image that is resampled */
+#define IMAGE_MAX_PIXELS (1UL << 28)
+
+static int get_components(const struct pdf_obj*);
+static const struct pdf_obj* get_filter(const struct pdf_obj*);
+static unsigned char* encode_jpeg(IWICImagingFactory*, IWICBitmapSource*,
+		int, size_t*);
+static struct pdf_obj* new_image(const struct pdf_obj*, UINT, UINT,
+		unsigned char*, size_t, int);
+
+/*
+ * Return nonzero if the given object is an image that resample_image()
+ * can work on: 8 bits per component of DeviceGray or DeviceRGB, stored
+ * as a JPEG, with FlateDecode, or without a filter. Stencil masks and
+ * images with a color key mask are left out, since resampling blends
+ * the colors they depend on.
+ */
+int can_resample_image(const struct pdf_obj* obj)
+{
+	const struct pdf_obj* width = NULL;
+	const struct pdf_obj* height = NULL;
+	const struct pdf_obj* bits = NULL;
+	const struct pdf_obj* mask = NULL;
+	const struct pdf_obj* filter = NULL;
+	const struct pdf_obj* parms = NULL;
+	const struct pdf_obj* predictor = NULL;
+
+	if(obj == NULL || obj->type != kPDF_OBJ_STREAM
+			|| !is_pdf_name(get_pdf_key(obj, "Subtype"), "Image"))
+		return 0;
+
+	width = get_pdf_key(obj, "Width");
+	height = get_pdf_key(obj, "Height");
+	bits = get_pdf_key(obj, "BitsPerComponent");
+	mask = get_pdf_key(obj, "ImageMask");
+
+	if(width == NULL || width->type != kPDF_OBJ_INT || width->u.integer <= 0
+			|| height == NULL || height->type != kPDF_OBJ_INT
+			|| height->u.integer <= 0 || bits == NULL
+			|| bits->type != kPDF_OBJ_INT || bits->u.integer != 8
+			|| (mask != NULL && mask->type == kPDF_OBJ_BOOL
+			&& mask->u.boolean) || get_components(obj) == 0)
+		return 0;
+
+	if((unsigned long int) width->u.integer
+			> IMAGE_MAX_PIXELS / (unsigned long int) height->u.integer)
+		return 0;
+
+	mask = get_pdf_key(obj, "Mask");
+
+	if(mask != NULL && mask->type == kPDF_OBJ_ARRAY)
+		return 0;
+
+	filter = get_filter(obj);
+	parms = get_pdf_key(obj, "DecodeParms");
+	predictor = get_pdf_key(parms, "Predictor");
+
+	/* decode_pdf_stream() only undoes PNG predictors */
+	if(predictor != NULL && (predictor->type != kPDF_OBJ_INT
+			|| (predictor->u.integer != 1 && predictor->u.integer < 10)))
+		return 0;
+
+	return filter == NULL || is_pdf_name(filter, "FlateDecode")
+			|| is_pdf_name(filter, "DCTDecode");
+}
+
+/*
+ * Return a copy of the given image, which can_resample_image() must
+ * accept, scaled down to at most max_side pixels on its longer side,
+ * or NULL if it is better left as it is. A JPEG is encoded again at
+ * the given quality, from 1 to 100, and is kept at its size only if
+ * that makes it smaller; other images are only kept if scaled, without
+ * a filter, for the PDF writer to compress. Windows Imaging Component
+ * does the work, so the calling thread may be a worker of a task graph;
+ * if it fails, the image is left as it is. The value of image must not
+ * be NULL. The object returned must be passed to free_pdf_object().
+ */
+struct pdf_obj* resample_image(const struct pdf_obj* image,
+		unsigned long int max_side, int quality)
+{
+	IWICImagingFactory* factory = NULL;
+	IWICStream* stream = NULL;
+	IWICBitmapDecoder* decoder = NULL;
+	IWICBitmapFrameDecode* frame = NULL;
+	IWICBitmap* bitmap = NULL;
+	IWICBitmapScaler* scaler = NULL;
+	IWICBitmapSource* source = NULL; /* pixels to write */
+	WICPixelFormatGUID format;
+	struct pdf_obj* result = NULL;
+	unsigned char* pixels = NULL; /* decoded pixels of an image */
+	unsigned char* out = NULL;
+	size_t out_len = 0;
+	UINT width = 0;
+	UINT height = 0;
+	UINT new_width = 0;
+	UINT new_height = 0;
+	int components = 0;
+	int jpeg = 0;
+	int com = 0;
+	HRESULT hr = S_OK;
+
+	RT_NOT_NULL(image);
+
+	width = (UINT) get_pdf_key(image, "Width")->u.integer;
+	height = (UINT) get_pdf_key(image, "Height")->u.integer;
+	components = get_components(image);
+	jpeg = is_pdf_name(get_filter(image), "DCTDecode");
+	new_width = width;
+	new_height = height;
+
+	if(max_side > 0 && (width > max_side || height > max_side)) {
+		double scale = (double) max_side / (width > height ? width : height);
+
+		new_width = (UINT) (width * scale + 0.5);
+		new_height = (UINT) (height * scale + 0.5);
+		new_width = new_width > 0 ? new_width : 1;
+		new_height = new_height > 0 ? new_height : 1;
+	}
+
+	/* Only a JPEG is worth encoding again at its own size */
+	if(!jpeg && new_width == width && new_height == height)
+		return NULL;
+
+	/* A thread already in a single-threaded apartment can use WIC too */
+	com = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+	hr = CoCreateInstance(&CLSID_WICImagingFactory, NULL,
+			CLSCTX_INPROC_SERVER, &IID_IWICImagingFactory, (LPVOID*) &factory);
+
+	/*
+	 * Channels are handed to WIC in the order the PDF has them, which
+	 * scaling does not care about, so RGB passes for BGR.
+	 */
+	if(SUCCEEDED(hr) && jpeg) {
+		hr = IWICImagingFactory_CreateStream(factory, &stream);
+
+		if(SUCCEEDED(hr))
+			hr = IWICStream_InitializeFromMemory(stream,
+					(BYTE*) image->u.stream.data,
+					(DWORD) image->u.stream.len);
+
+		if(SUCCEEDED(hr))
+			hr = IWICImagingFactory_CreateDecoderFromStream(factory,
+					(IStream*) stream, NULL, WICDecodeMetadataCacheOnDemand,
+					&decoder);
+
+		if(SUCCEEDED(hr))
+			hr = IWICBitmapDecoder_GetFrame(decoder, 0, &frame);
+
+		if(SUCCEEDED(hr))
+			hr = IWICBitmapFrameDecode_GetPixelFormat(frame, &format);
+
+		if(SUCCEEDED(hr) && !IsEqualGUID(&format, components == 3 ?
+				&GUID_WICPixelFormat24bppBGR : &GUID_WICPixelFormat8bppGray))
+			hr = E_FAIL;
+
+		source = (IWICBitmapSource*) frame;
+	} else if(SUCCEEDED(hr)) {
+		UINT stride = width * (UINT) components;
+		size_t len = 0;
+
+		pixels = decode_pdf_stream(image, &len);
+
+		if(len < (size_t) stride * height)
+			hr = E_FAIL;
+
+		if(SUCCEEDED(hr))
+			hr = IWICImagingFactory_CreateBitmapFromMemory(factory, width,
+					height, components == 3 ? &GUID_WICPixelFormat24bppBGR
+					: &GUID_WICPixelFormat8bppGray, stride, stride * height,
+					pixels, &bitmap);
+
+		source = (IWICBitmapSource*) bitmap;
+	}
+
+	if(SUCCEEDED(hr) && (new_width != width || new_height != height)) {
+		hr = IWICImagingFactory_CreateBitmapScaler(factory, &scaler);
+
+		if(SUCCEEDED(hr))
+			hr = IWICBitmapScaler_Initialize(scaler, source, new_width,
+					new_height, WICBitmapInterpolationModeFant);
+
+		source = (IWICBitmapSource*) scaler;
+	}
+
+	if(SUCCEEDED(hr) && jpeg) {
+		out = encode_jpeg(factory, source, quality, &out_len);
+
+		if(out == NULL)
+			hr = E_FAIL;
+	} else if(SUCCEEDED(hr)) {
+		out_len = (size_t) new_width * components * new_height;
+		out = (unsigned char*) require_mem(out_len + 1);
+		hr = IWICBitmapSource_CopyPixels(source, NULL,
+				new_width * (UINT) components, (UINT) out_len, out);
+	}
+
+	if(FAILED(hr)) {
+		writelog(kVERBOSE, _T("Left an image as it is (0x%08lx)\n"),
+				(unsigned long int) hr);
+		free(out);
+	} else if(jpeg && new_width == width && out_len >= image->u.stream.len) {
+		free(out);
+	} else {
+		result = new_image(image, new_width, new_height, out, out_len, jpeg);
+	}
+
+	if(scaler != NULL)
+		IWICBitmapScaler_Release(scaler);
+
+	if(bitmap != NULL)
+		IWICBitmap_Release(bitmap);
+
+	if(frame != NULL)
+		IWICBitmapFrameDecode_Release(frame);
+
+	if(decoder != NULL)
+		IWICBitmapDecoder_Release(decoder);
+
+	if(stream != NULL)
+		IWICStream_Release(stream);
+
+	if(factory != NULL)
+		IWICImagingFactory_Release(factory);
+
+	if(com)
+		CoUninitialize();
+
+	free(pixels);
+
+	return result;
+}
+
+/*
+ * Return the number of color components of the given image, or 0 if
+ * its color space is neither DeviceGray nor DeviceRGB. The value of
+ * image must not be NULL.
+ */
+static int get_components(const struct pdf_obj* image)
+{
+	const struct pdf_obj* space = NULL;
+
+	RT_NOT_NULL(image);
+
+	space = get_pdf_key(image, "ColorSpace");
+
+	if(is_pdf_name(space, "DeviceGray"))
+		return 1;
+
+	if(is_pdf_name(space, "DeviceRGB"))
+		return 3;
+
+	return 0;
+}
+
+/*
+ * Return the filter of the given stream, which may be given as an array
+ * of one filter, or NULL if it has none or a chain of filters. The
+ * value of stream must not be NULL.
+ */
+static const struct pdf_obj* get_filter(const struct pdf_obj* stream)
+{
+	const struct pdf_obj* filter = NULL;
+
+	RT_NOT_NULL(stream);
+
+	filter = get_pdf_key(stream, "Filter");
+
+	if(filter != NULL && filter->type == kPDF_OBJ_ARRAY)
+		return filter->u.array.count == 1 ? filter->u.array.items[0] : NULL;
+
+	return filter;
+}
+
+/*
+ * Return the pixels of the given source encoded as a JPEG of the given
+ * quality, from 1 to 100, and store its length in the value pointed to
+ * by len, or return NULL if that fails. The values of factory, source
+ * and len must not be NULL. The pointer returned must be passed to
+ * free().
+ */
+static unsigned char* encode_jpeg(IWICImagingFactory* factory,
+		IWICBitmapSource* source, int quality, size_t* len)
+{
+	IStream* stream = NULL;
+	IWICBitmapEncoder* encoder = NULL;
+	IWICBitmapFrameEncode* frame = NULL;
+	IPropertyBag2* props = NULL;
+	PROPBAG2 option;
+	VARIANT value;
+	WICPixelFormatGUID format;
+	STATSTG stat;
+	HGLOBAL global = NULL;
+	unsigned char* data = NULL;
+	UINT width = 0;
+	UINT height = 0;
+	HRESULT hr = S_OK;
+
+	RT_NOT_NULL(factory);
+	RT_NOT_NULL(source);
+	RT_NOT_NULL(len);
+
+	hr = CreateStreamOnHGlobal(NULL, TRUE, &stream);
+
+	if(SUCCEEDED(hr))
+		hr = IWICImagingFactory_CreateEncoder(factory,
+				&GUID_ContainerFormatJpeg, NULL, &encoder);
+
+	if(SUCCEEDED(hr))
+		hr = IWICBitmapEncoder_Initialize(encoder, stream,
+				WICBitmapEncoderNoCache);
+
+	if(SUCCEEDED(hr))
+		hr = IWICBitmapEncoder_CreateNewFrame(encoder, &frame, &props);
+
+	if(SUCCEEDED(hr)) {
+		memset(&option, 0, sizeof(option));
+		option.pstrName = (LPOLESTR) L"ImageQuality";
+		VariantInit(&value);
+		value.vt = VT_R4;
+		value.fltVal = (FLOAT) quality / 100.0f;
+		hr = IPropertyBag2_Write(props, 1, &option, &value);
+	}
+
+	if(SUCCEEDED(hr))
+		hr = IWICBitmapFrameEncode_Initialize(frame, props);
+
+	if(SUCCEEDED(hr))
+		hr = IWICBitmapSource_GetSize(source, &width, &height);
+
+	if(SUCCEEDED(hr))
+		hr = IWICBitmapFrameEncode_SetSize(frame, width, height);
+
+	if(SUCCEEDED(hr))
+		hr = IWICBitmapSource_GetPixelFormat(source, &format);
+
+	if(SUCCEEDED(hr))
+		hr = IWICBitmapFrameEncode_SetPixelFormat(frame, &format);
+
+	if(SUCCEEDED(hr))
+		hr = IWICBitmapFrameEncode_WriteSource(frame, source, NULL);
+
+	if(SUCCEEDED(hr))
+		hr = IWICBitmapFrameEncode_Commit(frame);
+
+	if(SUCCEEDED(hr))
+		hr = IWICBitmapEncoder_Commit(encoder);
+
+	if(SUCCEEDED(hr))
+		hr = IStream_Stat(stream, &stat, STATFLAG_NONAME);
+
+	if(SUCCEEDED(hr))
+		hr = GetHGlobalFromStream(stream, &global);
+
+	if(SUCCEEDED(hr)) {
+		const void* bytes = GlobalLock(global);
+
+		if(bytes != NULL) {
+			*len = (size_t) stat.cbSize.QuadPart;
+			data = (unsigned char*) require_mem(*len + 1);
+			memcpy(data, bytes, *len);
+			GlobalUnlock(global);
+		}
+	}
+
+	if(props != NULL)
+		IPropertyBag2_Release(props);
+
+	if(frame != NULL)
+		IWICBitmapFrameEncode_Release(frame);
+
+	if(encoder != NULL)
+		IWICBitmapEncoder_Release(encoder);
+
+	if(stream != NULL)
+		IStream_Release(stream);
+
+	return data;
+}
+
+/*
+ * Return a new image stream with the dictionary of the given image, the
+ * given size and the len bytes of data, which it then owns. The data is
+ * a JPEG if jpeg is nonzero, or unfiltered pixels otherwise. The values
+ * of image and data must not be NULL. The object returned must be
+ * passed to free_pdf_object().
+ */
+static struct pdf_obj* new_image(const struct pdf_obj* image, UINT width,
+		UINT height, unsigned char* data, size_t len, int jpeg)
+{
+	struct pdf_obj* result = NULL;
+
+	RT_NOT_NULL(image);
+	RT_NOT_NULL(data);
+
+	result = new_pdf_object(kPDF_OBJ_STREAM);
+	result->u.stream.dict = clone_pdf_object(image->u.stream.dict);
+	result->u.stream.data = data;
+	result->u.stream.len = len;
+	result->u.stream.owned = 1;
+	remove_pdf_key(result, "Filter");
+	remove_pdf_key(result, "DecodeParms");
+	remove_pdf_key(result, "Length");
+	set_pdf_key(result, "Width", new_pdf_int((long int) width));
+	set_pdf_key(result, "Height", new_pdf_int((long int) height));
+
+	if(jpeg)
+		set_pdf_key(result, "Filter", new_pdf_name("DCTDecode"));
+
+	return result;
+}
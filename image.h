@@ -0,0 +1,7 @@
+#pragma once
+
+#include "stdafx.h"
+#include "pdf.h"
+
+int can_resample_image(const struct pdf_obj*);
+struct pdf_obj* resample_image(const struct pdf_obj*, unsigned long int, int);
@@ -0,0 +1,1116 @@
+#include "stdafx.h"
+#include "linearize.h"
+#include "pdf.h"
+#include "util.h"
+#include "log.h"
+
+/* Deepest page tree accepted in the source */
+#define LINEARIZE_MAX_DEPTH 64
+
+/* Longest line of text written between the objects of the target */
+#define LINEARIZE_LINE_LEN 256
+
+/* Flags of an object of the source */
+#define LINEARIZE_PAGE 1 /* it is a page object */
+#define LINEARIZE_BOUNDARY 2 /* pages do not reach objects through it */
+#define LINEARIZE_FIRST 4 /* the first page uses it */
+#define LINEARIZE_PLACED 8 /* it has its place in the target */
+#define LINEARIZE_LATER 16 /* it waits to be placed with shared objects */
+
+/* Owner of an object used by more than one page */
+#define LINEARIZE_SHARED ULONG_MAX
+
+/*
+ * Objects written before the first page: the linearization parameters,
+ * the catalog and the hint stream
+ */
+#define LINEARIZE_HEAD 3
+
+/* Header of the target, with a comment of high bytes marking it binary */
+static const char header[] = "%PDF-1.4\n%\xe2\xe3\xcf\xd3\n";
+
+/* A page of the source and its section of the target */
+struct linearize_page {
+	unsigned long int num; /* object number in the source */
+	size_t first; /* index in order of its page object */
+	size_t count; /* number of objects in its section */
+	size_t shared_first; /* index in shared of its first shared object */
+	size_t shared_count; /* number of shared objects it uses */
+	ULONGLONG length; /* bytes in its section */
+	ULONGLONG content_offset; /* offset of its content in its section */
+	ULONGLONG content_length; /* bytes of content after its page object */
+};
+
+/* A PDF being rewritten linearized */
+struct linearize_job {
+	struct pdf_doc doc; /* the source PDF */
+	unsigned char* flags; /* LINEARIZE_ flags of each source object */
+	unsigned long int* owner; /* page using each object, plus 1, or 0 */
+	unsigned long int* stamp; /* last walk that reached each object */
+	unsigned long int walk; /* number of the last walk */
+	size_t* edge_start; /* index in edges of each object's references */
+	unsigned long int* edges; /* objects each object refers to, in order */
+	size_t edge_count; /* number of elements in edges */
+	size_t edge_capacity; /* number of elements allocated for edges */
+	unsigned long int* stack; /* objects the current walk has to visit */
+	unsigned long int* reached; /* objects the last walk reached, in order */
+	size_t reached_count; /* number of elements in reached */
+	struct linearize_page* pages; /* pages in order */
+	size_t page_count; /* number of elements in pages */
+	size_t page_capacity; /* number of elements allocated for pages */
+	unsigned long int catalog; /* catalog of the source */
+	unsigned long int info; /* document information of the source, or 0 */
+	unsigned long int* order; /* source objects in the order written */
+	size_t order_count; /* number of elements in order */
+	size_t first_end; /* index in order past the first page */
+	size_t shared_start; /* index in order of the first shared object */
+	size_t shared_end; /* index in order past the shared objects */
+	unsigned long int* later; /* shared objects waiting to be placed */
+	size_t later_count; /* number of elements in later */
+	unsigned long int* shared; /* shared objects each page uses */
+	size_t shared_count; /* number of elements in shared */
+	size_t shared_capacity; /* number of elements allocated for shared */
+	size_t* slot; /* index in order of each placed source object */
+	unsigned long int* map; /* target number of each source object, or 0 */
+	unsigned long int main_count; /* objects listed by the main xref */
+	size_t* lengths; /* bytes of each object of order */
+	ULONGLONG* offsets; /* offset of each object of order, without hints */
+	ULONGLONG end; /* offset past the last object, without hints */
+};
+
+/* Bits written to a buffer, most significant first */
+struct linearize_bits {
+	struct pdf_buffer buffer; /* whole bytes written */
+	unsigned int byte; /* bits of the byte being filled */
+	int used; /* number of bits in byte */
+};
+
+static void collect_pages(struct linearize_job*, unsigned long int,
+		unsigned int);
+static void read_edges(struct linearize_job*);
+static void add_edges(struct linearize_job*, const struct pdf_obj*);
+static void walk(struct linearize_job*, unsigned long int, int);
+static void classify(struct linearize_job*);
+static void arrange(struct linearize_job*);
+static void place(struct linearize_job*, unsigned long int);
+static void measure(struct linearize_job*, struct pdf_buffer*);
+static void measure_page(struct linearize_job*, struct linearize_page*);
+static void put_hints(struct linearize_job*, struct linearize_bits*,
+		size_t*);
+static void put_bits(struct linearize_bits*, ULONGLONG, int);
+static void align_bits(struct linearize_bits*);
+static int count_bits(ULONGLONG);
+static size_t format_parameters(const struct linearize_job*, char*,
+		ULONGLONG, ULONGLONG, ULONGLONG, ULONGLONG, ULONGLONG);
+static void format_first_xref(const struct linearize_job*,
+		struct pdf_buffer*, ULONGLONG, ULONGLONG, ULONGLONG);
+static void write_target(struct linearize_job*, LPCTSTR,
+		const struct pdf_buffer*, struct pdf_buffer*);
+static void write_object(struct linearize_job*, FILE*, LPCTSTR, size_t,
+		struct pdf_buffer*);
+static void write_bytes(FILE*, LPCTSTR, const void*, size_t);
+static struct pdf_obj* load_renumbered(struct linearize_job*,
+		unsigned long int);
+static void renumber(struct linearize_job*, struct pdf_obj*);
+static unsigned long int get_ref(const struct pdf_obj*);
+
+/*
+ * Write the PDF at the given source path to the given target path as a
+ * linearized PDF, which a viewer can show the first page of as soon as
+ * that much is downloaded. The catalog, a hint stream and every object
+ * of the first page come first, each other page follows with the
+ * objects only it uses, then the objects pages share, and last every
+ * other object. The hint stream holds the page offset and shared object
+ * hint tables telling a viewer which byte ranges each page needs.
+ * Objects not reachable from the catalog are dropped, and objects of
+ * object streams are written as plain objects, so the target is a PDF
+ * 1.4 file with cross-reference tables. A PDF without pages is copied
+ * as it is. The values of target and source must not be NULL.
+ */
+void linearize_pdf(LPCTSTR target, LPCTSTR source)
+{
+	struct linearize_job job;
+	struct linearize_bits bits;
+	struct pdf_buffer hints; /* the hint stream as an indirect object */
+	struct pdf_buffer scratch; /* each object formatted in turn */
+	struct pdf_obj* catalog = NULL;
+	struct pdf_obj stream;
+	size_t shared_table = 0; /* offset of the shared object hint table */
+	unsigned long int count = 0;
+
+	RT_NOT_NULL(target);
+	RT_NOT_NULL(source);
+
+	memset(&job, 0, sizeof(job));
+	open_pdf(&job.doc, source);
+	count = job.doc.xref_count;
+	job.catalog = get_ref(get_pdf_key(job.doc.trailer, "Root"));
+	job.info = get_ref(get_pdf_key(job.doc.trailer, "Info"));
+
+	if(job.catalog == 0 || job.catalog >= count)
+		errorout(E_PDF, _T("PDF '%s' has no catalog"), source);
+
+	job.flags = (unsigned char*) require_cmem(count, sizeof(*job.flags));
+	job.flags[job.catalog] |= LINEARIZE_BOUNDARY;
+	catalog = load_pdf_object(&job.doc, job.catalog);
+	collect_pages(&job, get_ref(get_pdf_key(catalog, "Pages")), 0);
+	free_pdf_object(catalog);
+
+	if(job.page_count == 0) {
+		writelog(kVERBOSE, _T("PDF '%s' has no pages to linearize\n"),
+				source);
+		close_pdf(&job.doc);
+		free(job.flags);
+
+		if(!CopyFile(source, target, FALSE))
+			errorout(E_BADF, _T("Failed to copy PDF '%s' to '%s'"), source,
+					target);
+
+		return;
+	}
+
+	job.owner = (unsigned long int*) require_cmem(count, sizeof(*job.owner));
+	job.stamp = (unsigned long int*) require_cmem(count, sizeof(*job.stamp));
+	job.reached = (unsigned long int*) require_cmem(count,
+			sizeof(*job.reached));
+	job.order = (unsigned long int*) require_cmem(count, sizeof(*job.order));
+	job.later = (unsigned long int*) require_cmem(count, sizeof(*job.later));
+	job.slot = (size_t*) require_cmem(count, sizeof(*job.slot));
+	job.map = (unsigned long int*) require_cmem(count, sizeof(*job.map));
+
+	read_edges(&job);
+	classify(&job);
+	arrange(&job);
+
+	memset(&scratch, 0, sizeof(scratch));
+	measure(&job, &scratch);
+
+	memset(&bits, 0, sizeof(bits));
+	put_hints(&job, &bits, &shared_table);
+
+	memset(&stream, 0, sizeof(stream));
+	stream.type = kPDF_OBJ_STREAM;
+	stream.u.stream.dict = new_pdf_object(kPDF_OBJ_DICT);
+	stream.u.stream.data = bits.buffer.data != NULL ? bits.buffer.data
+			: (const unsigned char*) "";
+	stream.u.stream.len = bits.buffer.len;
+	set_pdf_key(stream.u.stream.dict, "S", new_pdf_int((long int)
+			shared_table));
+	memset(&hints, 0, sizeof(hints));
+	format_pdf_object(&hints, job.main_count + 2, &stream);
+	free_pdf_object(stream.u.stream.dict);
+	free(bits.buffer.data);
+
+	write_target(&job, target, &hints, &scratch);
+
+	writelog(kVERBOSE, _T("Linearized %lu pages of '%s'\n"),
+			(unsigned long int) job.page_count, target);
+
+	close_pdf(&job.doc);
+	free(hints.data);
+	free(scratch.data);
+	free(job.offsets);
+	free(job.lengths);
+	free(job.map);
+	free(job.slot);
+	free(job.shared);
+	free(job.later);
+	free(job.order);
+	free(job.pages);
+	free(job.reached);
+	free(job.stack);
+	free(job.edges);
+	free(job.edge_start);
+	free(job.stamp);
+	free(job.owner);
+	free(job.flags);
+}
+
+/*
+ * Add the pages under the node of the page tree of the source of the
+ * given job with the given number, at the given depth, to its pages, in
+ * order, and mark the nodes so that walks from a page stop at them. A
+ * node reached twice is skipped. The value of job must not be NULL.
+ */
+static void collect_pages(struct linearize_job* job, unsigned long int num,
+		unsigned int depth)
+{
+	struct pdf_obj* node = NULL;
+	const struct pdf_obj* kids = NULL;
+	size_t i = 0;
+
+	RT_NOT_NULL(job);
+
+	if(num == 0 || num >= job->doc.xref_count
+			|| (job->flags[num] & LINEARIZE_PAGE) != 0
+			|| depth > LINEARIZE_MAX_DEPTH)
+		return;
+
+	node = load_pdf_object(&job->doc, num);
+	kids = get_pdf_key(node, "Kids");
+
+	if(is_pdf_name(get_pdf_key(node, "Type"), "Pages")
+			|| (kids != NULL && !is_pdf_name(get_pdf_key(node, "Type"),
+			"Page"))) {
+		/* A node is marked first so that a cycle ends here */
+		if((job->flags[num] & LINEARIZE_BOUNDARY) == 0) {
+			job->flags[num] |= LINEARIZE_BOUNDARY;
+
+			if(kids != NULL && kids->type == kPDF_OBJ_ARRAY)
+				for(i = 0; i < kids->u.array.count; ++i)
+					collect_pages(job, get_ref(kids->u.array.items[i]),
+							depth + 1);
+		}
+	} else {
+		if(job->page_count == job->page_capacity) {
+			job->page_capacity = job->page_capacity * 2 + 64;
+			job->pages = (struct linearize_page*) require_realloc(
+					job->pages, job->page_capacity, sizeof(*job->pages));
+		}
+
+		memset(&job->pages[job->page_count], 0, sizeof(*job->pages));
+		job->pages[job->page_count++].num = num;
+		job->flags[num] |= LINEARIZE_PAGE | LINEARIZE_BOUNDARY;
+	}
+
+	free_pdf_object(node);
+}
+
+/*
+ * Record the objects each object of the source of the given job refers
+ * to, in the order they are written. The content of a page comes
+ * before everything else it refers to, and its parent is left out. The
+ * value of job must not be NULL.
+ */
+static void read_edges(struct linearize_job* job)
+{
+	unsigned long int num = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(job);
+
+	job->edge_start = (size_t*) require_cmem(job->doc.xref_count + 1,
+			sizeof(*job->edge_start));
+
+	for(num = 0; num < job->doc.xref_count; ++num) {
+		struct pdf_obj* obj = NULL;
+
+		job->edge_start[num] = job->edge_count;
+
+		if(num == 0 || (job->doc.xref[num].state != kXREF_USED
+				&& job->doc.xref[num].state != kXREF_COMPRESSED))
+			continue;
+
+		obj = load_pdf_object(&job->doc, num);
+
+		if((job->flags[num] & LINEARIZE_PAGE) != 0
+				&& obj->type == kPDF_OBJ_DICT) {
+			const struct pdf_obj* contents = get_pdf_key(obj, "Contents");
+
+			if(contents != NULL)
+				add_edges(job, contents);
+
+			for(i = 0; i < obj->u.dict.count; ++i)
+				if(strcmp(obj->u.dict.pairs[i].key, "Contents") != 0
+						&& strcmp(obj->u.dict.pairs[i].key, "Parent") != 0)
+					add_edges(job, obj->u.dict.pairs[i].value);
+		} else {
+			add_edges(job, obj);
+		}
+
+		free_pdf_object(obj);
+	}
+
+	job->edge_start[job->doc.xref_count] = job->edge_count;
+
+	/* An object is pushed once per reference from an object visited */
+	job->stack = (unsigned long int*) require_cmem(job->edge_count + 1,
+			sizeof(*job->stack));
+}
+
+/*
+ * Add each object the given value refers to, and exists in the source
+ * of the given job, to its edges. The values of job and value must not
+ * be NULL.
+ */
+static void add_edges(struct linearize_job* job, const struct pdf_obj* value)
+{
+	unsigned long int num = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(job);
+	RT_NOT_NULL(value);
+
+	switch(value->type) {
+	case kPDF_OBJ_REF:
+		num = value->u.ref.num;
+
+		if(num == 0 || num >= job->doc.xref_count
+				|| (job->doc.xref[num].state != kXREF_USED
+				&& job->doc.xref[num].state != kXREF_COMPRESSED))
+			break;
+
+		if(job->edge_count == job->edge_capacity) {
+			job->edge_capacity = job->edge_capacity * 2 + 1024;
+			job->edges = (unsigned long int*) require_realloc(job->edges,
+					job->edge_capacity, sizeof(*job->edges));
+		}
+
+		job->edges[job->edge_count++] = num;
+		break;
+	case kPDF_OBJ_ARRAY:
+		for(i = 0; i < value->u.array.count; ++i)
+			add_edges(job, value->u.array.items[i]);
+
+		break;
+	case kPDF_OBJ_DICT:
+		for(i = 0; i < value->u.dict.count; ++i)
+			add_edges(job, value->u.dict.pairs[i].value);
+
+		break;
+	case kPDF_OBJ_STREAM:
+		add_edges(job, value->u.stream.dict);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Store in the reached objects of the given job every object reachable
+ * from the object with the given number, itself first, each before the
+ * objects it refers to. If bounded is nonzero, page objects, the nodes
+ * of the page tree and the catalog are not entered, except for start.
+ * The value of job must not be NULL.
+ */
+static void walk(struct linearize_job* job, unsigned long int start,
+		int bounded)
+{
+	size_t depth = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(job);
+
+	++job->walk;
+	job->reached_count = 0;
+	job->stack[depth++] = start;
+
+	while(depth > 0) {
+		unsigned long int num = job->stack[--depth];
+
+		if(job->stamp[num] == job->walk)
+			continue;
+
+		job->stamp[num] = job->walk;
+		job->reached[job->reached_count++] = num;
+
+		/* Pushed last to first, so that references are visited in order */
+		for(i = job->edge_start[num + 1]; i > job->edge_start[num]; --i) {
+			unsigned long int next = job->edges[i - 1];
+
+			if(job->stamp[next] != job->walk && (!bounded
+					|| (job->flags[next] & LINEARIZE_BOUNDARY) == 0))
+				job->stack[depth++] = next;
+		}
+	}
+}
+
+/*
+ * Record which page of the source of the given job uses each object,
+ * or that several do, and which objects the first page uses. The value
+ * of job must not be NULL.
+ */
+static void classify(struct linearize_job* job)
+{
+	unsigned long int page = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(job);
+
+	for(page = 0; page < job->page_count; ++page) {
+		walk(job, job->pages[page].num, 1);
+
+		for(i = 0; i < job->reached_count; ++i) {
+			unsigned long int num = job->reached[i];
+
+			if(job->owner[num] == 0)
+				job->owner[num] = page + 1;
+			else if(job->owner[num] != page + 1)
+				job->owner[num] = LINEARIZE_SHARED;
+
+			if(page == 0)
+				job->flags[num] |= LINEARIZE_FIRST;
+		}
+	}
+}
+
+/*
+ * Put the objects of the source of the given job in the order they are
+ * written, record the shared objects each page uses, and number them.
+ * The catalog comes first and the first page with every object it uses
+ * second. Each other page follows with the objects only it uses, then
+ * the objects other pages share, then the objects reachable from the
+ * catalog or the document information that no page uses. The catalog
+ * and the first page are numbered after every other object, as the
+ * first-page cross-reference table lists them. The value of job must
+ * not be NULL.
+ */
+static void arrange(struct linearize_job* job)
+{
+	struct linearize_page* page = NULL;
+	unsigned long int first = 0; /* number of the first head object */
+	size_t i = 0;
+	size_t j = 0;
+
+	RT_NOT_NULL(job);
+
+	place(job, job->catalog);
+	walk(job, job->pages[0].num, 1);
+	job->pages[0].first = job->order_count;
+
+	for(i = 0; i < job->reached_count; ++i)
+		place(job, job->reached[i]);
+
+	job->first_end = job->order_count;
+	job->pages[0].count = job->first_end - job->pages[0].first;
+
+	for(i = 1; i < job->page_count; ++i) {
+		page = &job->pages[i];
+		walk(job, page->num, 1);
+		page->first = job->order_count;
+		page->shared_first = job->shared_count;
+
+		for(j = 0; j < job->reached_count; ++j) {
+			unsigned long int num = job->reached[j];
+
+			if(job->owner[num] == i + 1) {
+				place(job, num);
+				continue;
+			}
+
+			if(job->shared_count == job->shared_capacity) {
+				job->shared_capacity = job->shared_capacity * 2 + 256;
+				job->shared = (unsigned long int*) require_realloc(
+						job->shared, job->shared_capacity,
+						sizeof(*job->shared));
+			}
+
+			job->shared[job->shared_count++] = num;
+
+			if((job->flags[num] & (LINEARIZE_FIRST | LINEARIZE_LATER)) == 0) {
+				job->flags[num] |= LINEARIZE_LATER;
+				job->later[job->later_count++] = num;
+			}
+		}
+
+		page->count = job->order_count - page->first;
+		page->shared_count = job->shared_count - page->shared_first;
+	}
+
+	job->shared_start = job->order_count;
+
+	for(i = 0; i < job->later_count; ++i)
+		place(job, job->later[i]);
+
+	job->shared_end = job->order_count;
+	walk(job, job->catalog, 0);
+
+	for(i = 0; i < job->reached_count; ++i)
+		if((job->flags[job->reached[i]] & LINEARIZE_PLACED) == 0)
+			place(job, job->reached[i]);
+
+	if(job->info != 0 && job->info < job->doc.xref_count) {
+		walk(job, job->info, 0);
+
+		for(i = 0; i < job->reached_count; ++i)
+			if((job->flags[job->reached[i]] & LINEARIZE_PLACED) == 0)
+				place(job, job->reached[i]);
+	}
+
+	/* Object 0 is free, so the main part starts at 1 */
+	for(i = job->first_end; i < job->order_count; ++i)
+		job->map[job->order[i]] = (unsigned long int) (i - job->first_end)
+				+ 1;
+
+	job->main_count = (unsigned long int) (job->order_count
+			- job->first_end) + 1;
+	first = job->main_count;
+	job->map[job->catalog] = first + 1;
+
+	for(i = 1; i < job->first_end; ++i)
+		job->map[job->order[i]] = first + LINEARIZE_HEAD
+				+ (unsigned long int) (i - 1);
+
+	/* A shared object is identified by its entry in the hint table */
+	for(i = 0; i < job->shared_count; ++i) {
+		size_t slot = job->slot[job->shared[i]];
+
+		job->shared[i] = (unsigned long int) (slot < job->first_end
+				? slot - 1 : job->first_end - 1 + slot - job->shared_start);
+	}
+}
+
+/*
+ * Append the object of the source of the given job with the given
+ * number to the objects in the order they are written. The value of
+ * job must not be NULL.
+ */
+static void place(struct linearize_job* job, unsigned long int num)
+{
+	RT_NOT_NULL(job);
+
+	job->flags[num] |= LINEARIZE_PLACED;
+	job->slot[num] = job->order_count;
+	job->order[job->order_count++] = num;
+}
+
+/*
+ * Record the length of each object of the given job as it is written,
+ * and its offset as if there were no hint stream, which is how the
+ * hint tables give offsets, along with the extent of each page. Each
+ * object is formatted in the given buffer. The values of job and
+ * buffer must not be NULL.
+ */
+static void measure(struct linearize_job* job, struct pdf_buffer* buffer)
+{
+	char line[LINEARIZE_LINE_LEN];
+	ULONGLONG offset = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(job);
+	RT_NOT_NULL(buffer);
+
+	job->lengths = (size_t*) require_cmem(job->order_count,
+			sizeof(*job->lengths));
+	job->offsets = (ULONGLONG*) require_cmem(job->order_count,
+			sizeof(*job->offsets));
+
+	/* The head has numbers padded to a fixed width, so zeros will do */
+	buffer->len = 0;
+	format_first_xref(job, buffer, 0, 0, 0);
+	offset = (ULONGLONG) strlen(header) + (ULONGLONG) format_parameters(job,
+			line, 0, 0, 0, 0, 0) + buffer->len;
+
+	for(i = 0; i < job->order_count; ++i) {
+		struct pdf_obj* obj = load_renumbered(job, job->order[i]);
+
+		buffer->len = 0;
+		format_pdf_object(buffer, job->map[job->order[i]], obj);
+		free_pdf_object(obj);
+		job->offsets[i] = offset;
+		job->lengths[i] = buffer->len;
+		offset += buffer->len;
+	}
+
+	job->end = offset;
+
+	for(i = 0; i < job->page_count; ++i)
+		measure_page(job, &job->pages[i]);
+}
+
+/*
+ * Record the length of the section of the given page of the given job
+ * and where the content after its page object is. Only content written
+ * right after the page object counts, which is all of it unless it is
+ * shared. The values of job and page must not be NULL.
+ */
+static void measure_page(struct linearize_job* job,
+		struct linearize_page* page)
+{
+	size_t start = 0; /* index in edges of the first reference of page */
+	size_t contents = 0; /* number of references of page to its content */
+	struct pdf_obj* obj = NULL;
+	const struct pdf_obj* value = NULL;
+	size_t next = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(job);
+	RT_NOT_NULL(page);
+
+	next = page->first + page->count;
+	page->length = (next < job->order_count ? job->offsets[next] : job->end)
+			- job->offsets[page->first];
+
+	/* The references to the content come first, as read_edges() adds */
+	obj = load_pdf_object(&job->doc, page->num);
+	value = get_pdf_key(obj, "Contents");
+
+	if(value != NULL && value->type == kPDF_OBJ_REF)
+		contents = 1;
+	else if(value != NULL && value->type == kPDF_OBJ_ARRAY)
+		for(i = 0; i < value->u.array.count; ++i)
+			if(value->u.array.items[i]->type == kPDF_OBJ_REF)
+				++contents;
+
+	free_pdf_object(obj);
+	start = job->edge_start[page->num];
+
+	if(start + contents > job->edge_start[page->num + 1])
+		contents = job->edge_start[page->num + 1] - start;
+
+	for(next = page->first + 1; next < page->first + page->count; ++next) {
+		for(i = start; i < start + contents; ++i)
+			if(job->edges[i] == job->order[next])
+				break;
+
+		if(i == start + contents)
+			break;
+
+		page->content_length += job->lengths[next];
+	}
+
+	if(page->content_length > 0)
+		page->content_offset = job->lengths[page->first];
+}
+
+/*
+ * Write the page offset hint table of the given job and then its shared
+ * object hint table to the given bits, and store the offset of the
+ * latter in the value pointed to by shared_table. Offsets are given as
+ * if there were no hint stream. Every object is its own shared object
+ * group, and no shared object has a signature. The values of job, bits
+ * and shared_table must not be NULL.
+ */
+static void put_hints(struct linearize_job* job, struct linearize_bits* bits,
+		size_t* shared_table)
+{
+	const struct linearize_page* pages = NULL;
+	ULONGLONG least[4]; /* objects, length, content offset and length */
+	ULONGLONG most[4];
+	ULONGLONG values[4];
+	ULONGLONG most_shared = 0; /* shared objects a page uses at most */
+	ULONGLONG largest_id = 0; /* greatest identifier of a shared object */
+	ULONGLONG least_group = 0; /* shortest shared object group */
+	ULONGLONG longest_group = 0;
+	size_t ranges[2][2]; /* parts of order in the shared object table */
+	size_t entries = 0; /* entries of the shared object hint table */
+	size_t i = 0;
+	size_t k = 0;
+	int range = 0;
+	int item = 0;
+
+	RT_NOT_NULL(job);
+	RT_NOT_NULL(bits);
+	RT_NOT_NULL(shared_table);
+
+	pages = job->pages;
+
+	for(i = 0; i < job->page_count; ++i) {
+		values[0] = pages[i].count;
+		values[1] = pages[i].length;
+		values[2] = pages[i].content_offset;
+		values[3] = pages[i].content_length;
+
+		for(item = 0; item < 4; ++item) {
+			if(i == 0 || values[item] < least[item])
+				least[item] = values[item];
+
+			if(i == 0 || values[item] > most[item])
+				most[item] = values[item];
+		}
+
+		if(pages[i].shared_count > most_shared)
+			most_shared = pages[i].shared_count;
+	}
+
+	for(i = 0; i < job->shared_count; ++i)
+		if(job->shared[i] > largest_id)
+			largest_id = job->shared[i];
+
+	/* The header of the page offset hint table */
+	put_bits(bits, least[0], 32);
+	put_bits(bits, job->offsets[pages[0].first], 32);
+	put_bits(bits, count_bits(most[0] - least[0]), 16);
+	put_bits(bits, least[1], 32);
+	put_bits(bits, count_bits(most[1] - least[1]), 16);
+	put_bits(bits, least[2], 32);
+	put_bits(bits, count_bits(most[2] - least[2]), 16);
+	put_bits(bits, least[3], 32);
+	put_bits(bits, count_bits(most[3] - least[3]), 16);
+	put_bits(bits, count_bits(most_shared), 16);
+	put_bits(bits, count_bits(largest_id), 16);
+	put_bits(bits, 0, 16);
+	put_bits(bits, 1, 16);
+
+	/* Each item of the entries for all pages starts at a byte */
+	for(i = 0; i < job->page_count; ++i)
+		put_bits(bits, pages[i].count - least[0], count_bits(most[0]
+				- least[0]));
+
+	align_bits(bits);
+
+	for(i = 0; i < job->page_count; ++i)
+		put_bits(bits, pages[i].length - least[1], count_bits(most[1]
+				- least[1]));
+
+	align_bits(bits);
+
+	for(i = 0; i < job->page_count; ++i)
+		put_bits(bits, pages[i].shared_count, count_bits(most_shared));
+
+	align_bits(bits);
+
+	for(i = 0; i < job->page_count; ++i)
+		for(k = 0; k < pages[i].shared_count; ++k)
+			put_bits(bits, job->shared[pages[i].shared_first + k],
+					count_bits(largest_id));
+
+	align_bits(bits);
+
+	for(i = 0; i < job->page_count; ++i)
+		put_bits(bits, pages[i].content_offset - least[2],
+				count_bits(most[2] - least[2]));
+
+	align_bits(bits);
+
+	for(i = 0; i < job->page_count; ++i)
+		put_bits(bits, pages[i].content_length - least[3],
+				count_bits(most[3] - least[3]));
+
+	align_bits(bits);
+	*shared_table = bits->buffer.len;
+
+	/* The first page's objects come first, then the shared objects */
+	ranges[0][0] = 1;
+	ranges[0][1] = job->first_end;
+	ranges[1][0] = job->shared_start;
+	ranges[1][1] = job->shared_end;
+	entries = job->first_end - 1 + job->shared_end - job->shared_start;
+	least_group = job->lengths[1];
+
+	for(range = 0; range < 2; ++range) {
+		for(i = ranges[range][0]; i < ranges[range][1]; ++i) {
+			if(job->lengths[i] < least_group)
+				least_group = job->lengths[i];
+
+			if(job->lengths[i] > longest_group)
+				longest_group = job->lengths[i];
+		}
+	}
+
+	if(job->shared_end > job->shared_start) {
+		put_bits(bits, job->map[job->order[job->shared_start]], 32);
+		put_bits(bits, job->offsets[job->shared_start], 32);
+	} else {
+		put_bits(bits, 0, 32);
+		put_bits(bits, 0, 32);
+	}
+
+	put_bits(bits, job->first_end - 1, 32);
+	put_bits(bits, entries, 32);
+	put_bits(bits, 0, 16);
+	put_bits(bits, least_group, 32);
+	put_bits(bits, count_bits(longest_group - least_group), 16);
+
+	for(range = 0; range < 2; ++range)
+		for(i = ranges[range][0]; i < ranges[range][1]; ++i)
+			put_bits(bits, job->lengths[i] - least_group,
+					count_bits(longest_group - least_group));
+
+	align_bits(bits);
+
+	for(i = 0; i < entries; ++i)
+		put_bits(bits, 0, 1);
+
+	align_bits(bits);
+}
+
+/*
+ * Write the count low bits of the given value to the given bits, most
+ * significant first. The value of bits must not be NULL.
+ */
+static void put_bits(struct linearize_bits* bits, ULONGLONG value, int count)
+{
+	unsigned char byte = 0;
+	int i = 0;
+
+	RT_NOT_NULL(bits);
+
+	for(i = count - 1; i >= 0; --i) {
+		bits->byte = bits->byte << 1 | (unsigned int) ((value >> i) & 1);
+
+		if(++bits->used == 8) {
+			byte = (unsigned char) bits->byte;
+			append_pdf_buffer(&bits->buffer, &byte, 1);
+			bits->byte = 0;
+			bits->used = 0;
+		}
+	}
+}
+
+/*
+ * Fill the byte being written to the given bits with zeros, so that
+ * the next bits start a byte. The value of bits must not be NULL.
+ */
+static void align_bits(struct linearize_bits* bits)
+{
+	RT_NOT_NULL(bits);
+
+	if(bits->used > 0)
+		put_bits(bits, 0, 8 - bits->used);
+}
+
+/*
+ * Return the number of bits needed to write the given value.
+ */
+static int count_bits(ULONGLONG value)
+{
+	int count = 0;
+
+	while(value != 0) {
+		++count;
+		value >>= 1;
+	}
+
+	return count;
+}
+
+/*
+ * Format the linearization parameters of the given job into the given
+ * line, with the given length of the file, offset and length of the
+ * hint stream, offset past the first page and offset of the first entry
+ * of the main cross-reference table, and return their length. Numbers
+ * are padded to a fixed width, so the length does not depend on them.
+ * The values of job and line must not be NULL.
+ */
+static size_t format_parameters(const struct linearize_job* job, char* line,
+		ULONGLONG file_length, ULONGLONG hint_offset, ULONGLONG hint_length,
+		ULONGLONG end_first, ULONGLONG main_entry)
+{
+	RT_NOT_NULL(job);
+	RT_NOT_NULL(line);
+
+	return (size_t) sprintf(line, "%lu 0 obj\n<< /Linearized 1 /L %-10I64u "
+			"/H [%-10I64u %-10I64u] /O %lu /E %-10I64u /N %lu /T %-10I64u "
+			">>\nendobj\n", job->main_count, file_length, hint_offset,
+			hint_length, job->map[job->pages[0].num], end_first,
+			(unsigned long int) job->page_count, main_entry);
+}
+
+/*
+ * Append the first-page cross-reference table and trailer of the given
+ * job to the given buffer, with the given offset of the hint stream,
+ * number of bytes the first page moves by for it and offset of the
+ * main cross-reference table. They list the linearization parameters,
+ * the catalog, the hint stream and the first page. Offsets are padded
+ * to a fixed width, so the length does not depend on them. The values
+ * of job and buffer must not be NULL.
+ */
+static void format_first_xref(const struct linearize_job* job,
+		struct pdf_buffer* buffer, ULONGLONG hint_offset, ULONGLONG shift,
+		ULONGLONG main_xref)
+{
+	char line[LINEARIZE_LINE_LEN];
+	unsigned long int count = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(job);
+	RT_NOT_NULL(buffer);
+
+	count = LINEARIZE_HEAD + (unsigned long int) (job->first_end - 1);
+	append_pdf_buffer(buffer, line, (size_t) sprintf(line, "xref\n%lu %lu\n"
+			"%010I64u 00000 n \n%010I64u 00000 n \n%010I64u 00000 n \n",
+			job->main_count, count, (ULONGLONG) strlen(header),
+			job->offsets[0], hint_offset));
+
+	for(i = 1; i < job->first_end; ++i)
+		append_pdf_buffer(buffer, line, (size_t) sprintf(line,
+				"%010I64u 00000 n \n", job->offsets[i] + shift));
+
+	append_pdf_buffer(buffer, line, (size_t) sprintf(line, "trailer\n<< "
+			"/Size %lu /Root %lu 0 R ", job->main_count + count,
+			job->map[job->catalog]));
+
+	if(job->info != 0 && job->map[job->info] != 0)
+		append_pdf_buffer(buffer, line, (size_t) sprintf(line,
+				"/Info %lu 0 R ", job->map[job->info]));
+
+	append_pdf_buffer(buffer, line, (size_t) sprintf(line, "/Prev %-10I64u "
+			">>\nstartxref\n0\n%%%%EOF\n", main_xref));
+}
+
+/*
+ * Write the target of the given job to the given path, with the given
+ * hint stream, formatting each object in turn in the given buffer. The
+ * file ends by pointing at the first-page cross-reference table, whose
+ * trailer points at the main one listing every other object. The
+ * values of job, path, hints and buffer must not be NULL.
+ */
+static void write_target(struct linearize_job* job, LPCTSTR path,
+		const struct pdf_buffer* hints, struct pdf_buffer* buffer)
+{
+	char line[LINEARIZE_LINE_LEN];
+	FILE* file = NULL;
+	ULONGLONG first_xref = 0; /* offset of the first-page xref table */
+	ULONGLONG hint_offset = 0;
+	ULONGLONG shift = 0; /* bytes objects after the hints move by */
+	ULONGLONG end_first = 0; /* offset past the first page */
+	ULONGLONG main_xref = 0;
+	ULONGLONG main_entry = 0; /* offset before its first entry */
+	ULONGLONG file_length = 0;
+	size_t len = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(job);
+	RT_NOT_NULL(path);
+	RT_NOT_NULL(hints);
+	RT_NOT_NULL(buffer);
+
+	shift = hints->len;
+	hint_offset = job->offsets[0] + job->lengths[0];
+	end_first = (job->first_end < job->order_count
+			? job->offsets[job->first_end] : job->end) + shift;
+	main_xref = job->end + shift;
+	main_entry = main_xref + (ULONGLONG) sprintf(line, "xref\n0 %lu",
+			job->main_count);
+	first_xref = (ULONGLONG) strlen(header) + (ULONGLONG) format_parameters(
+			job, line, 0, 0, 0, 0, 0);
+	file_length = main_xref + (ULONGLONG) sprintf(line, "xref\n0 %lu\n",
+			job->main_count) + (ULONGLONG) 20 * job->main_count
+			+ (ULONGLONG) sprintf(line, "trailer\n<< /Size %lu >>\n"
+			"startxref\n%I64u\n%%%%EOF\n", job->main_count, first_xref);
+
+	file = require_open_file(path, _T("wb"));
+	write_bytes(file, path, header, strlen(header));
+	len = format_parameters(job, line, file_length, hint_offset, hints->len,
+			end_first, main_entry);
+	write_bytes(file, path, line, len);
+	buffer->len = 0;
+	format_first_xref(job, buffer, hint_offset, shift, main_xref);
+	write_bytes(file, path, buffer->data, buffer->len);
+
+	write_object(job, file, path, 0, buffer);
+	write_bytes(file, path, hints->data, hints->len);
+
+	for(i = 1; i < job->order_count; ++i)
+		write_object(job, file, path, i, buffer);
+
+	len = (size_t) sprintf(line, "xref\n0 %lu\n0000000000 65535 f \n",
+			job->main_count);
+	write_bytes(file, path, line, len);
+
+	for(i = job->first_end; i < job->order_count; ++i) {
+		len = (size_t) sprintf(line, "%010I64u 00000 n \n",
+				job->offsets[i] + shift);
+		write_bytes(file, path, line, len);
+	}
+
+	len = (size_t) sprintf(line, "trailer\n<< /Size %lu >>\nstartxref\n"
+			"%I64u\n%%%%EOF\n", job->main_count, first_xref);
+	write_bytes(file, path, line, len);
+
+	if(release_file(file) != 0)
+		errorout(E_BADF, _T("Failed to write PDF '%s'"), path);
+}
+
+/*
+ * Write the object at the given index in the order of the given job to
+ * the given file at the given path, formatted in the given buffer. The
+ * values of job, file, path and buffer must not be NULL.
+ */
+static void write_object(struct linearize_job* job, FILE* file, LPCTSTR path,
+		size_t index, struct pdf_buffer* buffer)
+{
+	struct pdf_obj* obj = NULL;
+
+	RT_NOT_NULL(job);
+	RT_NOT_NULL(file);
+	RT_NOT_NULL(path);
+	RT_NOT_NULL(buffer);
+
+	obj = load_renumbered(job, job->order[index]);
+	buffer->len = 0;
+	format_pdf_object(buffer, job->map[job->order[index]], obj);
+	free_pdf_object(obj);
+
+	if(buffer->len != job->lengths[index])
+		errorout(E_PDF, _T("Object %lu of '%s' changed while linearized"),
+				job->map[job->order[index]], path);
+
+	write_bytes(file, path, buffer->data, buffer->len);
+}
+
+/*
+ * Write the given len bytes to the given file at the given path. The
+ * values of file, path and bytes must not be NULL.
+ */
+static void write_bytes(FILE* file, LPCTSTR path, const void* bytes,
+		size_t len)
+{
+	RT_NOT_NULL(file);
+	RT_NOT_NULL(path);
+	RT_NOT_NULL(bytes);
+
+	if(fwrite(bytes, 1, len, file) != len)
+		errorout(E_BADF, _T("Failed to write PDF '%s'"), path);
+}
+
+/*
+ * Return the object of the source of the given job with the given
+ * number, with its references renumbered for the target. The object
+ * returned must be passed to free_pdf_object(). The value of job must
+ * not be NULL.
+ */
+static struct pdf_obj* load_renumbered(struct linearize_job* job,
+		unsigned long int num)
+{
+	struct pdf_obj* obj = NULL;
+
+	RT_NOT_NULL(job);
+
+	obj = load_pdf_object(&job->doc, num);
+	renumber(job, obj);
+
+	return obj;
+}
+
+/*
+ * Replace each indirect reference in the given object by a reference to
+ * the same object in the target of the given job, or by null if the
+ * target does not have it. The values of job and obj must not be NULL.
+ */
+static void renumber(struct linearize_job* job, struct pdf_obj* obj)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(job);
+	RT_NOT_NULL(obj);
+
+	switch(obj->type) {
+	case kPDF_OBJ_REF:
+		if(obj->u.ref.num >= job->doc.xref_count
+				|| job->map[obj->u.ref.num] == 0) {
+			obj->type = kPDF_OBJ_NULL;
+			break;
+		}
+
+		obj->u.ref.num = job->map[obj->u.ref.num];
+		obj->u.ref.gen = 0;
+		break;
+	case kPDF_OBJ_ARRAY:
+		for(i = 0; i < obj->u.array.count; ++i)
+			renumber(job, obj->u.array.items[i]);
+
+		break;
+	case kPDF_OBJ_DICT:
+		for(i = 0; i < obj->u.dict.count; ++i)
+			renumber(job, obj->u.dict.pairs[i].value);
+
+		break;
+	case kPDF_OBJ_STREAM:
+		renumber(job, obj->u.stream.dict);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Return the object number the given value refers to, or 0 if it is
+ * NULL or not an indirect reference.
+ */
+static unsigned long int get_ref(const struct pdf_obj* value)
+{
+	return value != NULL && value->type == kPDF_OBJ_REF ? value->u.ref.num
+			: 0;
+}
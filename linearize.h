@@ -0,0 +1,5 @@
+#pragma once
+
+#include "stdafx.h"
+
+void linearize_pdf(LPCTSTR, LPCTSTR);
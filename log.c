@@ -12,6 +12,9 @@ extern enum log_level log_filter = /* Maximum verbosity to log */
 #endif
 		;
 
+/* Where errorout() returns to on this thread, or NULL to exit */
+static __declspec(thread) struct error_trap* error_trap = NULL;
+
 static LPCTSTR tags[kLL_LAST] = {
 	_T("[ERROR] "),
 	_T("[MSG  ] "),
@@ -50,7 +53,9 @@ int writelog(enum log_level level, LPCTSTR format, ...)
 
 /*
  * Writes a message to errorfd if log_filter is greater than kQUIET and
- * exit()s with the given value. This procedure never returns.
+ * exit()s with the given value. If the calling thread has set an error
+ * trap, it longjmp()s to the trap instead and clears it. Either way,
+ * this procedure never returns.
  */
 void errorout(enum error_code ret, LPCTSTR format, ...)
 {
@@ -69,5 +74,54 @@ void errorout(enum error_code ret, LPCTSTR format, ...)
 		_fputtc(_T('\n'), errorfd);
 	}
 
+	if(error_trap != NULL) {
+		struct error_trap* trap = error_trap;
+
+		error_trap = NULL;
+		trap->code = ret;
+		longjmp(trap->env, 1);
+	}
+
 	exit(ret);
 }
+
+/*
+ * Pass on an error with the given code, which a trap of the calling
+ * thread caught from errorout() and which was logged then, to the trap
+ * set before that one, or exit() with it if there is none. This lets a
+ * procedure release what it holds before its caller sees the error.
+ * This procedure never returns.
+ */
+void rethrow_error(enum error_code ret)
+{
+	if(error_trap != NULL) {
+		struct error_trap* trap = error_trap;
+
+		error_trap = NULL;
+		trap->code = ret;
+		longjmp(trap->env, 1);
+	}
+
+	exit(ret);
+}
+
+/*
+ * Make errorout() on the calling thread return to the given trap, which
+ * must have been initialized with setjmp(), instead of exiting. The
+ * trap is cleared when errorout() uses it. Whatever the failing code
+ * had allocated is not released, unless a procedure between the two
+ * sets a trap of its own to release it and then calls rethrow_error().
+ * If trap is NULL, errorout() exits again.
+ */
+void set_error_trap(struct error_trap* trap)
+{
+	error_trap = trap;
+}
+
+/*
+ * Return the error trap of the calling thread, or NULL if it has none.
+ */
+struct error_trap* get_error_trap(void)
+{
+	return error_trap;
+}
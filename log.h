@@ -15,6 +15,8 @@ enum error_code {
 	E_STR = 9, /* failure to manipulate strings */
 	E_PDFMERGER = 10, /* pdf merger failure */
 	E_PDF, /* error reading PDF */
+	E_TIMEOUT, /* deadline exceeded */
+	E_FONT, /* failure to use a font */
 
 	E_LAST
 };
@@ -27,9 +29,18 @@ enum log_level {
 	kLL_LAST
 };
 
+/* Where errorout() returns to on one thread instead of exiting */
+struct error_trap {
+	jmp_buf env; /* restored by errorout() */
+	enum error_code code; /* error code passed to errorout() */
+};
+
 extern FILE* errorfd;
 extern FILE* logfd;
 extern enum log_level log_filter;
 
 int writelog(enum log_level, LPCTSTR, ...);
 void errorout(enum error_code, LPCTSTR, ...);
+void rethrow_error(enum error_code);
+void set_error_trap(struct error_trap*);
+struct error_trap* get_error_trap(void);
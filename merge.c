@@ -0,0 +1,2258 @@
+#include "stdafx.h"
+#include "merge.h"
+#include "font.h"
+#include "image.h"
+#include "linearize.h"
+#include "pdf.h"
+#include "task.h"
+#include "util.h"
+#include "log.h"
+
+/* Number of page attributes inherited through the page tree */
+#define MERGE_INHERITED 4
+
+/* Deepest page tree accepted in a source PDF */
+#define MERGE_MAX_DEPTH 64
+
+/* Target number of a source object that is copied as null */
+#define MERGE_DROPPED ULONG_MAX
+
+/* Target number of a source stream whose dictionary is being remapped */
+#define MERGE_VISITING (ULONG_MAX - 1)
+
+/* Bytes in a SHA-256 digest */
+#define MERGE_DIGEST_LEN 32
+
+/* Bytes of images a merge holds before resampling them at once */
+#define MERGE_IMAGE_BATCH (64 * 1024 * 1024)
+
+/* Longest content stream drawing the watermark, and longest name of it */
+#define MERGE_OVERLAY_LEN 160
+#define MERGE_NAME_LEN 32
+
+/* Margin of a page without one, in millimeters, like the PDF getter */
+#define MERGE_MARGIN 10.0
+
+/* Font size of stamped text without one, in CSS pixels, like a browser */
+#define MERGE_FONT_SIZE 16.0
+
+/* A merge of some PDFs into one, run as a task of a merge tree */
+struct merge_node {
+	LPCTSTR* sources; /* paths to merge, in order */
+	size_t count; /* number of elements in sources */
+	LPCTSTR target; /* path to write */
+	struct merge_options options; /* how to write it */
+	TCHAR path[MAX_PATH + 1]; /* intermediate PDF, unless at the root */
+	UINT id; /* ID of the temp file at path, or 0 */
+};
+
+/* A merge into the target of a conversion, fed a segment at a time */
+struct merge_job {
+	struct merge_target* merge; /* the merge */
+	struct merge_options options; /* how it writes its target */
+	LPCTSTR target; /* path to the target of the conversion */
+	int linearize; /* nonzero to linearize the merged PDF into target */
+	struct merge_stamp stamp; /* header and footer drawn, if any */
+	TCHAR watermark_pdf[MAX_PATH + 1]; /* path to the watermark, or empty */
+	TCHAR merged_pdf[MAX_PATH + 1]; /* PDF to linearize, or empty */
+	UINT merged_id; /* ID of the temp file at merged_pdf, or 0 */
+};
+
+/* Page attributes a page takes from its ancestors if it lacks them */
+static const char* const inheritable[MERGE_INHERITED] = { "Resources",
+		"MediaBox", "CropBox", "Rotate" };
+
+/* A page of a source PDF */
+struct merge_page {
+	unsigned long int num; /* object number in the source */
+	struct pdf_obj* inherited[MERGE_INHERITED]; /* inherited values, or NULL */
+};
+
+/* An object of a source PDF mapped into the target but not copied */
+struct merge_pending {
+	unsigned long int num; /* object number in the source */
+	struct pdf_obj* obj; /* the object, as parsed */
+	int remapped; /* nonzero if the references in obj are remapped */
+};
+
+/* A stream written to the target, found by the digest of its contents */
+struct merge_stream {
+	unsigned char digest[MERGE_DIGEST_LEN]; /* SHA-256 of the stream */
+	unsigned long int num; /* object number in the target, or 0 if free */
+};
+
+/* An image held by a merge until it is resampled */
+struct merge_image {
+	unsigned long int num; /* object number in the target */
+	struct pdf_obj* image; /* the image, owning its data */
+	struct pdf_obj* result; /* the image resampled, or NULL */
+	unsigned long int max_side; /* pixels on its longer side at most */
+	int quality; /* JPEG quality */
+};
+
+/* A source PDF being copied into the target */
+struct merge_source {
+	struct pdf_doc doc; /* the source PDF */
+	unsigned long int* map; /* target number of each source object, or 0 */
+	struct merge_pending* pending; /* objects mapped but not copied */
+	size_t pending_count; /* number of elements in pending */
+	size_t pending_capacity; /* number of elements allocated for pending */
+	struct merge_page* pages; /* pages in order */
+	size_t page_count; /* number of elements in pages */
+};
+
+/* A page of the target with a header and footer drawn on it */
+struct merge_stamped {
+	unsigned long int page_num; /* object number of the page */
+	unsigned long int form_num; /* Form XObject drawing them, written last */
+	double box[4]; /* media box of the page */
+};
+
+/* The PDF written by a merge */
+struct merge_target {
+	const struct merge_options* options; /* how to write the target */
+	struct pdf_writer writer; /* the target PDF */
+	unsigned long int pages_num; /* root of its page tree */
+	struct pdf_obj* kids; /* references to each of its pages */
+	size_t front; /* pages added in front of the others */
+	unsigned long int watermark_num; /* Form XObject of the watermark, or 0 */
+	double watermark_box[4]; /* bounding box of the watermark */
+	unsigned long int overlay_num; /* last content drawing it, or 0 */
+	char overlay[MERGE_OVERLAY_LEN]; /* operators of overlay_num */
+	unsigned long int part_nums[kSTAMP_PARTS]; /* Form XObjects, or 0 */
+	double part_boxes[kSTAMP_PARTS][4]; /* bounding boxes of them */
+	char* header_text[3]; /* stamped text, encoded, or NULL */
+	char* footer_text[3]; /* stamped text, encoded, or NULL */
+	struct pdf_font font; /* font of the stamped text */
+	unsigned long int font_num; /* font dictionary of font, or 0 */
+	struct merge_stamped* stamped; /* pages stamped, in order of number */
+	size_t stamped_count; /* number of elements in stamped */
+	size_t stamped_capacity; /* number of elements allocated for stamped */
+	unsigned long int save_num; /* content saving the state, or 0 */
+	unsigned long int restore_num; /* last content drawing a stamp, or 0 */
+	char restore[MERGE_OVERLAY_LEN]; /* operators of restore_num */
+	BCRYPT_ALG_HANDLE sha256; /* provider hashing streams */
+	struct merge_stream* streams; /* hash table of streams written */
+	size_t stream_count; /* number of streams in streams */
+	size_t stream_capacity; /* number of slots in streams, a power of 2 */
+	unsigned long int shared; /* number of duplicate streams dropped */
+	unsigned long int image_limit; /* longest side for the current page */
+	struct merge_image* images; /* images waiting to be resampled */
+	size_t image_count; /* number of elements in images */
+	size_t image_capacity; /* number of elements allocated for images */
+	size_t image_bytes; /* number of bytes in the images of images */
+	unsigned long int resampled; /* number of images made smaller */
+};
+
+static void init_merge_options(struct merge_options*, LPTSTR, UINT,
+		const struct pdf_info*);
+static void init_merge_stamp(struct merge_stamp*, const UINT*,
+		const struct pdf_info*);
+static void merge_node_task(void*);
+static int is_empty_pdf(LPCTSTR);
+static unsigned long int add_form(struct merge_target*, LPCTSTR, double*);
+static void open_stamp(struct merge_target*, const struct merge_stamp*);
+static struct pdf_obj* find_first_page(struct pdf_doc*, struct pdf_obj**);
+static struct pdf_obj* join_contents(struct pdf_doc*, const struct pdf_obj*);
+static void append_source(struct merge_target*, LPCTSTR, int);
+static void collect_pages(struct merge_target*, struct merge_source*,
+		unsigned long int, struct pdf_obj* const*, unsigned int);
+static void copy_page(struct merge_target*, struct merge_source*,
+		struct merge_page*, int);
+static void copy_pending(struct merge_target*, struct merge_source*);
+static void remap_refs(struct merge_target*, struct merge_source*,
+		struct pdf_obj*);
+static void map_object(struct merge_target*, struct merge_source*,
+		unsigned long int);
+static void push_pending(struct merge_source*, unsigned long int,
+		struct pdf_obj*, int);
+static unsigned long int share_stream(struct merge_target*,
+		const struct pdf_obj*, int*);
+static size_t first_slot(const unsigned char*, size_t);
+static void hash_object(BCRYPT_HASH_HANDLE, const struct pdf_obj*);
+static void hash_bytes(BCRYPT_HASH_HANDLE, const void*, size_t);
+static void queue_image(struct merge_target*, unsigned long int,
+		struct pdf_obj*);
+static void flush_images(struct merge_target*);
+static void resample_task(void*);
+static void prepare_page(struct merge_source*, struct pdf_obj*);
+static void name_xobject(struct pdf_obj*, const char*, char*);
+static void stamp_page(struct merge_target*, struct merge_source*,
+		struct pdf_obj*, char*, char*);
+static void add_overlay(struct merge_target*, struct pdf_obj*, const char*,
+		const char*);
+static void reserve_stamp(struct merge_target*, struct merge_source*,
+		struct pdf_obj*, unsigned long int, char*);
+static void add_stamp(struct merge_target*, struct pdf_obj*, const char*);
+static void write_stamps(struct merge_target*);
+static int compare_stamped(const void*, const void*);
+static void write_stamp(struct merge_target*, const struct merge_stamped*,
+		enum merge_stamp_part, enum merge_stamp_part, unsigned long int,
+		unsigned long int);
+static void expand_stamp_text(struct pdf_buffer*, const char*,
+		unsigned long int, unsigned long int);
+static void draw_stamp_part(struct pdf_buffer*, const double*,
+		const double*, double, double, const char*);
+static void show_stamp_text(struct merge_target*, struct pdf_buffer*,
+		const char*, int, double, const double*, unsigned long int,
+		unsigned long int);
+static int read_box(struct pdf_doc*, const struct pdf_obj*, double*);
+
+/*
+ * Merge the PDF cover page, table of contents and segments into the
+ * target, and lay the watermark under every page if watermark_id is
+ * not zero. The length of the array of IDs of segment temporary files,
+ * arr, must be n and contain the IDs in the order in which the segments
+ * should be merged. IDs of 0 belong to segments converted into the PDF
+ * of an earlier segment and are skipped. The PDFs are merged by
+ * merge_pdf_tree() as the structure pointed to by info asks, which also
+ * lays the watermark, so the target is written once, unless it is to
+ * be linearized, which linearize_pdf() does to the merged PDF. If the
+ * header and footer are stamped, as begin_merge_pdfs() describes with
+ * stamp_ids, a single merge writes the target instead, since pages are
+ * numbered apart from the cover page and TOC, and the temp files of
+ * the segments are removed. The values of target, cover, toc,
+ * stamp_ids and info must not be NULL. The value of arr must not be
+ * NULL unless n is equal to zero.
+ */
+void do_merge_pdfs(LPCTSTR target, LPCTSTR cover, LPCTSTR toc, size_t n,
+		UINT* arr, UINT watermark_id, const UINT* stamp_ids,
+		const struct pdf_info* info)
+{
+	struct merge_options options;
+	struct merge_job* job = NULL;
+	TCHAR watermark_pdf[MAX_PATH + 1] = _T("");
+	TCHAR merged_pdf[MAX_PATH + 1] = _T("");
+	UINT merged_id = 0;
+	LPCTSTR* sources = NULL; /* paths to merge in order */
+	TCHAR (*paths)[MAX_PATH + 1] = NULL; /* paths to the segments */
+	size_t count = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(target);
+	RT_NOT_NULL(cover);
+	RT_NOT_NULL(toc);
+	RT_NOT_NULL(stamp_ids);
+	RT_NOT_NULL(info);
+
+	if(n > 0)
+		RT_NOT_NULL(arr);
+
+	if(info->stamp_headers) {
+		job = begin_merge_pdfs(watermark_id, stamp_ids, info);
+
+		for(i = 0; i < n; ++i)
+			merge_segment(job, &arr[i]);
+
+		end_merge_pdfs(job, cover, toc);
+		return;
+	}
+
+	sources = (LPCTSTR*) require_cmem(n + 2, sizeof(*sources));
+	paths = (TCHAR (*)[MAX_PATH + 1]) require_cmem(n + 1, sizeof(*paths));
+	sources[count++] = cover;
+	sources[count++] = toc;
+
+	for(i = 0; i < n; ++i) {
+		if(arr[i] == 0)
+			continue;
+
+		require_tmp_file(paths[i], &arr[i]);
+		sources[count++] = paths[i];
+	}
+
+	init_merge_options(&options, watermark_pdf, watermark_id, info);
+
+	if(info->linearize) {
+		require_tmp_file(merged_pdf, &merged_id);
+		merge_pdf_tree(merged_pdf, sources, count, &options);
+		linearize_pdf(target, merged_pdf);
+		remove_tmp_file(merged_pdf);
+	} else {
+		merge_pdf_tree(target, sources, count, &options);
+	}
+
+	free(paths);
+	free(sources);
+}
+
+/*
+ * Start merging PDFs into the target of the conversion described by
+ * the structure pointed to by info, laying the watermark under every
+ * page if watermark_id is not zero, and return the merge for
+ * merge_segment() and end_merge_pdfs(). Unlike do_merge_pdfs(), which
+ * needs every PDF at once, this lets segments be merged as soon as
+ * they are converted, in a single merge. If the stamp_headers member
+ * of info is not zero and the header and footer are shown, they are
+ * drawn on every page from the PDFs in the temporary files whose IDs
+ * are in the array pointed to by stamp_ids, indexed by
+ * merge_stamp_part, which are 0 for missing parts. The values of
+ * stamp_ids and info must not be NULL. The pointer returned must be
+ * passed to end_merge_pdfs().
+ */
+struct merge_job* begin_merge_pdfs(UINT watermark_id, const UINT* stamp_ids,
+		const struct pdf_info* info)
+{
+	struct merge_job* job = NULL;
+
+	RT_NOT_NULL(stamp_ids);
+	RT_NOT_NULL(info);
+
+	job = (struct merge_job*) require_cmem(1, sizeof(*job));
+	init_merge_options(&job->options, job->watermark_pdf, watermark_id,
+			info);
+
+	if(info->stamp_headers && info->hf_opts != kPDF_HF_HIDE) {
+		init_merge_stamp(&job->stamp, stamp_ids, info);
+		job->options.stamp = &job->stamp;
+	}
+	job->target = info->target_path;
+	job->linearize = info->linearize != 0;
+
+	if(job->linearize) {
+		require_tmp_file(job->merged_pdf, &job->merged_id);
+		job->merge = open_merge(job->merged_pdf, &job->options);
+	} else {
+		job->merge = open_merge(job->target, &job->options);
+	}
+
+	return job;
+}
+
+/*
+ * Append the pages of the segment PDF in the temporary file whose ID is
+ * pointed to by id to the given merge, then remove the file and set
+ * the ID to 0. IDs of 0 are skipped. Neither the value of job nor the
+ * value of id may be NULL.
+ */
+void merge_segment(struct merge_job* job, UINT* id)
+{
+	TCHAR path[MAX_PATH + 1] = _T("");
+
+	RT_NOT_NULL(job);
+	RT_NOT_NULL(id);
+
+	if(*id == 0)
+		return;
+
+	require_tmp_file(path, id);
+	add_merge_source(job->merge, path, 0);
+	remove_tmp_file(path);
+	*id = 0;
+}
+
+/*
+ * Put the PDF cover page and table of contents in front of the pages
+ * merged by the given merge and finish writing its target, linearizing
+ * it if the conversion asked for that. The structure pointed to by job
+ * is freed. The values of job, cover and toc must not be NULL.
+ */
+void end_merge_pdfs(struct merge_job* job, LPCTSTR cover, LPCTSTR toc)
+{
+	RT_NOT_NULL(job);
+	RT_NOT_NULL(cover);
+	RT_NOT_NULL(toc);
+
+	add_merge_source(job->merge, cover, 1);
+	add_merge_source(job->merge, toc, 1);
+	close_merge(job->merge);
+	job->merge = NULL;
+
+	if(job->linearize) {
+		linearize_pdf(job->target, job->merged_pdf);
+		remove_tmp_file(job->merged_pdf);
+	}
+
+	free(job);
+}
+
+/*
+ * Give up the given merge after an error, removing the PDF it was
+ * writing, and free the structure pointed to by job. The value of job
+ * must not be NULL.
+ */
+void abort_merge_pdfs(struct merge_job* job)
+{
+	RT_NOT_NULL(job);
+
+	if(job->merge != NULL)
+		abort_merge(job->merge);
+	else if(job->linearize)
+		remove_tmp_file(job->merged_pdf);
+
+	free(job);
+}
+
+/*
+ * Set the structure pointed to by options to merge as the structure
+ * pointed to by info asks. If watermark_id is not zero, the path of
+ * that temporary file is stored in the buffer pointed to by
+ * watermark_pdf, which must hold MAX_PATH + 1 characters, and used as
+ * the watermark. The values of options, watermark_pdf and info must not
+ * be NULL.
+ */
+static void init_merge_options(struct merge_options* options,
+		LPTSTR watermark_pdf, UINT watermark_id, const struct pdf_info* info)
+{
+	RT_NOT_NULL(options);
+	RT_NOT_NULL(watermark_pdf);
+	RT_NOT_NULL(info);
+
+	memset(options, 0, sizeof(*options));
+	options->fanout = info->merge_fanout;
+	options->compress_level = (int) info->compress_level;
+	options->object_streams = info->object_streams != 0;
+	options->image_dpi = info->image_dpi;
+	options->jpeg_quality = (int) info->jpeg_quality;
+
+	if(watermark_id != 0) {
+		require_tmp_file(watermark_pdf, &watermark_id);
+		options->watermark = watermark_pdf;
+	}
+
+	/* Linearizing writes plain objects, so object streams are wasted */
+	if(info->linearize)
+		options->object_streams = 0;
+}
+
+/*
+ * Set the structure pointed to by stamp to draw the header and footer
+ * of the conversion described by the structure pointed to by info. The
+ * array pointed to by ids holds the ID of the temporary file with the
+ * PDF of each part, indexed by merge_stamp_part, or 0 if the part is
+ * missing. The first page has its own parts if info asks for a special
+ * first page. Margins are read like the PDF getter reads them, in
+ * millimeters unless they give a unit. The values of stamp, ids and
+ * info must not be NULL.
+ */
+static void init_merge_stamp(struct merge_stamp* stamp, const UINT* ids,
+		const struct pdf_info* info)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(stamp);
+	RT_NOT_NULL(ids);
+	RT_NOT_NULL(info);
+
+	memset(stamp, 0, sizeof(*stamp));
+
+	for(i = 0; i < kSTAMP_PARTS; ++i) {
+		UINT id = ids[i];
+
+		if(id != 0)
+			require_tmp_file(stamp->parts[i], &id);
+	}
+
+	stamp->first = info->hf_opts == kPDF_HF_SPECIAL;
+	stamp->header_text[0] = info->header_left;
+	stamp->header_text[1] = info->header_center;
+	stamp->header_text[2] = info->header_right;
+	stamp->footer_text[0] = info->footer_left;
+	stamp->footer_text[1] = info->footer_center;
+	stamp->footer_text[2] = info->footer_right;
+	stamp->font_family = info->font_family;
+	stamp->font_size = read_pdf_length(info->font_size, MERGE_FONT_SIZE,
+			FONT_PX);
+	stamp->top = read_pdf_length(info->margins.top, MERGE_MARGIN, FONT_MM);
+	stamp->bottom = read_pdf_length(info->margins.bottom, MERGE_MARGIN,
+			FONT_MM);
+	stamp->left = read_pdf_length(info->margins.left, MERGE_MARGIN, FONT_MM);
+	stamp->right = read_pdf_length(info->margins.right, MERGE_MARGIN,
+			FONT_MM);
+	stamp->header_spacing = read_pdf_length(info->margins.header, 0.0,
+			FONT_MM);
+	stamp->footer_spacing = read_pdf_length(info->margins.footer, 0.0,
+			FONT_MM);
+}
+
+/*
+ * Write the pages of the count PDFs at the paths in the array pointed
+ * to by sources, in order, to a new PDF at the given target path, as
+ * merge_pdfs() does with the structure pointed to by options, but
+ * through a tree of merges. Runs of at most its fanout sources are
+ * merged into intermediate PDFs in parallel, then runs of those are
+ * merged in turn, until a single merge writes the target. Runs on a
+ * level are made as even as possible. If the fanout is less than 2 or
+ * there are no more sources than that, the target is written by a
+ * single merge. Intermediate PDFs are compressed, but watermarks,
+ * stamps, object streams and resampled images are left to the merge
+ * writing the target. The values of target, sources and options must
+ * not be NULL.
+ */
+void merge_pdf_tree(LPCTSTR target, const LPCTSTR* sources, size_t count,
+		const struct merge_options* options)
+{
+	struct task_graph graph;
+	struct merge_node** nodes = NULL; /* every merge in the tree */
+	struct task** tasks = NULL; /* merge writing each path, or NULL */
+	LPCTSTR* paths = NULL; /* PDFs to merge on the current level */
+	unsigned long int fanout = 0;
+	size_t node_count = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(target);
+	RT_NOT_NULL(sources);
+	RT_NOT_NULL(options);
+
+	fanout = options->fanout;
+
+	if(fanout < 2 || count <= fanout) {
+		merge_pdfs(target, sources, count, options);
+		return;
+	}
+
+	init_task_graph(&graph);
+	paths = (LPCTSTR*) require_cmem(count, sizeof(*paths));
+	tasks = (struct task**) require_cmem(count, sizeof(*tasks));
+	memcpy(paths, sources, count * sizeof(*paths));
+
+	while(count > 1) {
+		size_t groups = (count + fanout - 1) / fanout;
+		size_t first = 0;
+		size_t group = 0;
+
+		for(group = 0; group < groups; ++group) {
+			/* Spread the remainder over the first runs of the level */
+			size_t len = count / groups + (group < count % groups ? 1 : 0);
+			struct merge_node* node = NULL;
+			struct task* task = NULL;
+
+			node = (struct merge_node*) require_cmem(1, sizeof(*node));
+			node->sources = (LPCTSTR*) require_cmem(len, sizeof(*paths));
+			node->count = len;
+			memcpy(node->sources, &paths[first], len * sizeof(*paths));
+
+			node->options = *options;
+
+			if(groups > 1) {
+				require_tmp_file(node->path, &node->id);
+				node->target = node->path;
+				node->options.watermark = NULL;
+				node->options.stamp = NULL;
+				node->options.object_streams = 0;
+				node->options.image_dpi = 0;
+			} else {
+				node->target = target;
+			}
+
+			task = add_task(&graph, _T("merge group"), merge_node_task, node);
+
+			for(i = first; i < first + len; ++i)
+				if(tasks[i] != NULL)
+					add_task_dependency(task, tasks[i]);
+
+			nodes = (struct merge_node**) require_realloc(nodes,
+					node_count + 1, sizeof(*nodes));
+			nodes[node_count++] = node;
+			paths[group] = node->target;
+			tasks[group] = task;
+			first += len;
+		}
+
+		count = groups;
+	}
+
+	writelog(kVERBOSE, _T("Merging through %lu intermediate PDFs\n"),
+			(unsigned long int) node_count - 1);
+	run_task_graph(&graph);
+	destroy_task_graph(&graph);
+
+	for(i = 0; i < node_count; ++i) {
+		if(nodes[i]->id != 0)
+			remove_tmp_file(nodes[i]->path);
+
+		free(nodes[i]->sources);
+		free(nodes[i]);
+	}
+
+	free(nodes);
+	free(tasks);
+	free(paths);
+}
+
+/*
+ * Do the merge described by the merge_node structure pointed to by arg.
+ * The value of arg must not be NULL.
+ */
+static void merge_node_task(void* arg)
+{
+	struct merge_node* node = (struct merge_node*) arg;
+
+	RT_NOT_NULL(node);
+
+	merge_pdfs(node->target, node->sources, node->count, &node->options);
+}
+
+/*
+ * Write the pages of the count PDFs at the paths in the array pointed
+ * to by sources, in order, to a new PDF at the given target path. Empty
+ * paths and empty files, which is what a missing cover page or table
+ * of contents leaves behind, are skipped. The objects each page needs
+ * are copied once per source and renumbered, and the page tree is
+ * flattened with inherited attributes copied into each page. Sources
+ * are read one at a time from a mapping of the file and objects are
+ * written as soon as they are parsed, so memory grows with the number
+ * of objects and pages rather than with the size of the PDFs. Streams
+ * with the same dictionary and data, such as the fonts and images every
+ * segment embeds, are written once and shared. The target is written
+ * as the structure pointed to by options asks; if it has a watermark,
+ * the first page of that PDF is laid under every page, scaled to fit,
+ * and is written once and shared by all of them. If it has an image
+ * resolution, images are resampled in parallel so that none has more
+ * pixels than that many per inch on the longer side of the first page
+ * showing it, whatever its place on the page. If it has a stamp, the
+ * header and footer are drawn on every page as open_merge() describes.
+ * The values of target, sources and options must not be NULL.
+ */
+void merge_pdfs(LPCTSTR target, const LPCTSTR* sources, size_t count,
+		const struct merge_options* options)
+{
+	struct merge_target* merge = NULL;
+	size_t i = 0;
+
+	RT_NOT_NULL(target);
+	RT_NOT_NULL(sources);
+	RT_NOT_NULL(options);
+
+	merge = open_merge(target, options);
+
+	for(i = 0; i < count; ++i)
+		add_merge_source(merge, sources[i], 0);
+
+	close_merge(merge);
+}
+
+/*
+ * Start a merge writing a new PDF at the given target path as the
+ * structure pointed to by options asks, which must stay valid until the
+ * merge is closed, and return it for add_merge_source(). If it has a
+ * stamp, the first page of the PDF of each header part is drawn at the
+ * top of the top margin of every page, scaled to the width of the page,
+ * and each footer part at the top of the bottom margin, leaving out the
+ * spacing next to the page. Its text is set in the middle of the
+ * margins, with "[page]" replaced by the number of the page and
+ * "[topage]" by the number of pages, not counting pages added in front.
+ * Those pages are not stamped at all, and the first page after them
+ * gets the first parts of the stamp if it has them. The values of
+ * target and options must not be NULL. The pointer returned must be
+ * passed to close_merge().
+ */
+struct merge_target* open_merge(LPCTSTR target,
+		const struct merge_options* options)
+{
+	struct merge_target* merge = NULL;
+
+	RT_NOT_NULL(target);
+	RT_NOT_NULL(options);
+
+	merge = (struct merge_target*) require_cmem(1, sizeof(*merge));
+	merge->options = options;
+
+	if(!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&merge->sha256,
+			BCRYPT_SHA256_ALGORITHM, NULL, 0)))
+		errorout(E_MALLOC, _T("Failed to open the SHA-256 provider"));
+
+	open_pdf_writer(&merge->writer, target, options->compress_level,
+			options->object_streams);
+	merge->pages_num = reserve_pdf_object(&merge->writer);
+	merge->kids = new_pdf_object(kPDF_OBJ_ARRAY);
+
+	if(options->watermark != NULL) {
+		merge->watermark_num = add_form(merge, options->watermark,
+				merge->watermark_box);
+		writelog(kVERBOSE, _T("Laying '%s' under every page\n"),
+				options->watermark);
+	}
+
+	if(options->stamp != NULL)
+		open_stamp(merge, options->stamp);
+
+	return merge;
+}
+
+/*
+ * Copy the pages of the PDF at the given path to the target of the
+ * given merge, after the pages added before it, or, if front is not
+ * zero, after the pages added before it with front set but before
+ * every other page. An empty path or file is skipped. The values of
+ * merge and path must not be NULL.
+ */
+void add_merge_source(struct merge_target* merge, LPCTSTR path, int front)
+{
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(path);
+
+	if(!is_empty_pdf(path))
+		append_source(merge, path, front);
+}
+
+/*
+ * Finish writing the target of the given merge with its page tree and
+ * catalog, and free the structure pointed to by merge. The value of
+ * merge must not be NULL.
+ */
+void close_merge(struct merge_target* merge)
+{
+	struct pdf_obj* pages = NULL; /* root of the page tree */
+	struct pdf_obj* catalog = NULL;
+	unsigned long int catalog_num = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(merge);
+
+	flush_images(merge);
+
+	/* Page numbers are known once every page is in place */
+	if(merge->options->stamp != NULL)
+		write_stamps(merge);
+
+	pages = new_pdf_object(kPDF_OBJ_DICT);
+	set_pdf_key(pages, "Type", new_pdf_name("Pages"));
+	set_pdf_key(pages, "Count", new_pdf_int((long int)
+			merge->kids->u.array.count));
+	set_pdf_key(pages, "Kids", merge->kids);
+	merge->kids = NULL;
+	write_pdf_object(&merge->writer, merge->pages_num, pages);
+	free_pdf_object(pages);
+
+	catalog_num = reserve_pdf_object(&merge->writer);
+	catalog = new_pdf_object(kPDF_OBJ_DICT);
+	set_pdf_key(catalog, "Type", new_pdf_name("Catalog"));
+	set_pdf_key(catalog, "Pages", new_pdf_ref(merge->pages_num));
+	write_pdf_object(&merge->writer, catalog_num, catalog);
+	free_pdf_object(catalog);
+
+	if(merge->shared > 0)
+		writelog(kVERBOSE, _T("Shared %lu duplicate streams in '%s'\n"),
+				merge->shared, merge->writer.path);
+
+	if(merge->resampled > 0)
+		writelog(kVERBOSE, _T("Resampled %lu images in '%s'\n"),
+				merge->resampled, merge->writer.path);
+
+	close_pdf_writer(&merge->writer, catalog_num);
+
+	for(i = 0; i < 3; ++i) {
+		free(merge->header_text[i]);
+		free(merge->footer_text[i]);
+	}
+
+	free(merge->stamped);
+	free(merge->images);
+	free(merge->streams);
+	BCryptCloseAlgorithmProvider(merge->sha256, 0);
+	free(merge);
+}
+
+/*
+ * Give up the given merge after an error, removing its unfinished
+ * target, and free the structure pointed to by merge. The value of
+ * merge must not be NULL.
+ */
+void abort_merge(struct merge_target* merge)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(merge);
+
+	for(i = 0; i < merge->image_count; ++i) {
+		if(merge->images[i].result != NULL)
+			free_pdf_object(merge->images[i].result);
+
+		if(merge->images[i].image != NULL)
+			free_pdf_object(merge->images[i].image);
+	}
+
+	if(merge->kids != NULL)
+		free_pdf_object(merge->kids);
+
+	abort_pdf_writer(&merge->writer);
+
+	for(i = 0; i < 3; ++i) {
+		free(merge->header_text[i]);
+		free(merge->footer_text[i]);
+	}
+
+	free(merge->stamped);
+	free(merge->images);
+	free(merge->streams);
+
+	if(merge->sha256 != NULL)
+		BCryptCloseAlgorithmProvider(merge->sha256, 0);
+
+	free(merge);
+}
+
+/*
+ * Return nonzero if the given path is empty or names an empty file.
+ * The value of path must not be NULL.
+ */
+static int is_empty_pdf(LPCTSTR path)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attrs;
+
+	RT_NOT_NULL(path);
+
+	if(path[0] == _T('\0'))
+		return 1;
+
+	if(!GetFileAttributesEx(path, GetFileExInfoStandard, &attrs))
+		errorout(E_BADF, _T("Failed to find PDF '%s' (%lu)"), path,
+				GetLastError());
+
+	return attrs.nFileSizeHigh == 0 && attrs.nFileSizeLow == 0;
+}
+
+/*
+ * Write the first page of the PDF at the given path to the target of
+ * the given merge as a Form XObject, with everything it refers to, and
+ * return its object number, for copy_page() to draw on every page. Its
+ * bounding box is stored in the array of four numbers pointed to by
+ * box. The values of merge, path and box must not be NULL.
+ */
+static unsigned long int add_form(struct merge_target* merge, LPCTSTR path,
+		double* box)
+{
+	struct merge_source source;
+	struct pdf_obj* page = NULL;
+	struct pdf_obj* resources = NULL;
+	struct pdf_obj* form = NULL;
+	struct pdf_obj* rect = NULL;
+	unsigned long int num = 0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(path);
+	RT_NOT_NULL(box);
+
+	memset(&source, 0, sizeof(source));
+	open_pdf(&source.doc, path);
+	source.map = (unsigned long int*) require_cmem(
+			source.doc.xref_count + 1, sizeof(*source.map));
+	page = find_first_page(&source.doc, &resources);
+	rect = get_pdf_key(page, "CropBox");
+
+	if(rect == NULL)
+		rect = get_pdf_key(page, "MediaBox");
+
+	if(!read_box(&source.doc, rect, box))
+		errorout(E_PDF, _T("PDF '%s' has no page size"), path);
+
+	form = join_contents(&source.doc, get_pdf_key(page, "Contents"));
+	set_pdf_key(form, "Type", new_pdf_name("XObject"));
+	set_pdf_key(form, "Subtype", new_pdf_name("Form"));
+	set_pdf_key(form, "BBox", load_pdf_value(&source.doc, rect));
+
+	if(resources != NULL)
+		set_pdf_key(form, "Resources", resources);
+
+	remap_refs(merge, &source, form);
+	num = reserve_pdf_object(&merge->writer);
+	write_pdf_object(&merge->writer, num, form);
+	copy_pending(merge, &source);
+	free_pdf_object(form);
+	free_pdf_object(page);
+	free(source.pending);
+	free(source.map);
+	close_pdf(&source.doc);
+
+	return num;
+}
+
+/*
+ * Write the parts of the given stamp to the target of the given merge
+ * as Form XObjects, and its font if it has text, for write_stamps().
+ * The values of merge and stamp must not be NULL.
+ */
+static void open_stamp(struct merge_target* merge,
+		const struct merge_stamp* stamp)
+{
+	LPTSTR family = NULL; /* font family of the text */
+	int has_text = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(stamp);
+
+	for(i = 0; i < kSTAMP_PARTS; ++i)
+		if(stamp->parts[i][0] != _T('\0'))
+			merge->part_nums[i] = add_form(merge, stamp->parts[i],
+					merge->part_boxes[i]);
+
+	for(i = 0; i < 3; ++i) {
+		if(stamp->header_text[i] != NULL) {
+			merge->header_text[i] = encode_pdf_text(stamp->header_text[i]);
+			has_text = 1;
+		}
+
+		if(stamp->footer_text[i] != NULL) {
+			merge->footer_text[i] = encode_pdf_text(stamp->footer_text[i]);
+			has_text = 1;
+		}
+	}
+
+	if(has_text) {
+		family = get_pdf_font_family(stamp->font_family);
+		load_pdf_font(&merge->font, family);
+		free(family);
+		merge->font_num = write_pdf_font(&merge->writer, &merge->font);
+	}
+
+	writelog(kVERBOSE, _T("Stamping the header and footer of every page\n"));
+}
+
+/*
+ * Return the first page of the PDF of the structure pointed to by doc
+ * and store the resources it uses, possibly inherited, in the value
+ * pointed to by resources, or NULL if it has none. The values of doc
+ * and resources must not be NULL. The objects returned must be passed
+ * to free_pdf_object().
+ */
+static struct pdf_obj* find_first_page(struct pdf_doc* doc,
+		struct pdf_obj** resources)
+{
+	struct pdf_obj* catalog = NULL;
+	struct pdf_obj* node = NULL;
+	struct pdf_obj* inherited[MERGE_INHERITED] = { NULL };
+	unsigned int depth = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(doc);
+	RT_NOT_NULL(resources);
+
+	catalog = load_pdf_value(doc, get_pdf_key(doc->trailer, "Root"));
+	node = load_pdf_value(doc, get_pdf_key(catalog, "Pages"));
+
+	if(catalog != NULL)
+		free_pdf_object(catalog);
+
+	for(;;) {
+		struct pdf_obj* kids = NULL;
+		struct pdf_obj* kid = NULL;
+
+		if(node == NULL || node->type != kPDF_OBJ_DICT
+				|| depth++ > MERGE_MAX_DEPTH)
+			errorout(E_PDF, _T("Malformed page tree in '%s'"), doc->path);
+
+		for(i = 0; i < MERGE_INHERITED; ++i) {
+			struct pdf_obj* value = get_pdf_key(node, inheritable[i]);
+
+			if(value != NULL) {
+				if(inherited[i] != NULL)
+					free_pdf_object(inherited[i]);
+
+				inherited[i] = clone_pdf_object(value);
+			}
+		}
+
+		kids = load_pdf_value(doc, get_pdf_key(node, "Kids"));
+
+		if(kids == NULL)
+			break;
+
+		if(kids->type == kPDF_OBJ_ARRAY && kids->u.array.count > 0)
+			kid = load_pdf_value(doc, kids->u.array.items[0]);
+
+		free_pdf_object(kids);
+		free_pdf_object(node);
+		node = kid;
+	}
+
+	/* The page gets what it inherits, except its resources */
+	*resources = inherited[0];
+
+	for(i = 1; i < MERGE_INHERITED; ++i)
+		if(inherited[i] != NULL)
+			set_pdf_key(node, inheritable[i], inherited[i]);
+
+	return node;
+}
+
+/*
+ * Return a new stream with the data of the given page contents of the
+ * PDF of the structure pointed to by doc, which is a reference to a
+ * stream, an array of such references, or NULL for a blank page. A
+ * single stream keeps its filter; several are decoded and joined. The
+ * value of doc must not be NULL. The object returned must be passed to
+ * free_pdf_object().
+ */
+static struct pdf_obj* join_contents(struct pdf_doc* doc,
+		const struct pdf_obj* contents)
+{
+	struct pdf_obj* list = NULL; /* the streams, in order */
+	struct pdf_obj* form = NULL;
+	unsigned char* data = NULL;
+	size_t len = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(doc);
+
+	form = new_pdf_object(kPDF_OBJ_STREAM);
+	form->u.stream.dict = new_pdf_object(kPDF_OBJ_DICT);
+	form->u.stream.owned = 1;
+	list = load_pdf_value(doc, contents);
+
+	if(list != NULL && list->type == kPDF_OBJ_STREAM) {
+		struct pdf_obj* filter = get_pdf_key(list, "Filter");
+		struct pdf_obj* parms = get_pdf_key(list, "DecodeParms");
+
+		data = (unsigned char*) require_mem(list->u.stream.len + 1);
+		memcpy(data, list->u.stream.data, list->u.stream.len);
+		len = list->u.stream.len;
+
+		if(filter != NULL)
+			set_pdf_key(form, "Filter", load_pdf_value(doc, filter));
+
+		if(parms != NULL)
+			set_pdf_key(form, "DecodeParms", load_pdf_value(doc, parms));
+	} else if(list != NULL && list->type == kPDF_OBJ_ARRAY) {
+		for(i = 0; i < list->u.array.count; ++i) {
+			struct pdf_obj* stream = load_pdf_value(doc,
+					list->u.array.items[i]);
+			unsigned char* part = NULL;
+			size_t part_len = 0;
+
+			if(stream->type != kPDF_OBJ_STREAM) {
+				free_pdf_object(stream);
+				continue;
+			}
+
+			/* Streams are joined as if a space separated them */
+			part = decode_pdf_stream(stream, &part_len);
+			data = (unsigned char*) require_realloc(data,
+					len + part_len + 2, 1);
+			memcpy(data + len, part, part_len);
+			len += part_len;
+			data[len++] = '\n';
+			free(part);
+			free_pdf_object(stream);
+		}
+	}
+
+	if(list != NULL)
+		free_pdf_object(list);
+
+	if(data == NULL)
+		data = (unsigned char*) require_mem(1);
+
+	form->u.stream.data = data;
+	form->u.stream.len = len;
+
+	return form;
+}
+
+/*
+ * Copy every page of the PDF at the given path, and everything those
+ * pages refer to, to the end of the target of the given merge. The
+ * catalog of the source is not copied; references to it become null
+ * and references to its page tree become references to the page tree
+ * of the target. If front is not zero, the pages go before every page
+ * that was not added with front set instead. The values of merge and
+ * path must not be NULL.
+ */
+static void append_source(struct merge_target* merge, LPCTSTR path,
+		int front)
+{
+	struct merge_source source;
+	struct pdf_obj* inherited[MERGE_INHERITED] = { NULL };
+	struct pdf_obj* root = NULL; /* reference to the catalog */
+	struct pdf_obj* catalog = NULL;
+	struct pdf_obj* pages = NULL; /* reference to the page tree */
+	size_t i = 0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(path);
+
+	memset(&source, 0, sizeof(source));
+	open_pdf(&source.doc, path);
+	source.map = (unsigned long int*) require_cmem(
+			source.doc.xref_count + 1, sizeof(*source.map));
+	root = get_pdf_key(source.doc.trailer, "Root");
+	catalog = load_pdf_value(&source.doc, root);
+	pages = get_pdf_key(catalog, "Pages");
+
+	if(pages == NULL || pages->type != kPDF_OBJ_REF)
+		errorout(E_PDF, _T("PDF '%s' has no page tree"), path);
+
+	if(root->type == kPDF_OBJ_REF && root->u.ref.num < source.doc.xref_count)
+		source.map[root->u.ref.num] = MERGE_DROPPED;
+
+	collect_pages(merge, &source, pages->u.ref.num, inherited, 0);
+	free_pdf_object(catalog);
+
+	/* Objects are parsed once mapped, so they are written page by page */
+	for(i = 0; i < source.page_count; ++i) {
+		copy_page(merge, &source, &source.pages[i], front);
+		copy_pending(merge, &source);
+	}
+
+	writelog(kVERBOSE, _T("Merged %lu pages of '%s'\n"),
+			(unsigned long int) source.page_count, path);
+	free(source.pages);
+	free(source.pending);
+	free(source.map);
+	close_pdf(&source.doc);
+}
+
+/*
+ * Add the pages below the page tree node with the given object number
+ * in the given source to its list of pages, in order, and give each of
+ * them a number in the target of the given merge. The node is depth
+ * levels below the root and inherits the attributes in the array
+ * pointed to by inherited, whose elements are NULL for attributes that
+ * are not inherited. The values of merge, source and inherited must not
+ * be NULL.
+ */
+static void collect_pages(struct merge_target* merge,
+		struct merge_source* source, unsigned long int num,
+		struct pdf_obj* const* inherited, unsigned int depth)
+{
+	struct pdf_obj* node = NULL;
+	struct pdf_obj* kids = NULL;
+	size_t i = 0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(source);
+	RT_NOT_NULL(inherited);
+
+	/* A node seen before would make the tree a cycle */
+	if(depth > MERGE_MAX_DEPTH || num >= source->doc.xref_count
+			|| source->map[num] != 0)
+		errorout(E_PDF, _T("Malformed page tree in '%s'"), source->doc.path);
+
+	node = load_pdf_object(&source->doc, num);
+	kids = get_pdf_key(node, "Kids");
+
+	if(is_pdf_name(get_pdf_key(node, "Type"), "Pages") || (kids != NULL
+			&& !is_pdf_name(get_pdf_key(node, "Type"), "Page"))) {
+		struct pdf_obj* own[MERGE_INHERITED]; /* what the kids inherit */
+
+		source->map[num] = merge->pages_num;
+
+		for(i = 0; i < MERGE_INHERITED; ++i) {
+			own[i] = get_pdf_key(node, inheritable[i]);
+
+			if(own[i] == NULL)
+				own[i] = inherited[i];
+		}
+
+		kids = load_pdf_value(&source->doc, kids);
+
+		if(kids == NULL || kids->type != kPDF_OBJ_ARRAY)
+			errorout(E_PDF, _T("Malformed page tree in '%s'"),
+					source->doc.path);
+
+		for(i = 0; i < kids->u.array.count; ++i)
+			if(kids->u.array.items[i]->type == kPDF_OBJ_REF)
+				collect_pages(merge, source,
+						kids->u.array.items[i]->u.ref.num, own, depth + 1);
+
+		free_pdf_object(kids);
+	} else {
+		struct merge_page* page = NULL;
+
+		if(node->type != kPDF_OBJ_DICT)
+			errorout(E_PDF, _T("Malformed page tree in '%s'"),
+					source->doc.path);
+
+		source->pages = (struct merge_page*) require_realloc(source->pages,
+				source->page_count + 1, sizeof(*source->pages));
+		page = &source->pages[source->page_count++];
+		page->num = num;
+
+		for(i = 0; i < MERGE_INHERITED; ++i)
+			page->inherited[i] = inherited[i] != NULL
+					&& get_pdf_key(node, inheritable[i]) == NULL ?
+					clone_pdf_object(inherited[i]) : NULL;
+
+		source->map[num] = reserve_pdf_object(&merge->writer);
+	}
+
+	free_pdf_object(node);
+}
+
+/*
+ * Write the given page of the given source, with the attributes it
+ * inherits, to the target of the given merge as a child of its page
+ * tree, at its end or, if front is not zero, after the pages at its
+ * front. The objects the page refers to are queued for copy_pending().
+ * The values of merge, source and page must not be NULL.
+ */
+static void copy_page(struct merge_target* merge, struct merge_source* source,
+		struct merge_page* page, int front)
+{
+	struct pdf_obj** kids = NULL; /* pages of the target so far */
+	struct pdf_obj* ref = NULL; /* reference to the page */
+	struct pdf_obj* obj = NULL;
+	char name[MERGE_NAME_LEN] = ""; /* name of the watermark in the page */
+	char overlay[MERGE_OVERLAY_LEN] = ""; /* operators drawing it */
+	char stamp_name[MERGE_NAME_LEN] = ""; /* name of the stamp in the page */
+	int stamped = 0; /* nonzero if the page gets a header and footer */
+	size_t i = 0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(source);
+	RT_NOT_NULL(page);
+
+	/* The cover page and the TOC go without a header and footer */
+	stamped = merge->options->stamp != NULL && !front;
+
+	obj = load_pdf_object(&source->doc, page->num);
+
+	for(i = 0; i < MERGE_INHERITED; ++i) {
+		if(page->inherited[i] != NULL) {
+			set_pdf_key(obj, inheritable[i], page->inherited[i]);
+			page->inherited[i] = NULL;
+		}
+	}
+
+	if(merge->watermark_num != 0 || stamped)
+		prepare_page(source, obj);
+
+	if(merge->watermark_num != 0)
+		stamp_page(merge, source, obj, name, overlay);
+
+	if(stamped)
+		reserve_stamp(merge, source, obj, source->map[page->num],
+				stamp_name);
+
+	/* An image cannot show more pixels than fit on the page */
+	if(merge->options->image_dpi > 0) {
+		double box[4] = { 0.0, 0.0, 612.0, 792.0 }; /* US Letter */
+		double side = 0.0;
+
+		read_box(&source->doc, get_pdf_key(obj, "MediaBox"), box);
+		side = max(box[2] - box[0], box[3] - box[1]);
+		merge->image_limit = (unsigned long int) ceil(side / 72.0
+				* merge->options->image_dpi);
+	}
+
+	remap_refs(merge, source, obj);
+
+	if(merge->watermark_num != 0)
+		add_overlay(merge, obj, name, overlay);
+
+	if(stamped)
+		add_stamp(merge, obj, stamp_name);
+
+	set_pdf_key(obj, "Parent", new_pdf_ref(merge->pages_num));
+	write_pdf_object(&merge->writer, source->map[page->num], obj);
+	ref = new_pdf_ref(source->map[page->num]);
+	append_pdf_item(merge->kids, ref);
+	free_pdf_object(obj);
+
+	/* Pages added late, like a cover page, can still go first */
+	if(front) {
+		kids = merge->kids->u.array.items;
+		memmove(&kids[merge->front + 1], &kids[merge->front],
+				(merge->kids->u.array.count - 1 - merge->front)
+				* sizeof(*kids));
+		kids[merge->front++] = ref;
+	}
+}
+
+/*
+ * Write every object of the given source that has a number in the
+ * target of the given merge but was not written yet, along with the
+ * objects those refer to in turn. The values of merge and source must
+ * not be NULL.
+ */
+static void copy_pending(struct merge_target* merge,
+		struct merge_source* source)
+{
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(source);
+
+	while(source->pending_count > 0) {
+		struct merge_pending pending = source->pending[--source->pending_count];
+
+		if(!pending.remapped)
+			remap_refs(merge, source, pending.obj);
+
+		write_pdf_object(&merge->writer, source->map[pending.num],
+				pending.obj);
+		free_pdf_object(pending.obj);
+	}
+}
+
+/*
+ * Replace each indirect reference in the given object of the given
+ * source by a reference to the same object in the target of the given
+ * merge. Objects referred to for the first time are mapped by
+ * map_object(). References to objects that are missing or dropped
+ * become null. The values of merge, source and obj must not be NULL.
+ */
+static void remap_refs(struct merge_target* merge, struct merge_source* source,
+		struct pdf_obj* obj)
+{
+	unsigned long int num = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(source);
+	RT_NOT_NULL(obj);
+
+	switch(obj->type) {
+	case kPDF_OBJ_REF:
+		num = obj->u.ref.num;
+
+		if(num >= source->doc.xref_count
+				|| (source->doc.xref[num].state != kXREF_USED
+				&& source->doc.xref[num].state != kXREF_COMPRESSED)
+				|| source->map[num] == MERGE_DROPPED) {
+			obj->type = kPDF_OBJ_NULL;
+			break;
+		}
+
+		/* A stream that refers back to itself is simply not shared */
+		if(source->map[num] == MERGE_VISITING)
+			source->map[num] = reserve_pdf_object(&merge->writer);
+		else if(source->map[num] == 0)
+			map_object(merge, source, num);
+
+		obj->u.ref.num = source->map[num];
+		obj->u.ref.gen = 0;
+		break;
+	case kPDF_OBJ_ARRAY:
+		for(i = 0; i < obj->u.array.count; ++i)
+			remap_refs(merge, source, obj->u.array.items[i]);
+
+		break;
+	case kPDF_OBJ_DICT:
+		for(i = 0; i < obj->u.dict.count; ++i)
+			remap_refs(merge, source, obj->u.dict.pairs[i].value);
+
+		break;
+	case kPDF_OBJ_STREAM:
+		remap_refs(merge, source, obj->u.stream.dict);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Give the object with the given number in the given source a number
+ * in the target of the given merge and queue it for copy_pending(). A
+ * stream has its references remapped first; if the target already has
+ * a stream with the same dictionary and data, that stream is used
+ * instead and nothing is queued. The values of merge and source must
+ * not be NULL.
+ */
+static void map_object(struct merge_target* merge,
+		struct merge_source* source, unsigned long int num)
+{
+	struct pdf_obj* obj = NULL;
+	int found = 0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(source);
+
+	obj = load_pdf_object(&source->doc, num);
+
+	if(obj->type != kPDF_OBJ_STREAM) {
+		source->map[num] = reserve_pdf_object(&merge->writer);
+		push_pending(source, num, obj, 0);
+		return;
+	}
+
+	/* Streams it refers to are shared first, so copies compare equal */
+	source->map[num] = MERGE_VISITING;
+	remap_refs(merge, source, obj);
+
+	if(source->map[num] == MERGE_VISITING) {
+		source->map[num] = share_stream(merge, obj, &found);
+
+		if(found) {
+			++merge->shared;
+			free_pdf_object(obj);
+			return;
+		}
+
+		/* Only new streams are resampled, so copies are done once */
+		if(merge->options->image_dpi > 0 && can_resample_image(obj)) {
+			queue_image(merge, source->map[num], obj);
+			return;
+		}
+	}
+
+	push_pending(source, num, obj, 1);
+}
+
+/*
+ * Queue the given object, which has the given number in the given
+ * source, for copy_pending(). The queue owns the object. If remapped
+ * is nonzero, its references are already remapped. The values of
+ * source and obj must not be NULL.
+ */
+static void push_pending(struct merge_source* source, unsigned long int num,
+		struct pdf_obj* obj, int remapped)
+{
+	struct merge_pending* pending = NULL;
+
+	RT_NOT_NULL(source);
+	RT_NOT_NULL(obj);
+
+	if(source->pending_count == source->pending_capacity) {
+		source->pending_capacity = source->pending_capacity * 2 + 64;
+		source->pending = (struct merge_pending*) require_realloc(
+				source->pending, source->pending_capacity,
+				sizeof(*source->pending));
+	}
+
+	pending = &source->pending[source->pending_count++];
+	pending->num = num;
+	pending->obj = obj;
+	pending->remapped = remapped;
+}
+
+/*
+ * Return the number of the stream in the target of the given merge
+ * that has the same dictionary and data as the given stream, whose
+ * references are remapped, and set the value pointed to by found to
+ * nonzero. If there is none, the stream gets a new number, which is
+ * recorded for the streams that follow and returned, and the value
+ * pointed to by found is set to zero. The values of merge, stream and
+ * found must not be NULL.
+ */
+static unsigned long int share_stream(struct merge_target* merge,
+		const struct pdf_obj* stream, int* found)
+{
+	BCRYPT_HASH_HANDLE hash = NULL;
+	unsigned char digest[MERGE_DIGEST_LEN];
+	size_t slot = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(stream);
+	RT_NOT_NULL(found);
+
+	*found = 0;
+
+	if(!BCRYPT_SUCCESS(BCryptCreateHash(merge->sha256, &hash, NULL, 0, NULL,
+			0, 0)))
+		errorout(E_MALLOC, _T("Failed to create a SHA-256 hash"));
+
+	hash_object(hash, stream);
+
+	if(!BCRYPT_SUCCESS(BCryptFinishHash(hash, digest, sizeof(digest), 0)))
+		errorout(E_MALLOC, _T("Failed to finish a SHA-256 hash"));
+
+	BCryptDestroyHash(hash);
+
+	/* The table is kept at most half full */
+	if(2 * (merge->stream_count + 1) > merge->stream_capacity) {
+		struct merge_stream* old = merge->streams;
+		size_t old_capacity = merge->stream_capacity;
+
+		merge->stream_capacity = old_capacity > 0 ? old_capacity * 2 : 256;
+		merge->streams = (struct merge_stream*) require_cmem(
+				merge->stream_capacity, sizeof(*merge->streams));
+
+		for(i = 0; i < old_capacity; ++i) {
+			if(old[i].num == 0)
+				continue;
+
+			slot = first_slot(old[i].digest, merge->stream_capacity);
+
+			while(merge->streams[slot].num != 0)
+				slot = (slot + 1) & (merge->stream_capacity - 1);
+
+			merge->streams[slot] = old[i];
+		}
+
+		free(old);
+	}
+
+	slot = first_slot(digest, merge->stream_capacity);
+
+	for(; merge->streams[slot].num != 0;
+			slot = (slot + 1) & (merge->stream_capacity - 1))
+		if(memcmp(merge->streams[slot].digest, digest, sizeof(digest)) == 0) {
+			*found = 1;
+			return merge->streams[slot].num;
+		}
+
+	memcpy(merge->streams[slot].digest, digest, sizeof(digest));
+	merge->streams[slot].num = reserve_pdf_object(&merge->writer);
+	++merge->stream_count;
+
+	return merge->streams[slot].num;
+}
+
+/*
+ * Hold the given image, which is to be written as the given object
+ * number of the target of the given merge, until flush_images() runs.
+ * The merge takes the image and copies its data, so the source may be
+ * closed first. The values of merge and image must not be NULL.
+ */
+static void queue_image(struct merge_target* merge, unsigned long int num,
+		struct pdf_obj* image)
+{
+	struct merge_image* job = NULL;
+	unsigned char* data = NULL;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(image);
+
+	if(!image->u.stream.owned) {
+		data = (unsigned char*) require_mem(image->u.stream.len + 1);
+		memcpy(data, image->u.stream.data, image->u.stream.len);
+		image->u.stream.data = data;
+		image->u.stream.owned = 1;
+	}
+
+	if(merge->image_count == merge->image_capacity) {
+		merge->image_capacity = merge->image_capacity * 2 + 16;
+		merge->images = (struct merge_image*) require_realloc(merge->images,
+				merge->image_capacity, sizeof(*merge->images));
+	}
+
+	job = &merge->images[merge->image_count++];
+	job->num = num;
+	job->image = image;
+	job->result = NULL;
+	job->max_side = merge->image_limit;
+	job->quality = merge->options->jpeg_quality;
+	merge->image_bytes += image->u.stream.len;
+
+	if(merge->image_bytes >= MERGE_IMAGE_BATCH)
+		flush_images(merge);
+}
+
+/*
+ * Resample the images held by the given merge, one task per image, and
+ * write each of them, or the original where resampling did not help,
+ * to its target. The value of merge must not be NULL.
+ */
+static void flush_images(struct merge_target* merge)
+{
+	struct task_graph graph;
+	size_t i = 0;
+
+	RT_NOT_NULL(merge);
+
+	if(merge->image_count == 0)
+		return;
+
+	init_task_graph(&graph);
+
+	for(i = 0; i < merge->image_count; ++i)
+		add_task(&graph, _T("resample image"), resample_task,
+				&merge->images[i]);
+
+	run_task_graph(&graph);
+	destroy_task_graph(&graph);
+
+	for(i = 0; i < merge->image_count; ++i) {
+		struct merge_image* job = &merge->images[i];
+
+		if(job->result != NULL) {
+			write_pdf_object(&merge->writer, job->num, job->result);
+			free_pdf_object(job->result);
+			++merge->resampled;
+		} else {
+			write_pdf_object(&merge->writer, job->num, job->image);
+		}
+
+		free_pdf_object(job->image);
+		job->image = NULL;
+		job->result = NULL;
+	}
+
+	merge->image_count = 0;
+	merge->image_bytes = 0;
+}
+
+/*
+ * Resample the image described by the merge_image structure pointed to
+ * by arg. The value of arg must not be NULL.
+ */
+static void resample_task(void* arg)
+{
+	struct merge_image* job = (struct merge_image*) arg;
+
+	RT_NOT_NULL(job);
+
+	job->result = resample_image(job->image, job->max_side, job->quality);
+}
+
+/*
+ * Return the slot where the stream with the given digest is looked up
+ * first in a hash table of the given capacity, which must be a power
+ * of 2. The value of digest must not be NULL.
+ */
+static size_t first_slot(const unsigned char* digest, size_t capacity)
+{
+	RT_NOT_NULL(digest);
+
+	/* The bytes of a digest are already uniformly distributed */
+	return ((size_t) digest[0] | (size_t) digest[1] << 8
+			| (size_t) digest[2] << 16 | (size_t) digest[3] << 24)
+			& (capacity - 1);
+}
+
+/*
+ * Add the given object to the given hash. Each object is hashed with
+ * its type and size, so different objects never hash the same bytes.
+ * The /Length of a stream is left out, since its data is hashed. The
+ * value of obj must not be NULL.
+ */
+static void hash_object(BCRYPT_HASH_HANDLE hash, const struct pdf_obj* obj)
+{
+	unsigned long int size = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(obj);
+
+	hash_bytes(hash, &obj->type, sizeof(obj->type));
+
+	switch(obj->type) {
+	case kPDF_OBJ_BOOL:
+		hash_bytes(hash, &obj->u.boolean, sizeof(obj->u.boolean));
+		break;
+	case kPDF_OBJ_INT:
+		hash_bytes(hash, &obj->u.integer, sizeof(obj->u.integer));
+		break;
+	case kPDF_OBJ_REAL:
+	case kPDF_OBJ_NAME:
+		hash_bytes(hash, obj->u.text, strlen(obj->u.text) + 1);
+		break;
+	case kPDF_OBJ_STRING:
+		size = (unsigned long int) obj->u.string.len;
+		hash_bytes(hash, &size, sizeof(size));
+		hash_bytes(hash, obj->u.string.data, obj->u.string.len);
+		break;
+	case kPDF_OBJ_ARRAY:
+		size = (unsigned long int) obj->u.array.count;
+		hash_bytes(hash, &size, sizeof(size));
+
+		for(i = 0; i < obj->u.array.count; ++i)
+			hash_object(hash, obj->u.array.items[i]);
+
+		break;
+	case kPDF_OBJ_DICT:
+		size = (unsigned long int) obj->u.dict.count;
+		hash_bytes(hash, &size, sizeof(size));
+
+		for(i = 0; i < obj->u.dict.count; ++i) {
+			const struct pdf_pair* pair = &obj->u.dict.pairs[i];
+
+			if(strcmp(pair->key, "Length") == 0)
+				continue;
+
+			hash_bytes(hash, pair->key, strlen(pair->key) + 1);
+			hash_object(hash, pair->value);
+		}
+
+		break;
+	case kPDF_OBJ_REF:
+		hash_bytes(hash, &obj->u.ref.num, sizeof(obj->u.ref.num));
+		break;
+	case kPDF_OBJ_STREAM:
+		hash_object(hash, obj->u.stream.dict);
+		size = (unsigned long int) obj->u.stream.len;
+		hash_bytes(hash, &size, sizeof(size));
+		hash_bytes(hash, obj->u.stream.data, obj->u.stream.len);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Add the len bytes pointed to by bytes to the given hash. The value of
+ * bytes must not be NULL.
+ */
+static void hash_bytes(BCRYPT_HASH_HANDLE hash, const void* bytes, size_t len)
+{
+	RT_NOT_NULL(bytes);
+
+	/* BCryptHashData() takes at most ULONG_MAX bytes at a time */
+	while(len > 0) {
+		ULONG part = len > ULONG_MAX ? ULONG_MAX : (ULONG) len;
+
+		if(!BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR) bytes, part, 0)))
+			errorout(E_MALLOC, _T("Failed to compute a SHA-256 hash"));
+
+		bytes = (const unsigned char*) bytes + part;
+		len -= part;
+	}
+}
+
+/*
+ * Prepare the given page of the given source for add_overlay() and
+ * add_stamp(), before its references are remapped: make its resources
+ * and their XObject dictionary direct, so only this page sees what is
+ * added to them, and make its contents an array. The values of source
+ * and page must not be NULL.
+ */
+static void prepare_page(struct merge_source* source, struct pdf_obj* page)
+{
+	struct pdf_obj* resources = NULL;
+	struct pdf_obj* xobjects = NULL;
+	struct pdf_obj* contents = NULL;
+
+	RT_NOT_NULL(source);
+	RT_NOT_NULL(page);
+
+	resources = load_pdf_value(&source->doc, get_pdf_key(page, "Resources"));
+
+	if(resources == NULL || resources->type != kPDF_OBJ_DICT) {
+		if(resources != NULL)
+			free_pdf_object(resources);
+
+		resources = new_pdf_object(kPDF_OBJ_DICT);
+	}
+
+	xobjects = load_pdf_value(&source->doc, get_pdf_key(resources, "XObject"));
+
+	if(xobjects == NULL || xobjects->type != kPDF_OBJ_DICT) {
+		if(xobjects != NULL)
+			free_pdf_object(xobjects);
+
+		xobjects = new_pdf_object(kPDF_OBJ_DICT);
+	}
+
+	set_pdf_key(resources, "XObject", xobjects);
+	set_pdf_key(page, "Resources", resources);
+
+	contents = load_pdf_value(&source->doc, get_pdf_key(page, "Contents"));
+
+	if(contents != NULL && contents->type != kPDF_OBJ_ARRAY) {
+		free_pdf_object(contents);
+		contents = new_pdf_object(kPDF_OBJ_ARRAY);
+		append_pdf_item(contents, clone_pdf_object(get_pdf_key(page,
+				"Contents")));
+	} else if(contents == NULL) {
+		contents = new_pdf_object(kPDF_OBJ_ARRAY);
+	}
+
+	set_pdf_key(page, "Contents", contents);
+}
+
+/*
+ * Pick a name starting with the given base that the XObject dictionary
+ * of the given page, prepared by prepare_page(), does not use yet, and
+ * store it in the buffer pointed to by name, which must hold
+ * MERGE_NAME_LEN characters. The name is kept by a placeholder until
+ * the reference can be set. The values of page, base and name must not
+ * be NULL.
+ */
+static void name_xobject(struct pdf_obj* page, const char* base, char* name)
+{
+	struct pdf_obj* xobjects = NULL;
+	unsigned int i = 0;
+
+	RT_NOT_NULL(page);
+	RT_NOT_NULL(base);
+	RT_NOT_NULL(name);
+
+	xobjects = get_pdf_key(get_pdf_key(page, "Resources"), "XObject");
+	strcpy(name, base);
+
+	while(get_pdf_key(xobjects, name) != NULL)
+		sprintf(name, "%s%u", base, ++i);
+
+	set_pdf_key(xobjects, name, new_pdf_object(kPDF_OBJ_NULL));
+}
+
+/*
+ * Pick a name for the watermark of the given merge in the given page
+ * of the given source, prepared by prepare_page(), and store it in the
+ * buffer pointed to by name, which must hold MERGE_NAME_LEN
+ * characters. The operators that draw the watermark, mapping its
+ * bounding box onto the media box of the page, are stored in the
+ * buffer pointed to by overlay, which must hold MERGE_OVERLAY_LEN
+ * characters. The values of merge, source, page, name and overlay must
+ * not be NULL.
+ */
+static void stamp_page(struct merge_target* merge, struct merge_source* source,
+		struct pdf_obj* page, char* name, char* overlay)
+{
+	const double* wm = NULL; /* bounding box of the watermark */
+	double box[4] = { 0.0, 0.0, 612.0, 792.0 }; /* US Letter by default */
+	double scale = 0.0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(source);
+	RT_NOT_NULL(page);
+	RT_NOT_NULL(name);
+	RT_NOT_NULL(overlay);
+
+	name_xobject(page, "Watermark", name);
+	wm = merge->watermark_box;
+	read_box(&source->doc, get_pdf_key(page, "MediaBox"), box);
+
+	if(wm[2] - wm[0] > 0 && wm[3] - wm[1] > 0) {
+		scale = (box[2] - box[0]) / (wm[2] - wm[0]);
+
+		if((box[3] - box[1]) / (wm[3] - wm[1]) < scale)
+			scale = (box[3] - box[1]) / (wm[3] - wm[1]);
+	}
+
+	/* Scale to fit, centered, and restore the state for the page */
+	sprintf(overlay, "q %.4f 0 0 %.4f %.4f %.4f cm /%s Do Q\n", scale, scale,
+			box[0] + ((box[2] - box[0]) - (wm[2] - wm[0]) * scale) / 2
+			- wm[0] * scale,
+			box[1] + ((box[3] - box[1]) - (wm[3] - wm[1]) * scale) / 2
+			- wm[1] * scale, name);
+}
+
+/*
+ * Lay the watermark of the given merge under the given page, which was
+ * prepared by stamp_page() with the given name for the watermark and
+ * the given operators drawing it, and has its references remapped. The
+ * content stream with the operators is shared by consecutive pages
+ * drawing the watermark the same way. The values of merge, page, name
+ * and overlay must not be NULL.
+ */
+static void add_overlay(struct merge_target* merge, struct pdf_obj* page,
+		const char* name, const char* overlay)
+{
+	struct pdf_obj* contents = NULL;
+	struct pdf_obj* old = NULL;
+	size_t i = 0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(page);
+	RT_NOT_NULL(name);
+	RT_NOT_NULL(overlay);
+
+	if(merge->overlay_num == 0 || strcmp(overlay, merge->overlay) != 0) {
+		struct pdf_obj* stream = new_pdf_object(kPDF_OBJ_STREAM);
+
+		stream->u.stream.dict = new_pdf_object(kPDF_OBJ_DICT);
+		stream->u.stream.data = (const unsigned char*) overlay;
+		stream->u.stream.len = strlen(overlay);
+		merge->overlay_num = reserve_pdf_object(&merge->writer);
+		write_pdf_object(&merge->writer, merge->overlay_num, stream);
+		free_pdf_object(stream);
+		strcpy(merge->overlay, overlay);
+	}
+
+	set_pdf_key(get_pdf_key(get_pdf_key(page, "Resources"), "XObject"), name,
+			new_pdf_ref(merge->watermark_num));
+
+	/* The overlay is drawn first, so the page is drawn over it */
+	old = get_pdf_key(page, "Contents");
+	contents = new_pdf_object(kPDF_OBJ_ARRAY);
+	append_pdf_item(contents, new_pdf_ref(merge->overlay_num));
+
+	for(i = 0; i < old->u.array.count; ++i)
+		append_pdf_item(contents, clone_pdf_object(old->u.array.items[i]));
+
+	set_pdf_key(page, "Contents", contents);
+}
+
+/*
+ * Pick a name for the stamp of the given merge in the given page of
+ * the given source, prepared by prepare_page(), and store it in the
+ * buffer pointed to by name, which must hold MERGE_NAME_LEN characters.
+ * The page, which has the given object number in the target, gets a
+ * Form XObject drawing its header and footer, which write_stamps()
+ * writes once every page is numbered. The values of merge, source,
+ * page and name must not be NULL.
+ */
+static void reserve_stamp(struct merge_target* merge,
+		struct merge_source* source, struct pdf_obj* page,
+		unsigned long int num, char* name)
+{
+	struct merge_stamped* stamped = NULL;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(source);
+	RT_NOT_NULL(page);
+	RT_NOT_NULL(name);
+
+	name_xobject(page, "Stamp", name);
+
+	if(merge->stamped_count == merge->stamped_capacity) {
+		merge->stamped_capacity = merge->stamped_capacity * 2 + 64;
+		merge->stamped = (struct merge_stamped*) require_realloc(
+				merge->stamped, merge->stamped_capacity,
+				sizeof(*merge->stamped));
+	}
+
+	stamped = &merge->stamped[merge->stamped_count++];
+	stamped->page_num = num;
+	stamped->form_num = reserve_pdf_object(&merge->writer);
+
+	/* US Letter by default */
+	stamped->box[0] = 0.0;
+	stamped->box[1] = 0.0;
+	stamped->box[2] = 612.0;
+	stamped->box[3] = 792.0;
+	read_box(&source->doc, get_pdf_key(page, "MediaBox"), stamped->box);
+}
+
+/*
+ * Draw the stamp reserved last by reserve_stamp() over the given page,
+ * which has the given name for it and has its references remapped. The
+ * contents of the page are drawn in a graphics state of their own, so
+ * nothing they leave behind moves the stamp. The content streams doing
+ * that are shared by pages using the same name. The values of merge,
+ * page and name must not be NULL.
+ */
+static void add_stamp(struct merge_target* merge, struct pdf_obj* page,
+		const char* name)
+{
+	struct pdf_obj* stream = NULL;
+	struct pdf_obj* contents = NULL;
+	struct pdf_obj* old = NULL;
+	char restore[MERGE_OVERLAY_LEN] = "";
+	size_t i = 0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(page);
+	RT_NOT_NULL(name);
+
+	if(merge->save_num == 0) {
+		stream = new_pdf_object(kPDF_OBJ_STREAM);
+		stream->u.stream.dict = new_pdf_object(kPDF_OBJ_DICT);
+		stream->u.stream.data = (const unsigned char*) "q\n";
+		stream->u.stream.len = 2;
+		merge->save_num = reserve_pdf_object(&merge->writer);
+		write_pdf_object(&merge->writer, merge->save_num, stream);
+		free_pdf_object(stream);
+	}
+
+	sprintf(restore, "Q /%s Do\n", name);
+
+	if(merge->restore_num == 0 || strcmp(restore, merge->restore) != 0) {
+		stream = new_pdf_object(kPDF_OBJ_STREAM);
+		stream->u.stream.dict = new_pdf_object(kPDF_OBJ_DICT);
+		stream->u.stream.data = (const unsigned char*) restore;
+		stream->u.stream.len = strlen(restore);
+		merge->restore_num = reserve_pdf_object(&merge->writer);
+		write_pdf_object(&merge->writer, merge->restore_num, stream);
+		free_pdf_object(stream);
+		strcpy(merge->restore, restore);
+	}
+
+	set_pdf_key(get_pdf_key(get_pdf_key(page, "Resources"), "XObject"), name,
+			new_pdf_ref(merge->stamped[merge->stamped_count - 1].form_num));
+
+	old = get_pdf_key(page, "Contents");
+	contents = new_pdf_object(kPDF_OBJ_ARRAY);
+	append_pdf_item(contents, new_pdf_ref(merge->save_num));
+
+	for(i = 0; i < old->u.array.count; ++i)
+		append_pdf_item(contents, clone_pdf_object(old->u.array.items[i]));
+
+	append_pdf_item(contents, new_pdf_ref(merge->restore_num));
+	set_pdf_key(page, "Contents", contents);
+}
+
+/*
+ * Write the stamp of each page of the given merge, now that the pages
+ * are in their final order. Pages added in front have none and are
+ * left out of the page numbers. The first page after them gets the
+ * first parts if the stamp has them. The value of merge must not be
+ * NULL.
+ */
+static void write_stamps(struct merge_target* merge)
+{
+	struct pdf_obj** kids = NULL; /* pages of the target */
+	size_t count = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(merge);
+
+	kids = merge->kids->u.array.items;
+	count = merge->kids->u.array.count;
+
+	for(i = 0; i < count; ++i) {
+		struct merge_stamped key;
+		const struct merge_stamped* stamped = NULL;
+		int first = i == merge->front && merge->options->stamp->first;
+
+		/* Pages are numbered as they are copied, so stamped is sorted */
+		key.page_num = kids[i]->u.ref.num;
+		stamped = (const struct merge_stamped*) bsearch(&key, merge->stamped,
+				merge->stamped_count, sizeof(*merge->stamped),
+				compare_stamped);
+
+		if(stamped == NULL)
+			continue;
+
+		write_stamp(merge, stamped, first ? kSTAMP_FIRST_HEADER :
+				kSTAMP_HEADER, first ? kSTAMP_FIRST_FOOTER : kSTAMP_FOOTER,
+				i - merge->front + 1, count - merge->front);
+	}
+}
+
+/*
+ * Compare the page numbers of the merge_stamped structures pointed to
+ * by a and b for bsearch(). The values of a and b must not be NULL.
+ */
+static int compare_stamped(const void* a, const void* b)
+{
+	const struct merge_stamped* x = (const struct merge_stamped*) a;
+	const struct merge_stamped* y = (const struct merge_stamped*) b;
+
+	RT_NOT_NULL(x);
+	RT_NOT_NULL(y);
+
+	if(x->page_num < y->page_num)
+		return -1;
+
+	return x->page_num > y->page_num;
+}
+
+/*
+ * Write the Form XObject of the page stamped as the structure pointed
+ * to by stamped describes to the target of the given merge. It draws
+ * the given header and footer parts and, if page is not zero, the text
+ * of the stamp with that page number out of total. The values of merge
+ * and stamped must not be NULL.
+ */
+static void write_stamp(struct merge_target* merge,
+		const struct merge_stamped* stamped, enum merge_stamp_part header,
+		enum merge_stamp_part footer, unsigned long int page,
+		unsigned long int total)
+{
+	const struct merge_stamp* stamp = NULL;
+	const double* box = NULL; /* media box of the page */
+	struct pdf_buffer content;
+	struct pdf_obj* form = NULL;
+	struct pdf_obj* bbox = NULL;
+	struct pdf_obj* resources = NULL;
+	struct pdf_obj* xobjects = NULL;
+	struct pdf_obj* fonts = NULL;
+	double header_bottom = 0.0; /* bottom of the header */
+	double footer_top = 0.0; /* top of the footer */
+	char buf[64] = "";
+	int i = 0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(stamped);
+
+	stamp = merge->options->stamp;
+	box = stamped->box;
+	header_bottom = box[3] - stamp->top + stamp->header_spacing;
+	footer_top = box[1] + stamp->bottom - stamp->footer_spacing;
+	memset(&content, 0, sizeof(content));
+	xobjects = new_pdf_object(kPDF_OBJ_DICT);
+
+	if(merge->part_nums[header] != 0) {
+		draw_stamp_part(&content, box, merge->part_boxes[header],
+				header_bottom, box[3], "Header");
+		set_pdf_key(xobjects, "Header", new_pdf_ref(merge->part_nums[header]));
+	}
+
+	if(merge->part_nums[footer] != 0) {
+		draw_stamp_part(&content, box, merge->part_boxes[footer], box[1],
+				footer_top, "Footer");
+		set_pdf_key(xobjects, "Footer", new_pdf_ref(merge->part_nums[footer]));
+	}
+
+	if(page > 0 && merge->font_num != 0) {
+		sprintf(buf, "BT\n/F1 %.2f Tf\n", stamp->font_size);
+		append_pdf_buffer(&content, buf, strlen(buf));
+
+		for(i = 0; i < 3; ++i) {
+			show_stamp_text(merge, &content, merge->header_text[i], i,
+					(header_bottom + box[3]) / 2, box, page, total);
+			show_stamp_text(merge, &content, merge->footer_text[i], i,
+					(box[1] + footer_top) / 2, box, page, total);
+		}
+
+		append_pdf_buffer(&content, "ET\n", 3);
+	}
+
+	/* The box only clips, so it may as well be a little larger */
+	bbox = new_pdf_object(kPDF_OBJ_ARRAY);
+	append_pdf_item(bbox, new_pdf_int((long int) floor(box[0])));
+	append_pdf_item(bbox, new_pdf_int((long int) floor(box[1])));
+	append_pdf_item(bbox, new_pdf_int((long int) ceil(box[2])));
+	append_pdf_item(bbox, new_pdf_int((long int) ceil(box[3])));
+	resources = new_pdf_object(kPDF_OBJ_DICT);
+	set_pdf_key(resources, "XObject", xobjects);
+
+	if(merge->font_num != 0) {
+		fonts = new_pdf_object(kPDF_OBJ_DICT);
+		set_pdf_key(fonts, "F1", new_pdf_ref(merge->font_num));
+		set_pdf_key(resources, "Font", fonts);
+	}
+
+	form = new_pdf_object(kPDF_OBJ_STREAM);
+	form->u.stream.dict = new_pdf_object(kPDF_OBJ_DICT);
+	form->u.stream.data = content.data != NULL ? content.data :
+			(const unsigned char*) "";
+	form->u.stream.len = content.len;
+	set_pdf_key(form, "Type", new_pdf_name("XObject"));
+	set_pdf_key(form, "Subtype", new_pdf_name("Form"));
+	set_pdf_key(form, "BBox", bbox);
+	set_pdf_key(form, "Resources", resources);
+	write_pdf_object(&merge->writer, stamped->form_num, form);
+	free_pdf_object(form);
+	free(content.data);
+}
+
+/*
+ * Append the operators drawing the part with the given name and
+ * bounding box to the given content of a page with the given media
+ * box. The part is scaled to the width of the page, its top is put at
+ * the given top and it is clipped to the band between bottom and top.
+ * A band without height draws nothing. The values of content, box,
+ * part and name must not be NULL.
+ */
+static void draw_stamp_part(struct pdf_buffer* content, const double* box,
+		const double* part, double bottom, double top, const char* name)
+{
+	char buf[MERGE_OVERLAY_LEN] = "";
+	double scale = 1.0;
+
+	RT_NOT_NULL(content);
+	RT_NOT_NULL(box);
+	RT_NOT_NULL(part);
+	RT_NOT_NULL(name);
+
+	if(top <= bottom)
+		return;
+
+	if(part[2] - part[0] > 0)
+		scale = (box[2] - box[0]) / (part[2] - part[0]);
+
+	sprintf(buf, "q %.2f %.2f %.2f %.2f re W n %.4f 0 0 %.4f %.4f %.4f cm "
+			"/%s Do Q\n", box[0], bottom, box[2] - box[0], top - bottom,
+			scale, scale, box[0] - part[0] * scale, top - part[3] * scale,
+			name);
+	append_pdf_buffer(content, buf, strlen(buf));
+}
+
+/*
+ * Append the operators showing the given text of the stamp of the
+ * given merge, encoded and with its page numbers not yet replaced, to
+ * the given content of a page with the given media box, inside a text
+ * object. The text is aligned on the left margin if align is 0, in the
+ * middle of the page if it is 1 and on the right margin if it is 2,
+ * and centered on the given y. "[page]" is replaced by the given page
+ * number and "[topage]" by total. If text is NULL, nothing is shown.
+ * The values of merge, content and box must not be NULL.
+ */
+static void show_stamp_text(struct merge_target* merge,
+		struct pdf_buffer* content, const char* text, int align, double y,
+		const double* box, unsigned long int page, unsigned long int total)
+{
+	const struct merge_stamp* stamp = NULL;
+	struct pdf_buffer line; /* the text with its page numbers */
+	char buf[64] = "";
+	double width = 0.0;
+	double x = 0.0;
+
+	RT_NOT_NULL(merge);
+	RT_NOT_NULL(content);
+	RT_NOT_NULL(box);
+
+	if(text == NULL)
+		return;
+
+	stamp = merge->options->stamp;
+	memset(&line, 0, sizeof(line));
+	expand_stamp_text(&line, text, page, total);
+
+	if(line.len == 0)
+		return;
+
+	width = measure_pdf_text(&merge->font, (const char*) line.data, line.len,
+			stamp->font_size);
+
+	if(align == 0)
+		x = box[0] + stamp->left;
+	else if(align == 1)
+		x = (box[0] + box[2] - width) / 2;
+	else
+		x = box[2] - stamp->right - width;
+
+	/* Capital letters are what look centered */
+	sprintf(buf, "1 0 0 1 %.2f %.2f Tm ", x, y - merge->font.cap_height
+			* stamp->font_size / 2000);
+	append_pdf_buffer(content, buf, strlen(buf));
+	append_pdf_text(content, (const char*) line.data, line.len);
+	free(line.data);
+}
+
+/*
+ * Append the given text to the given buffer with "[page]" replaced by
+ * the given page number and "[topage]" by total, like the PDF getter
+ * does for text headers. The values of buffer and text must not be
+ * NULL.
+ */
+static void expand_stamp_text(struct pdf_buffer* buffer, const char* text,
+		unsigned long int page, unsigned long int total)
+{
+	char number[32] = "";
+
+	RT_NOT_NULL(buffer);
+	RT_NOT_NULL(text);
+
+	while(*text != '\0') {
+		if(strncmp(text, "[page]", 6) == 0) {
+			sprintf(number, "%lu", page);
+			append_pdf_buffer(buffer, number, strlen(number));
+			text += 6;
+		} else if(strncmp(text, "[topage]", 8) == 0) {
+			sprintf(number, "%lu", total);
+			append_pdf_buffer(buffer, number, strlen(number));
+			text += 8;
+		} else {
+			append_pdf_buffer(buffer, text++, 1);
+		}
+	}
+}
+
+/*
+ * Read the given rectangle of the PDF of the structure pointed to by
+ * doc into the array of four numbers pointed to by box, lower left
+ * corner first, and return nonzero if it is valid. The rectangle may
+ * be NULL. The values of doc and box must not be NULL; box is not
+ * changed if the rectangle is not valid.
+ */
+static int read_box(struct pdf_doc* doc, const struct pdf_obj* rect,
+		double* box)
+{
+	struct pdf_obj* array = NULL;
+	double values[4];
+	int valid = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(doc);
+	RT_NOT_NULL(box);
+
+	array = load_pdf_value(doc, rect);
+
+	if(array == NULL)
+		return 0;
+
+	if(array->type == kPDF_OBJ_ARRAY && array->u.array.count == 4) {
+		valid = 1;
+
+		for(i = 0; i < 4 && valid; ++i) {
+			struct pdf_obj* value = load_pdf_value(doc,
+					array->u.array.items[i]);
+
+			if(value->type == kPDF_OBJ_INT)
+				values[i] = (double) value->u.integer;
+			else if(value->type == kPDF_OBJ_REAL)
+				values[i] = strtod(value->u.text, NULL);
+			else
+				valid = 0;
+
+			free_pdf_object(value);
+		}
+	}
+
+	free_pdf_object(array);
+
+	if(!valid)
+		return 0;
+
+	/* Any two opposite corners may be given */
+	box[0] = min(values[0], values[2]);
+	box[1] = min(values[1], values[3]);
+	box[2] = max(values[0], values[2]);
+	box[3] = max(values[1], values[3]);
+
+	return 1;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "stdafx.h"
+#include "parse.h"
+
+/* PDFs of the header and footer drawn on pages by a merge */
+enum merge_stamp_part {
+	kSTAMP_HEADER, /* header of every page */
+	kSTAMP_FOOTER, /* footer of every page */
+	kSTAMP_FIRST_HEADER, /* header of the first page, if it has its own */
+	kSTAMP_FIRST_FOOTER, /* footer of the first page, if it has its own */
+	kSTAMP_PARTS /* number of parts */
+};
+
+/* Header and footer drawn in the margins of every page by a merge */
+struct merge_stamp {
+	TCHAR parts[kSTAMP_PARTS][MAX_PATH + 1]; /* PDF of each part, or empty */
+	int first; /* nonzero if the first page has its own parts */
+	LPCTSTR header_text[3]; /* left, center and right text, or NULL */
+	LPCTSTR footer_text[3]; /* left, center and right text, or NULL */
+	LPCTSTR font_family; /* CSS font family of the text, or NULL */
+	double font_size; /* font size of the text in points */
+	double top; /* top margin in points, which holds the header */
+	double bottom; /* bottom margin in points, which holds the footer */
+	double left; /* left margin in points */
+	double right; /* right margin in points */
+	double header_spacing; /* points between the header and the page */
+	double footer_spacing; /* points between the footer and the page */
+};
+
+/* How a merge writes its target */
+struct merge_options {
+	LPCTSTR watermark; /* PDF laid under every page, or NULL */
+	const struct merge_stamp* stamp; /* header and footer drawn, or NULL */
+	unsigned long int fanout; /* PDFs per merge in a merge tree */
+	int compress_level; /* zlib level for streams without a filter, or 0 */
+	int object_streams; /* nonzero to pack objects into object streams */
+	unsigned long int image_dpi; /* resolution images are cut to, or 0 */
+	int jpeg_quality; /* quality of JPEG images resampled, from 1 to 100 */
+};
+
+/* A merge in progress, and one into the target of a conversion */
+struct merge_target;
+struct merge_job;
+
+void merge_pdfs(LPCTSTR, const LPCTSTR*, size_t,
+		const struct merge_options*);
+void merge_pdf_tree(LPCTSTR, const LPCTSTR*, size_t,
+		const struct merge_options*);
+struct merge_target* open_merge(LPCTSTR, const struct merge_options*);
+void add_merge_source(struct merge_target*, LPCTSTR, int);
+void close_merge(struct merge_target*);
+void abort_merge(struct merge_target*);
+void do_merge_pdfs(LPCTSTR, LPCTSTR, LPCTSTR, size_t, UINT*, UINT,
+		const UINT*, const struct pdf_info*);
+struct merge_job* begin_merge_pdfs(UINT, const UINT*, const struct pdf_info*);
+void merge_segment(struct merge_job*, UINT*);
+void end_merge_pdfs(struct merge_job*, LPCTSTR, LPCTSTR);
+void abort_merge_pdfs(struct merge_job*);
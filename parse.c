@@ -60,10 +60,42 @@ void init_pdf_info(struct pdf_info* info)
 	info->base_url = NULL;
 	info->footer_url = NULL;
 	info->header_url = NULL;
+	info->header_left = NULL;
+	info->header_center = NULL;
+	info->header_right = NULL;
+	info->footer_left = NULL;
+	info->footer_center = NULL;
+	info->footer_right = NULL;
 	info->target_path = NULL;
 	info->font_family = NULL;
 	info->font_size = NULL;
+	info->cost_store_path = NULL;
+	info->renderer = NULL;
+	info->render_cache_path = NULL;
+	info->proxy_blocklist = NULL;
 	info->segments = ULONG_MAX;
+	info->parallel_renders = 1;
+	info->render_memory = 0;
+	info->segment_timeout = 0;
+	info->job_timeout = 0;
+	info->render_retries = 2;
+	info->hedge_percent = 0;
+	info->hedge_percentile = 90;
+	info->batch_segments = 1;
+	info->merge_fanout = 16;
+	info->incremental_merge = 0;
+	info->compress_level = 6;
+	info->object_streams = 1;
+	info->image_dpi = 0;
+	info->jpeg_quality = 80;
+	info->linearize = 0;
+	info->native_toc = 1;
+	info->stamp_headers = 0;
+	info->render_cache_size = 1024;
+	info->revalidate_cache = 1;
+	info->subresource_proxy = 0;
+	info->proxy_cache_size = 64;
+	info->prefetch_segments = 0;
 }
 
 /*
@@ -115,6 +147,89 @@ void get_pdf_info(struct pdf_info* pi, FILE* fd)
 
 			if(_tcscmp(_T("iSegments"), var) == 0) {
 				pi->segments = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iParallelRenders"), var) == 0) {
+				/* The Library renderer runs one at a time regardless */
+				pi->parallel_renders = require_strtoul(val, NULL, 10);
+
+				if(pi->parallel_renders == 0)
+					pi->parallel_renders = 1;
+			} else if(_tcscmp(_T("iRenderMemoryMB"), var) == 0) {
+				pi->render_memory = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iSegmentTimeoutSec"), var) == 0) {
+				pi->segment_timeout = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iJobTimeoutSec"), var) == 0) {
+				pi->job_timeout = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iRenderRetries"), var) == 0) {
+				pi->render_retries = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iHedgePercent"), var) == 0) {
+				pi->hedge_percent = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iHedgePercentile"), var) == 0) {
+				pi->hedge_percentile = require_strtoul(val, NULL, 10);
+
+				if(pi->hedge_percentile > 100)
+					pi->hedge_percentile = 100;
+			} else if(_tcscmp(_T("iBatchSegments"), var) == 0) {
+				pi->batch_segments = require_strtoul(val, NULL, 10);
+
+				if(pi->batch_segments == 0)
+					pi->batch_segments = 1;
+			} else if(_tcscmp(_T("iMergeFanout"), var) == 0) {
+				pi->merge_fanout = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iIncrementalMerge"), var) == 0) {
+				/* One merge in order, without the tree of iMergeFanout */
+				pi->incremental_merge = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iCompressLevel"), var) == 0) {
+				pi->compress_level = require_strtoul(val, NULL, 10);
+
+				if(pi->compress_level > 9)
+					pi->compress_level = 9;
+			} else if(_tcscmp(_T("iObjectStreams"), var) == 0) {
+				pi->object_streams = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iImageDPI"), var) == 0) {
+				pi->image_dpi = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iJpegQuality"), var) == 0) {
+				pi->jpeg_quality = require_strtoul(val, NULL, 10);
+
+				if(pi->jpeg_quality == 0)
+					pi->jpeg_quality = 1;
+				else if(pi->jpeg_quality > 100)
+					pi->jpeg_quality = 100;
+			} else if(_tcscmp(_T("iLinearize"), var) == 0) {
+				pi->linearize = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iNativeTOC"), var) == 0) {
+				pi->native_toc = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iStampHeaders"), var) == 0) {
+				pi->stamp_headers = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("sHeaderLeft"), var) == 0) {
+				pi->header_left = require_dup_str(val);
+			} else if(_tcscmp(_T("sHeaderCenter"), var) == 0) {
+				pi->header_center = require_dup_str(val);
+			} else if(_tcscmp(_T("sHeaderRight"), var) == 0) {
+				pi->header_right = require_dup_str(val);
+			} else if(_tcscmp(_T("sFooterLeft"), var) == 0) {
+				pi->footer_left = require_dup_str(val);
+			} else if(_tcscmp(_T("sFooterCenter"), var) == 0) {
+				pi->footer_center = require_dup_str(val);
+			} else if(_tcscmp(_T("sFooterRight"), var) == 0) {
+				pi->footer_right = require_dup_str(val);
+			} else if(_tcscmp(_T("sRenderer"), var) == 0) {
+				pi->renderer = require_dup_str(val);
+			} else if(_tcscmp(_T("sCostStorePath"), var) == 0) {
+				pi->cost_store_path = require_dup_str(val);
+			} else if(_tcscmp(_T("sRenderCachePath"), var) == 0) {
+				pi->render_cache_path = require_dup_str(val);
+			} else if(_tcscmp(_T("iRenderCacheSize"), var) == 0) {
+				pi->render_cache_size = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iRevalidateCache"), var) == 0) {
+				pi->revalidate_cache = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iSubresourceProxy"), var) == 0) {
+				pi->subresource_proxy = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iProxyCacheSize"), var) == 0) {
+				pi->proxy_cache_size = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("iPrefetchSegments"), var) == 0) {
+				pi->prefetch_segments = require_strtoul(val, NULL, 10);
+			} else if(_tcscmp(_T("sProxyBlocklist"), var) == 0) {
+				pi->proxy_blocklist = require_dup_str(val);
 			} else if(_tcscmp(_T("sBaseURL"), var) == 0) {
 				pi->base_url = require_dup_str(val);
 			} else if(_tcscmp(_T("sTargetPath"), var) == 0) {
@@ -398,10 +513,20 @@ void destroy_pdf_info(struct pdf_info* pi)
 	free(pi->first_header_url);
 	free(pi->footer_url);
 	free(pi->header_url);
+	free(pi->header_left);
+	free(pi->header_center);
+	free(pi->header_right);
+	free(pi->footer_left);
+	free(pi->footer_center);
+	free(pi->footer_right);
 	free(pi->session);
 	free(pi->watermark_url);
 	free(pi->font_family);
 	free(pi->font_size);
+	free(pi->cost_store_path);
+	free(pi->renderer);
+	free(pi->render_cache_path);
+	free(pi->proxy_blocklist);
 
 	destroy_pdf_margins(&pi->margins);
 	destroy_pdf_segment_info(&pi->cover_page);
@@ -43,10 +43,42 @@ struct pdf_info {
 	LPTSTR base_url; /* URL to Cockpit with trailing / */
 	LPTSTR footer_url; /* normal footer query string */
 	LPTSTR header_url; /* normal header query string */
+	LPTSTR header_left; /* text at the left of stamped headers, or NULL */
+	LPTSTR header_center; /* text at the center of stamped headers */
+	LPTSTR header_right; /* text at the right of stamped headers */
+	LPTSTR footer_left; /* text at the left of stamped footers, or NULL */
+	LPTSTR footer_center; /* text at the center of stamped footers */
+	LPTSTR footer_right; /* text at the right of stamped footers */
 	LPTSTR target_path; /* path to the final PDF output file */
 	LPTSTR font_size; /* size of the document font for the TOC */
 	LPTSTR font_family; /* font family of the document font for the TOC */
+	LPTSTR cost_store_path; /* file remembering conversion costs */
+	LPTSTR renderer; /* name of the renderer backend, or NULL */
+	LPTSTR render_cache_path; /* directory of cached conversions, or NULL */
+	LPTSTR proxy_blocklist; /* hosts the proxy never contacts, or NULL */
 	unsigned long int segments; /* number of segments to expect */
+	unsigned long int parallel_renders; /* segments to convert at once */
+	unsigned long int render_memory; /* MB for conversions, or 0 for any */
+	unsigned long int segment_timeout; /* seconds per conversion, or 0 */
+	unsigned long int job_timeout; /* seconds for everything, or 0 */
+	unsigned long int render_retries; /* retries of a killed conversion */
+	unsigned long int hedge_percent; /* straggler threshold, or 0 */
+	unsigned long int hedge_percentile; /* expected time without history */
+	unsigned long int batch_segments; /* segments per PDF getter at most */
+	unsigned long int merge_fanout; /* PDFs per merge, or 0 for all */
+	unsigned long int incremental_merge; /* nonzero to merge as rendered */
+	unsigned long int compress_level; /* zlib level, or 0 for none */
+	unsigned long int object_streams; /* nonzero to use object streams */
+	unsigned long int image_dpi; /* resolution of images, or 0 for any */
+	unsigned long int jpeg_quality; /* quality of JPEG images resampled */
+	unsigned long int linearize; /* nonzero to linearize the target */
+	unsigned long int native_toc; /* nonzero to typeset the TOC itself */
+	unsigned long int stamp_headers; /* nonzero to draw them in the merge */
+	unsigned long int render_cache_size; /* MB cached at most, or 0 */
+	unsigned long int revalidate_cache; /* nonzero to check sources first */
+	unsigned long int subresource_proxy; /* nonzero to load via the proxy */
+	unsigned long int proxy_cache_size; /* MB shared via the proxy, or 0 */
+	unsigned long int prefetch_segments; /* downloads at once, or 0 */
 	enum pdf_hf_opts hf_opts; /* header and footer display options */
 	enum pdf_toc_opts toc_opts; /* table of contents display options */
 };
@@ -0,0 +1,2459 @@
+#include "stdafx.h"
+#include <zlib.h>
+#include "pdf.h"
+#include "task.h"
+#include "util.h"
+#include "log.h"
+
+/* Deepest nesting of arrays and dictionaries accepted by the parser */
+#define PDF_MAX_DEPTH 64
+
+/* Most cross-reference sections followed through /Prev */
+#define PDF_MAX_XREF_SECTIONS 256
+
+/* Most objects a PDF may have, as limited by the PDF specification */
+#define PDF_MAX_OBJECTS 8388607L
+
+/* Number of bytes at the end of a file searched for startxref */
+#define PDF_TAIL_LEN 1024
+
+/* Longest number token accepted by the parser */
+#define PDF_MAX_NUMBER 64
+
+/* Size of the buffer of a PDF being written, in bytes */
+#define PDF_WRITE_BUFFER 65536
+
+/* Largest /Columns accepted for a PNG predictor */
+#define PDF_MAX_COLUMNS 65536
+
+/* Bytes of streams a writer holds before compressing them at once */
+#define PDF_DEFLATE_BATCH (16 * 1024 * 1024)
+
+/* Position of the parser in a mapped PDF file or a decoded stream */
+struct pdf_lexer {
+	struct pdf_doc* doc; /* document being read */
+	const unsigned char* start; /* start of the bytes being read */
+	const unsigned char* pos; /* next byte to read */
+	const unsigned char* end; /* end of the bytes that may be read */
+};
+
+static void read_xref(struct pdf_doc*);
+static size_t find_startxref(struct pdf_doc*);
+static struct pdf_obj* read_xref_section(struct pdf_doc*, size_t);
+static struct pdf_obj* read_xref_stream(struct pdf_lexer*);
+static unsigned long int read_field(const unsigned char*, long int);
+static void grow_xref(struct pdf_doc*, unsigned long int);
+static struct pdf_obj* parse_object(struct pdf_doc*, unsigned long int, int);
+static struct pdf_obj* parse_indirect(struct pdf_lexer*, unsigned long int*,
+		int);
+static struct pdf_obj* parse_compressed(struct pdf_doc*, unsigned long int);
+static unsigned char* inflate_bytes(const unsigned char*, size_t, size_t*);
+static size_t unpredict_png(unsigned char*, size_t, const struct pdf_obj*);
+static long int get_int_key(const struct pdf_obj*, const char*, long int);
+static void init_lexer(struct pdf_lexer*, struct pdf_doc*,
+		const unsigned char*, size_t, size_t);
+static void read_stream(struct pdf_lexer*, struct pdf_obj*, size_t);
+static const unsigned char* find_bytes(const unsigned char*,
+		const unsigned char*, const char*);
+static struct pdf_obj* parse_value(struct pdf_lexer*, int);
+static struct pdf_obj* parse_number(struct pdf_lexer*);
+static struct pdf_obj* parse_name(struct pdf_lexer*);
+static struct pdf_obj* parse_literal(struct pdf_lexer*);
+static size_t decode_literal(struct pdf_lexer*, char*);
+static struct pdf_obj* parse_hex(struct pdf_lexer*);
+static struct pdf_obj* parse_array(struct pdf_lexer*, int);
+static struct pdf_obj* parse_dict(struct pdf_lexer*, int);
+static int read_uint(struct pdf_lexer*, unsigned long int*);
+static int match_keyword(struct pdf_lexer*, const char*);
+static void skip_space(struct pdf_lexer*);
+static int is_space(int);
+static int is_delimiter(int);
+static int hex_value(int);
+static void malformed(const struct pdf_lexer*);
+static char* dup_bytes(const char*, size_t);
+static void queue_deflate(struct pdf_writer*, unsigned long int,
+		struct pdf_obj*, unsigned char*, size_t);
+static void flush_deflates(struct pdf_writer*);
+static void deflate_task(void*);
+static void pack_object(struct pdf_writer*, unsigned long int,
+		const struct pdf_obj*);
+static void flush_objstm(struct pdf_writer*);
+static void put_xref_stream(struct pdf_writer*, unsigned long int);
+static void append_field(struct pdf_buffer*, ULONGLONG, int);
+static void put_value(struct pdf_writer*, const struct pdf_obj*);
+static void put_dict(struct pdf_writer*, const struct pdf_obj*, const size_t*);
+static void put_string(struct pdf_writer*, const struct pdf_obj*);
+static void put_bytes(struct pdf_writer*, const void*, size_t);
+static void put_text(struct pdf_writer*, const char*, ...);
+
+/*
+ * Map the PDF file at the given path into memory and read its
+ * cross-reference table into the structure pointed to by doc. Objects
+ * are only parsed when they are loaded, so the memory used does not
+ * grow with the size of their content. Both cross-reference tables and
+ * the cross-reference streams of PDF 1.5 are read. Execution is
+ * terminated if the file cannot be read or is not a PDF. The values of
+ * doc and path must not be NULL. The structure must be passed to
+ * close_pdf().
+ */
+void open_pdf(struct pdf_doc* doc, LPCTSTR path)
+{
+	LARGE_INTEGER size;
+
+	RT_NOT_NULL(doc);
+	RT_NOT_NULL(path);
+
+	memset(doc, 0, sizeof(*doc));
+	doc->path = require_dup_str(path);
+	doc->file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if(doc->file == INVALID_HANDLE_VALUE)
+		errorout(E_BADF, _T("Failed to open PDF '%s' (%lu)"), path,
+				GetLastError());
+
+	if(!GetFileSizeEx(doc->file, &size))
+		errorout(E_BADF, _T("Failed to get size of PDF '%s' (%lu)"), path,
+				GetLastError());
+
+	if(size.QuadPart <= 0
+			|| (ULONGLONG) size.QuadPart > (ULONGLONG) (SIZE_T) -1)
+		errorout(E_PDF, _T("PDF '%s' is empty or too large to map"), path);
+
+	doc->size = (size_t) size.QuadPart;
+	doc->mapping = CreateFileMapping(doc->file, NULL, PAGE_READONLY, 0, 0,
+			NULL);
+
+	if(doc->mapping == NULL)
+		errorout(E_BADF, _T("Failed to map PDF '%s' (%lu)"), path,
+				GetLastError());
+
+	doc->data = (const unsigned char*) MapViewOfFile(doc->mapping,
+			FILE_MAP_READ, 0, 0, 0);
+
+	if(doc->data == NULL)
+		errorout(E_BADF, _T("Failed to map PDF '%s' (%lu)"), path,
+				GetLastError());
+
+	if(doc->size < 8 || memcmp(doc->data, "%PDF-", 5) != 0)
+		errorout(E_PDF, _T("'%s' is not a PDF"), path);
+
+	read_xref(doc);
+
+	if(get_pdf_key(doc->trailer, "Root") == NULL)
+		errorout(E_PDF, _T("PDF '%s' has no catalog"), path);
+}
+
+/*
+ * Unmap the PDF file of the structure pointed to by doc and release
+ * everything open_pdf() allocated for it. Streams loaded from it must
+ * not be used afterwards. The value of doc must not be NULL.
+ */
+void close_pdf(struct pdf_doc* doc)
+{
+	RT_NOT_NULL(doc);
+
+	if(doc->data != NULL)
+		UnmapViewOfFile(doc->data);
+
+	if(doc->mapping != NULL)
+		CloseHandle(doc->mapping);
+
+	if(doc->file != NULL && doc->file != INVALID_HANDLE_VALUE)
+		CloseHandle(doc->file);
+
+	if(doc->trailer != NULL)
+		free_pdf_object(doc->trailer);
+
+	free(doc->objstm);
+	free(doc->xref);
+	free(doc->path);
+	memset(doc, 0, sizeof(*doc));
+}
+
+/*
+ * Parse the object with the given number from the PDF of the structure
+ * pointed to by doc, which may be in an object stream. An object that
+ * is free or not in the file is null. A stream keeps pointing into the
+ * mapped file, and its /Length is replaced by the number of bytes it
+ * has. Execution is terminated if the object is malformed. The value
+ * of doc must not be NULL. The object returned must be passed to
+ * free_pdf_object().
+ */
+struct pdf_obj* load_pdf_object(struct pdf_doc* doc, unsigned long int num)
+{
+	RT_NOT_NULL(doc);
+
+	return parse_object(doc, num, 1);
+}
+
+/*
+ * Return the object that the given value stands for in the PDF of the
+ * structure pointed to by doc: the object it refers to if it is an
+ * indirect reference, or a copy of it otherwise. The value of doc must
+ * not be NULL. If value is NULL, NULL is returned. Otherwise, the
+ * object returned must be passed to free_pdf_object().
+ */
+struct pdf_obj* load_pdf_value(struct pdf_doc* doc, const struct pdf_obj* value)
+{
+	RT_NOT_NULL(doc);
+
+	if(value == NULL)
+		return NULL;
+
+	if(value->type == kPDF_OBJ_REF)
+		return load_pdf_object(doc, value->u.ref.num);
+
+	return clone_pdf_object(value);
+}
+
+/*
+ * Return the data of the given stream with its filter undone and store
+ * its length in the value pointed to by len. Streams without a filter
+ * and streams with /FlateDecode, with or without a PNG predictor, are
+ * supported; execution is terminated for any other filter. The values
+ * of stream and len must not be NULL. The pointer returned must be
+ * passed to free().
+ */
+unsigned char* decode_pdf_stream(const struct pdf_obj* stream, size_t* len)
+{
+	const struct pdf_obj* filter = NULL;
+	const struct pdf_obj* parms = NULL;
+	unsigned char* data = NULL;
+	long int predictor = 1;
+
+	RT_NOT_NULL(stream);
+	RT_NOT_NULL(len);
+
+	if(stream->type != kPDF_OBJ_STREAM)
+		errorout(E_PDF, _T("Decoded an object that is not a stream"));
+
+	filter = get_pdf_key(stream, "Filter");
+	parms = get_pdf_key(stream, "DecodeParms");
+
+	/* A chain of one filter is the same as that filter */
+	if(filter != NULL && filter->type == kPDF_OBJ_ARRAY
+			&& filter->u.array.count == 1) {
+		filter = filter->u.array.items[0];
+
+		if(parms != NULL && parms->type == kPDF_OBJ_ARRAY)
+			parms = parms->u.array.count == 1 ? parms->u.array.items[0]
+					: NULL;
+	}
+
+	if(filter == NULL) {
+		data = (unsigned char*) require_mem(stream->u.stream.len + 1);
+		memcpy(data, stream->u.stream.data, stream->u.stream.len);
+		*len = stream->u.stream.len;
+		return data;
+	}
+
+	if(!is_pdf_name(filter, "FlateDecode"))
+		errorout(E_PDF, _T("Unsupported stream filter"));
+
+	data = inflate_bytes(stream->u.stream.data, stream->u.stream.len, len);
+	predictor = get_int_key(parms, "Predictor", 1);
+
+	if(predictor >= 10)
+		*len = unpredict_png(data, *len, parms);
+	else if(predictor != 1)
+		errorout(E_PDF, _T("Unsupported stream predictor %ld"), predictor);
+
+	return data;
+}
+
+/*
+ * Return the value of the given key in the given dictionary, or in the
+ * dictionary of the given stream, without resolving it. NULL is
+ * returned if obj is NULL, is neither, or lacks the key. The value of
+ * key must not be NULL.
+ */
+struct pdf_obj* get_pdf_key(const struct pdf_obj* obj, const char* key)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(key);
+
+	if(obj != NULL && obj->type == kPDF_OBJ_STREAM)
+		obj = obj->u.stream.dict;
+
+	if(obj == NULL || obj->type != kPDF_OBJ_DICT)
+		return NULL;
+
+	for(i = 0; i < obj->u.dict.count; ++i)
+		if(strcmp(obj->u.dict.pairs[i].key, key) == 0)
+			return obj->u.dict.pairs[i].value;
+
+	return NULL;
+}
+
+/*
+ * Set the given key of the given dictionary, or of the dictionary of
+ * the given stream, to the given value, which the dictionary then owns.
+ * A previous value of the key is released. The values of obj, key and
+ * value must not be NULL.
+ */
+void set_pdf_key(struct pdf_obj* obj, const char* key, struct pdf_obj* value)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(obj);
+	RT_NOT_NULL(key);
+	RT_NOT_NULL(value);
+
+	if(obj->type == kPDF_OBJ_STREAM)
+		obj = obj->u.stream.dict;
+
+	if(obj->type != kPDF_OBJ_DICT)
+		errorout(E_PDF, _T("Set /%hs of an object that is not a dictionary"),
+				key);
+
+	for(i = 0; i < obj->u.dict.count; ++i) {
+		if(strcmp(obj->u.dict.pairs[i].key, key) == 0) {
+			free_pdf_object(obj->u.dict.pairs[i].value);
+			obj->u.dict.pairs[i].value = value;
+			return;
+		}
+	}
+
+	obj->u.dict.pairs = (struct pdf_pair*) require_realloc(obj->u.dict.pairs,
+			obj->u.dict.count + 1, sizeof(*obj->u.dict.pairs));
+	obj->u.dict.pairs[i].key = dup_bytes(key, strlen(key));
+	obj->u.dict.pairs[i].value = value;
+	++obj->u.dict.count;
+}
+
+/*
+ * Remove the given key and its value from the given dictionary, or
+ * from the dictionary of the given stream, if it is there. The values
+ * of obj and key must not be NULL.
+ */
+void remove_pdf_key(struct pdf_obj* obj, const char* key)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(obj);
+	RT_NOT_NULL(key);
+
+	if(obj->type == kPDF_OBJ_STREAM)
+		obj = obj->u.stream.dict;
+
+	if(obj->type != kPDF_OBJ_DICT)
+		return;
+
+	for(i = 0; i < obj->u.dict.count; ++i) {
+		if(strcmp(obj->u.dict.pairs[i].key, key) == 0) {
+			free(obj->u.dict.pairs[i].key);
+			free_pdf_object(obj->u.dict.pairs[i].value);
+			memmove(&obj->u.dict.pairs[i], &obj->u.dict.pairs[i + 1],
+					(obj->u.dict.count - i - 1) * sizeof(*obj->u.dict.pairs));
+			--obj->u.dict.count;
+			return;
+		}
+	}
+}
+
+/*
+ * Append the given item, which the array then owns, to the given
+ * array. The values of array and item must not be NULL.
+ */
+void append_pdf_item(struct pdf_obj* array, struct pdf_obj* item)
+{
+	RT_NOT_NULL(array);
+	RT_NOT_NULL(item);
+
+	if(array->type != kPDF_OBJ_ARRAY)
+		errorout(E_PDF, _T("Appended to an object that is not an array"));
+
+	array->u.array.items = (struct pdf_obj**) require_realloc(
+			array->u.array.items, array->u.array.count + 1,
+			sizeof(*array->u.array.items));
+	array->u.array.items[array->u.array.count++] = item;
+}
+
+/*
+ * Return nonzero if the given object is the name given without its
+ * slash. The value of name must not be NULL.
+ */
+int is_pdf_name(const struct pdf_obj* obj, const char* name)
+{
+	RT_NOT_NULL(name);
+
+	return obj != NULL && obj->type == kPDF_OBJ_NAME
+			&& strcmp(obj->u.text, name) == 0;
+}
+
+/*
+ * Return a new object of the given type: null, false, zero, or an empty
+ * string, array or dictionary. Reals, names, references and streams are
+ * made by the other constructors and by the parser. The object returned
+ * must be passed to free_pdf_object().
+ */
+struct pdf_obj* new_pdf_object(enum pdf_type type)
+{
+	struct pdf_obj* obj = (struct pdf_obj*) require_cmem(1, sizeof(*obj));
+
+	obj->type = type;
+
+	return obj;
+}
+
+/*
+ * Return a new integer object with the given value. The object returned
+ * must be passed to free_pdf_object().
+ */
+struct pdf_obj* new_pdf_int(long int value)
+{
+	struct pdf_obj* obj = new_pdf_object(kPDF_OBJ_INT);
+
+	obj->u.integer = value;
+
+	return obj;
+}
+
+/*
+ * Return a new name object for the given name without its slash. The
+ * value of name must not be NULL. The object returned must be passed to
+ * free_pdf_object().
+ */
+struct pdf_obj* new_pdf_name(const char* name)
+{
+	struct pdf_obj* obj = NULL;
+
+	RT_NOT_NULL(name);
+
+	obj = new_pdf_object(kPDF_OBJ_NAME);
+	obj->u.text = dup_bytes(name, strlen(name));
+
+	return obj;
+}
+
+/*
+ * Return a new reference to the object with the given number and
+ * generation zero. The object returned must be passed to
+ * free_pdf_object().
+ */
+struct pdf_obj* new_pdf_ref(unsigned long int num)
+{
+	struct pdf_obj* obj = new_pdf_object(kPDF_OBJ_REF);
+
+	obj->u.ref.num = num;
+
+	return obj;
+}
+
+/*
+ * Return a deep copy of the given object. The data of a stream is only
+ * copied if the stream owns it. The value of obj must not be NULL. The
+ * object returned must be passed to free_pdf_object().
+ */
+struct pdf_obj* clone_pdf_object(const struct pdf_obj* obj)
+{
+	struct pdf_obj* copy = NULL;
+	size_t i = 0;
+
+	RT_NOT_NULL(obj);
+
+	copy = new_pdf_object(obj->type);
+	copy->u = obj->u;
+
+	switch(obj->type) {
+	case kPDF_OBJ_REAL:
+	case kPDF_OBJ_NAME:
+		copy->u.text = dup_bytes(obj->u.text, strlen(obj->u.text));
+		break;
+	case kPDF_OBJ_STRING:
+		copy->u.string.data = dup_bytes(obj->u.string.data,
+				obj->u.string.len);
+		break;
+	case kPDF_OBJ_ARRAY:
+		copy->u.array.items = (struct pdf_obj**) require_cmem(
+				obj->u.array.count + 1, sizeof(*copy->u.array.items));
+
+		for(i = 0; i < obj->u.array.count; ++i)
+			copy->u.array.items[i] = clone_pdf_object(obj->u.array.items[i]);
+
+		break;
+	case kPDF_OBJ_DICT:
+		copy->u.dict.pairs = (struct pdf_pair*) require_cmem(
+				obj->u.dict.count + 1, sizeof(*copy->u.dict.pairs));
+
+		for(i = 0; i < obj->u.dict.count; ++i) {
+			const struct pdf_pair* pair = &obj->u.dict.pairs[i];
+
+			copy->u.dict.pairs[i].key = dup_bytes(pair->key,
+					strlen(pair->key));
+			copy->u.dict.pairs[i].value = clone_pdf_object(pair->value);
+		}
+
+		break;
+	case kPDF_OBJ_STREAM:
+		copy->u.stream.dict = clone_pdf_object(obj->u.stream.dict);
+
+		if(obj->u.stream.owned) {
+			unsigned char* data = (unsigned char*) require_mem(
+					obj->u.stream.len + 1);
+
+			memcpy(data, obj->u.stream.data, obj->u.stream.len);
+			copy->u.stream.data = data;
+		}
+
+		break;
+	default:
+		break;
+	}
+
+	return copy;
+}
+
+/*
+ * Release the given object and everything it owns. The value of obj
+ * must not be NULL.
+ */
+void free_pdf_object(struct pdf_obj* obj)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(obj);
+
+	switch(obj->type) {
+	case kPDF_OBJ_REAL:
+	case kPDF_OBJ_NAME:
+		free(obj->u.text);
+		break;
+	case kPDF_OBJ_STRING:
+		free(obj->u.string.data);
+		break;
+	case kPDF_OBJ_ARRAY:
+		for(i = 0; i < obj->u.array.count; ++i)
+			free_pdf_object(obj->u.array.items[i]);
+
+		free(obj->u.array.items);
+		break;
+	case kPDF_OBJ_DICT:
+		for(i = 0; i < obj->u.dict.count; ++i) {
+			free(obj->u.dict.pairs[i].key);
+			free_pdf_object(obj->u.dict.pairs[i].value);
+		}
+
+		free(obj->u.dict.pairs);
+		break;
+	case kPDF_OBJ_STREAM:
+		free_pdf_object(obj->u.stream.dict);
+
+		if(obj->u.stream.owned)
+			free((void*) obj->u.stream.data);
+
+		break;
+	default:
+		break;
+	}
+
+	free(obj);
+}
+
+/*
+ * Create the file at the given path and write the header of a PDF to
+ * it through the structure pointed to by writer. Streams without a
+ * filter are compressed at the given zlib level, from 1 to 9, unless
+ * it is 0; this is done in batches on a pool of threads. If pack is
+ * nonzero, objects other than streams are written in compressed object
+ * streams and the file ends with a cross-reference stream, which makes
+ * it a PDF 1.5 file; otherwise it is a PDF 1.4 file. Object number 0
+ * is never used. The values of writer and path must not be NULL. The
+ * structure must be passed to close_pdf_writer().
+ */
+void open_pdf_writer(struct pdf_writer* writer, LPCTSTR path, int level,
+		int pack)
+{
+	RT_NOT_NULL(writer);
+	RT_NOT_NULL(path);
+
+	memset(writer, 0, sizeof(*writer));
+	writer->path = require_dup_str(path);
+	writer->file = require_open_file(path, _T("wb"));
+	writer->count = 1;
+	writer->level = level < 0 ? 0 : level > 9 ? 9 : level;
+	writer->pack = pack;
+	setvbuf(writer->file, NULL, _IOFBF, PDF_WRITE_BUFFER);
+
+	/* The comment of high bytes marks the file as binary */
+	put_text(writer, "%%PDF-%s\n%%\xe2\xe3\xcf\xd3\n", pack ? "1.5" : "1.4");
+}
+
+/*
+ * Return a new object number for the PDF being written through the
+ * structure pointed to by writer. Every number reserved must be written
+ * by write_pdf_object() before the PDF is closed. The value of writer
+ * must not be NULL.
+ */
+unsigned long int reserve_pdf_object(struct pdf_writer* writer)
+{
+	RT_NOT_NULL(writer);
+
+	if(writer->count >= writer->capacity) {
+		writer->capacity = writer->capacity * 2 + 64;
+		writer->locations = (struct pdf_location*) require_realloc(
+				writer->locations, writer->capacity,
+				sizeof(*writer->locations));
+	}
+
+	writer->locations[writer->count].offset = 0;
+	writer->locations[writer->count].objstm = 0;
+
+	return writer->count++;
+}
+
+/*
+ * Write the given object as the reserved object number num of the PDF
+ * being written through the structure pointed to by writer. The /Length
+ * of a stream is written as the length of its data. A stream to be
+ * compressed and an object to be packed are copied and written later,
+ * so the caller may release obj and everything it points to as soon as
+ * this returns. The values of writer and obj must not be NULL.
+ */
+void write_pdf_object(struct pdf_writer* writer, unsigned long int num,
+		const struct pdf_obj* obj)
+{
+	RT_NOT_NULL(writer);
+	RT_NOT_NULL(obj);
+
+	if(num == 0 || num >= writer->count || writer->locations[num].offset != 0
+			|| writer->locations[num].objstm != 0)
+		errorout(E_PDF, _T("Object %lu of '%s' is not reserved or already ")
+				_T("written"), num, writer->path);
+
+	if(obj->type == kPDF_OBJ_STREAM && writer->level > 0
+			&& get_pdf_key(obj, "Filter") == NULL) {
+		unsigned char* data = (unsigned char*) require_mem(
+				obj->u.stream.len + 1);
+
+		memcpy(data, obj->u.stream.data, obj->u.stream.len);
+		queue_deflate(writer, num, clone_pdf_object(obj->u.stream.dict), data,
+				obj->u.stream.len);
+		return;
+	}
+
+	if(obj->type != kPDF_OBJ_STREAM && writer->pack) {
+		pack_object(writer, num, obj);
+		return;
+	}
+
+	writer->locations[num].offset = writer->pos;
+	put_text(writer, "%lu 0 obj\n", num);
+	put_value(writer, obj);
+	put_text(writer, "\nendobj\n");
+}
+
+/*
+ * Append the given object to the given buffer as the indirect object
+ * with the given number, formatted as write_pdf_object() writes it but
+ * never compressed or packed. The values of buffer and obj must not be
+ * NULL.
+ */
+void format_pdf_object(struct pdf_buffer* buffer, unsigned long int num,
+		const struct pdf_obj* obj)
+{
+	struct pdf_writer writer;
+
+	RT_NOT_NULL(buffer);
+	RT_NOT_NULL(obj);
+
+	memset(&writer, 0, sizeof(writer));
+	writer.path = (LPTSTR) _T("memory");
+	writer.sink = buffer;
+	put_text(&writer, "%lu 0 obj\n", num);
+	put_value(&writer, obj);
+	put_text(&writer, "\nendobj\n");
+}
+
+/*
+ * Write the objects still held by the structure pointed to by writer,
+ * then the cross-reference table or stream and the trailer of its PDF,
+ * with the object of the given number as its catalog, and close it.
+ * Execution is terminated if a reserved object was never written. The
+ * value of writer must not be NULL.
+ */
+void close_pdf_writer(struct pdf_writer* writer, unsigned long int root)
+{
+	FILE* file = NULL;
+	ULONGLONG xref = 0;
+	unsigned long int i = 0;
+
+	RT_NOT_NULL(writer);
+
+	flush_objstm(writer);
+	flush_deflates(writer);
+
+	for(i = 1; i < writer->count; ++i)
+		if(writer->locations[i].offset == 0
+				&& writer->locations[i].objstm == 0)
+			errorout(E_PDF, _T("Object %lu of '%s' was never written"), i,
+					writer->path);
+
+	if(writer->pack) {
+		put_xref_stream(writer, root);
+	} else {
+		xref = writer->pos;
+		put_text(writer, "xref\n0 %lu\n0000000000 65535 f \n",
+				writer->count);
+
+		for(i = 1; i < writer->count; ++i)
+			put_text(writer, "%010I64u 00000 n \n",
+					writer->locations[i].offset);
+
+		put_text(writer, "trailer\n<< /Size %lu /Root %lu 0 R >>\n"
+				"startxref\n%I64u\n%%%%EOF\n", writer->count, root, xref);
+	}
+
+	file = writer->file;
+	writer->file = NULL;
+
+	if(release_file(file) != 0)
+		errorout(E_BADF, _T("Failed to write PDF '%s'"), writer->path);
+
+	free(writer->objstm.data);
+	free(writer->deflates);
+	free(writer->locations);
+	free(writer->path);
+	memset(writer, 0, sizeof(*writer));
+}
+
+/*
+ * Close the PDF of the structure pointed to by writer without finishing
+ * it, after an error, and remove the file, releasing the streams still
+ * held. A writer already closed is left alone. The value of writer must
+ * not be NULL.
+ */
+void abort_pdf_writer(struct pdf_writer* writer)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(writer);
+
+	for(i = 0; i < writer->deflate_count; ++i) {
+		if(writer->deflates[i].dict != NULL)
+			free_pdf_object(writer->deflates[i].dict);
+
+		free(writer->deflates[i].data);
+	}
+
+	if(writer->file != NULL)
+		release_file(writer->file);
+
+	if(writer->path != NULL && writer->sink == NULL)
+		_tremove(writer->path);
+
+	free(writer->objstm.data);
+	free(writer->deflates);
+	free(writer->locations);
+	free(writer->path);
+	memset(writer, 0, sizeof(*writer));
+}
+
+/*
+ * Hold the stream with the given number, dictionary and data, which
+ * the structure pointed to by writer then owns, until a batch of
+ * streams is compressed by flush_deflates(). The values of writer,
+ * dict and data must not be NULL.
+ */
+static void queue_deflate(struct pdf_writer* writer, unsigned long int num,
+		struct pdf_obj* dict, unsigned char* data, size_t len)
+{
+	struct pdf_deflate* deflate = NULL;
+
+	RT_NOT_NULL(writer);
+	RT_NOT_NULL(dict);
+	RT_NOT_NULL(data);
+
+	/* A placeholder keeps the number from being written twice */
+	writer->locations[num].objstm = ULONG_MAX;
+
+	if(writer->deflate_count == writer->deflate_capacity) {
+		writer->deflate_capacity = writer->deflate_capacity * 2 + 64;
+		writer->deflates = (struct pdf_deflate*) require_realloc(
+				writer->deflates, writer->deflate_capacity,
+				sizeof(*writer->deflates));
+	}
+
+	deflate = &writer->deflates[writer->deflate_count++];
+	deflate->num = num;
+	deflate->dict = dict;
+	deflate->data = data;
+	deflate->len = len;
+	deflate->level = writer->level;
+	writer->deflate_bytes += len;
+
+	if(writer->deflate_bytes >= PDF_DEFLATE_BATCH)
+		flush_deflates(writer);
+}
+
+/*
+ * Compress the streams held by the structure pointed to by writer, one
+ * task per stream, and write them to its PDF in the order they were
+ * held. A stream that does not get smaller is written as it is. The
+ * value of writer must not be NULL.
+ */
+static void flush_deflates(struct pdf_writer* writer)
+{
+	struct task_graph graph;
+	size_t i = 0;
+
+	RT_NOT_NULL(writer);
+
+	if(writer->deflate_count == 0)
+		return;
+
+	init_task_graph(&graph);
+
+	for(i = 0; i < writer->deflate_count; ++i)
+		add_task(&graph, _T("deflate stream"), deflate_task,
+				&writer->deflates[i]);
+
+	run_task_graph(&graph);
+	destroy_task_graph(&graph);
+
+	for(i = 0; i < writer->deflate_count; ++i) {
+		struct pdf_deflate* deflate = &writer->deflates[i];
+		struct pdf_obj stream;
+
+		memset(&stream, 0, sizeof(stream));
+		stream.type = kPDF_OBJ_STREAM;
+		stream.u.stream.dict = deflate->dict;
+		stream.u.stream.data = deflate->data;
+		stream.u.stream.len = deflate->len;
+		writer->locations[deflate->num].objstm = 0;
+		writer->locations[deflate->num].offset = writer->pos;
+		put_text(writer, "%lu 0 obj\n", deflate->num);
+		put_value(writer, &stream);
+		put_text(writer, "\nendobj\n");
+		free_pdf_object(deflate->dict);
+		free(deflate->data);
+		deflate->dict = NULL;
+		deflate->data = NULL;
+	}
+
+	writer->deflate_count = 0;
+	writer->deflate_bytes = 0;
+}
+
+/*
+ * Compress the stream described by the pdf_deflate structure pointed
+ * to by arg and add /FlateDecode to its dictionary, unless that would
+ * not make it smaller. The value of arg must not be NULL.
+ */
+static void deflate_task(void* arg)
+{
+	struct pdf_deflate* deflate = (struct pdf_deflate*) arg;
+	unsigned char* out = NULL;
+	uLongf out_len = 0;
+
+	RT_NOT_NULL(deflate);
+
+	if(deflate->len == 0 || deflate->len > ULONG_MAX / 2)
+		return;
+
+	out_len = compressBound((uLong) deflate->len);
+	out = (unsigned char*) require_mem(out_len);
+
+	if(compress2(out, &out_len, deflate->data, (uLong) deflate->len,
+			deflate->level) != Z_OK)
+		errorout(E_MALLOC, _T("Failed to compress a stream"));
+
+	if(out_len >= deflate->len) {
+		free(out);
+		return;
+	}
+
+	free(deflate->data);
+	deflate->data = out;
+	deflate->len = out_len;
+	set_pdf_key(deflate->dict, "Filter", new_pdf_name("FlateDecode"));
+}
+
+/*
+ * Add the given object, which is not a stream, to the object stream
+ * being filled by the structure pointed to by writer as the given
+ * object number, and write that object stream once it is full. The
+ * values of writer and obj must not be NULL.
+ */
+static void pack_object(struct pdf_writer* writer, unsigned long int num,
+		const struct pdf_obj* obj)
+{
+	RT_NOT_NULL(writer);
+	RT_NOT_NULL(obj);
+
+	writer->locations[num].objstm = ULONG_MAX;
+	writer->objstm_nums[writer->objstm_count] = num;
+	writer->objstm_offsets[writer->objstm_count++] = writer->objstm.len;
+	writer->sink = &writer->objstm;
+	put_value(writer, obj);
+	put_text(writer, "\n");
+	writer->sink = NULL;
+
+	if(writer->objstm_count == PDF_OBJSTM_MAX)
+		flush_objstm(writer);
+}
+
+/*
+ * Write the object stream being filled by the structure pointed to by
+ * writer, if it has any objects, as a new object number, and record
+ * where each of its objects is. The value of writer must not be NULL.
+ */
+static void flush_objstm(struct pdf_writer* writer)
+{
+	struct pdf_buffer head; /* object numbers and offsets */
+	struct pdf_obj* dict = NULL;
+	unsigned long int num = 0;
+	unsigned long int i = 0;
+
+	RT_NOT_NULL(writer);
+
+	if(writer->objstm_count == 0)
+		return;
+
+	memset(&head, 0, sizeof(head));
+	writer->sink = &head;
+
+	for(i = 0; i < writer->objstm_count; ++i)
+		put_text(writer, "%lu %lu ", writer->objstm_nums[i],
+				(unsigned long int) writer->objstm_offsets[i]);
+
+	writer->sink = NULL;
+	num = reserve_pdf_object(writer);
+
+	for(i = 0; i < writer->objstm_count; ++i) {
+		writer->locations[writer->objstm_nums[i]].offset = i;
+		writer->locations[writer->objstm_nums[i]].objstm = num;
+	}
+
+	dict = new_pdf_object(kPDF_OBJ_DICT);
+	set_pdf_key(dict, "Type", new_pdf_name("ObjStm"));
+	set_pdf_key(dict, "N", new_pdf_int((long int) writer->objstm_count));
+	set_pdf_key(dict, "First", new_pdf_int((long int) head.len));
+	append_pdf_buffer(&head, writer->objstm.data, writer->objstm.len);
+	writer->objstm.len = 0;
+	writer->objstm_count = 0;
+
+	if(writer->level > 0) {
+		queue_deflate(writer, num, dict, head.data, head.len);
+	} else {
+		struct pdf_obj stream;
+
+		memset(&stream, 0, sizeof(stream));
+		stream.type = kPDF_OBJ_STREAM;
+		stream.u.stream.dict = dict;
+		stream.u.stream.data = head.data;
+		stream.u.stream.len = head.len;
+		writer->locations[num].offset = writer->pos;
+		put_text(writer, "%lu 0 obj\n", num);
+		put_value(writer, &stream);
+		put_text(writer, "\nendobj\n");
+		free_pdf_object(dict);
+		free(head.data);
+	}
+}
+
+/*
+ * Write the cross-reference stream and the trailer of the PDF being
+ * written through the structure pointed to by writer, with the object
+ * of the given number as its catalog. The value of writer must not be
+ * NULL.
+ */
+static void put_xref_stream(struct pdf_writer* writer, unsigned long int root)
+{
+	struct pdf_obj stream;
+	struct pdf_obj* widths = NULL;
+	struct pdf_buffer data;
+	unsigned long int num = 0;
+	unsigned char* compressed = NULL;
+	uLongf compressed_len = 0;
+	ULONGLONG largest = 0;
+	ULONGLONG xref = 0;
+	int width = 1; /* bytes for an offset or an object stream number */
+	unsigned long int i = 0;
+
+	RT_NOT_NULL(writer);
+
+	num = reserve_pdf_object(writer);
+	xref = writer->pos;
+	writer->locations[num].offset = xref;
+	largest = xref > writer->count ? xref : writer->count;
+
+	while(width < 8 && (largest >> (8 * width)) != 0)
+		++width;
+
+	/* Entries are a type, an offset or stream and a generation or index */
+	memset(&data, 0, sizeof(data));
+	append_pdf_buffer(&data, "\0", 1);
+	append_field(&data, 0, width);
+	append_field(&data, 65535, 2);
+
+	for(i = 1; i < writer->count; ++i) {
+		const struct pdf_location* location = &writer->locations[i];
+
+		append_pdf_buffer(&data, location->objstm != 0 ? "\2" : "\1", 1);
+		append_field(&data, location->objstm != 0 ? location->objstm
+				: location->offset, width);
+		append_field(&data, location->objstm != 0 ? location->offset : 0,
+				2);
+	}
+
+	memset(&stream, 0, sizeof(stream));
+	stream.type = kPDF_OBJ_STREAM;
+	stream.u.stream.dict = new_pdf_object(kPDF_OBJ_DICT);
+	stream.u.stream.data = data.data;
+	stream.u.stream.len = data.len;
+	widths = new_pdf_object(kPDF_OBJ_ARRAY);
+	append_pdf_item(widths, new_pdf_int(1));
+	append_pdf_item(widths, new_pdf_int(width));
+	append_pdf_item(widths, new_pdf_int(2));
+	set_pdf_key(stream.u.stream.dict, "Type", new_pdf_name("XRef"));
+	set_pdf_key(stream.u.stream.dict, "Size", new_pdf_int((long int)
+			writer->count));
+	set_pdf_key(stream.u.stream.dict, "W", widths);
+	set_pdf_key(stream.u.stream.dict, "Root", new_pdf_ref(root));
+
+	if(writer->level > 0 && data.len < ULONG_MAX / 2) {
+		compressed_len = compressBound((uLong) data.len);
+		compressed = (unsigned char*) require_mem(compressed_len);
+
+		if(compress2(compressed, &compressed_len, data.data,
+				(uLong) data.len, writer->level) != Z_OK)
+			errorout(E_MALLOC, _T("Failed to compress a stream"));
+
+		stream.u.stream.data = compressed;
+		stream.u.stream.len = compressed_len;
+		set_pdf_key(stream.u.stream.dict, "Filter",
+				new_pdf_name("FlateDecode"));
+	}
+
+	put_text(writer, "%lu 0 obj\n", num);
+	put_value(writer, &stream);
+	put_text(writer, "\nendobj\nstartxref\n%I64u\n%%%%EOF\n", xref);
+	free_pdf_object(stream.u.stream.dict);
+	free(compressed);
+	free(data.data);
+}
+
+/*
+ * Append the given value to the given buffer as a big-endian number of
+ * the given width in bytes. The value of buffer must not be NULL.
+ */
+static void append_field(struct pdf_buffer* buffer, ULONGLONG value,
+		int width)
+{
+	unsigned char bytes[8];
+	int i = 0;
+
+	RT_NOT_NULL(buffer);
+
+	for(i = width - 1; i >= 0; --i) {
+		bytes[i] = (unsigned char) (value & 0xff);
+		value >>= 8;
+	}
+
+	append_pdf_buffer(buffer, bytes, (size_t) width);
+}
+
+/*
+ * Append the len bytes pointed to by bytes to the given buffer, which
+ * keeps a null byte after its data. The values of buffer and bytes must
+ * not be NULL.
+ */
+void append_pdf_buffer(struct pdf_buffer* buffer, const void* bytes,
+		size_t len)
+{
+	RT_NOT_NULL(buffer);
+	RT_NOT_NULL(bytes);
+
+	if(buffer->len + len + 1 > buffer->capacity) {
+		buffer->capacity = (buffer->len + len + 1) * 2;
+		buffer->data = (unsigned char*) require_realloc(buffer->data,
+				buffer->capacity, 1);
+	}
+
+	memcpy(buffer->data + buffer->len, bytes, len);
+	buffer->len += len;
+	buffer->data[buffer->len] = '\0';
+}
+
+/*
+ * Read every cross-reference section of the PDF of the structure
+ * pointed to by doc, newest first, following /Prev and /XRefStm. An
+ * object keeps the location given by the newest section that lists
+ * it. The value of doc must not be NULL.
+ */
+static void read_xref(struct pdf_doc* doc)
+{
+	size_t offset = 0;
+	unsigned int sections = 0;
+
+	RT_NOT_NULL(doc);
+
+	offset = find_startxref(doc);
+
+	for(;;) {
+		struct pdf_obj* trailer = read_xref_section(doc, offset);
+		long int prev_offset = get_int_key(trailer, "Prev", -1);
+		long int stream_offset = get_int_key(trailer, "XRefStm", -1);
+
+		/* A hybrid file lists its compressed objects in a stream too */
+		if(stream_offset >= 0)
+			free_pdf_object(read_xref_section(doc, (size_t) stream_offset));
+
+		if(doc->trailer == NULL)
+			doc->trailer = trailer;
+		else
+			free_pdf_object(trailer);
+
+		if(prev_offset < 0 || ++sections == PDF_MAX_XREF_SECTIONS)
+			break;
+
+		offset = (size_t) prev_offset;
+	}
+}
+
+/*
+ * Return the byte offset given after the last startxref keyword of the
+ * PDF of the structure pointed to by doc. The value of doc must not be
+ * NULL.
+ */
+static size_t find_startxref(struct pdf_doc* doc)
+{
+	static const char keyword[] = "startxref";
+	struct pdf_lexer lex;
+	const unsigned char* start = NULL;
+	unsigned long int offset = 0;
+
+	RT_NOT_NULL(doc);
+
+	start = doc->data + (doc->size > PDF_TAIL_LEN ?
+			doc->size - PDF_TAIL_LEN : 0);
+	init_lexer(&lex, doc, doc->data, doc->size, doc->size);
+
+	for(lex.pos = lex.end - (sizeof(keyword) - 1); lex.pos >= start;
+			--lex.pos)
+		if(memcmp(lex.pos, keyword, sizeof(keyword) - 1) == 0)
+			break;
+
+	if(lex.pos < start)
+		errorout(E_PDF, _T("PDF '%s' has no startxref"), doc->path);
+
+	lex.pos += sizeof(keyword) - 1;
+
+	if(!read_uint(&lex, &offset))
+		malformed(&lex);
+
+	return (size_t) offset;
+}
+
+/*
+ * Read the cross-reference section at the given byte offset of the PDF
+ * of the structure pointed to by doc into its table and return the
+ * trailer dictionary after it. The section is either a table or a
+ * cross-reference stream, whose dictionary is its trailer. The value of
+ * doc must not be NULL. The object returned must be passed to
+ * free_pdf_object().
+ */
+static struct pdf_obj* read_xref_section(struct pdf_doc* doc, size_t offset)
+{
+	struct pdf_lexer lex;
+	struct pdf_obj* trailer = NULL;
+	struct pdf_obj* size = NULL;
+	unsigned long int num = 0;
+
+	RT_NOT_NULL(doc);
+
+	init_lexer(&lex, doc, doc->data, doc->size, offset);
+
+	if(!match_keyword(&lex, "xref"))
+		return read_xref_stream(&lex);
+
+	while(!match_keyword(&lex, "trailer")) {
+		unsigned long int first = 0;
+		unsigned long int count = 0;
+
+		if(!read_uint(&lex, &first) || !read_uint(&lex, &count)
+				|| first > PDF_MAX_OBJECTS || count > PDF_MAX_OBJECTS - first)
+			malformed(&lex);
+
+		grow_xref(doc, first + count);
+
+		for(num = first; num < first + count; ++num) {
+			struct pdf_xref* entry = &doc->xref[num];
+			unsigned long int entry_offset = 0;
+			unsigned long int gen = 0;
+			int used = 0;
+
+			if(!read_uint(&lex, &entry_offset) || !read_uint(&lex, &gen))
+				malformed(&lex);
+
+			if(match_keyword(&lex, "n"))
+				used = 1;
+			else if(!match_keyword(&lex, "f"))
+				malformed(&lex);
+
+			/* Sections are read newest first */
+			if(entry->state != kXREF_UNSEEN)
+				continue;
+
+			entry->state = used && entry_offset != 0 ? kXREF_USED
+					: kXREF_FREE;
+			entry->offset = (size_t) entry_offset;
+			entry->gen = (unsigned int) gen;
+		}
+	}
+
+	trailer = parse_value(&lex, 0);
+
+	if(trailer->type != kPDF_OBJ_DICT)
+		malformed(&lex);
+
+	size = get_pdf_key(trailer, "Size");
+
+	if(size != NULL && size->type == kPDF_OBJ_INT && size->u.integer > 0
+			&& size->u.integer <= PDF_MAX_OBJECTS)
+		grow_xref(doc, (unsigned long int) size->u.integer);
+
+	return trailer;
+}
+
+/*
+ * Read the cross-reference stream at the position of the given lexer
+ * into the table of its document and return a copy of its dictionary.
+ * The value of lex must not be NULL. The object returned must be
+ * passed to free_pdf_object().
+ */
+static struct pdf_obj* read_xref_stream(struct pdf_lexer* lex)
+{
+	struct pdf_doc* doc = NULL;
+	struct pdf_obj* stream = NULL;
+	struct pdf_obj* trailer = NULL;
+	struct pdf_obj* widths = NULL; /* /W: bytes in each field */
+	struct pdf_obj* index = NULL; /* /Index: first and count of each run */
+	unsigned char* data = NULL;
+	const unsigned char* entry = NULL;
+	size_t len = 0;
+	long int w[3] = { 0, 0, 0 };
+	long int size = 0;
+	unsigned long int num = 0;
+	size_t run = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(lex);
+
+	doc = lex->doc;
+	stream = parse_indirect(lex, &num, 1);
+	widths = get_pdf_key(stream, "W");
+	index = get_pdf_key(stream, "Index");
+	size = get_int_key(stream, "Size", -1);
+
+	if(stream->type != kPDF_OBJ_STREAM
+			|| !is_pdf_name(get_pdf_key(stream, "Type"), "XRef")
+			|| widths == NULL || widths->type != kPDF_OBJ_ARRAY
+			|| widths->u.array.count != 3 || size < 0
+			|| size > PDF_MAX_OBJECTS
+			|| (index != NULL && index->type != kPDF_OBJ_ARRAY))
+		malformed(lex);
+
+	for(i = 0; i < 3; ++i) {
+		const struct pdf_obj* width = widths->u.array.items[i];
+
+		if(width->type != kPDF_OBJ_INT || width->u.integer < 0
+				|| width->u.integer > 8)
+			malformed(lex);
+
+		w[i] = width->u.integer;
+	}
+
+	data = decode_pdf_stream(stream, &len);
+	entry = data;
+
+	/* Without /Index, the stream lists every object from 0 to /Size */
+	for(run = 0; index == NULL ? run < 1 : run + 1 < index->u.array.count;
+			run += 2) {
+		long int first = 0;
+		long int count = size;
+
+		if(index != NULL) {
+			if(index->u.array.items[run]->type != kPDF_OBJ_INT
+					|| index->u.array.items[run + 1]->type != kPDF_OBJ_INT)
+				malformed(lex);
+
+			first = index->u.array.items[run]->u.integer;
+			count = index->u.array.items[run + 1]->u.integer;
+		}
+
+		if(first < 0 || count < 0 || first > PDF_MAX_OBJECTS
+				|| count > PDF_MAX_OBJECTS - first)
+			malformed(lex);
+
+		grow_xref(doc, (unsigned long int) (first + count));
+
+		for(num = (unsigned long int) first;
+				num < (unsigned long int) (first + count); ++num) {
+			struct pdf_xref* xref = &doc->xref[num];
+			unsigned long int type = 1; /* the type if /W omits it */
+			unsigned long int field2 = 0;
+			unsigned long int field3 = 0;
+
+			if((size_t) (data + len - entry) < (size_t) (w[0] + w[1] + w[2]))
+				malformed(lex);
+
+			if(w[0] > 0)
+				type = read_field(entry, w[0]);
+
+			field2 = read_field(entry + w[0], w[1]);
+			field3 = read_field(entry + w[0] + w[1], w[2]);
+			entry += w[0] + w[1] + w[2];
+
+			/*
+			 * Sections are read newest first, but the table of a
+			 * hybrid file lists objects of its stream as free.
+			 */
+			if(xref->state != kXREF_UNSEEN
+					&& (xref->state != kXREF_FREE || type != 2))
+				continue;
+
+			if(type == 1 && field2 != 0) {
+				xref->state = kXREF_USED;
+				xref->offset = (size_t) field2;
+				xref->gen = (unsigned int) field3;
+			} else if(type == 2) {
+				xref->state = kXREF_COMPRESSED;
+				xref->offset = (size_t) field2;
+				xref->gen = (unsigned int) field3;
+			} else if(type <= 2) {
+				xref->state = kXREF_FREE;
+			}
+		}
+	}
+
+	grow_xref(doc, (unsigned long int) size);
+	trailer = clone_pdf_object(stream->u.stream.dict);
+	free(data);
+	free_pdf_object(stream);
+
+	return trailer;
+}
+
+/*
+ * Return the big-endian number of the given width in bytes at the
+ * given pointer. The value of bytes must not be NULL.
+ */
+static unsigned long int read_field(const unsigned char* bytes, long int width)
+{
+	unsigned long int value = 0;
+
+	RT_NOT_NULL(bytes);
+
+	while(width-- > 0)
+		value = (value << 8) | *bytes++;
+
+	return value;
+}
+
+/*
+ * Make the cross-reference table of the structure pointed to by doc
+ * hold at least count entries. New entries are kXREF_UNSEEN. The value
+ * of doc must not be NULL.
+ */
+static void grow_xref(struct pdf_doc* doc, unsigned long int count)
+{
+	RT_NOT_NULL(doc);
+
+	if(count <= doc->xref_count)
+		return;
+
+	doc->xref = (struct pdf_xref*) require_realloc(doc->xref, count,
+			sizeof(*doc->xref));
+	memset(&doc->xref[doc->xref_count], 0,
+			(count - doc->xref_count) * sizeof(*doc->xref));
+	doc->xref_count = count;
+}
+
+/*
+ * Parse the object with the given number from the PDF of the structure
+ * pointed to by doc, with its stream data if streams is nonzero. An
+ * object that is free or not in the file is null. The value of doc must
+ * not be NULL. The object returned must be passed to free_pdf_object().
+ */
+static struct pdf_obj* parse_object(struct pdf_doc* doc, unsigned long int num,
+		int streams)
+{
+	struct pdf_lexer lex;
+	struct pdf_obj* obj = NULL;
+	unsigned long int found = 0;
+
+	RT_NOT_NULL(doc);
+
+	if(num < doc->xref_count && doc->xref[num].state == kXREF_COMPRESSED)
+		return parse_compressed(doc, num);
+
+	if(num >= doc->xref_count || doc->xref[num].state != kXREF_USED)
+		return new_pdf_object(kPDF_OBJ_NULL);
+
+	init_lexer(&lex, doc, doc->data, doc->size, doc->xref[num].offset);
+	obj = parse_indirect(&lex, &found, streams);
+
+	if(found != num)
+		malformed(&lex);
+
+	return obj;
+}
+
+/*
+ * Parse the indirect object at the position of the given lexer, with
+ * its stream data if streams is nonzero, and store its number in the
+ * value pointed to by num. The values of lex and num must not be NULL.
+ * The object returned must be passed to free_pdf_object().
+ */
+static struct pdf_obj* parse_indirect(struct pdf_lexer* lex,
+		unsigned long int* num, int streams)
+{
+	struct pdf_doc* doc = NULL;
+	struct pdf_obj* obj = NULL;
+	unsigned long int gen = 0;
+
+	RT_NOT_NULL(lex);
+	RT_NOT_NULL(num);
+
+	doc = lex->doc;
+
+	if(!read_uint(lex, num) || !read_uint(lex, &gen)
+			|| !match_keyword(lex, "obj"))
+		malformed(lex);
+
+	obj = parse_value(lex, 0);
+
+	if(obj->type == kPDF_OBJ_DICT && match_keyword(lex, "stream")) {
+		struct pdf_obj* stream = new_pdf_object(kPDF_OBJ_STREAM);
+		struct pdf_obj* length = get_pdf_key(obj, "Length");
+		size_t len = (size_t) -1;
+
+		stream->u.stream.dict = obj;
+
+		/*
+		 * A length in an object stream is not looked up, since that
+		 * could lead back here; the data then runs up to endstream.
+		 */
+		if(length != NULL && length->type == kPDF_OBJ_REF && streams
+				&& length->u.ref.num != *num
+				&& length->u.ref.num < doc->xref_count
+				&& doc->xref[length->u.ref.num].state == kXREF_USED) {
+			struct pdf_obj* value = parse_object(doc, length->u.ref.num, 0);
+
+			if(value->type == kPDF_OBJ_INT && value->u.integer >= 0)
+				len = (size_t) value->u.integer;
+
+			free_pdf_object(value);
+		} else if(length != NULL && length->type == kPDF_OBJ_INT
+				&& length->u.integer >= 0) {
+			len = (size_t) length->u.integer;
+		}
+
+		if(streams)
+			read_stream(lex, stream, len);
+
+		obj = stream;
+	}
+
+	return obj;
+}
+
+/*
+ * Parse the object with the given number from the object stream that
+ * holds it in the PDF of the structure pointed to by doc. The last
+ * object stream used stays decoded in the structure, since objects are
+ * mostly loaded in the order they were written. The value of doc must
+ * not be NULL. The object returned must be passed to free_pdf_object().
+ */
+static struct pdf_obj* parse_compressed(struct pdf_doc* doc,
+		unsigned long int num)
+{
+	struct pdf_lexer lex;
+	unsigned long int stream_num = 0;
+	unsigned long int index = 0;
+	unsigned long int found = 0;
+	unsigned long int offset = 0;
+	unsigned long int i = 0;
+
+	RT_NOT_NULL(doc);
+
+	stream_num = (unsigned long int) doc->xref[num].offset;
+	index = doc->xref[num].gen;
+
+	if(doc->objstm == NULL || doc->objstm_num != stream_num) {
+		struct pdf_obj* stream = NULL;
+		long int first = 0;
+
+		if(stream_num >= doc->xref_count
+				|| doc->xref[stream_num].state != kXREF_USED)
+			errorout(E_PDF, _T("Object %lu of PDF '%s' is in a missing ")
+					_T("object stream"), num, doc->path);
+
+		stream = parse_object(doc, stream_num, 1);
+		first = get_int_key(stream, "First", -1);
+
+		if(stream->type != kPDF_OBJ_STREAM || first < 0)
+			errorout(E_PDF, _T("Malformed object stream %lu in PDF '%s'"),
+					stream_num, doc->path);
+
+		free(doc->objstm);
+		doc->objstm = NULL;
+		doc->objstm = decode_pdf_stream(stream, &doc->objstm_len);
+		doc->objstm_num = stream_num;
+		doc->objstm_first = (size_t) first;
+		free_pdf_object(stream);
+	}
+
+	/* The stream starts with a number and an offset for each object */
+	init_lexer(&lex, doc, doc->objstm, doc->objstm_len, 0);
+
+	for(i = 0; i <= index; ++i)
+		if(!read_uint(&lex, &found) || !read_uint(&lex, &offset))
+			malformed(&lex);
+
+	if(found != num || offset > doc->objstm_len - doc->objstm_first
+			|| doc->objstm_first > doc->objstm_len)
+		malformed(&lex);
+
+	lex.pos = doc->objstm + doc->objstm_first + offset;
+
+	return parse_value(&lex, 0);
+}
+
+/*
+ * Return the given data inflated by zlib and store its length in the
+ * value pointed to by len. Data cut off at the end of the input is
+ * kept. The values of data and len must not be NULL. The pointer
+ * returned must be passed to free().
+ */
+static unsigned char* inflate_bytes(const unsigned char* data, size_t size,
+		size_t* len)
+{
+	z_stream zs;
+	unsigned char* out = NULL;
+	size_t capacity = 0;
+	int ret = Z_OK;
+
+	RT_NOT_NULL(data);
+	RT_NOT_NULL(len);
+
+	memset(&zs, 0, sizeof(zs));
+
+	if(inflateInit(&zs) != Z_OK)
+		errorout(E_MALLOC, _T("Failed to initialize zlib"));
+
+	capacity = size * 4 + 64;
+	out = (unsigned char*) require_mem(capacity);
+	zs.next_in = (Bytef*) data;
+	zs.avail_in = (uInt) size;
+
+	do {
+		if(zs.total_out == capacity) {
+			capacity *= 2;
+			out = (unsigned char*) require_realloc(out, capacity, 1);
+		}
+
+		zs.next_out = out + zs.total_out;
+		zs.avail_out = (uInt) (capacity - zs.total_out);
+		ret = inflate(&zs, Z_NO_FLUSH);
+	} while(ret == Z_OK);
+
+	*len = zs.total_out;
+	inflateEnd(&zs);
+
+	if(ret != Z_STREAM_END && (ret != Z_BUF_ERROR || zs.avail_in != 0))
+		errorout(E_PDF, _T("Corrupt compressed stream (%d)"), ret);
+
+	return out;
+}
+
+/*
+ * Undo the PNG predictor described by the given decode parameters on
+ * the len bytes pointed to by data, in place, and return the number of
+ * bytes left. Each row starts with a byte giving its PNG filter. The
+ * value of data must not be NULL.
+ */
+static size_t unpredict_png(unsigned char* data, size_t len,
+		const struct pdf_obj* parms)
+{
+	long int colors = get_int_key(parms, "Colors", 1);
+	long int bits = get_int_key(parms, "BitsPerComponent", 8);
+	long int columns = get_int_key(parms, "Columns", 1);
+	unsigned char* prior = NULL; /* previous row, decoded */
+	size_t pixel = 0; /* bytes per pixel, at least 1 */
+	size_t row = 0; /* bytes per row, without the filter byte */
+	size_t rows = 0;
+	size_t r = 0;
+
+	RT_NOT_NULL(data);
+
+	if(colors < 1 || colors > 32 || bits < 1 || bits > 16 || columns < 1
+			|| columns > PDF_MAX_COLUMNS)
+		errorout(E_PDF, _T("Unsupported stream predictor parameters"));
+
+	pixel = (size_t) (colors * bits + 7) / 8;
+	row = (size_t) (colors * bits * columns + 7) / 8;
+	rows = len / (row + 1);
+	prior = (unsigned char*) require_cmem(row, 1);
+
+	/* Rows shrink by a byte each, so every row is moved back in place */
+	for(r = 0; r < rows; ++r) {
+		const unsigned char* in = data + r * (row + 1) + 1;
+		unsigned char* out = data + r * row;
+		int filter = in[-1];
+		size_t i = 0;
+
+		for(i = 0; i < row; ++i) {
+			int a = i >= pixel ? out[i - pixel] : 0; /* left */
+			int b = prior[i]; /* above */
+			int c = i >= pixel ? prior[i - pixel] : 0; /* above left */
+			int value = in[i];
+
+			switch(filter) {
+			case 1:
+				value += a;
+				break;
+			case 2:
+				value += b;
+				break;
+			case 3:
+				value += (a + b) / 2;
+				break;
+			case 4: {
+				int p = a + b - c;
+				int pa = abs(p - a);
+				int pb = abs(p - b);
+				int pc = abs(p - c);
+
+				value += pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+				break;
+			}
+			default:
+				break;
+			}
+
+			out[i] = (unsigned char) value;
+		}
+
+		memcpy(prior, out, row);
+	}
+
+	free(prior);
+
+	return rows * row;
+}
+
+/*
+ * Return the value of the given integer key of the given dictionary or
+ * stream, or def if obj is NULL or the key is missing or not a direct
+ * integer. The value of key must not be NULL.
+ */
+static long int get_int_key(const struct pdf_obj* obj, const char* key,
+		long int def)
+{
+	const struct pdf_obj* value = get_pdf_key(obj, key);
+
+	return value != NULL && value->type == kPDF_OBJ_INT ? value->u.integer
+			: def;
+}
+
+/*
+ * Set the data of the given stream to the bytes after the stream
+ * keyword the given lexer just read. If len does not lead to the
+ * endstream keyword, the data runs up to the first one instead, so a
+ * wrong /Length is tolerated. The /Length of the stream is then set to
+ * the length found. The values of lex and stream must not be NULL.
+ */
+static void read_stream(struct pdf_lexer* lex, struct pdf_obj* stream,
+		size_t len)
+{
+	const unsigned char* data = NULL;
+	const unsigned char* end = NULL;
+
+	RT_NOT_NULL(lex);
+	RT_NOT_NULL(stream);
+
+	/* The keyword is followed by CRLF or LF, or by CR in broken files */
+	data = lex->pos;
+
+	if(data < lex->end && *data == '\r')
+		++data;
+
+	if(data < lex->end && *data == '\n')
+		++data;
+
+	if(len <= (size_t) (lex->end - data)) {
+		lex->pos = data + len;
+		skip_space(lex);
+
+		if(!match_keyword(lex, "endstream"))
+			len = (size_t) -1;
+	}
+
+	if(len > (size_t) (lex->end - data)) {
+		end = find_bytes(data, lex->end, "endstream");
+
+		if(end == NULL) {
+			lex->pos = data;
+			malformed(lex);
+		}
+
+		if(end > data && end[-1] == '\n')
+			--end;
+
+		if(end > data && end[-1] == '\r')
+			--end;
+
+		len = (size_t) (end - data);
+	}
+
+	stream->u.stream.data = data;
+	stream->u.stream.len = len;
+	stream->u.stream.owned = 0;
+	set_pdf_key(stream, "Length", new_pdf_int((long int) len));
+}
+
+/*
+ * Return a pointer to the first occurrence of the given text in the
+ * bytes from start up to end, or NULL if there is none. The values of
+ * start, end and text must not be NULL.
+ */
+static const unsigned char* find_bytes(const unsigned char* start,
+		const unsigned char* end, const char* text)
+{
+	size_t len = 0;
+
+	RT_NOT_NULL(start);
+	RT_NOT_NULL(end);
+	RT_NOT_NULL(text);
+
+	len = strlen(text);
+
+	for(; (size_t) (end - start) >= len; ++start) {
+		start = (const unsigned char*) memchr(start, text[0],
+				(size_t) (end - start) - len + 1);
+
+		if(start == NULL)
+			return NULL;
+
+		if(memcmp(start, text, len) == 0)
+			return start;
+	}
+
+	return NULL;
+}
+
+/*
+ * Parse the object at the position of the given lexer, nested in depth
+ * arrays and dictionaries. The value of lex must not be NULL. The
+ * object returned must be passed to free_pdf_object().
+ */
+static struct pdf_obj* parse_value(struct pdf_lexer* lex, int depth)
+{
+	struct pdf_obj* obj = NULL;
+	int c = 0;
+
+	RT_NOT_NULL(lex);
+
+	skip_space(lex);
+
+	if(depth > PDF_MAX_DEPTH || lex->pos >= lex->end)
+		malformed(lex);
+
+	c = *lex->pos;
+
+	switch(c) {
+	case '/':
+		return parse_name(lex);
+	case '(':
+		return parse_literal(lex);
+	case '[':
+		return parse_array(lex, depth);
+	case '<':
+		if(lex->pos + 1 < lex->end && lex->pos[1] == '<')
+			return parse_dict(lex, depth);
+
+		return parse_hex(lex);
+	default:
+		break;
+	}
+
+	if(c == '+' || c == '-' || c == '.' || (c >= '0' && c <= '9'))
+		return parse_number(lex);
+
+	if(match_keyword(lex, "null"))
+		return new_pdf_object(kPDF_OBJ_NULL);
+
+	if(match_keyword(lex, "true")) {
+		obj = new_pdf_object(kPDF_OBJ_BOOL);
+		obj->u.boolean = 1;
+		return obj;
+	}
+
+	if(match_keyword(lex, "false"))
+		return new_pdf_object(kPDF_OBJ_BOOL);
+
+	malformed(lex);
+	return NULL;
+}
+
+/*
+ * Parse the integer, real or indirect reference at the position of the
+ * given lexer. The value of lex must not be NULL. The object returned
+ * must be passed to free_pdf_object().
+ */
+static struct pdf_obj* parse_number(struct pdf_lexer* lex)
+{
+	struct pdf_obj* obj = NULL;
+	const unsigned char* start = NULL;
+	char number[PDF_MAX_NUMBER + 1] = "";
+	size_t len = 0;
+	int real = 0;
+	int digits = 0;
+
+	RT_NOT_NULL(lex);
+
+	start = lex->pos;
+
+	if(*lex->pos == '+' || *lex->pos == '-')
+		++lex->pos;
+
+	for(; lex->pos < lex->end; ++lex->pos) {
+		if(*lex->pos == '.' && !real)
+			real = 1;
+		else if(*lex->pos >= '0' && *lex->pos <= '9')
+			digits = 1;
+		else
+			break;
+	}
+
+	len = (size_t) (lex->pos - start);
+
+	if(!digits || len > PDF_MAX_NUMBER)
+		malformed(lex);
+
+	memcpy(number, start, len);
+	number[len] = '\0';
+
+	if(real) {
+		obj = new_pdf_object(kPDF_OBJ_REAL);
+		obj->u.text = dup_bytes(number, len);
+		return obj;
+	}
+
+	obj = new_pdf_int(strtol(number, NULL, 10));
+
+	/* An unsigned integer may start an indirect reference */
+	if(*start != '+' && *start != '-') {
+		const unsigned char* after = lex->pos;
+		unsigned long int gen = 0;
+
+		if(read_uint(lex, &gen) && match_keyword(lex, "R")) {
+			obj->type = kPDF_OBJ_REF;
+			obj->u.ref.num = strtoul(number, NULL, 10);
+			obj->u.ref.gen = (unsigned int) gen;
+		} else {
+			lex->pos = after;
+		}
+	}
+
+	return obj;
+}
+
+/*
+ * Parse the name at the position of the given lexer, which is a slash.
+ * The value of lex must not be NULL. The object returned must be passed
+ * to free_pdf_object().
+ */
+static struct pdf_obj* parse_name(struct pdf_lexer* lex)
+{
+	struct pdf_obj* obj = NULL;
+	const unsigned char* start = NULL;
+
+	RT_NOT_NULL(lex);
+
+	start = ++lex->pos;
+
+	while(lex->pos < lex->end && !is_space(*lex->pos)
+			&& !is_delimiter(*lex->pos))
+		++lex->pos;
+
+	obj = new_pdf_object(kPDF_OBJ_NAME);
+	obj->u.text = dup_bytes((const char*) start, (size_t) (lex->pos - start));
+
+	return obj;
+}
+
+/*
+ * Parse the literal string at the position of the given lexer, which
+ * is an opening parenthesis. The value of lex must not be NULL. The
+ * object returned must be passed to free_pdf_object().
+ */
+static struct pdf_obj* parse_literal(struct pdf_lexer* lex)
+{
+	struct pdf_obj* obj = NULL;
+	size_t len = 0;
+
+	RT_NOT_NULL(lex);
+
+	/* Measure the string first so that it is decoded in one buffer */
+	len = decode_literal(lex, NULL);
+	obj = new_pdf_object(kPDF_OBJ_STRING);
+	obj->u.string.data = (char*) require_mem(len + 1);
+	obj->u.string.len = decode_literal(lex, obj->u.string.data);
+
+	return obj;
+}
+
+/*
+ * Decode the literal string at the position of the given lexer into
+ * the buffer pointed to by out and return its length. If out is NULL,
+ * the length is returned without decoding or moving the lexer. The
+ * value of lex must not be NULL.
+ */
+static size_t decode_literal(struct pdf_lexer* lex, char* out)
+{
+	const unsigned char* pos = NULL;
+	size_t len = 0;
+	int depth = 0;
+
+	RT_NOT_NULL(lex);
+
+	for(pos = lex->pos; pos < lex->end; ++pos) {
+		int c = *pos;
+
+		if(c == '(') {
+			if(depth++ == 0)
+				continue;
+		} else if(c == ')') {
+			if(--depth == 0)
+				break;
+		} else if(c == '\\' && pos + 1 < lex->end) {
+			c = *++pos;
+
+			switch(c) {
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case '\r':
+				if(pos + 1 < lex->end && pos[1] == '\n')
+					++pos;
+
+				continue;
+			case '\n':
+				continue;
+			default:
+				if(c >= '0' && c <= '7') {
+					int digits = 1;
+
+					c -= '0';
+
+					while(digits++ < 3 && pos + 1 < lex->end
+							&& pos[1] >= '0' && pos[1] <= '7')
+						c = c * 8 + *++pos - '0';
+				}
+
+				break;
+			}
+		}
+
+		if(out != NULL)
+			out[len] = (char) c;
+
+		++len;
+	}
+
+	if(pos >= lex->end)
+		malformed(lex);
+
+	if(out != NULL) {
+		out[len] = '\0';
+		lex->pos = pos + 1;
+	}
+
+	return len;
+}
+
+/*
+ * Parse the hexadecimal string at the position of the given lexer,
+ * which is a less-than sign. The value of lex must not be NULL. The
+ * object returned must be passed to free_pdf_object().
+ */
+static struct pdf_obj* parse_hex(struct pdf_lexer* lex)
+{
+	struct pdf_obj* obj = NULL;
+	const unsigned char* end = NULL;
+	size_t len = 0;
+	int high = -1; /* first digit of a byte, or -1 */
+
+	RT_NOT_NULL(lex);
+
+	end = (const unsigned char*) memchr(lex->pos, '>',
+			(size_t) (lex->end - lex->pos));
+
+	if(end == NULL)
+		malformed(lex);
+
+	obj = new_pdf_object(kPDF_OBJ_STRING);
+	obj->u.string.data = (char*) require_mem(
+			(size_t) (end - lex->pos) / 2 + 2);
+
+	for(++lex->pos; lex->pos < end; ++lex->pos) {
+		int digit = hex_value(*lex->pos);
+
+		if(digit < 0) {
+			if(!is_space(*lex->pos))
+				malformed(lex);
+		} else if(high < 0) {
+			high = digit;
+		} else {
+			obj->u.string.data[len++] = (char) (high * 16 + digit);
+			high = -1;
+		}
+	}
+
+	/* A missing last digit is zero */
+	if(high >= 0)
+		obj->u.string.data[len++] = (char) (high * 16);
+
+	obj->u.string.data[len] = '\0';
+	obj->u.string.len = len;
+	lex->pos = end + 1;
+
+	return obj;
+}
+
+/*
+ * Parse the array at the position of the given lexer, which is nested
+ * in depth arrays and dictionaries. The value of lex must not be NULL.
+ * The object returned must be passed to free_pdf_object().
+ */
+static struct pdf_obj* parse_array(struct pdf_lexer* lex, int depth)
+{
+	struct pdf_obj* obj = NULL;
+
+	RT_NOT_NULL(lex);
+
+	++lex->pos;
+	obj = new_pdf_object(kPDF_OBJ_ARRAY);
+
+	for(;;) {
+		skip_space(lex);
+
+		if(lex->pos >= lex->end)
+			malformed(lex);
+
+		if(*lex->pos == ']')
+			break;
+
+		append_pdf_item(obj, parse_value(lex, depth + 1));
+	}
+
+	++lex->pos;
+
+	return obj;
+}
+
+/*
+ * Parse the dictionary at the position of the given lexer, which is
+ * nested in depth arrays and dictionaries. The value of lex must not be
+ * NULL. The object returned must be passed to free_pdf_object().
+ */
+static struct pdf_obj* parse_dict(struct pdf_lexer* lex, int depth)
+{
+	struct pdf_obj* obj = NULL;
+
+	RT_NOT_NULL(lex);
+
+	lex->pos += 2;
+	obj = new_pdf_object(kPDF_OBJ_DICT);
+
+	for(;;) {
+		struct pdf_obj* key = NULL;
+		struct pdf_pair* pairs = NULL;
+
+		skip_space(lex);
+
+		if(lex->pos + 1 >= lex->end)
+			malformed(lex);
+
+		if(lex->pos[0] == '>' && lex->pos[1] == '>')
+			break;
+
+		if(*lex->pos != '/')
+			malformed(lex);
+
+		key = parse_name(lex);
+		pairs = (struct pdf_pair*) require_realloc(obj->u.dict.pairs,
+				obj->u.dict.count + 1, sizeof(*pairs));
+		pairs[obj->u.dict.count].key = key->u.text;
+		key->u.text = NULL;
+		free_pdf_object(key);
+		obj->u.dict.pairs = pairs;
+		pairs[obj->u.dict.count].value = parse_value(lex, depth + 1);
+		++obj->u.dict.count;
+	}
+
+	lex->pos += 2;
+
+	return obj;
+}
+
+/*
+ * Read an unsigned integer at the position of the given lexer into the
+ * value pointed to by value and return nonzero. If there is none, zero
+ * is returned and the lexer is only moved past white space. The values
+ * of lex and value must not be NULL.
+ */
+static int read_uint(struct pdf_lexer* lex, unsigned long int* value)
+{
+	const unsigned char* start = NULL;
+	unsigned long int result = 0;
+
+	RT_NOT_NULL(lex);
+	RT_NOT_NULL(value);
+
+	skip_space(lex);
+	start = lex->pos;
+
+	for(; lex->pos < lex->end && *lex->pos >= '0' && *lex->pos <= '9';
+			++lex->pos)
+		result = result * 10 + (unsigned long int) (*lex->pos - '0');
+
+	if(lex->pos == start
+			|| (lex->pos < lex->end && !is_space(*lex->pos)
+					&& !is_delimiter(*lex->pos))) {
+		lex->pos = start;
+		return 0;
+	}
+
+	*value = result;
+
+	return 1;
+}
+
+/*
+ * Move the given lexer past white space and the given keyword and
+ * return nonzero if the keyword comes next as a whole token. Otherwise,
+ * zero is returned and the lexer is only moved past white space. The
+ * values of lex and keyword must not be NULL.
+ */
+static int match_keyword(struct pdf_lexer* lex, const char* keyword)
+{
+	size_t len = 0;
+
+	RT_NOT_NULL(lex);
+	RT_NOT_NULL(keyword);
+
+	skip_space(lex);
+	len = strlen(keyword);
+
+	if((size_t) (lex->end - lex->pos) < len
+			|| memcmp(lex->pos, keyword, len) != 0)
+		return 0;
+
+	if(lex->pos + len < lex->end && !is_space(lex->pos[len])
+			&& !is_delimiter(lex->pos[len]))
+		return 0;
+
+	lex->pos += len;
+
+	return 1;
+}
+
+/*
+ * Move the given lexer past white space and comments. The value of lex
+ * must not be NULL.
+ */
+static void skip_space(struct pdf_lexer* lex)
+{
+	RT_NOT_NULL(lex);
+
+	while(lex->pos < lex->end) {
+		if(*lex->pos == '%') {
+			while(lex->pos < lex->end && *lex->pos != '\r'
+					&& *lex->pos != '\n')
+				++lex->pos;
+		} else if(is_space(*lex->pos)) {
+			++lex->pos;
+		} else {
+			break;
+		}
+	}
+}
+
+/*
+ * Return nonzero if the given byte is PDF white space.
+ */
+static int is_space(int c)
+{
+	return c == '\0' || c == '\t' || c == '\n' || c == '\f' || c == '\r'
+			|| c == ' ';
+}
+
+/*
+ * Return nonzero if the given byte is a PDF delimiter.
+ */
+static int is_delimiter(int c)
+{
+	return c != '\0' && strchr("()<>[]{}/%", c) != NULL;
+}
+
+/*
+ * Return the value of the given hexadecimal digit, or -1 if it is not
+ * one.
+ */
+static int hex_value(int c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+/*
+ * Set the given lexer to read the len bytes at start, which belong to
+ * the PDF of the structure pointed to by doc, from the given offset on.
+ * The values of lex, doc and start must not be NULL.
+ */
+static void init_lexer(struct pdf_lexer* lex, struct pdf_doc* doc,
+		const unsigned char* start, size_t len, size_t offset)
+{
+	RT_NOT_NULL(lex);
+	RT_NOT_NULL(doc);
+	RT_NOT_NULL(start);
+
+	lex->doc = doc;
+	lex->start = start;
+	lex->pos = start + (offset < len ? offset : len);
+	lex->end = start + len;
+}
+
+/*
+ * Terminate execution because the PDF read by the given lexer is
+ * malformed at its position. The value of lex must not be NULL.
+ */
+static void malformed(const struct pdf_lexer* lex)
+{
+	RT_NOT_NULL(lex);
+
+	errorout(E_PDF, _T("Malformed PDF '%s' near byte %lu%s"), lex->doc->path,
+			(unsigned long int) (lex->pos - lex->start),
+			lex->start == lex->doc->data ? _T("") : _T(" of a stream"));
+}
+
+/*
+ * Return a copy of the given len bytes with a terminating null byte.
+ * The value of bytes must not be NULL. The pointer returned must be
+ * passed to free().
+ */
+static char* dup_bytes(const char* bytes, size_t len)
+{
+	char* copy = NULL;
+
+	RT_NOT_NULL(bytes);
+
+	copy = (char*) require_mem(len + 1);
+	memcpy(copy, bytes, len);
+	copy[len] = '\0';
+
+	return copy;
+}
+
+/*
+ * Write the given object as PDF syntax through the structure pointed
+ * to by writer. The values of writer and obj must not be NULL.
+ */
+static void put_value(struct pdf_writer* writer, const struct pdf_obj* obj)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(writer);
+	RT_NOT_NULL(obj);
+
+	switch(obj->type) {
+	case kPDF_OBJ_NULL:
+		put_text(writer, "null");
+		break;
+	case kPDF_OBJ_BOOL:
+		put_text(writer, obj->u.boolean ? "true" : "false");
+		break;
+	case kPDF_OBJ_INT:
+		put_text(writer, "%ld", obj->u.integer);
+		break;
+	case kPDF_OBJ_REAL:
+		put_text(writer, "%s", obj->u.text);
+		break;
+	case kPDF_OBJ_STRING:
+		put_string(writer, obj);
+		break;
+	case kPDF_OBJ_NAME:
+		put_text(writer, "/%s", obj->u.text);
+		break;
+	case kPDF_OBJ_ARRAY:
+		put_text(writer, "[");
+
+		for(i = 0; i < obj->u.array.count; ++i) {
+			if(i > 0)
+				put_text(writer, " ");
+
+			put_value(writer, obj->u.array.items[i]);
+		}
+
+		put_text(writer, "]");
+		break;
+	case kPDF_OBJ_DICT:
+		put_dict(writer, obj, NULL);
+		break;
+	case kPDF_OBJ_REF:
+		put_text(writer, "%lu %u R", obj->u.ref.num, obj->u.ref.gen);
+		break;
+	case kPDF_OBJ_STREAM:
+		put_dict(writer, obj->u.stream.dict, &obj->u.stream.len);
+		put_text(writer, "\nstream\n");
+		put_bytes(writer, obj->u.stream.data, obj->u.stream.len);
+		put_text(writer, "\nendstream");
+		break;
+	}
+}
+
+/*
+ * Write the given dictionary through the structure pointed to by
+ * writer. If length is not NULL, the dictionary belongs to a stream
+ * and its /Length is written as the value pointed to by length. The
+ * values of writer and dict must not be NULL.
+ */
+static void put_dict(struct pdf_writer* writer, const struct pdf_obj* dict,
+		const size_t* length)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(writer);
+	RT_NOT_NULL(dict);
+
+	put_text(writer, "<<");
+
+	for(i = 0; i < dict->u.dict.count; ++i) {
+		const struct pdf_pair* pair = &dict->u.dict.pairs[i];
+
+		if(length != NULL && strcmp(pair->key, "Length") == 0)
+			continue;
+
+		put_text(writer, " /%s ", pair->key);
+		put_value(writer, pair->value);
+	}
+
+	if(length != NULL)
+		put_text(writer, " /Length %lu", (unsigned long int) *length);
+
+	put_text(writer, " >>");
+}
+
+/*
+ * Write the given string as a literal string through the structure
+ * pointed to by writer. Parentheses and backslashes are escaped, and
+ * bytes that are not printable ASCII are written as octal escapes. The
+ * values of writer and obj must not be NULL.
+ */
+static void put_string(struct pdf_writer* writer, const struct pdf_obj* obj)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(writer);
+	RT_NOT_NULL(obj);
+
+	put_text(writer, "(");
+
+	for(i = 0; i < obj->u.string.len; ++i) {
+		unsigned char c = (unsigned char) obj->u.string.data[i];
+
+		if(c == '(' || c == ')' || c == '\\')
+			put_text(writer, "\\%c", c);
+		else if(c < ' ' || c > '~')
+			put_text(writer, "\\%03o", c);
+		else
+			put_bytes(writer, &c, 1);
+	}
+
+	put_text(writer, ")");
+}
+
+/*
+ * Write the given len bytes through the structure pointed to by
+ * writer, to its sink if it has one. The values of writer and bytes
+ * must not be NULL.
+ */
+static void put_bytes(struct pdf_writer* writer, const void* bytes, size_t len)
+{
+	RT_NOT_NULL(writer);
+	RT_NOT_NULL(bytes);
+
+	if(writer->sink != NULL) {
+		append_pdf_buffer(writer->sink, bytes, len);
+		return;
+	}
+
+	if(fwrite(bytes, 1, len, writer->file) != len)
+		errorout(E_BADF, _T("Failed to write PDF '%s'"), writer->path);
+
+	writer->pos += len;
+}
+
+/*
+ * Write text formatted as by printf() through the structure pointed to
+ * by writer, to its sink if it has one. The values of writer and format
+ * must not be NULL.
+ */
+static void put_text(struct pdf_writer* writer, const char* format, ...)
+{
+	va_list ap;
+	int len = 0;
+
+	RT_NOT_NULL(writer);
+	RT_NOT_NULL(format);
+
+	if(writer->sink != NULL) {
+		struct pdf_buffer* sink = writer->sink;
+
+		va_start(ap, format);
+		len = _vsnprintf(NULL, 0, format, ap);
+		va_end(ap);
+
+		if(len < 0)
+			errorout(E_STR, _T("Failed to format PDF '%s'"), writer->path);
+
+		if(sink->len + (size_t) len + 1 > sink->capacity) {
+			sink->capacity = (sink->len + (size_t) len + 1) * 2;
+			sink->data = (unsigned char*) require_realloc(sink->data,
+					sink->capacity, 1);
+		}
+
+		va_start(ap, format);
+		_vsnprintf((char*) sink->data + sink->len, (size_t) len + 1, format,
+				ap);
+		va_end(ap);
+		sink->len += (size_t) len;
+		return;
+	}
+
+	va_start(ap, format);
+	len = vfprintf(writer->file, format, ap);
+	va_end(ap);
+
+	if(len < 0)
+		errorout(E_BADF, _T("Failed to write PDF '%s'"), writer->path);
+
+	writer->pos += (ULONGLONG) len;
+}
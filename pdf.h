@@ -0,0 +1,160 @@
+#pragma once
+
+#include "stdafx.h"
+
+/* Most objects put in one object stream by a pdf_writer */
+#define PDF_OBJSTM_MAX 100
+
+/* Kinds of PDF objects */
+enum pdf_type {
+	kPDF_OBJ_NULL, /* null */
+	kPDF_OBJ_BOOL, /* true or false */
+	kPDF_OBJ_INT, /* integer */
+	kPDF_OBJ_REAL, /* real number */
+	kPDF_OBJ_STRING, /* literal or hexadecimal string */
+	kPDF_OBJ_NAME, /* name */
+	kPDF_OBJ_ARRAY, /* array */
+	kPDF_OBJ_DICT, /* dictionary */
+	kPDF_OBJ_REF, /* indirect reference */
+	kPDF_OBJ_STREAM /* stream */
+};
+
+/* States of an entry of a cross-reference table */
+enum pdf_xref_state {
+	kXREF_UNSEEN, /* not listed by any section read so far */
+	kXREF_FREE, /* free object */
+	kXREF_USED, /* object at a byte offset */
+	kXREF_COMPRESSED /* object in an object stream */
+};
+
+struct pdf_obj;
+
+/* A key of a PDF dictionary and its value */
+struct pdf_pair {
+	char* key; /* name without its slash, as written */
+	struct pdf_obj* value; /* value owned by the dictionary */
+};
+
+/* A PDF object parsed into memory */
+struct pdf_obj {
+	enum pdf_type type;
+	union {
+		int boolean; /* value of kPDF_OBJ_BOOL */
+		long int integer; /* value of kPDF_OBJ_INT */
+		char* text; /* kPDF_OBJ_REAL as written, or kPDF_OBJ_NAME */
+		struct {
+			char* data; /* bytes after escapes are decoded */
+			size_t len; /* number of bytes in data */
+		} string;
+		struct {
+			struct pdf_obj** items; /* elements owned by the array */
+			size_t count; /* number of elements */
+		} array;
+		struct {
+			struct pdf_pair* pairs; /* entries in the order written */
+			size_t count; /* number of entries */
+		} dict;
+		struct {
+			unsigned long int num; /* object number */
+			unsigned int gen; /* generation number */
+		} ref;
+		struct {
+			struct pdf_obj* dict; /* stream dictionary */
+			const unsigned char* data; /* encoded stream data */
+			size_t len; /* number of bytes in data */
+			int owned; /* nonzero if data is freed with the stream */
+		} stream;
+	} u;
+};
+
+/* Where an object of a PDF file is */
+struct pdf_xref {
+	enum pdf_xref_state state;
+	size_t offset; /* byte offset, or number of the object stream */
+	unsigned int gen; /* generation, or index in the object stream */
+};
+
+/* A PDF file mapped into memory for reading */
+struct pdf_doc {
+	LPTSTR path; /* path to the file */
+	HANDLE file; /* handle of the file */
+	HANDLE mapping; /* file mapping object */
+	const unsigned char* data; /* view of the whole file */
+	size_t size; /* length of the file in bytes */
+	struct pdf_xref* xref; /* location of each object number */
+	unsigned long int xref_count; /* number of elements in xref */
+	struct pdf_obj* trailer; /* dictionary of the newest trailer */
+	unsigned char* objstm; /* last object stream decoded, or NULL */
+	size_t objstm_len; /* number of bytes in objstm */
+	size_t objstm_first; /* offset of the first object in objstm */
+	unsigned long int objstm_num; /* object number of objstm */
+};
+
+/* Bytes collected in memory */
+struct pdf_buffer {
+	unsigned char* data; /* the bytes, or NULL */
+	size_t len; /* number of bytes in data */
+	size_t capacity; /* number of bytes allocated for data */
+};
+
+/* Where an object written to a PDF file is */
+struct pdf_location {
+	ULONGLONG offset; /* byte offset, or index in its object stream */
+	unsigned long int objstm; /* number of its object stream, or 0 */
+};
+
+/* A stream held by a pdf_writer until it is compressed */
+struct pdf_deflate {
+	unsigned long int num; /* object number of the stream */
+	struct pdf_obj* dict; /* stream dictionary, without a filter */
+	unsigned char* data; /* the data, compressed once done */
+	size_t len; /* number of bytes in data */
+	int level; /* zlib compression level */
+};
+
+/* A PDF file being written sequentially */
+struct pdf_writer {
+	LPTSTR path; /* path to the file */
+	FILE* file; /* stream of the file */
+	ULONGLONG pos; /* number of bytes written */
+	struct pdf_location* locations; /* where each object is, or zeros */
+	unsigned long int count; /* number of object numbers reserved */
+	unsigned long int capacity; /* number of elements in locations */
+	int level; /* zlib level for streams without a filter, or 0 */
+	int pack; /* nonzero to write objects in object streams */
+	struct pdf_buffer* sink; /* buffer written instead of file, or NULL */
+	struct pdf_buffer objstm; /* objects of the object stream being filled */
+	unsigned long int objstm_nums[PDF_OBJSTM_MAX]; /* their numbers */
+	size_t objstm_offsets[PDF_OBJSTM_MAX]; /* their offsets in objstm */
+	unsigned long int objstm_count; /* number of objects in objstm */
+	struct pdf_deflate* deflates; /* streams waiting to be compressed */
+	size_t deflate_count; /* number of elements in deflates */
+	size_t deflate_capacity; /* number of elements allocated for deflates */
+	size_t deflate_bytes; /* number of bytes in the streams of deflates */
+};
+
+void open_pdf(struct pdf_doc*, LPCTSTR);
+void close_pdf(struct pdf_doc*);
+struct pdf_obj* load_pdf_object(struct pdf_doc*, unsigned long int);
+struct pdf_obj* load_pdf_value(struct pdf_doc*, const struct pdf_obj*);
+unsigned char* decode_pdf_stream(const struct pdf_obj*, size_t*);
+struct pdf_obj* get_pdf_key(const struct pdf_obj*, const char*);
+void set_pdf_key(struct pdf_obj*, const char*, struct pdf_obj*);
+void remove_pdf_key(struct pdf_obj*, const char*);
+void append_pdf_item(struct pdf_obj*, struct pdf_obj*);
+int is_pdf_name(const struct pdf_obj*, const char*);
+struct pdf_obj* new_pdf_object(enum pdf_type);
+struct pdf_obj* new_pdf_int(long int);
+struct pdf_obj* new_pdf_name(const char*);
+struct pdf_obj* new_pdf_ref(unsigned long int);
+struct pdf_obj* clone_pdf_object(const struct pdf_obj*);
+void free_pdf_object(struct pdf_obj*);
+void open_pdf_writer(struct pdf_writer*, LPCTSTR, int, int);
+unsigned long int reserve_pdf_object(struct pdf_writer*);
+void write_pdf_object(struct pdf_writer*, unsigned long int,
+		const struct pdf_obj*);
+void close_pdf_writer(struct pdf_writer*, unsigned long int);
+void abort_pdf_writer(struct pdf_writer*);
+void format_pdf_object(struct pdf_buffer*, unsigned long int,
+		const struct pdf_obj*);
+void append_pdf_buffer(struct pdf_buffer*, const void*, size_t);
@@ -0,0 +1,701 @@
+#include "stdafx.h"
+#include "prefetch.h"
+#include "wkhtmltopdf_cmd.h"
+#include "util.h"
+#include "log.h"
+
+/* Bytes read from a response at a time */
+#define PREFETCH_CHUNK 65536
+
+/* Longest character encoding name kept from a Content-Type header */
+#define PREFETCH_CHARSET_MAX 40
+
+/* Longest ETag or Last-Modified date kept, so both fit a cache entry */
+#define PREFETCH_VALIDATOR_MAX 500
+
+/* Encodings whose markup is not ASCII, so a spooled page cannot be */
+static const char* const wide_charsets[] = {
+	"utf-16", "utf-32", "ucs-2", "ucs-4", "unicode"
+};
+
+/* The HTML of one segment, downloaded ahead of its conversion */
+struct prefetch_item {
+	LPTSTR url; /* URL of the segment, with its session */
+	LPTSTR path; /* local copy of the page, or NULL if it was not fetched */
+	LPTSTR etag; /* ETag of the page, or empty, with path */
+	LPTSTR modified; /* Last-Modified date of the page, or empty, with path */
+	UINT tmp_id; /* ID of the temp file reserving the name of path */
+	int done; /* nonzero once the download is over */
+};
+
+/* Downloads of the segments of one conversion */
+struct prefetch {
+	CRITICAL_SECTION lock; /* protects queue, next and items' path, done */
+	CONDITION_VARIABLE fetched; /* signaled whenever a download ends */
+	HINTERNET session; /* WinInet session shared by the downloads */
+	struct prefetch_item* items; /* segments, in document order */
+	size_t* queue; /* indices of items in the order to fetch them */
+	size_t count; /* number of elements in items */
+	size_t queued; /* number of elements in queue */
+	size_t next; /* index in queue of the next item to fetch */
+	HANDLE* threads; /* threads downloading */
+	size_t thread_count; /* number of elements in threads */
+	unsigned long int parallel; /* most downloads at once */
+	int ordered; /* nonzero once order_prefetch() was called */
+	volatile LONG stopping; /* nonzero once nothing more is fetched */
+};
+
+static unsigned __stdcall prefetch_thread(void*);
+static LPTSTR trap_spool(HINTERNET, struct prefetch_item*);
+static LPTSTR spool_segment(HINTERNET, struct prefetch_item*);
+static LPTSTR get_validator(HINTERNET, DWORD);
+static int get_charset(HINTERNET, char*);
+static int is_wide(const char*, size_t);
+static char* read_body(HINTERNET, size_t*);
+static int write_spool(FILE*, const char*, size_t, LPCTSTR, const char*);
+static size_t find_head_end(const char*);
+static const char* find_tag(const char*, const char*);
+static struct prefetch_item* find_item(struct prefetch*, LPCTSTR);
+
+/*
+ * Prepare to download the HTML of each of the n segments in the array
+ * pointed to by jobs, from the URLs the PDF getter would load, and
+ * return the state of the downloads, which must be passed to
+ * stop_prefetch(). Nothing is fetched until order_prefetch() gives the
+ * segments which are converted and their order, once the render cache
+ * was searched, so that a segment found there is not downloaded. They
+ * are then fetched by as many threads as the prefetch_segments member
+ * of the structure pointed to by info, on connections WinInet keeps
+ * alive between requests, so slow responses overlap each other and the
+ * conversion of the segments which arrived first. Each page is spooled
+ * to a local HTML file with a base element pointing back at its URL, so
+ * that its relative links still resolve, and the character encoding
+ * named by its Content-Type header, which a local file would otherwise
+ * lose. Pages with a base element of their own are left to the PDF
+ * getter. Return NULL, starting nothing, if prefetch_segments or n is
+ * zero. The value of info must not be NULL.
+ */
+struct prefetch* start_prefetch(const struct pdf_info* info,
+		const struct render_job* jobs, size_t n)
+{
+	struct prefetch* prefetch = NULL;
+	size_t i = 0;
+
+	RT_NOT_NULL(info);
+
+	if(info->prefetch_segments == 0 || n == 0)
+		return NULL;
+
+	RT_NOT_NULL(jobs);
+
+	prefetch = (struct prefetch*) require_cmem(1, sizeof(*prefetch));
+	InitializeCriticalSection(&prefetch->lock);
+	InitializeConditionVariable(&prefetch->fetched);
+	prefetch->items = (struct prefetch_item*) require_cmem(n,
+			sizeof(*prefetch->items));
+	prefetch->queue = (size_t*) require_cmem(n, sizeof(*prefetch->queue));
+	prefetch->count = n;
+
+	for(i = 0; i < n; ++i) {
+		prefetch->items[i].url = get_segment_url(info, &jobs[i].segment);
+		prefetch->queue[i] = i;
+	}
+
+	prefetch->session = InternetOpen(_T("HTMLToPDFHelper"),
+			INTERNET_OPEN_TYPE_PRECONFIG, NULL, NULL, 0);
+
+	if(prefetch->session == NULL) {
+		writelog(kNORM, _T("Failed to start WinInet (%lu); segments are ")
+				_T("not prefetched\n"), GetLastError());
+
+		for(i = 0; i < n; ++i)
+			prefetch->items[i].done = 1;
+
+		return prefetch;
+	}
+
+	/* WinInet would otherwise queue all but a few requests per server */
+	raise_conn_limit(info->prefetch_segments);
+	prefetch->parallel = info->prefetch_segments;
+
+	return prefetch;
+}
+
+/*
+ * Start fetching the segments of the n units in the array pointed to
+ * by units in the order the scheduler starts them, which is the order
+ * of the indices in the array pointed to by order. Each unit covers the
+ * segments in its sections member. The other segments of the structure
+ * pointed to by prefetch, such as those whose conversion was found in
+ * the render cache, are never fetched; the PDF getter loads them itself
+ * if it needs them. Only the first call has an effect. The value of
+ * prefetch may be NULL, in which case nothing is prefetched. The value
+ * of order may be NULL if the units are started in order. The values
+ * of info and units must not be NULL unless n is equal to zero.
+ */
+void order_prefetch(struct prefetch* prefetch, const struct pdf_info* info,
+		const struct render_job* units, const size_t* order, size_t n)
+{
+	char* placed = NULL; /* nonzero for each item placed in the queue */
+	size_t i = 0;
+	size_t j = 0;
+
+	if(prefetch == NULL || prefetch->ordered)
+		return;
+
+	prefetch->ordered = 1;
+	placed = (char*) require_cmem(prefetch->count + 1, sizeof(*placed));
+
+	/* No thread runs yet, so this needs no lock */
+	for(i = 0; i < n; ++i) {
+		const struct render_job* unit = &units[order != NULL ? order[i] : i];
+
+		for(j = 0; j < unit->section_count; ++j) {
+			LPTSTR url = get_segment_url(info, &unit->sections[j]);
+			struct prefetch_item* item = find_item(prefetch, url);
+
+			if(item != NULL && !placed[item - prefetch->items]) {
+				placed[item - prefetch->items] = 1;
+				prefetch->queue[prefetch->queued++] =
+						(size_t) (item - prefetch->items);
+			}
+
+			free(url);
+		}
+	}
+
+	/* Nothing should wait for a segment which is not fetched */
+	for(i = 0; i < prefetch->count; ++i)
+		if(!placed[i])
+			prefetch->items[i].done = 1;
+
+	free(placed);
+
+	if(prefetch->session == NULL || prefetch->queued == 0)
+		return;
+
+	prefetch->thread_count = prefetch->parallel < prefetch->queued ?
+			prefetch->parallel : prefetch->queued;
+	prefetch->threads = (HANDLE*) require_cmem(prefetch->thread_count,
+			sizeof(*prefetch->threads));
+
+	for(i = 0; i < prefetch->thread_count; ++i) {
+		prefetch->threads[i] = (HANDLE) _beginthreadex(NULL, 0,
+				prefetch_thread, prefetch, 0, NULL);
+
+		if(prefetch->threads[i] == 0)
+			errorout(E_CMD, _T("Failed to start prefetch thread"));
+	}
+
+	writelog(kVERBOSE, _T("Prefetching %lu of %lu segments, %lu at a ")
+			_T("time\n"), (unsigned long int) prefetch->queued,
+			(unsigned long int) prefetch->count,
+			(unsigned long int) prefetch->thread_count);
+}
+
+/*
+ * Return nonzero unless the HTML of one of the count segments in the
+ * array pointed to by sections is still being downloaded by the
+ * structure pointed to by prefetch, so that converting them now would
+ * wait for it. The value of prefetch may be NULL, in which case nothing
+ * is prefetched. The values of info and sections must not be NULL.
+ */
+int is_prefetched(struct prefetch* prefetch, const struct pdf_info* info,
+		const struct pdf_segment_info* sections, size_t count)
+{
+	int ready = 1;
+	size_t i = 0;
+
+	RT_NOT_NULL(info);
+	RT_NOT_NULL(sections);
+
+	if(prefetch == NULL)
+		return 1;
+
+	for(i = 0; i < count && ready; ++i) {
+		LPTSTR url = get_segment_url(info, &sections[i]);
+		struct prefetch_item* item = find_item(prefetch, url);
+
+		if(item != NULL) {
+			EnterCriticalSection(&prefetch->lock);
+			ready = item->done;
+			LeaveCriticalSection(&prefetch->lock);
+		}
+
+		free(url);
+	}
+
+	return ready;
+}
+
+/*
+ * Return the path to the local copy of the page at the given URL made
+ * by the structure pointed to by prefetch, waiting for its download if
+ * it is in progress. Return NULL if prefetch is NULL, the URL is not
+ * one of its segments or the download failed, in which case the PDF
+ * getter should load the URL itself. Otherwise, the values pointed to
+ * by etag and modified are set to the ETag and Last-Modified date of
+ * the response the copy was made from, or to empty strings, which are
+ * the validators the render cache should keep for a PDF of the copy.
+ * The strings returned stay valid until stop_prefetch() is called. The
+ * values of url, etag and modified must not be NULL.
+ */
+LPCTSTR wait_prefetched(struct prefetch* prefetch, LPCTSTR url,
+		LPCTSTR* etag, LPCTSTR* modified)
+{
+	struct prefetch_item* item = NULL;
+	LPCTSTR path = NULL;
+
+	RT_NOT_NULL(url);
+	RT_NOT_NULL(etag);
+	RT_NOT_NULL(modified);
+
+	if(prefetch == NULL || (item = find_item(prefetch, url)) == NULL)
+		return NULL;
+
+	EnterCriticalSection(&prefetch->lock);
+
+	while(!item->done)
+		SleepConditionVariableCS(&prefetch->fetched, &prefetch->lock,
+				INFINITE);
+
+	path = item->path;
+	*etag = item->etag;
+	*modified = item->modified;
+	LeaveCriticalSection(&prefetch->lock);
+
+	return path;
+}
+
+/*
+ * Stop the downloads of the structure pointed to by prefetch, abort
+ * those in progress by closing their WinInet session and wait for
+ * their threads, then remove the local copies of the pages and free
+ * the structure. The value of prefetch may be NULL.
+ */
+void stop_prefetch(struct prefetch* prefetch)
+{
+	size_t i = 0;
+
+	if(prefetch == NULL)
+		return;
+
+	InterlockedExchange(&prefetch->stopping, 1);
+
+	/* A thread waiting on a slow server would otherwise keep waiting */
+	if(prefetch->session != NULL)
+		InternetCloseHandle(prefetch->session);
+
+	for(i = 0; i < prefetch->thread_count; ++i) {
+		WaitForSingleObject(prefetch->threads[i], INFINITE);
+		CloseHandle(prefetch->threads[i]);
+	}
+
+	for(i = 0; i < prefetch->count; ++i) {
+		struct prefetch_item* item = &prefetch->items[i];
+
+		if(item->path != NULL)
+			remove_tmp_file(item->path);
+
+		if(item->tmp_id != 0) {
+			TCHAR tmp_path[MAX_PATH + 1] = _T("");
+
+			get_tmp_file(tmp_path, &item->tmp_id);
+			remove_tmp_file(tmp_path);
+		}
+
+		free(item->url);
+		free(item->path);
+		free(item->etag);
+		free(item->modified);
+	}
+
+	DeleteCriticalSection(&prefetch->lock);
+	free(prefetch->threads);
+	free(prefetch->queue);
+	free(prefetch->items);
+	free(prefetch);
+}
+
+/*
+ * Download the items of the prefetch structure pointed to by arg, in
+ * the order of its queue, until none is left or stop_prefetch() is
+ * called.
+ */
+static unsigned __stdcall prefetch_thread(void* arg)
+{
+	struct prefetch* prefetch = (struct prefetch*) arg;
+
+	RT_NOT_NULL(prefetch);
+
+	while(!prefetch->stopping) {
+		struct prefetch_item* item = NULL;
+		LPTSTR path = NULL;
+
+		EnterCriticalSection(&prefetch->lock);
+
+		if(prefetch->next < prefetch->queued)
+			item = &prefetch->items[prefetch->queue[prefetch->next++]];
+
+		LeaveCriticalSection(&prefetch->lock);
+
+		if(item == NULL)
+			break;
+
+		path = trap_spool(prefetch->session, item);
+
+		EnterCriticalSection(&prefetch->lock);
+		item->path = path;
+		item->done = 1;
+		WakeAllConditionVariable(&prefetch->fetched);
+		LeaveCriticalSection(&prefetch->lock);
+	}
+
+	return 0;
+}
+
+/*
+ * Return what spool_segment() returns for the given arguments, or NULL
+ * if it calls errorout(), so that an error in one download leaves its
+ * segment to the PDF getter instead of ending every job of the process.
+ * Whatever the failed download had allocated is not released.
+ */
+static LPTSTR trap_spool(HINTERNET session, struct prefetch_item* item)
+{
+	struct error_trap trap;
+	LPTSTR path = NULL;
+
+	if(setjmp(trap.env) != 0)
+		return NULL;
+
+	set_error_trap(&trap);
+	path = spool_segment(session, item);
+	set_error_trap(NULL);
+	return path;
+}
+
+/*
+ * Download the page at the URL of the item pointed to by item with the
+ * given WinInet session and write it to a new local HTML file, whose
+ * path is returned. The tmp_id member of the item is set to the ID of
+ * the temp file reserving the name of that file, and its etag and
+ * modified members to the validators of the response, which are as old
+ * as the copy. Return NULL if the URL is not an HTTP one, the
+ * page could not be downloaded with status 200, its encoding cannot be
+ * kept in a local copy or it has a base element of its own, which a
+ * local copy might resolve differently, so that the PDF getter loads
+ * it itself and reports any failure as usual. The pointer returned
+ * must be passed to free().
+ */
+static LPTSTR spool_segment(HINTERNET session, struct prefetch_item* item)
+{
+	TCHAR final_url[INTERNET_MAX_URL_LENGTH + 1] = _T("");
+	TCHAR tmp_path[MAX_PATH + 1] = _T("");
+	char charset[PREFETCH_CHARSET_MAX + 1] = ""; /* from Content-Type */
+	HINTERNET request = NULL;
+	LPCTSTR url = item->url;
+	LPCTSTR base = url; /* URL the page was loaded from after redirects */
+	LPTSTR path = NULL;
+	FILE* file = NULL;
+	char* body = NULL;
+	size_t len = 0;
+	DWORD status = 0;
+	DWORD size = sizeof(status);
+	DWORD start = GetTickCount();
+
+	if(_tcsnicmp(url, _T("http://"), 7) != 0
+			&& _tcsnicmp(url, _T("https://"), 8) != 0)
+		return NULL;
+
+	/* Like the PDF getter, use neither WinInet's cache nor its cookies */
+	request = InternetOpenUrl(session, url, NULL, 0, INTERNET_FLAG_RELOAD
+			| INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_KEEP_CONNECTION
+			| INTERNET_FLAG_NO_COOKIES | INTERNET_FLAG_NO_UI, 0);
+
+	if(request == NULL) {
+		writelog(kNORM, _T("Failed to prefetch '%s' (%lu)\n"), url,
+				GetLastError());
+		return NULL;
+	}
+
+	if(!HttpQueryInfo(request, HTTP_QUERY_STATUS_CODE
+			| HTTP_QUERY_FLAG_NUMBER, &status, &size, NULL)
+			|| status != HTTP_STATUS_OK
+			|| (body = read_body(request, &len)) == NULL) {
+		writelog(kNORM, _T("Failed to prefetch '%s' (status %lu)\n"), url,
+				status);
+		InternetCloseHandle(request);
+		return NULL;
+	}
+
+	if(!get_charset(request, charset) || is_wide(body, len)) {
+		writelog(kVERBOSE, _T("Not prefetching '%s', whose encoding a ")
+				_T("local copy cannot keep\n"), url);
+		InternetCloseHandle(request);
+		free(body);
+		return NULL;
+	}
+
+	if(find_tag(body, "base") != NULL) {
+		writelog(kVERBOSE, _T("Not prefetching '%s', which has a base ")
+				_T("element\n"), url);
+		InternetCloseHandle(request);
+		free(body);
+		return NULL;
+	}
+
+	size = sizeof(final_url);
+
+	if(InternetQueryOption(request, INTERNET_OPTION_URL, final_url, &size))
+		base = final_url;
+
+	item->etag = get_validator(request, HTTP_QUERY_ETAG);
+	item->modified = get_validator(request, HTTP_QUERY_LAST_MODIFIED);
+	InternetCloseHandle(request);
+	require_tmp_file(tmp_path, &item->tmp_id);
+
+	/* The PDF getter goes by the extension of a local file */
+	path = require_strf(_T("%s.html"), tmp_path);
+	file = open_file(path, _T("wb"));
+
+	if(file == NULL || !write_spool(file, body, len, base, charset)) {
+		writelog(kNORM, _T("Failed to spool '%s' to '%s'\n"), url, path);
+
+		if(file != NULL) {
+			release_file(file);
+			remove_tmp_file(path);
+		}
+
+		free(path);
+		free(body);
+		return NULL;
+	}
+
+	release_file(file);
+	free(body);
+	writelog(kDEBUG, _T("Prefetched '%s' (%lu bytes) in %lu ms\n"), url,
+			(unsigned long int) len, GetTickCount() - start);
+
+	return path;
+}
+
+/*
+ * Return the value of the given header of the response to the given
+ * WinInet request, which is an ETag or a Last-Modified date, or an
+ * empty string if there is none or it is longer than
+ * PREFETCH_VALIDATOR_MAX. The pointer returned must be passed to
+ * free().
+ */
+static LPTSTR get_validator(HINTERNET request, DWORD query)
+{
+	TCHAR value[PREFETCH_VALIDATOR_MAX + 1] = _T("");
+	DWORD size = sizeof(value);
+
+	if(!HttpQueryInfo(request, query, value, &size, NULL))
+		value[0] = _T('\0');
+
+	return require_dup_str(value);
+}
+
+/*
+ * Store in the buffer pointed to by charset, which is assumed to be at
+ * least PREFETCH_CHARSET_MAX + 1 in length, the lowercase name of the
+ * character encoding given by the Content-Type header of the response
+ * to the given WinInet request, or an empty string if it gives none.
+ * Return zero if it gives one which a page spooled with ASCII markup
+ * cannot declare: a name too long or with unexpected characters, or
+ * one of wide_charsets.
+ */
+static int get_charset(HINTERNET request, char* charset)
+{
+	char type[256] = "";
+	DWORD size = sizeof(type);
+	const char* value = NULL;
+	size_t len = 0;
+	size_t i = 0;
+
+	charset[0] = '\0';
+
+	if(!HttpQueryInfoA(request, HTTP_QUERY_CONTENT_TYPE, type, &size, NULL))
+		return GetLastError() == ERROR_HTTP_HEADER_NOT_FOUND;
+
+	CharLowerA(type);
+
+	if((value = strstr(type, "charset=")) == NULL)
+		return 1;
+
+	value += strlen("charset=");
+
+	if(*value == '"')
+		++value;
+
+	len = strcspn(value, "\"; \t");
+
+	if(len == 0 || len > PREFETCH_CHARSET_MAX
+			|| strspn(value, "abcdefghijklmnopqrstuvwxyz0123456789-_.:") < len)
+		return 0;
+
+	for(i = 0; i < LENGTHOF(wide_charsets); ++i) {
+		if(strncmp(value, wide_charsets[i], strlen(wide_charsets[i])) == 0)
+			return 0;
+	}
+
+	memcpy(charset, value, len);
+	charset[len] = '\0';
+
+	return 1;
+}
+
+/*
+ * Return nonzero if the page of len bytes pointed to by body starts
+ * with a UTF-16 byte order mark, which outweighs any declared encoding
+ * and makes its markup something other than ASCII.
+ */
+static int is_wide(const char* body, size_t len)
+{
+	const unsigned char* bytes = (const unsigned char*) body;
+
+	return len >= 2 && ((bytes[0] == 0xFF && bytes[1] == 0xFE)
+			|| (bytes[0] == 0xFE && bytes[1] == 0xFF));
+}
+
+/*
+ * Read the whole body of the response to the given WinInet request and
+ * return it, followed by a terminating null character. The number of
+ * bytes read is stored in the object pointed to by len. Return NULL if
+ * the connection failed before the end. The pointer returned must be
+ * passed to free().
+ */
+static char* read_body(HINTERNET request, size_t* len)
+{
+	size_t cap = PREFETCH_CHUNK;
+	char* body = (char*) require_mem(cap + 1);
+	DWORD read = 0;
+
+	*len = 0;
+
+	for(;;) {
+		if(!InternetReadFile(request, &body[*len], (DWORD) (cap - *len),
+				&read)) {
+			free(body);
+			return NULL;
+		}
+
+		if(read == 0)
+			break;
+
+		*len += read;
+
+		if(cap - *len < PREFETCH_CHUNK) {
+			cap *= 2;
+			body = (char*) require_realloc(body, cap + 1, 1);
+		}
+	}
+
+	body[*len] = '\0';
+
+	return body;
+}
+
+/*
+ * Write the page of len bytes pointed to by body to the given file
+ * with a base element for the given URL at the start of its head, or
+ * at the very start, after any UTF-8 byte order mark, if it has none.
+ * Unless charset is empty, a meta element declaring that encoding goes
+ * before it, so that it is read as the server said rather than as the
+ * page or the PDF getter guesses. Return zero if writing failed.
+ */
+static int write_spool(FILE* file, const char* body, size_t len,
+		LPCTSTR url, const char* charset)
+{
+	char* utf8 = require_utf8(url);
+	size_t at = find_head_end(body);
+	const char* c = NULL;
+
+	if(at == 0 && len >= 3 && memcmp(body, "\xEF\xBB\xBF", 3) == 0)
+		at = 3;
+
+	fwrite(body, 1, at, file);
+
+	if(*charset != '\0')
+		fprintf(file, "<meta charset=\"%s\">", charset);
+
+	fputs("<base href=\"", file);
+
+	/* URLs are ASCII, but the session may hold & and quotes */
+	for(c = utf8; *c != '\0'; ++c) {
+		if(*c == '&')
+			fputs("&amp;", file);
+		else if(*c == '"')
+			fputs("&quot;", file);
+		else if(*c == '<')
+			fputs("&lt;", file);
+		else if(*c == '>')
+			fputs("&gt;", file);
+		else
+			fputc(*c, file);
+	}
+
+	fputs("\">", file);
+	fwrite(&body[at], 1, len - at, file);
+	free(utf8);
+
+	return !ferror(file);
+}
+
+/*
+ * Return the offset just past the start tag of the head element in the
+ * given null-terminated page, or 0 if there is no such tag.
+ */
+static size_t find_head_end(const char* body)
+{
+	const char* tag = find_tag(body, "head");
+	const char* end = tag != NULL ? strchr(tag, '>') : NULL;
+
+	return end != NULL ? (size_t) (end + 1 - body) : 0;
+}
+
+/*
+ * Return a pointer to the first start tag of the element with the
+ * given lowercase name in the given null-terminated page, or NULL if
+ * there is none.
+ */
+static const char* find_tag(const char* body, const char* name)
+{
+	size_t len = strlen(name);
+	const char* tag = NULL;
+
+	for(tag = strchr(body, '<'); tag != NULL; tag = strchr(tag + 1, '<')) {
+		char next = '\0';
+
+		if(_strnicmp(tag + 1, name, len) != 0)
+			continue;
+
+		/* Not to be mistaken for <header> when looking for <head> */
+		next = tag[len + 1];
+
+		if(next == '>' || next == '/' || next == ' ' || next == '\t'
+				|| next == '\r' || next == '\n')
+			return tag;
+	}
+
+	return NULL;
+}
+
+/*
+ * Return the item of the structure pointed to by prefetch for the given
+ * URL, or NULL if there is none. Items never change their URL, so the
+ * lock is not needed.
+ */
+static struct prefetch_item* find_item(struct prefetch* prefetch,
+		LPCTSTR url)
+{
+	size_t i = 0;
+
+	for(i = 0; i < prefetch->count; ++i) {
+		if(_tcscmp(prefetch->items[i].url, url) == 0)
+			return &prefetch->items[i];
+	}
+
+	return NULL;
+}
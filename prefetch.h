@@ -0,0 +1,14 @@
+#pragma once
+
+#include "stdafx.h"
+#include "parse.h"
+#include "render.h"
+
+struct prefetch* start_prefetch(const struct pdf_info*,
+		const struct render_job*, size_t);
+void order_prefetch(struct prefetch*, const struct pdf_info*,
+		const struct render_job*, const size_t*, size_t);
+int is_prefetched(struct prefetch*, const struct pdf_info*,
+		const struct pdf_segment_info*, size_t);
+LPCTSTR wait_prefetched(struct prefetch*, LPCTSTR, LPCTSTR*, LPCTSTR*);
+void stop_prefetch(struct prefetch*);
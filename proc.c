@@ -0,0 +1,633 @@
+#include "stdafx.h"
+#include "proc.h"
+#include "util.h"
+#include "log.h"
+
+/* Group of the children started on this thread, or NULL */
+static __declspec(thread) struct child_group* child_group = NULL;
+
+static LPPROC_THREAD_ATTRIBUTE_LIST new_handle_list(HANDLE*, size_t*,
+		HANDLE);
+static void add_inherited(HANDLE*, size_t*, HANDLE);
+static void CALLBACK child_exited(PVOID, BOOLEAN);
+static void reap_child(struct supervisor*, struct child*);
+static void sample_child(struct child*);
+static void read_child_errors(struct child*);
+
+/*
+ * Initialize the given supervisor structure with no children. The
+ * value of sup must not be NULL. The structure must be passed to
+ * destroy_supervisor().
+ */
+void init_supervisor(struct supervisor* sup)
+{
+	RT_NOT_NULL(sup);
+
+	sup->running = NULL;
+	sup->count = 0;
+	sup->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+
+	if(sup->port == NULL)
+		errorout(E_CMD, _T("Failed to create completion port (%lu)"),
+				GetLastError());
+}
+
+/*
+ * Constructs a string based on the given format and starts it as a
+ * child process of the given supervisor. This procedure does not block.
+ * The child and all of its descendants are placed in a job object so
+ * that they can be terminated together, and the exit of the child is
+ * posted to the completion port of the supervisor. Its standard error
+ * output is captured and its standard output is shared with this
+ * process; it inherits no other handle. If the calling thread has a
+ * child group, the child is in it too, and it is killed at once if the
+ * group is cancelled. The value of data is stored in the child for the
+ * caller. The values of sup, child and format must not be NULL. The
+ * string is constructed by _vsntprintf(). If this procedure succeeds,
+ * the child must be reaped with wait_child() and passed to
+ * release_child().
+ */
+enum cmd_err start_child(struct supervisor* sup, struct child* child,
+		void* data, LPCTSTR format, ...)
+{
+	JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+	SECURITY_ATTRIBUTES inherit;
+	STARTUPINFOEX startup;
+	PROCESS_INFORMATION proc_info;
+	LPTSTR cmd_line = NULL;
+	HANDLE errors = INVALID_HANDLE_VALUE;
+	HANDLE inherited[3]; /* the only handles the child inherits */
+	size_t inherited_count = 0;
+	BOOL created = FALSE;
+	va_list argv;
+	TCHAR errors_path[MAX_PATH + 1] = _T("");
+
+	RT_NOT_NULL(sup);
+	RT_NOT_NULL(child);
+	RT_NOT_NULL(format);
+
+	va_start(argv, format);
+	cmd_line = require_vstrf(format, argv);
+	va_end(argv);
+
+	if(_tcslen(cmd_line) >= CMD_MAX_LEN) {
+		free(cmd_line);
+		return CMD_ERR_TOO_LONG;
+	}
+
+	memset(child, 0, sizeof(*child));
+	child->data = data;
+	require_tmp_file(errors_path, &child->errors_id);
+
+	inherit.nLength = sizeof(inherit);
+	inherit.lpSecurityDescriptor = NULL;
+	inherit.bInheritHandle = TRUE;
+	errors = CreateFile(errors_path, GENERIC_WRITE,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, &inherit,
+			CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if(errors == INVALID_HANDLE_VALUE)
+		errorout(E_BADF, _T("Failed to open file"));
+
+	memset(&startup, 0, sizeof(startup));
+	startup.StartupInfo.cb = sizeof(startup);
+	startup.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+	startup.StartupInfo.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+	startup.StartupInfo.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+	startup.StartupInfo.hStdError = errors;
+
+	/*
+	 * Other threads start children and open sockets at the same time,
+	 * so the child is only given its own standard handles.
+	 */
+	add_inherited(inherited, &inherited_count,
+			startup.StartupInfo.hStdInput);
+	add_inherited(inherited, &inherited_count,
+			startup.StartupInfo.hStdOutput);
+	startup.lpAttributeList = new_handle_list(inherited, &inherited_count,
+			errors);
+
+	writelog(kDEBUG, _T("Starting command: '%s'\n"), cmd_line);
+	created = CreateProcess(NULL, cmd_line, NULL, NULL, TRUE,
+			CREATE_SUSPENDED | EXTENDED_STARTUPINFO_PRESENT, NULL, NULL,
+			&startup.StartupInfo, &proc_info);
+	DeleteProcThreadAttributeList(startup.lpAttributeList);
+	free(startup.lpAttributeList);
+
+	if(!created) {
+		writelog(kNORM, _T("Failed to start '%s' (%lu)\n"), cmd_line,
+				GetLastError());
+		CloseHandle(errors);
+		remove_tmp_file(errors_path);
+		free(cmd_line);
+		return CMD_ERR_POPEN_FAILED;
+	}
+
+	CloseHandle(errors);
+	free(cmd_line);
+
+	/*
+	 * The job of the child nests inside the job of its group, which
+	 * only works if the process is placed in the group first.
+	 */
+	if(child_group != NULL && child_group->job != NULL
+			&& !AssignProcessToJobObject(child_group->job,
+				proc_info.hProcess))
+		writelog(kNORM, _T("Failed to place process %lu in the job of ")
+				_T("its group (%lu)\n"), proc_info.dwProcessId,
+				GetLastError());
+
+	/*
+	 * Closing the last handle to the job terminates whatever is left
+	 * in it, so no descendant can outlive its child.
+	 */
+	memset(&limits, 0, sizeof(limits));
+	limits.BasicLimitInformation.LimitFlags =
+			JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+	child->job = CreateJobObject(NULL, NULL);
+
+	if(child->job == NULL
+			|| !SetInformationJobObject(child->job,
+				JobObjectExtendedLimitInformation, &limits, sizeof(limits))
+			|| !AssignProcessToJobObject(child->job, proc_info.hProcess)) {
+		/*
+		 * This fails before Windows 8, or if this process is in a job
+		 * which does not allow nesting. The child is still waited for,
+		 * but killing it leaves its descendants running.
+		 */
+		writelog(kNORM, _T("Failed to place process %lu in a job (%lu)\n"),
+				proc_info.dwProcessId, GetLastError());
+
+		if(child->job != NULL)
+			CloseHandle(child->job);
+
+		child->job = NULL;
+	}
+
+	child->process = proc_info.hProcess;
+	child->pid = proc_info.dwProcessId;
+	child->port = sup->port;
+
+	/* Job notifications may be dropped, but a wait on the process may not */
+	if(!RegisterWaitForSingleObject(&child->wait, child->process,
+			child_exited, child, INFINITE, WT_EXECUTEONLYONCE)) {
+		writelog(kNORM, _T("Failed to wait for process %lu (%lu)\n"),
+				child->pid, GetLastError());
+		TerminateProcess(proc_info.hProcess, ERROR_CANCELLED);
+		CloseHandle(proc_info.hThread);
+		CloseHandle(proc_info.hProcess);
+
+		if(child->job != NULL)
+			CloseHandle(child->job);
+
+		remove_tmp_file(errors_path);
+		memset(child, 0, sizeof(*child));
+		return CMD_ERR_POPEN_FAILED;
+	}
+
+	/* A group cancelled while it was started missed killing it */
+	if(child_group != NULL
+			&& InterlockedCompareExchange(&child_group->cancelled, 0, 0)
+				!= E_SUCCESS)
+		TerminateProcess(proc_info.hProcess, ERROR_CANCELLED);
+
+	ResumeThread(proc_info.hThread);
+	CloseHandle(proc_info.hThread);
+	child->running = 1;
+	child->next = sup->running;
+	sup->running = child;
+	++sup->count;
+
+	return CMD_ERR_SUCCESS;
+}
+
+/*
+ * Add the given child to the running children of the given supervisor
+ * without starting a process for it. The work it stands for is done
+ * elsewhere, such as on another thread, which must call finish_child()
+ * exactly once when it is done. The value of data is stored in the
+ * child for the caller. The values of sup and child must not be NULL.
+ * The child must be reaped with wait_child() and passed to
+ * release_child().
+ */
+void start_child_work(struct supervisor* sup, struct child* child,
+		void* data)
+{
+	RT_NOT_NULL(sup);
+	RT_NOT_NULL(child);
+
+	memset(child, 0, sizeof(*child));
+	child->data = data;
+	child->port = sup->port;
+	child->running = 1;
+	child->next = sup->running;
+	sup->running = child;
+	++sup->count;
+}
+
+/*
+ * Mark the work of the given child started by start_child_work() as
+ * finished with the given exit status by posting it to its supervisor.
+ * If errors is not NULL, it is kept as the standard error output of the
+ * child. This procedure may be called from any thread. The supervisor
+ * may reap and release the child as soon as it is posted, so neither
+ * this procedure nor the caller uses it afterwards. The value of child
+ * must not be NULL.
+ */
+void finish_child(struct child* child, DWORD status, const char* errors)
+{
+	RT_NOT_NULL(child);
+
+	if(errors != NULL) {
+		child->errors = (char*) require_mem(strlen(errors) + 1);
+		strcpy(child->errors, errors);
+	}
+
+	child->status = status;
+
+	if(!PostQueuedCompletionStatus(child->port, 0, (ULONG_PTR) child, NULL))
+		errorout(E_CMD, _T("Failed to post finished work (%lu)"),
+				GetLastError());
+}
+
+/*
+ * Wait for any running child of the given supervisor to finish and
+ * return a pointer to it. Its status member is set to its exit status
+ * and its errors member to the end of its standard error output. If no
+ * child finishes within timeout milliseconds, or if the supervisor has
+ * no running children, NULL is returned. The value of timeout may be
+ * INFINITE. The value of sup must not be NULL.
+ */
+struct child* wait_child(struct supervisor* sup, DWORD timeout)
+{
+	struct child* child = NULL;
+	DWORD bytes = 0;
+	ULONG_PTR key = 0;
+	LPOVERLAPPED overlapped = NULL;
+
+	RT_NOT_NULL(sup);
+
+	if(sup->running == NULL)
+		return NULL;
+
+	/*
+	 * Each child posts itself exactly once when it finishes, so a
+	 * packet is only ever taken for a running child.
+	 */
+	if(!GetQueuedCompletionStatus(sup->port, &bytes, &key, &overlapped,
+			timeout)) {
+		if(GetLastError() != WAIT_TIMEOUT)
+			errorout(E_CMD, _T("Failed to wait for children (%lu)"),
+					GetLastError());
+
+		return NULL;
+	}
+
+	child = (struct child*) key;
+	RT_NOT_NULL(child);
+	reap_child(sup, child);
+
+	return child;
+}
+
+/*
+ * Update the memory and peak_memory members of each running child of
+ * the given supervisor. The value of sup must not be NULL.
+ */
+void sample_children(struct supervisor* sup)
+{
+	struct child* child = NULL;
+
+	RT_NOT_NULL(sup);
+
+	for(child = sup->running; child != NULL; child = child->next)
+		sample_child(child);
+}
+
+/*
+ * Terminate the given child and all of its descendants with the given
+ * exit status. This procedure does not block. Work started by
+ * start_child_work() cannot be interrupted and is left to finish. The
+ * child must still be reaped with wait_child(). The value of child must
+ * not be NULL.
+ */
+void kill_child(struct child* child, DWORD status)
+{
+	RT_NOT_NULL(child);
+
+	if(!child->running || child->process == NULL)
+		return;
+
+	if(child->job != NULL)
+		TerminateJobObject(child->job, status);
+	else
+		TerminateProcess(child->process, status);
+}
+
+/*
+ * Terminate execution with the given error code if the given child
+ * exited with a nonzero status. Its captured standard error output is
+ * logged first. The value of name is the name of the executable used
+ * in the message. The values of child and name must not be NULL.
+ */
+void check_child(const struct child* child, enum error_code code,
+		LPCTSTR name)
+{
+	RT_NOT_NULL(child);
+	RT_NOT_NULL(name);
+
+	if(child->status == 0)
+		return;
+
+	if(child->errors != NULL && child->errors[0] != '\0')
+		writelog(kNORM, _T("%s (process %lu) reported:\n%hs\n"), name,
+				child->pid, child->errors);
+
+	errorout(code, _T("%s exited with status %lu"), name, child->status);
+}
+
+/*
+ * Release the resources held by the given child. If the child or any
+ * of its descendants is still running, it is terminated. The child must
+ * not be used after calling this procedure unless it is started again.
+ * The value of child must not be NULL.
+ */
+void release_child(struct child* child)
+{
+	RT_NOT_NULL(child);
+
+	if(child->running)
+		errorout(E_CMD, _T("Released process %lu before reaping it"),
+				child->pid);
+
+	if(child->job != NULL)
+		CloseHandle(child->job);
+
+	free(child->errors);
+	child->job = NULL;
+	child->errors = NULL;
+}
+
+/*
+ * Release the resources held by the given supervisor. Every child it
+ * started must have been reaped. The value of sup must not be NULL.
+ */
+void destroy_supervisor(struct supervisor* sup)
+{
+	RT_NOT_NULL(sup);
+
+	if(sup->running != NULL)
+		errorout(E_CMD, _T("Supervisor destroyed with %lu running processes"),
+				(unsigned long int) sup->count);
+
+	CloseHandle(sup->port);
+	sup->port = NULL;
+}
+
+/*
+ * Initialize the given child_group structure with no children. If its
+ * job object cannot be created, cancelling the group only keeps new
+ * children from running. The value of group must not be NULL. The
+ * structure must be passed to destroy_child_group().
+ */
+void init_child_group(struct child_group* group)
+{
+	JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+
+	RT_NOT_NULL(group);
+
+	group->cancelled = E_SUCCESS;
+	memset(&limits, 0, sizeof(limits));
+	limits.BasicLimitInformation.LimitFlags =
+			JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+	group->job = CreateJobObject(NULL, NULL);
+
+	if(group->job != NULL && !SetInformationJobObject(group->job,
+			JobObjectExtendedLimitInformation, &limits, sizeof(limits))) {
+		CloseHandle(group->job);
+		group->job = NULL;
+	}
+
+	if(group->job == NULL)
+		writelog(kVERBOSE, _T("Failed to create the job of a child group ")
+				_T("(%lu)\n"), GetLastError());
+}
+
+/*
+ * Place the children that the calling thread starts from now on in the
+ * given group, or in none if group is NULL.
+ */
+void set_child_group(struct child_group* group)
+{
+	child_group = group;
+}
+
+/*
+ * Return the group of the children started by the calling thread, or
+ * NULL if it has none.
+ */
+struct child_group* get_child_group(void)
+{
+	return child_group;
+}
+
+/*
+ * Kill every child of the given group and its descendants, and any
+ * child started in it afterwards, with the given error code, which
+ * must not be E_SUCCESS. The children must still be reaped by their
+ * supervisors. This procedure may be called from any thread and does
+ * not block. The value of group must not be NULL.
+ */
+void cancel_child_group(struct child_group* group, enum error_code code)
+{
+	RT_NOT_NULL(group);
+
+	InterlockedExchange(&group->cancelled, code);
+
+	if(group->job != NULL)
+		TerminateJobObject(group->job, ERROR_CANCELLED);
+}
+
+/*
+ * Release the resources held by the given group. Any of its children
+ * still running is terminated. The value of group must not be NULL.
+ */
+void destroy_child_group(struct child_group* group)
+{
+	RT_NOT_NULL(group);
+
+	if(group->job != NULL)
+		CloseHandle(group->job);
+
+	group->job = NULL;
+}
+
+/*
+ * Add the given handle to the array pointed to by handles, which holds
+ * as many handles as the value pointed to by count and has room for
+ * one more, if a child should inherit it: it is an inheritable handle
+ * that is not already there and not a console, which children reach
+ * without inheriting. The value pointed to by count is incremented if
+ * it is added. The values of handles and count must not be NULL.
+ */
+static void add_inherited(HANDLE* handles, size_t* count, HANDLE handle)
+{
+	DWORD flags = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(handles);
+	RT_NOT_NULL(count);
+
+	if(handle == NULL || handle == INVALID_HANDLE_VALUE
+			|| !GetHandleInformation(handle, &flags)
+			|| !(flags & HANDLE_FLAG_INHERIT)
+			|| GetFileType(handle) == FILE_TYPE_CHAR)
+		return;
+
+	for(i = 0; i < *count; ++i)
+		if(handles[i] == handle)
+			return;
+
+	handles[(*count)++] = handle;
+}
+
+/*
+ * Add the given handle to the array pointed to by handles like
+ * add_inherited(), and return a new attribute list which limits the
+ * handles a child inherits to those in the array. The array must stay
+ * valid until the child is created. The list returned must be passed
+ * to DeleteProcThreadAttributeList() and then free(). The values of
+ * handles and count must not be NULL.
+ */
+static LPPROC_THREAD_ATTRIBUTE_LIST new_handle_list(HANDLE* handles,
+		size_t* count, HANDLE handle)
+{
+	LPPROC_THREAD_ATTRIBUTE_LIST list = NULL;
+	SIZE_T size = 0;
+
+	RT_NOT_NULL(handles);
+	RT_NOT_NULL(count);
+
+	add_inherited(handles, count, handle);
+
+	/* The first call only fails with the size the list needs */
+	InitializeProcThreadAttributeList(NULL, 1, 0, &size);
+	list = (LPPROC_THREAD_ATTRIBUTE_LIST) require_mem(size);
+
+	if(!InitializeProcThreadAttributeList(list, 1, 0, &size))
+		errorout(E_CMD, _T("Failed to create an attribute list (%lu)"),
+				GetLastError());
+
+	if(!UpdateProcThreadAttribute(list, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+			handles, *count * sizeof(*handles), NULL, NULL))
+		errorout(E_CMD, _T("Failed to limit inherited handles (%lu)"),
+				GetLastError());
+
+	return list;
+}
+
+/*
+ * Post the child pointed to by arg to the completion port of its
+ * supervisor once its process has exited. This is called on a thread of
+ * the thread pool.
+ */
+static void CALLBACK child_exited(PVOID arg, BOOLEAN timed_out)
+{
+	struct child* child = (struct child*) arg;
+
+	if(!PostQueuedCompletionStatus(child->port, 0, (ULONG_PTR) child, NULL))
+		errorout(E_CMD, _T("Failed to post exited process %lu (%lu)"),
+				child->pid, GetLastError());
+}
+
+/*
+ * Remove the given finished child from the running children of the
+ * given supervisor and collect its exit status and standard error
+ * output. The values of sup and child must not be NULL.
+ */
+static void reap_child(struct supervisor* sup, struct child* child)
+{
+	struct child** link = NULL;
+
+	RT_NOT_NULL(sup);
+	RT_NOT_NULL(child);
+
+	for(link = &sup->running; *link != NULL; link = &(*link)->next) {
+		if(*link == child) {
+			*link = child->next;
+			break;
+		}
+	}
+
+	child->next = NULL;
+	child->running = 0;
+	--sup->count;
+
+	/* Work has its status and errors set by finish_child() */
+	if(child->process != NULL) {
+		/* The wait has fired, but its callback may not have returned */
+		UnregisterWaitEx(child->wait, INVALID_HANDLE_VALUE);
+		child->wait = NULL;
+
+		if(!GetExitCodeProcess(child->process, &child->status))
+			child->status = (DWORD) -1;
+
+		sample_child(child);
+		CloseHandle(child->process);
+		child->process = NULL;
+		read_child_errors(child);
+	}
+
+	writelog(kDEBUG, _T("Process %lu exited with status %lu\n"), child->pid,
+			child->status);
+}
+
+/*
+ * Update the memory and peak_memory members of the given child from
+ * the working set of its process. The members are left unchanged if the
+ * process cannot be queried. The value of child must not be NULL.
+ */
+static void sample_child(struct child* child)
+{
+	PROCESS_MEMORY_COUNTERS counters;
+
+	RT_NOT_NULL(child);
+
+	counters.cb = sizeof(counters);
+
+	if(child->process == NULL
+			|| !GetProcessMemoryInfo(child->process, &counters,
+				sizeof(counters)))
+		return;
+
+	child->memory = counters.WorkingSetSize;
+
+	if(counters.PeakWorkingSetSize > child->peak_memory)
+		child->peak_memory = counters.PeakWorkingSetSize;
+}
+
+/*
+ * Read the end of the standard error output of the given child into its
+ * errors member and remove the file it was captured in. The value of
+ * child must not be NULL.
+ */
+static void read_child_errors(struct child* child)
+{
+	FILE* file = NULL;
+	size_t len = 0;
+	TCHAR errors_path[MAX_PATH + 1] = _T("");
+
+	RT_NOT_NULL(child);
+
+	require_tmp_file(errors_path, &child->errors_id);
+	file = require_open_file(errors_path, _T("rb"));
+	child->errors = (char*) require_mem(CHILD_ERRORS_MAX + 1);
+
+	if(fseek(file, -CHILD_ERRORS_MAX, SEEK_END) != 0)
+		rewind(file);
+
+	len = fread(child->errors, 1, CHILD_ERRORS_MAX, file);
+	child->errors[len] = '\0';
+	release_file(file);
+	remove_tmp_file(errors_path);
+}
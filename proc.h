@@ -0,0 +1,55 @@
+#pragma once
+
+#include "stdafx.h"
+#include "cmd.h"
+#include "log.h"
+
+/* Maximum number of bytes of standard error output kept for a child */
+#define CHILD_ERRORS_MAX 4096
+
+/* A child process, or work done elsewhere, started by a supervisor */
+struct child {
+	struct child* next; /* next running child of the same supervisor */
+	HANDLE process; /* handle to the child process, or NULL for work */
+	HANDLE job; /* job object containing the child and its descendants */
+	HANDLE wait; /* wait posting the exit of the process, or NULL */
+	HANDLE port; /* completion port notified when the child finishes */
+	char* errors; /* end of the captured standard error output */
+	void* data; /* caller data associated with the child */
+	SIZE_T memory; /* working set when the child was last sampled */
+	SIZE_T peak_memory; /* largest working set seen for the child */
+	DWORD status; /* exit status once the child has finished */
+	DWORD pid; /* process ID of the child */
+	UINT errors_id; /* ID of the temp file receiving standard error */
+	int running; /* nonzero while the child has not been reaped */
+};
+
+/* Starts children and waits for any number of them at once */
+struct supervisor {
+	struct child* running; /* children which have not been reaped */
+	HANDLE port; /* completion port receiving finished children */
+	size_t count; /* number of running children */
+};
+
+/* Children started for one conversion, which are cancelled together */
+struct child_group {
+	HANDLE job; /* job object holding the job of each child, or NULL */
+	volatile LONG cancelled; /* error code once cancelled, or E_SUCCESS */
+};
+
+void init_supervisor(struct supervisor*);
+enum cmd_err start_child(struct supervisor*, struct child*, void*, LPCTSTR,
+		...);
+void start_child_work(struct supervisor*, struct child*, void*);
+void finish_child(struct child*, DWORD, const char*);
+struct child* wait_child(struct supervisor*, DWORD);
+void sample_children(struct supervisor*);
+void kill_child(struct child*, DWORD);
+void check_child(const struct child*, enum error_code, LPCTSTR);
+void release_child(struct child*);
+void destroy_supervisor(struct supervisor*);
+void init_child_group(struct child_group*);
+void set_child_group(struct child_group*);
+struct child_group* get_child_group(void);
+void cancel_child_group(struct child_group*, enum error_code);
+void destroy_child_group(struct child_group*);
@@ -0,0 +1,1376 @@
+#include "stdafx.h"
+#include "proxy.h"
+#include "util.h"
+#include "log.h"
+
+/* Longest request head accepted from a renderer, in bytes */
+#define PROXY_HEAD_MAX 16384
+
+/* Bytes read from upstream or relayed through a tunnel at a time */
+#define PROXY_CHUNK 16384
+
+/* Time in milliseconds an idle connection from a renderer is kept */
+#define PROXY_IDLE_MS 30000
+
+/* Time in milliseconds a response without a max-age is reused */
+#define PROXY_FRESH_MS ((ULONGLONG) 600 * 1000)
+
+/* Connections WinInet may keep open to each upstream server */
+#define PROXY_CONNS_PER_SERVER 16
+
+/* Largest cache a job may keep, in megabytes, within the address space */
+#define PROXY_CACHE_MAX_MB 1024UL
+
+/* A response kept by the proxy, or one being fetched for a renderer */
+struct proxy_entry {
+	struct proxy_entry* newer; /* next more recently used entry */
+	struct proxy_entry* older; /* next less recently used entry */
+	char* url; /* absolute URL which was requested */
+	char* head; /* status line and headers, without the empty line */
+	char* body; /* body of the response */
+	size_t head_len; /* bytes in head */
+	size_t body_len; /* bytes in body */
+	ULONGLONG expires; /* tick count after which it is fetched again */
+	int ready; /* nonzero once fetched, zero while being fetched */
+};
+
+/* A job whose renderers go through the proxy */
+struct proxy_job {
+	struct proxy_job* next; /* next job using the proxy */
+	const struct pdf_info* info; /* instructions of the job */
+	LONG refs; /* the job, its accept thread and its connections */
+	volatile LONG closed; /* nonzero once it stopped accepting */
+	SOCKET listener; /* socket accepting the job's renderers */
+	char** blocked; /* hosts which are never contacted */
+	size_t blocked_count; /* number of elements in blocked */
+	int caching; /* nonzero if the job uses the shared cache */
+	LPTSTR url; /* URL of the listener */
+};
+
+/* A response to send to a renderer */
+struct proxy_response {
+	char* head; /* status line and headers, without the empty line */
+	char* body; /* body of the response */
+	size_t head_len; /* bytes in head */
+	size_t body_len; /* bytes in body */
+	ULONGLONG fresh; /* milliseconds it may be reused, or 0 if never */
+};
+
+/* A request read from a renderer */
+struct proxy_request {
+	char* line; /* storage for method and target */
+	char* method; /* request method */
+	char* target; /* absolute URL, or host and port for CONNECT */
+	char* headers; /* headers to forward, each followed by CRLF */
+	char* body; /* body of the request, or NULL */
+	size_t body_len; /* bytes in body */
+	int keep_alive; /* nonzero if the connection stays open after it */
+	char host[INTERNET_MAX_HOST_NAME_LENGTH + 1]; /* host of target */
+	INTERNET_PORT port; /* port of target */
+	const char* path; /* path and query of target, or NULL for CONNECT */
+	int secure; /* nonzero if target is an HTTPS URL */
+	int credentials; /* nonzero if it carries credentials or cookies */
+};
+
+/* A connection from a renderer */
+struct proxy_conn {
+	struct proxy_job* job; /* job whose listener accepted it */
+	SOCKET sock; /* the accepted socket */
+	char data[PROXY_HEAD_MAX]; /* bytes received but not handled yet */
+	size_t len; /* bytes in data */
+};
+
+static BOOL CALLBACK start_proxy(PINIT_ONCE, PVOID, PVOID*);
+static struct proxy_job* find_job(const struct pdf_info*);
+static void release_job(struct proxy_job*);
+static void parse_blocklist(struct proxy_job*, LPCTSTR);
+static unsigned __stdcall accept_thread(void*);
+static unsigned __stdcall client_thread(void*);
+static int read_request(struct proxy_conn*, struct proxy_request*);
+static size_t find_head_end(const char*, size_t);
+static void free_request(struct proxy_request*);
+static int crack_target(struct proxy_request*);
+static int handle_request(struct proxy_conn*, struct proxy_request*);
+static int serve_cached(SOCKET, const struct proxy_request*);
+static int fetch_upstream(const struct proxy_request*,
+		struct proxy_response*);
+static int read_response(HINTERNET, struct proxy_response*);
+static char* filter_head(const char*, size_t, size_t*);
+static ULONGLONG get_freshness(HINTERNET);
+static void tunnel(struct proxy_conn*, const struct proxy_request*);
+static void relay(SOCKET, SOCKET);
+static int is_blocked(const struct proxy_job*, const char*);
+static int is_listed(const char*, size_t, const char* const*, size_t);
+static int send_response(SOCKET, const struct proxy_response*, int);
+static int send_status(SOCKET, const char*, int);
+static int send_all(SOCKET, const char*, size_t);
+static SOCKET keep_socket(SOCKET);
+static char* copy_bytes(const char*, size_t);
+static struct proxy_entry* find_entry(const char*);
+static void link_entry(struct proxy_entry*);
+static void unlink_entry(struct proxy_entry*);
+static void remove_entry(struct proxy_entry*);
+static void evict_entries(void);
+
+/* Content types of the subresources which are shared between renders */
+static const char* const static_types[] = {
+	"text/css", "text/javascript", "application/javascript",
+	"application/x-javascript", "image/", "font/", "application/font-",
+	"application/x-font-", "application/vnd.ms-fontobject"
+};
+
+/*
+ * Headers which only concern one connection, or which the proxy and
+ * WinInet set themselves, and so are never forwarded
+ */
+static const char* const hop_headers[] = {
+	"Connection", "Proxy-Connection", "Keep-Alive", "Proxy-Authorization",
+	"Proxy-Authenticate", "TE", "Trailer", "Transfer-Encoding", "Upgrade",
+	"Content-Length", "Host"
+};
+
+/* Headers which make a response only fit for the renderer asking */
+static const char* const credential_headers[] = {
+	"Authorization", "Cookie"
+};
+
+/* State shared by every thread of the proxy */
+static struct {
+	INIT_ONCE once; /* initializes the members below */
+	CRITICAL_SECTION lock; /* protects the entries and size */
+	CONDITION_VARIABLE fetched; /* signaled whenever a fetch ends */
+	struct proxy_entry* newest; /* most recently used entry */
+	struct proxy_entry* oldest; /* least recently used entry */
+	size_t size; /* bytes kept by ready entries */
+	size_t limit; /* largest cache size of any job, in bytes */
+	struct proxy_job* jobs; /* jobs using the proxy, protected by lock */
+	HINTERNET session; /* WinInet session, or NULL if it did not start */
+} proxy = { INIT_ONCE_STATIC_INIT };
+
+/*
+ * Start listening for the renderers of the job with the instructions
+ * pointed to by info, unless its subresource_proxy member is zero. The
+ * shared part of the proxy is started by the first job and then serves
+ * every job of the process, so that stylesheets, scripts, fonts and
+ * images shared by the segments of a job, and by the jobs of a server,
+ * are downloaded once. Each job has a listener of its own, so that its
+ * blocklist and cache size only apply to its renderers; the cache
+ * keeps as much as the largest size any job asked for, and a job with
+ * a size of zero neither uses nor fills it. If anything fails,
+ * renderers of the job load everything themselves. The structure
+ * pointed to by info must stay valid until close_proxy() is called
+ * with it. The value of info must not be NULL.
+ */
+void open_proxy(const struct pdf_info* info)
+{
+	struct proxy_job* job = NULL;
+	struct sockaddr_in addr;
+	int addr_len = sizeof(addr);
+	HANDLE thread = NULL;
+	size_t limit = 0;
+
+	RT_NOT_NULL(info);
+
+	if(!info->subresource_proxy)
+		return;
+
+	if(!InitOnceExecuteOnce(&proxy.once, start_proxy, NULL, NULL))
+		errorout(E_MALLOC, _T("Failed to start the caching proxy"));
+
+	if(proxy.session == NULL)
+		return;
+
+	job = (struct proxy_job*) require_cmem(1, sizeof(*job));
+	job->info = info;
+	job->refs = 1;
+	job->caching = info->proxy_cache_size > 0;
+	job->listener = keep_socket(socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+	parse_blocklist(job, info->proxy_blocklist);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	if(job->listener == INVALID_SOCKET
+			|| bind(job->listener, (struct sockaddr*) &addr,
+					sizeof(addr)) != 0
+			|| listen(job->listener, SOMAXCONN) != 0
+			|| getsockname(job->listener, (struct sockaddr*) &addr,
+					&addr_len) != 0) {
+		writelog(kNORM, _T("Failed to start the caching proxy (%d); ")
+				_T("renderers load subresources themselves\n"),
+				WSAGetLastError());
+
+		if(job->listener != INVALID_SOCKET)
+			closesocket(job->listener);
+
+		release_job(job);
+		return;
+	}
+
+	job->url = require_strf(_T("http://127.0.0.1:%u"),
+			(unsigned int) ntohs(addr.sin_port));
+
+	/* The accept thread holds a reference of its own */
+	job->refs = 2;
+	thread = (HANDLE) _beginthreadex(NULL, 0, accept_thread, job, 0, NULL);
+
+	if(thread == 0) {
+		writelog(kNORM, _T("Failed to start the caching proxy thread; ")
+				_T("renderers load subresources themselves\n"));
+		closesocket(job->listener);
+		job->refs = 1;
+		release_job(job);
+		return;
+	}
+
+	CloseHandle(thread);
+
+	/* Sizes past the address space would wrap around in a size_t */
+	if(info->proxy_cache_size > PROXY_CACHE_MAX_MB)
+		writelog(kNORM, _T("Keeping at most %lu MB of iProxyCacheSize %lu ")
+				_T("MB\n"), PROXY_CACHE_MAX_MB, info->proxy_cache_size);
+
+	limit = (size_t) (min((ULONGLONG) info->proxy_cache_size,
+			PROXY_CACHE_MAX_MB) * 1024 * 1024);
+
+	EnterCriticalSection(&proxy.lock);
+	job->next = proxy.jobs;
+	proxy.jobs = job;
+
+	if(limit > proxy.limit)
+		proxy.limit = limit;
+
+	LeaveCriticalSection(&proxy.lock);
+
+	writelog(kVERBOSE, _T("Caching proxy listening at %s, keeping up to ")
+			_T("%lu MB\n"), job->url, (unsigned long int) (limit >> 20));
+}
+
+/*
+ * Return the URL of the caching proxy through which the PDF getter
+ * should load pages and their subresources for the job with the
+ * instructions pointed to by info, or NULL if open_proxy() did not
+ * start listening for it. The string returned stays valid until
+ * close_proxy() is called. The value of info must not be NULL.
+ */
+LPCTSTR get_proxy_url(const struct pdf_info* info)
+{
+	struct proxy_job* job = NULL;
+
+	RT_NOT_NULL(info);
+
+	if(!info->subresource_proxy)
+		return NULL;
+
+	if(!InitOnceExecuteOnce(&proxy.once, start_proxy, NULL, NULL))
+		errorout(E_MALLOC, _T("Failed to start the caching proxy"));
+
+	EnterCriticalSection(&proxy.lock);
+	job = find_job(info);
+	LeaveCriticalSection(&proxy.lock);
+
+	return job != NULL ? job->url : NULL;
+}
+
+/*
+ * Stop listening for the renderers of the job with the instructions
+ * pointed to by info, which were passed to open_proxy(). Connections
+ * still open are served until they close, but the job no longer uses
+ * info. Responses it put in the cache stay there for other jobs. The
+ * value of info must not be NULL.
+ */
+void close_proxy(const struct pdf_info* info)
+{
+	struct proxy_job** link = NULL;
+	struct proxy_job* job = NULL;
+
+	RT_NOT_NULL(info);
+
+	if(!info->subresource_proxy)
+		return;
+
+	if(!InitOnceExecuteOnce(&proxy.once, start_proxy, NULL, NULL))
+		errorout(E_MALLOC, _T("Failed to start the caching proxy"));
+
+	EnterCriticalSection(&proxy.lock);
+
+	for(link = &proxy.jobs; *link != NULL; link = &(*link)->next) {
+		if((*link)->info == info) {
+			job = *link;
+			*link = job->next;
+			break;
+		}
+	}
+
+	LeaveCriticalSection(&proxy.lock);
+
+	if(job == NULL)
+		return;
+
+	/* Its accept thread fails, sees it is closed and lets go of it */
+	InterlockedExchange(&job->closed, 1);
+	closesocket(job->listener);
+	release_job(job);
+}
+
+/*
+ * Initialize the state shared by every job using the proxy and start
+ * Winsock and WinInet. If either fails, the session member of proxy is
+ * left NULL and renderers load everything themselves. This is an
+ * InitOnceExecuteOnce() callback; its parameters are unused.
+ */
+static BOOL CALLBACK start_proxy(PINIT_ONCE once, PVOID param,
+		PVOID* context)
+{
+	WSADATA wsa;
+
+	InitializeCriticalSection(&proxy.lock);
+	InitializeConditionVariable(&proxy.fetched);
+	proxy.newest = NULL;
+	proxy.oldest = NULL;
+	proxy.size = 0;
+	proxy.limit = 0;
+	proxy.jobs = NULL;
+	proxy.session = NULL;
+
+	if(WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+		writelog(kNORM, _T("Failed to start Winsock; renderers load ")
+				_T("subresources themselves\n"));
+		return TRUE;
+	}
+
+	/* WinInet's default would queue the requests of all renderers */
+	raise_conn_limit(PROXY_CONNS_PER_SERVER);
+	proxy.session = InternetOpenA("HTMLToPDFHelper",
+			INTERNET_OPEN_TYPE_PRECONFIG, NULL, NULL, 0);
+
+	if(proxy.session == NULL)
+		writelog(kNORM, _T("Failed to start WinInet (%lu); renderers ")
+				_T("load subresources themselves\n"), GetLastError());
+
+	return TRUE;
+}
+
+/*
+ * Return the job with the instructions pointed to by info, or NULL if
+ * the proxy is not listening for it. The lock member of proxy must be
+ * held.
+ */
+static struct proxy_job* find_job(const struct pdf_info* info)
+{
+	struct proxy_job* job = NULL;
+
+	for(job = proxy.jobs; job != NULL; job = job->next)
+		if(job->info == info)
+			return job;
+
+	return NULL;
+}
+
+/*
+ * Drop a reference to the job pointed to by job, freeing it with the
+ * last one.
+ */
+static void release_job(struct proxy_job* job)
+{
+	size_t i = 0;
+
+	if(InterlockedDecrement(&job->refs) != 0)
+		return;
+
+	for(i = 0; i < job->blocked_count; ++i)
+		free(job->blocked[i]);
+
+	free(job->blocked);
+	free(job->url);
+	free(job);
+}
+
+/*
+ * Split the given list of host names, separated by commas, semicolons
+ * or spaces, into the blocked member of the job pointed to by job. The
+ * value of list may be NULL, in which case no host is blocked.
+ */
+static void parse_blocklist(struct proxy_job* job, LPCTSTR list)
+{
+	char* hosts = NULL;
+	const char* host = NULL;
+	size_t len = 0;
+
+	job->blocked = NULL;
+	job->blocked_count = 0;
+
+	if(list == NULL)
+		return;
+
+	hosts = require_utf8(list);
+
+	for(host = hosts; *host != '\0'; host += len) {
+		host += strspn(host, ",; ");
+		len = strcspn(host, ",; ");
+
+		if(len == 0)
+			continue;
+
+		job->blocked = require_realloc(job->blocked,
+				job->blocked_count + 1, sizeof(*job->blocked));
+		job->blocked[job->blocked_count] = copy_bytes(host, len);
+		job->blocked[job->blocked_count++][len] = '\0';
+	}
+
+	free(hosts);
+}
+
+/*
+ * Accept connections from the renderers of the job pointed to by arg
+ * and serve each from a thread of its own, since a renderer keeps
+ * several connections open at once. This returns once close_proxy()
+ * closes the listener of the job.
+ */
+static unsigned __stdcall accept_thread(void* arg)
+{
+	struct proxy_job* job = (struct proxy_job*) arg;
+
+	for(;;) {
+		struct proxy_conn* conn = NULL;
+		HANDLE thread = NULL;
+		SOCKET sock = keep_socket(accept(job->listener, NULL, NULL));
+
+		if(sock == INVALID_SOCKET && job->closed)
+			break;
+
+		if(sock == INVALID_SOCKET) {
+			writelog(kDEBUG, _T("Caching proxy failed to accept a ")
+					_T("connection (%d)\n"), WSAGetLastError());
+			continue;
+		}
+
+		/* Running out of memory only costs this connection */
+		conn = malloc(sizeof(*conn));
+
+		if(conn == NULL) {
+			closesocket(sock);
+			continue;
+		}
+
+		conn->job = job;
+		conn->sock = sock;
+		conn->len = 0;
+		InterlockedIncrement(&job->refs);
+		thread = (HANDLE) _beginthreadex(NULL, 0, client_thread, conn, 0,
+				NULL);
+
+		if(thread == 0) {
+			closesocket(sock);
+			release_job(job);
+			free(conn);
+			continue;
+		}
+
+		CloseHandle(thread);
+	}
+
+	release_job(job);
+	return 0;
+}
+
+/*
+ * Handle requests on the connection pointed to by arg, which is freed,
+ * until the renderer closes it, asks for it to be closed or leaves it
+ * idle for PROXY_IDLE_MS. An error only closes the connection, so the
+ * renderer loads what it asked for itself or fails on its own.
+ */
+static unsigned __stdcall client_thread(void* arg)
+{
+	struct error_trap trap;
+	struct proxy_conn* conn = (struct proxy_conn*) arg;
+	struct proxy_request req;
+	DWORD idle = PROXY_IDLE_MS;
+	int keep = 1;
+
+	setsockopt(conn->sock, SOL_SOCKET, SO_RCVTIMEO, (const char*) &idle,
+			sizeof(idle));
+
+	if(setjmp(trap.env) == 0) {
+		set_error_trap(&trap);
+
+		while(keep && read_request(conn, &req)) {
+			keep = handle_request(conn, &req);
+			free_request(&req);
+		}
+
+		set_error_trap(NULL);
+	}
+
+	closesocket(conn->sock);
+	release_job(conn->job);
+	free(conn);
+
+	return 0;
+}
+
+/*
+ * Read the next request on the connection pointed to by conn into the
+ * structure pointed to by req, leaving any bytes received after it in
+ * conn. Return zero if the renderer closed the connection, was idle
+ * too long or sent something other than a request with an optional
+ * Content-Length body; otherwise, req must be passed to free_request().
+ */
+static int read_request(struct proxy_conn* conn, struct proxy_request* req)
+{
+	size_t head_len = 0;
+	size_t have = 0;
+	char* line = NULL;
+	char* next = NULL;
+	char* version = NULL;
+	unsigned long int length = 0;
+	int chunked = 0;
+	int close = 0;
+	int keep = 0;
+
+	while((head_len = find_head_end(conn->data, conn->len)) == 0) {
+		int got = 0;
+
+		if(conn->len == sizeof(conn->data))
+			return 0;
+
+		got = recv(conn->sock, &conn->data[conn->len],
+				(int) (sizeof(conn->data) - conn->len), 0);
+
+		if(got <= 0)
+			return 0;
+
+		conn->len += got;
+	}
+
+	memset(req, 0, sizeof(*req));
+	req->line = copy_bytes(conn->data, head_len);
+	req->line[head_len] = '\0';
+	req->headers = require_mem(head_len + 1);
+	req->headers[0] = '\0';
+
+	/* The request line is "method target version" */
+	next = strstr(req->line, "\r\n");
+	*next = '\0';
+	req->method = req->line;
+	req->target = strchr(req->method, ' ');
+	version = req->target != NULL ? strchr(++req->target, ' ') : NULL;
+
+	if(version == NULL) {
+		free_request(req);
+		return 0;
+	}
+
+	req->target[-1] = '\0';
+	*version++ = '\0';
+
+	for(line = next + 2; *line != '\r'; line = next + 2) {
+		size_t name_len = strcspn(line, ":");
+
+		next = strstr(line, "\r\n");
+		*next = '\0';
+
+		if(is_listed(line, name_len, credential_headers,
+				LENGTHOF(credential_headers)))
+			req->credentials = 1;
+
+		if(!is_listed(line, name_len, hop_headers, LENGTHOF(hop_headers))) {
+			strcat(req->headers, line);
+			strcat(req->headers, "\r\n");
+			continue;
+		}
+
+		CharLowerA(line);
+
+		if(strncmp(line, "content-length:", name_len + 1) == 0)
+			length = strtoul(&line[name_len + 1], NULL, 10);
+		else if(strncmp(line, "transfer-encoding:", name_len + 1) == 0)
+			chunked = 1;
+		else if(strstr(line, "connection:") != NULL) {
+			close = close || strstr(line, "close") != NULL;
+			keep = keep || strstr(line, "keep-alive") != NULL;
+		}
+	}
+
+	/* Chunked request bodies are not supported; renderers never send them */
+	if(chunked) {
+		free_request(req);
+		return 0;
+	}
+
+	req->keep_alive = !close && (strcmp(version, "HTTP/1.1") == 0 || keep);
+	memmove(conn->data, &conn->data[head_len], conn->len - head_len);
+	conn->len -= head_len;
+
+	if(length > 0) {
+		req->body = require_mem(length);
+		req->body_len = length;
+		have = conn->len < length ? conn->len : length;
+		memcpy(req->body, conn->data, have);
+		memmove(conn->data, &conn->data[have], conn->len - have);
+		conn->len -= have;
+
+		while(have < length) {
+			int got = recv(conn->sock, &req->body[have],
+					(int) (length - have), 0);
+
+			if(got <= 0) {
+				free_request(req);
+				return 0;
+			}
+
+			have += got;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Return the length of the head at the start of the given bytes,
+ * including the empty line which ends it, or 0 if the bytes do not
+ * hold a whole head.
+ */
+static size_t find_head_end(const char* data, size_t len)
+{
+	size_t i = 0;
+
+	for(i = 3; i < len; ++i) {
+		if(data[i] == '\n' && data[i - 1] == '\r' && data[i - 2] == '\n'
+				&& data[i - 3] == '\r')
+			return i + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Free the members of the structure pointed to by req. The value of
+ * req must not be NULL.
+ */
+static void free_request(struct proxy_request* req)
+{
+	RT_NOT_NULL(req);
+
+	free(req->line);
+	free(req->headers);
+	free(req->body);
+}
+
+/*
+ * Split the target of the request pointed to by req into its host,
+ * port, path and scheme. Return zero if it is not an absolute HTTP or
+ * HTTPS URL, or host and port for CONNECT.
+ */
+static int crack_target(struct proxy_request* req)
+{
+	URL_COMPONENTSA parts;
+	const char* port = NULL;
+	const char* host = req->target;
+	size_t len = 0;
+
+	if(strcmp(req->method, "CONNECT") == 0) {
+		port = strrchr(host, ':');
+
+		if(port == NULL)
+			return 0;
+
+		len = port - host;
+
+		/* IPv6 addresses are in brackets */
+		if(len >= 2 && host[0] == '[' && host[len - 1] == ']') {
+			++host;
+			len -= 2;
+		}
+
+		if(len == 0 || len >= sizeof(req->host))
+			return 0;
+
+		memcpy(req->host, host, len);
+		req->host[len] = '\0';
+		req->port = (INTERNET_PORT) strtoul(port + 1, NULL, 10);
+
+		return req->port != 0;
+	}
+
+	memset(&parts, 0, sizeof(parts));
+	parts.dwStructSize = sizeof(parts);
+	parts.lpszHostName = req->host;
+	parts.dwHostNameLength = sizeof(req->host);
+	parts.dwUrlPathLength = 1; /* point into target */
+
+	if(!InternetCrackUrlA(req->target, 0, 0, &parts)
+			|| (parts.nScheme != INTERNET_SCHEME_HTTP
+					&& parts.nScheme != INTERNET_SCHEME_HTTPS))
+		return 0;
+
+	/* The path points into target, so it is followed by the query */
+	req->path = parts.dwUrlPathLength > 0 ? parts.lpszUrlPath : "/";
+	req->port = parts.nPort;
+	req->secure = parts.nScheme == INTERNET_SCHEME_HTTPS;
+
+	return 1;
+}
+
+/*
+ * Answer the request pointed to by req on the connection pointed to by
+ * conn. Blocked hosts are answered at once with an empty response, so
+ * that the renderer does not wait on them. Return nonzero if the
+ * connection may be used for another request.
+ */
+static int handle_request(struct proxy_conn* conn,
+		struct proxy_request* req)
+{
+	struct proxy_response res;
+	int sent = 0;
+
+	if(!crack_target(req)) {
+		send_status(conn->sock, "400 Bad Request", 0);
+		return 0;
+	}
+
+	if(is_blocked(conn->job, req->host)) {
+		writelog(kDEBUG, _T("Caching proxy blocked %hs\n"), req->target);
+
+		if(req->path == NULL) {
+			send_status(conn->sock, "403 Forbidden", 0);
+			return 0;
+		}
+
+		return send_status(conn->sock, "204 No Content", req->keep_alive)
+				&& req->keep_alive;
+	}
+
+	if(req->path == NULL) {
+		tunnel(conn, req);
+		return 0;
+	}
+
+	/* What one renderer may see with its credentials, others may not */
+	if(strcmp(req->method, "GET") == 0 && conn->job->caching
+			&& !req->credentials)
+		return serve_cached(conn->sock, req) && req->keep_alive;
+
+	if(!fetch_upstream(req, &res))
+		return send_status(conn->sock, "502 Bad Gateway", req->keep_alive)
+				&& req->keep_alive;
+
+	sent = send_response(conn->sock, &res, req->keep_alive);
+	free(res.head);
+	free(res.body);
+
+	return sent && req->keep_alive;
+}
+
+/*
+ * Answer the GET request pointed to by req on the given socket from
+ * the cache, fetching the response first if no fresh one is kept. A
+ * request for a URL which another renderer is already fetching waits
+ * for that fetch instead of repeating it, and if that fetch fails with
+ * an error, fetches the URL itself. Return zero if the renderer could
+ * not be answered.
+ */
+static int serve_cached(SOCKET sock, const struct proxy_request* req)
+{
+	struct error_trap trap;
+	struct error_trap* outer = get_error_trap(); /* trap to pass errors to */
+	struct proxy_entry* entry = NULL;
+	struct proxy_entry* pending = NULL; /* entry for a fetch, if needed */
+	struct proxy_response res;
+	int fetched = 0;
+	int sent = 0;
+
+	/* Nothing may fail while the lock is held or a fetch is pending */
+	pending = require_cmem(1, sizeof(*pending));
+	pending->url = copy_bytes(req->target, strlen(req->target));
+	pending->url[strlen(req->target)] = '\0';
+	EnterCriticalSection(&proxy.lock);
+
+	while((entry = find_entry(req->target)) != NULL && !entry->ready)
+		SleepConditionVariableCS(&proxy.fetched, &proxy.lock, INFINITE);
+
+	if(entry != NULL && entry->expires > GetTickCount64()) {
+		res.head = malloc(entry->head_len + 1);
+		res.head_len = entry->head_len;
+		res.body = malloc(entry->body_len + 1);
+		res.body_len = entry->body_len;
+
+		if(res.head != NULL && res.body != NULL) {
+			memcpy(res.head, entry->head, entry->head_len);
+			memcpy(res.body, entry->body, entry->body_len);
+			unlink_entry(entry);
+			link_entry(entry);
+		}
+
+		LeaveCriticalSection(&proxy.lock);
+		free(pending->url);
+		free(pending);
+
+		if(res.head == NULL || res.body == NULL) {
+			free(res.head);
+			free(res.body);
+			errorout(E_MALLOC, _T("Failed to allocate memory"));
+		}
+
+		writelog(kDEBUG, _T("Caching proxy reused %hs\n"), req->target);
+		sent = send_response(sock, &res, req->keep_alive);
+		free(res.head);
+		free(res.body);
+
+		return sent;
+	}
+
+	if(entry != NULL)
+		remove_entry(entry);
+
+	/* Later requests for the URL wait for this fetch */
+	entry = pending;
+	link_entry(entry);
+	LeaveCriticalSection(&proxy.lock);
+
+	/* If the fetch fails, later requests fetch the URL themselves */
+	if(setjmp(trap.env) != 0) {
+		EnterCriticalSection(&proxy.lock);
+		remove_entry(entry);
+		WakeAllConditionVariable(&proxy.fetched);
+		LeaveCriticalSection(&proxy.lock);
+		set_error_trap(outer);
+		rethrow_error(trap.code);
+	}
+
+	set_error_trap(&trap);
+	fetched = fetch_upstream(req, &res);
+	sent = fetched ? send_response(sock, &res, req->keep_alive) :
+			send_status(sock, "502 Bad Gateway", req->keep_alive);
+	set_error_trap(outer);
+
+	EnterCriticalSection(&proxy.lock);
+
+	if(fetched && res.fresh > 0
+			&& res.head_len + res.body_len <= proxy.limit) {
+		entry->head = res.head;
+		entry->head_len = res.head_len;
+		entry->body = res.body;
+		entry->body_len = res.body_len;
+		entry->expires = GetTickCount64() + res.fresh;
+		entry->ready = 1;
+		proxy.size += res.head_len + res.body_len;
+		evict_entries();
+	} else {
+		remove_entry(entry);
+
+		if(fetched) {
+			free(res.head);
+			free(res.body);
+		}
+	}
+
+	WakeAllConditionVariable(&proxy.fetched);
+	LeaveCriticalSection(&proxy.lock);
+
+	return sent;
+}
+
+/*
+ * Send the request pointed to by req upstream with WinInet and read the
+ * whole response into the structure pointed to by res, whose head and
+ * body must then be passed to free(). Redirects are passed on to the
+ * renderer rather than followed, and WinInet's own cache and cookies
+ * are bypassed since the renderer has its own. Return zero if no
+ * response was received.
+ */
+static int fetch_upstream(const struct proxy_request* req,
+		struct proxy_response* res)
+{
+	HINTERNET connect = NULL;
+	HINTERNET request = NULL;
+	DWORD flags = INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE
+			| INTERNET_FLAG_KEEP_CONNECTION | INTERNET_FLAG_NO_AUTO_REDIRECT
+			| INTERNET_FLAG_NO_COOKIES | INTERNET_FLAG_NO_UI;
+	int ok = 0;
+
+	if(req->secure)
+		flags |= INTERNET_FLAG_SECURE;
+
+	connect = InternetConnectA(proxy.session, req->host, req->port, NULL,
+			NULL, INTERNET_SERVICE_HTTP, 0, 0);
+
+	if(connect != NULL)
+		request = HttpOpenRequestA(connect, req->method, req->path, NULL,
+				NULL, NULL, flags, 0);
+
+	if(request != NULL && HttpSendRequestA(request, req->headers,
+			(DWORD) strlen(req->headers), req->body, (DWORD) req->body_len))
+		ok = read_response(request, res);
+
+	if(!ok)
+		writelog(kNORM, _T("Caching proxy failed to fetch %hs (%lu)\n"),
+				req->target, GetLastError());
+
+	if(request != NULL)
+		InternetCloseHandle(request);
+
+	if(connect != NULL)
+		InternetCloseHandle(connect);
+
+	return ok;
+}
+
+/*
+ * Read the head and body of the response to the given WinInet request
+ * into the structure pointed to by res, whose head and body must then
+ * be passed to free(). Return zero, filling nothing, if the response
+ * could not be read.
+ */
+static int read_response(HINTERNET request, struct proxy_response* res)
+{
+	char* raw = NULL;
+	DWORD raw_len = 0;
+	DWORD read = 0;
+	size_t cap = PROXY_CHUNK;
+
+	if(!HttpQueryInfoA(request, HTTP_QUERY_RAW_HEADERS_CRLF, NULL, &raw_len,
+			NULL) && GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+		return 0;
+
+	raw = require_mem(raw_len + 1);
+
+	if(!HttpQueryInfoA(request, HTTP_QUERY_RAW_HEADERS_CRLF, raw, &raw_len,
+			NULL)) {
+		free(raw);
+		return 0;
+	}
+
+	raw[raw_len] = '\0';
+	res->body = require_mem(cap);
+	res->body_len = 0;
+
+	for(;;) {
+		if(!InternetReadFile(request, &res->body[res->body_len],
+				(DWORD) (cap - res->body_len), &read)) {
+			free(res->body);
+			free(raw);
+			return 0;
+		}
+
+		if(read == 0)
+			break;
+
+		res->body_len += read;
+
+		if(cap - res->body_len < PROXY_CHUNK) {
+			cap *= 2;
+			res->body = require_realloc(res->body, cap, 1);
+		}
+	}
+
+	res->head = filter_head(raw, res->body_len, &res->head_len);
+	res->fresh = get_freshness(request);
+	free(raw);
+
+	return 1;
+}
+
+/*
+ * Return the status line and headers of the given raw response head
+ * from WinInet, without the headers which only concerned the upstream
+ * connection and with a Content-Length of the given body length, since
+ * WinInet has already removed any chunking. The empty line is left for
+ * send_response() to add after the Connection header. The length of
+ * the head returned is stored in the object pointed to by len. The
+ * pointer returned must be passed to free().
+ */
+static char* filter_head(const char* raw, size_t body_len, size_t* len)
+{
+	char* head = require_mem(strlen(raw) + 64);
+	const char* line = raw;
+	size_t line_len = strcspn(line, "\r\n");
+
+	/* The status line is kept as it is */
+	memcpy(head, line, line_len);
+	*len = line_len;
+	memcpy(&head[*len], "\r\n", 2);
+	*len += 2;
+
+	for(line += line_len; *line != '\0'; line += line_len) {
+		line += strspn(line, "\r\n");
+		line_len = strcspn(line, "\r\n");
+
+		if(line_len == 0 || is_listed(line, strcspn(line, ":"), hop_headers,
+				LENGTHOF(hop_headers)))
+			continue;
+
+		memcpy(&head[*len], line, line_len);
+		*len += line_len;
+		memcpy(&head[*len], "\r\n", 2);
+		*len += 2;
+	}
+
+	*len += sprintf(&head[*len], "Content-Length: %lu\r\n",
+			(unsigned long int) body_len);
+
+	return head;
+}
+
+/*
+ * Return the number of milliseconds the response to the given WinInet
+ * request may be given to other renderers, or 0 if it may not be
+ * reused. Only successful responses with a static type (stylesheets,
+ * scripts, fonts and images) which set no cookie and allow shared
+ * caching are reused, for their max-age or else PROXY_FRESH_MS.
+ */
+static ULONGLONG get_freshness(HINTERNET request)
+{
+	char value[256];
+	DWORD status = 0;
+	DWORD len = sizeof(status);
+	const char* age = NULL;
+	size_t i = 0;
+	int is_static = 0;
+
+	if(!HttpQueryInfoA(request, HTTP_QUERY_STATUS_CODE
+			| HTTP_QUERY_FLAG_NUMBER, &status, &len, NULL)
+			|| status != HTTP_STATUS_OK)
+		return 0;
+
+	len = sizeof(value);
+
+	if(HttpQueryInfoA(request, HTTP_QUERY_SET_COOKIE, value, &len, NULL)
+			|| GetLastError() != ERROR_HTTP_HEADER_NOT_FOUND)
+		return 0;
+
+	len = sizeof(value);
+
+	if(!HttpQueryInfoA(request, HTTP_QUERY_CONTENT_TYPE, value, &len,
+			NULL))
+		return 0;
+
+	for(i = 0; i < LENGTHOF(static_types) && !is_static; ++i)
+		is_static = _strnicmp(value, static_types[i],
+				strlen(static_types[i])) == 0;
+
+	if(!is_static)
+		return 0;
+
+	len = sizeof(value);
+
+	if(!HttpQueryInfoA(request, HTTP_QUERY_CACHE_CONTROL, value, &len,
+			NULL))
+		return GetLastError() == ERROR_HTTP_HEADER_NOT_FOUND ?
+				PROXY_FRESH_MS : 0;
+
+	CharLowerA(value);
+
+	if(strstr(value, "no-store") != NULL || strstr(value, "no-cache") != NULL
+			|| strstr(value, "private") != NULL)
+		return 0;
+
+	if((age = strstr(value, "s-maxage=")) == NULL)
+		age = strstr(value, "max-age=");
+
+	if(age == NULL)
+		return PROXY_FRESH_MS;
+
+	return (ULONGLONG) strtoul(strchr(age, '=') + 1, NULL, 10) * 1000;
+}
+
+/*
+ * Connect to the host and port of the CONNECT request pointed to by
+ * req and relay bytes both ways between it and the connection pointed
+ * to by conn. What goes through a tunnel is usually TLS, so it is
+ * never cached.
+ */
+static void tunnel(struct proxy_conn* conn, const struct proxy_request* req)
+{
+	struct addrinfo hints;
+	struct addrinfo* found = NULL;
+	char port[8];
+	SOCKET upstream = INVALID_SOCKET;
+	static const char established[] =
+			"HTTP/1.1 200 Connection established\r\n\r\n";
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	sprintf(port, "%u", (unsigned int) req->port);
+
+	if(getaddrinfo(req->host, port, &hints, &found) == 0) {
+		upstream = keep_socket(socket(found->ai_family,
+				found->ai_socktype, found->ai_protocol));
+
+		if(upstream != INVALID_SOCKET && connect(upstream, found->ai_addr,
+				(int) found->ai_addrlen) != 0) {
+			closesocket(upstream);
+			upstream = INVALID_SOCKET;
+		}
+
+		freeaddrinfo(found);
+	}
+
+	if(upstream == INVALID_SOCKET) {
+		writelog(kNORM, _T("Caching proxy failed to connect to %hs (%d)\n"),
+				req->target, WSAGetLastError());
+		send_status(conn->sock, "502 Bad Gateway", 0);
+		return;
+	}
+
+	/* Whatever the renderer sent after the request is for upstream */
+	if(send_all(conn->sock, established, sizeof(established) - 1)
+			&& send_all(upstream, conn->data, conn->len))
+		relay(conn->sock, upstream);
+
+	closesocket(upstream);
+}
+
+/*
+ * Copy bytes received on either of the given sockets to the other
+ * until one of them is closed or both stay idle for PROXY_IDLE_MS.
+ */
+static void relay(SOCKET renderer, SOCKET upstream)
+{
+	char buf[PROXY_CHUNK];
+	fd_set ready;
+	struct timeval idle;
+	int got = 0;
+
+	for(;;) {
+		FD_ZERO(&ready);
+		FD_SET(renderer, &ready);
+		FD_SET(upstream, &ready);
+		idle.tv_sec = PROXY_IDLE_MS / 1000;
+		idle.tv_usec = 0;
+
+		/* The first parameter is ignored by Winsock */
+		if(select(0, &ready, NULL, NULL, &idle) <= 0)
+			return;
+
+		if(FD_ISSET(renderer, &ready)) {
+			got = recv(renderer, buf, sizeof(buf), 0);
+
+			if(got <= 0 || !send_all(upstream, buf, got))
+				return;
+		}
+
+		if(FD_ISSET(upstream, &ready)) {
+			got = recv(upstream, buf, sizeof(buf), 0);
+
+			if(got <= 0 || !send_all(renderer, buf, got))
+				return;
+		}
+	}
+}
+
+/*
+ * Return nonzero if the given host is in the blocklist of the job
+ * pointed to by job, either by itself or as a subdomain of a host in
+ * it.
+ */
+static int is_blocked(const struct proxy_job* job, const char* host)
+{
+	size_t len = strlen(host);
+	size_t i = 0;
+
+	for(i = 0; i < job->blocked_count; ++i) {
+		size_t blocked_len = strlen(job->blocked[i]);
+
+		if(len == blocked_len && _stricmp(host, job->blocked[i]) == 0)
+			return 1;
+
+		if(len > blocked_len && host[len - blocked_len - 1] == '.'
+				&& _stricmp(&host[len - blocked_len], job->blocked[i]) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Return nonzero if the header with the given name, which is not
+ * terminated, is one of the count names in the array pointed to by
+ * names.
+ */
+static int is_listed(const char* name, size_t len,
+		const char* const* names, size_t count)
+{
+	size_t i = 0;
+
+	for(i = 0; i < count; ++i) {
+		if(strlen(names[i]) == len && _strnicmp(name, names[i], len) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Send the response pointed to by res on the given socket, telling the
+ * renderer whether the connection stays open. Return zero if the
+ * renderer went away.
+ */
+static int send_response(SOCKET sock, const struct proxy_response* res,
+		int keep_alive)
+{
+	static const char keep[] = "Connection: keep-alive\r\n\r\n";
+	static const char close[] = "Connection: close\r\n\r\n";
+
+	return send_all(sock, res->head, res->head_len)
+			&& (keep_alive ? send_all(sock, keep, sizeof(keep) - 1) :
+					send_all(sock, close, sizeof(close) - 1))
+			&& send_all(sock, res->body, res->body_len);
+}
+
+/*
+ * Send a response with the given status code and reason and no body
+ * on the given socket. Return zero if the renderer went away.
+ */
+static int send_status(SOCKET sock, const char* status, int keep_alive)
+{
+	struct proxy_response res;
+	char head[64];
+
+	res.head = head;
+	res.head_len = (size_t) sprintf(head,
+			"HTTP/1.1 %s\r\nContent-Length: 0\r\n", status);
+	res.body = NULL;
+	res.body_len = 0;
+
+	return send_response(sock, &res, keep_alive);
+}
+
+/*
+ * Send all the given bytes on the given socket. Return zero if the
+ * renderer went away.
+ */
+static int send_all(SOCKET sock, const char* data, size_t len)
+{
+	while(len > 0) {
+		int sent = send(sock, data, len > INT_MAX ? INT_MAX : (int) len,
+				0);
+
+		if(sent <= 0)
+			return 0;
+
+		data += sent;
+		len -= sent;
+	}
+
+	return 1;
+}
+
+/*
+ * Keep the given socket from being inherited by renderers started
+ * while it is open and return it. Sockets are inheritable by default,
+ * and a copy held by a renderer keeps a listener bound and a closed
+ * connection from ending. INVALID_SOCKET is returned as it is.
+ */
+static SOCKET keep_socket(SOCKET sock)
+{
+	if(sock != INVALID_SOCKET
+			&& !SetHandleInformation((HANDLE) sock, HANDLE_FLAG_INHERIT, 0))
+		writelog(kVERBOSE, _T("Failed to make socket %lu private (%lu)\n"),
+				(unsigned long int) sock, GetLastError());
+
+	return sock;
+}
+
+/*
+ * Return a copy of the given bytes with room for a terminator after
+ * them. The pointer returned must be passed to free().
+ */
+static char* copy_bytes(const char* data, size_t len)
+{
+	char* copy = require_mem(len + 1);
+
+	memcpy(copy, data, len);
+
+	return copy;
+}
+
+/*
+ * Return the entry for the given URL, or NULL if there is none. There
+ * are rarely more than a few hundred entries, so they are searched in
+ * order of use. The lock member of proxy must be held.
+ */
+static struct proxy_entry* find_entry(const char* url)
+{
+	struct proxy_entry* entry = NULL;
+
+	for(entry = proxy.newest; entry != NULL; entry = entry->older) {
+		if(strcmp(entry->url, url) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Make the entry pointed to by entry, which is not in the list, the
+ * most recently used one. The lock member of proxy must be held.
+ */
+static void link_entry(struct proxy_entry* entry)
+{
+	entry->newer = NULL;
+	entry->older = proxy.newest;
+
+	if(proxy.newest != NULL)
+		proxy.newest->newer = entry;
+	else
+		proxy.oldest = entry;
+
+	proxy.newest = entry;
+}
+
+/*
+ * Take the entry pointed to by entry out of the list. The lock member
+ * of proxy must be held.
+ */
+static void unlink_entry(struct proxy_entry* entry)
+{
+	if(entry->newer != NULL)
+		entry->newer->older = entry->older;
+	else
+		proxy.newest = entry->older;
+
+	if(entry->older != NULL)
+		entry->older->newer = entry->newer;
+	else
+		proxy.oldest = entry->newer;
+}
+
+/*
+ * Take the entry pointed to by entry out of the list and free it. The
+ * lock member of proxy must be held.
+ */
+static void remove_entry(struct proxy_entry* entry)
+{
+	unlink_entry(entry);
+
+	if(entry->ready)
+		proxy.size -= entry->head_len + entry->body_len;
+
+	free(entry->url);
+	free(entry->head);
+	free(entry->body);
+	free(entry);
+}
+
+/*
+ * Remove the least recently used entries until those kept fit in the
+ * limit. Entries being fetched are left alone. The lock member of proxy
+ * must be held.
+ */
+static void evict_entries(void)
+{
+	struct proxy_entry* entry = proxy.oldest;
+
+	while(proxy.size > proxy.limit && entry != NULL) {
+		struct proxy_entry* newer = entry->newer;
+
+		if(entry->ready)
+			remove_entry(entry);
+
+		entry = newer;
+	}
+}
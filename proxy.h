@@ -0,0 +1,8 @@
+#pragma once
+
+#include "stdafx.h"
+#include "parse.h"
+
+void open_proxy(const struct pdf_info*);
+LPCTSTR get_proxy_url(const struct pdf_info*);
+void close_proxy(const struct pdf_info*);
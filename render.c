@@ -0,0 +1,1518 @@
+#include "stdafx.h"
+#include "render.h"
+#include "cache.h"
+#include "cost.h"
+#include "prefetch.h"
+#include "task.h"
+#include "toc.h"
+#include "wkhtmltopdf_cmd.h"
+#include "util.h"
+#include "log.h"
+
+/* Longest combined source URLs of a batch, leaving room for options */
+#define RENDER_BATCH_SOURCES_MAX (CMD_MAX_LEN / 2)
+
+/* Memory a conversion is assumed to need until one has been measured */
+#define RENDER_MEMORY_GUESS (256UL * 1024 * 1024)
+
+/* How often held conversions are reconsidered, in milliseconds */
+#define RENDER_ADMIT_POLL_MS 250
+
+/* Delay before the first retry of a killed conversion, in milliseconds */
+#define RENDER_RETRY_BACKOFF_MS 1000
+
+/* Longest delay before a retry of a killed conversion, in milliseconds */
+#define RENDER_RETRY_BACKOFF_MAX_MS 30000
+
+/* Retries after which the delay is no longer doubled */
+#define RENDER_RETRY_BACKOFF_DOUBLINGS 5
+
+/* Position of a segment and its expected conversion time */
+struct render_cost {
+	size_t index; /* index of the segment */
+	unsigned long int millis; /* expected conversion time */
+};
+
+/* Settings and measurements shared by the passes of render_units() */
+struct render_state {
+	const struct pdf_info* info; /* global information */
+	unsigned long int parallel; /* maximum number of running conversions */
+	SIZE_T budget; /* memory available to conversions, or 0 for no limit */
+	SIZE_T expected; /* memory a new conversion is expected to need */
+	DWORD timeout; /* milliseconds a conversion may run, or 0 for any */
+	unsigned long int retries; /* times a killed conversion is retried */
+	unsigned long int hedge_percent; /* straggler threshold, or 0 */
+	unsigned long int hedge_percentile; /* expected time without history */
+	SIZE_T reserved; /* memory counted for this job in admission */
+	int holding; /* nonzero while a conversion is held for memory */
+	render_ready_proc ready_proc; /* procedure given final units, or NULL */
+	void* ready_arg; /* argument passed to ready_proc */
+	size_t ready; /* number of units given to ready_proc */
+	unsigned long int ready_pages; /* pages in those units */
+};
+
+/* A search of the render cache for a unit, run on the task pool */
+struct render_lookup {
+	struct render_job* job; /* unit to search for */
+	const struct pdf_info* info; /* global information */
+	unsigned long int offset; /* page offset to search at */
+	int found; /* nonzero if the unit was in the cache */
+};
+
+/* Segments converted in batches, given out as their batch is final */
+struct batch_ready {
+	struct render_job* jobs; /* segments of every batch */
+	const struct pdf_segment_info* sections; /* sections of every batch */
+	render_ready_proc proc; /* procedure given each segment, or NULL */
+	void* arg; /* argument passed to proc */
+};
+
+/* Memory reserved by the running conversions of every job */
+static struct {
+	INIT_ONCE once; /* initializes the members below */
+	CRITICAL_SECTION lock; /* protects reserved */
+	SIZE_T reserved; /* sum of the reserved members of every render_state */
+} admission = { INIT_ONCE_STATIC_INIT };
+
+static void render_units(struct render_job*, size_t,
+		const struct pdf_info*, render_ready_proc, void*);
+static void pass_ready(struct render_state*, struct render_job*, size_t);
+static void batch_ready(struct render_job*, void*);
+static int same_layout(const struct render_job*, const struct render_job*);
+static LPTSTR join_segments(const struct pdf_segment_info*, size_t);
+static void split_batch(struct render_job*, struct render_job*);
+static size_t look_up_units(struct render_state*, struct render_job*,
+		size_t, const size_t*, size_t, const unsigned long int*, size_t*);
+static void lookup_task(void*);
+static void render_pass(struct render_state*, struct render_job*, size_t,
+		const size_t*, size_t, const unsigned long int*);
+static void kill_overdue(struct render_state*, struct supervisor*);
+static void abort_pass(struct render_state*, struct supervisor*);
+static int admit_render(struct render_state*, struct supervisor*);
+static SIZE_T reserve_memory(struct render_state*, struct supervisor*);
+static BOOL CALLBACK start_admission(PINIT_ONCE, PVOID, PVOID*);
+static DWORD hedge_stragglers(struct render_state*, struct supervisor*,
+		const struct render_job*, size_t);
+static unsigned long int typical_millis(const struct render_job*, size_t,
+		unsigned long int);
+static int compare_millis(const void*, const void*);
+static size_t* order_by_cost(const struct render_job*, size_t);
+static int compare_cost(const void*, const void*);
+static unsigned long int guess_offset(const struct render_job*, size_t,
+		size_t);
+static void start_render(struct supervisor*, struct render_job*,
+		unsigned long int, const struct pdf_info*);
+static void start_hedge(struct supervisor*, struct render_job*,
+		const struct pdf_info*);
+static void finish_render(struct render_job*, struct child*,
+		const struct pdf_info*);
+static void discard_render(struct render_job*, struct child*);
+static void drop_pending(struct render_job*, size_t);
+static void swap_targets(struct render_job*);
+
+/*
+ * Convert each of the n segments in the array pointed to by jobs as
+ * described by render_units(). If the batch_segments member of the
+ * structure pointed to by info is greater than 1, runs of up to that
+ * many consecutive segments with the same size, orientation and
+ * options are converted by a single instance of the PDF getter, which
+ * saves starting it for each of them. Margins are the same for every
+ * segment. The combined outline dump is split at its top-level items,
+ * one per segment, to give each segment its own outline and number of
+ * pages. The first segment of a run keeps the combined PDF and the
+ * target_id member of the others is set to 0. A run is split as soon
+ * as it is final, and if proc is not NULL, it is then called as
+ * render_units() describes with each of its segments in order, so the
+ * segments are given out one by one either way. When this procedure
+ * returns, the offset and pages members of each job are set to the
+ * final page offset and number of pages of its segment. The value of
+ * info must not be NULL. The value of jobs must not be NULL unless n
+ * is equal to zero.
+ */
+void render_segments(struct render_job* jobs, size_t n,
+		const struct pdf_info* info, render_ready_proc proc, void* arg)
+{
+	struct render_job* units = NULL; /* segments converted together */
+	struct pdf_segment_info* sections = NULL; /* segments of each unit */
+	struct batch_ready batch; /* splits each unit once it is final */
+	size_t count = 0; /* number of units */
+	size_t first = 0; /* first segment of the current unit */
+	size_t i = 0;
+
+	RT_NOT_NULL(info);
+
+	if(n == 0)
+		return;
+
+	RT_NOT_NULL(jobs);
+
+	if(info->batch_segments <= 1) {
+		for(i = 0; i < n; ++i) {
+			jobs[i].sections = &jobs[i].segment;
+			jobs[i].section_count = 1;
+		}
+
+		render_units(jobs, n, info, proc, arg);
+		return;
+	}
+
+	units = (struct render_job*) require_cmem(n, sizeof(*units));
+	sections = (struct pdf_segment_info*) require_cmem(n, sizeof(*sections));
+
+	for(first = 0; first < n; first = i, ++count) {
+		struct render_job* unit = &units[count];
+		size_t len = 0;
+
+		/* The outline dump is the only way to tell the segments apart */
+		for(i = first; i < n && i - first < info->batch_segments; ++i) {
+			len += _tcslen(jobs[i].segment.segment) + MAX_PATH;
+
+			if(i > first && (!(jobs[first].options & kPDF_DUMP)
+					|| !same_layout(&jobs[first], &jobs[i])
+					|| len > RENDER_BATCH_SOURCES_MAX))
+				break;
+
+			sections[i] = jobs[i].segment;
+		}
+
+		unit->segment.size = jobs[first].segment.size;
+		unit->segment.orientation = jobs[first].segment.orientation;
+		unit->segment.segment = join_segments(&sections[first], i - first);
+		unit->sections = &sections[first];
+		unit->section_count = i - first;
+		unit->options = jobs[first].options;
+		unit->target_id = jobs[first].target_id;
+		unit->prefetch = jobs[first].prefetch;
+
+		if(unit->section_count == 1)
+			unit->outline_id = jobs[first].outline_id;
+	}
+
+	writelog(kVERBOSE, _T("Converting %lu segments in %lu batches\n"),
+			(unsigned long int) n, (unsigned long int) count);
+	batch.jobs = jobs;
+	batch.sections = sections;
+	batch.proc = proc;
+	batch.arg = arg;
+	render_units(units, count, info, batch_ready, &batch);
+
+	for(i = 0; i < count; ++i)
+		free(units[i].segment.segment);
+
+	free(sections);
+	free(units);
+}
+
+/*
+ * Convert each of the n units in the array pointed to by jobs. A unit
+ * is converted by one instance of the PDF getter and covers the
+ * segments in its sections member, which are treated as one. The
+ * structure pointed to by info provides the global information and its
+ * parallel_renders member limits how many instances of the PDF getter
+ * may run at once. If its render_memory member is not zero, a
+ * conversion is only started while the memory expected to be used by
+ * the running conversions of every job in the process fits in that many
+ * megabytes and the system has enough memory available. If its
+ * cost_store_path member is not NULL, the conversion time and number of
+ * pages of each segment are remembered in that file. When several
+ * conversions run at once, the segments expected to take longest are
+ * started first, and fetched first if the jobs prefetch their HTML, and
+ * remembered page counts are used to guess offsets. If its
+ * render_cache_path member is not NULL, the segments of each pass are
+ * searched in that cache all at once before any is started. If its
+ * segment_timeout member is not zero, a conversion running longer than
+ * that many seconds is killed along with its descendants and retried up
+ * to render_retries times with an increasing delay. If its
+ * hedge_percent member is not zero, a segment still converting that
+ * percentage of its expected time after every other segment was started
+ * is converted a second time alongside, and whichever conversion
+ * finishes first is kept. Since the page offset of a segment depends on
+ * the number of pages in every segment before it, segments that are
+ * started before their predecessors are finished are given a guessed
+ * offset. Once every segment has been converted, the segments with a
+ * wrong guess are converted again with the correct offset. Segments
+ * converted without the kPDF_OFFSET option are never converted again;
+ * the page numbers of their outline dump lack the offset, which is
+ * stored in their outline_offset member. If proc is not NULL, it is
+ * called with each job and arg, in order, as soon as the PDF of that
+ * segment and of every segment before it are final, which may be long
+ * before the last segment is. It may take over the temp file of the PDF
+ * by setting the target_id member of the job to 0. When this procedure
+ * returns, the offset and pages members of each job are set to the
+ * final page offset and number of pages of its segment. The value of
+ * info must not be NULL. The value of jobs must not be NULL unless n is
+ * equal to zero.
+ */
+static void render_units(struct render_job* jobs, size_t n,
+		const struct pdf_info* info, render_ready_proc proc, void* arg)
+{
+	struct render_state state;
+	struct cost_store store; /* remembered conversion costs */
+	size_t* order = NULL; /* indices of segments in the order to start them */
+	size_t* todo = NULL; /* indices of segments not found in the cache */
+	size_t* stale = NULL; /* indices of segments with a wrong offset */
+	unsigned long int* offsets = NULL; /* correct offset of each segment */
+	unsigned long int total_pages = 0;
+	size_t count = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(info);
+
+	if(n == 0)
+		return;
+
+	RT_NOT_NULL(jobs);
+
+	state.info = info;
+	state.parallel = info->parallel_renders > 1 ? info->parallel_renders : 1;
+	state.budget = (SIZE_T) info->render_memory * 1024 * 1024;
+	state.expected = 0;
+	state.reserved = 0;
+	state.holding = 0;
+	state.timeout = (DWORD) info->segment_timeout * 1000;
+	state.retries = info->render_retries;
+	state.hedge_percent = info->hedge_percent;
+	state.hedge_percentile = info->hedge_percentile;
+	state.ready_proc = proc;
+	state.ready_arg = arg;
+	state.ready = 0;
+	state.ready_pages = 0;
+
+	if(info->cost_store_path != NULL)
+		load_cost_store(&store, info->cost_store_path);
+
+	for(i = 0; i < n; ++i) {
+		const struct cost_entry* cost = NULL;
+
+		if(info->cost_store_path != NULL)
+			cost = find_cost(&store, &jobs[i].segment);
+
+		jobs[i].expected_pages = cost != NULL ? cost->pages : 0;
+		jobs[i].expected_millis = cost != NULL ? cost->millis : 0;
+		jobs[i].finished = 0;
+	}
+
+	/*
+	 * Starting segments out of order only helps if they can run at the
+	 * same time. One at a time, in order, every offset is known.
+	 */
+	if(state.parallel > 1)
+		order = order_by_cost(jobs, n);
+
+	todo = (size_t*) require_cmem(n, sizeof(*todo));
+	count = look_up_units(&state, jobs, n, order, n, NULL, todo);
+
+	/* Download the HTML of the segments left, in the order needed */
+	order_prefetch(jobs[0].prefetch, info, jobs, todo, count);
+
+	if(count > 0)
+		render_pass(&state, jobs, n, todo, count, NULL);
+
+	count = 0;
+
+	stale = (size_t*) require_cmem(n, sizeof(*stale));
+	offsets = (unsigned long int*) require_cmem(n, sizeof(*offsets));
+
+	for(i = 0; i < n; ++i) {
+		offsets[i] = total_pages;
+		total_pages += jobs[i].pages;
+
+		/* Without a page offset, a PDF is right at any offset */
+		if(!(jobs[i].options & kPDF_OFFSET))
+			jobs[i].offset = offsets[i];
+
+		if(jobs[i].offset != offsets[i])
+			stale[count++] = i;
+	}
+
+	if(count > 0) {
+		writelog(kVERBOSE, _T("Converting %lu of %lu segments again with ")
+				_T("corrected page offsets\n"), (unsigned long int) count,
+				(unsigned long int) n);
+		count = look_up_units(&state, jobs, n, stale, count, offsets, stale);
+
+		if(count > 0)
+			render_pass(&state, jobs, n, stale, count, offsets);
+	}
+
+	/*
+	 * The number of pages in a segment does not normally depend on its
+	 * offset. If it did, finish the remaining corrections one at a
+	 * time, which always produces the correct offsets.
+	 */
+	total_pages = 0;
+
+	for(i = 0; i < n; ++i) {
+		if(jobs[i].offset != total_pages) {
+			writelog(kVERBOSE, _T("Segment %lu changed length; converting ")
+					_T("it again at offset %lu\n"), (unsigned long int) i,
+					total_pages);
+			offsets[i] = total_pages;
+			state.parallel = 1;
+			render_pass(&state, jobs, n, &i, 1, offsets);
+		}
+
+		total_pages += jobs[i].pages;
+	}
+
+	/* Segments after the last correction were final all along */
+	pass_ready(&state, jobs, n);
+
+	if(info->cost_store_path != NULL) {
+		for(i = 0; i < n; ++i)
+			record_cost(&store, &jobs[i].segment, jobs[i].millis,
+					jobs[i].pages);
+
+		save_cost_store(&store);
+		destroy_cost_store(&store);
+	}
+
+	free(offsets);
+	free(stale);
+	free(todo);
+	free(order);
+}
+
+/*
+ * Search the render cache of the settings in the structure pointed to
+ * by state for the count of the n units in the array pointed to by jobs
+ * which render_pass() would convert with the same order and offsets,
+ * all at once on the task pool, before any of them is started, so that
+ * the thread reaping the conversions never waits for a server to say
+ * whether a source changed. Without offsets, units are searched at the
+ * offsets guess_offset() gives, unless they are converted one at a time
+ * with page offsets, which start_render() then searches for itself. A
+ * unit that is found is finished at once at the offset it was searched
+ * at, with the cached PDF, and given to the ready procedure if it is
+ * final. Every other unit keeps the validators to publish its
+ * conversion with, which start_render() uses instead of searching again
+ * if it starts the unit at the same offset. The indices of those units
+ * are stored in the array pointed to by todo, which may be order, in
+ * the same order, and their number is returned. If the cache is not
+ * used, every unit is left to convert. If a search fails, the
+ * validators of every unit are freed before the error is passed on. The
+ * values of state, jobs and todo must not be NULL.
+ */
+static size_t look_up_units(struct render_state* state,
+		struct render_job* jobs, size_t n, const size_t* order, size_t count,
+		const unsigned long int* offsets, size_t* todo)
+{
+	struct error_trap trap;
+	struct error_trap* outer = get_error_trap(); /* trap to pass errors to */
+	struct task_graph graph; /* one search per unit */
+	struct render_lookup* lookups = NULL; /* search of each unit */
+	size_t left = 0; /* number of units not found */
+	size_t i = 0;
+
+	RT_NOT_NULL(state);
+	RT_NOT_NULL(jobs);
+	RT_NOT_NULL(todo);
+
+	if(state->info->render_cache_path == NULL || count == 0) {
+		for(i = 0; i < count; ++i)
+			todo[i] = order != NULL ? order[i] : i;
+
+		return count;
+	}
+
+	init_task_graph(&graph);
+	lookups = (struct render_lookup*) require_cmem(count, sizeof(*lookups));
+
+	for(i = 0; i < count; ++i) {
+		size_t index = order != NULL ? order[i] : i;
+
+		lookups[i].job = &jobs[index];
+		lookups[i].info = state->info;
+
+		/*
+		 * One at a time, a unit is started at its true offset and
+		 * nothing waits while it is searched for, so a guess would
+		 * only risk converting it again.
+		 */
+		if(offsets == NULL && state->parallel == 1
+				&& jobs[index].options & kPDF_OFFSET)
+			continue;
+
+		lookups[i].offset = offsets != NULL ? offsets[index] :
+				guess_offset(jobs, n, index);
+		add_task(&graph, _T("cache lookup"), lookup_task, &lookups[i]);
+	}
+
+	if(setjmp(trap.env) != 0) {
+		drop_pending(jobs, n);
+		destroy_task_graph(&graph);
+		free(lookups);
+		set_error_trap(outer);
+		rethrow_error(trap.code);
+	}
+
+	set_error_trap(&trap);
+	run_task_graph(&graph);
+	set_error_trap(outer);
+	destroy_task_graph(&graph);
+
+	for(i = 0; i < count; ++i)
+		if(!lookups[i].found)
+			todo[left++] = (size_t) (lookups[i].job - jobs);
+
+	writelog(kVERBOSE, _T("Found %lu of %lu segments in the render cache\n"),
+			(unsigned long int) (count - left), (unsigned long int) count);
+	free(lookups);
+	pass_ready(state, jobs, n);
+
+	return left;
+}
+
+/*
+ * Search the render cache for the unit of the render_lookup structure
+ * pointed to by arg at its offset, as look_up_units() describes. The
+ * value of arg must not be NULL.
+ */
+static void lookup_task(void* arg)
+{
+	struct render_lookup* lookup = (struct render_lookup*) arg;
+	struct render_job* job = NULL;
+
+	RT_NOT_NULL(lookup);
+
+	job = lookup->job;
+	free_pending(job->pending);
+	job->pending = NULL;
+	job->checked = 0;
+	lookup->found = find_segment_pdf(&job->target_id, &job->outline_id,
+			lookup->offset, lookup->info, job->sections, job->section_count,
+			job->options, &job->cached_pages, &job->pending);
+
+	if(lookup->found) {
+		job->offset = lookup->offset;
+		job->pages = job->cached_pages;
+		job->millis = job->expected_millis;
+		job->finished = 1;
+	} else {
+		job->checked = 1;
+		job->checked_offset = lookup->offset;
+	}
+}
+
+/*
+ * Convert count of the n segments in the array pointed to by jobs with
+ * the settings in the structure pointed to by state. New conversions
+ * are only started while admit_render() allows them. If order is not
+ * NULL, it points to the indices of the segments to convert in the
+ * order in which to start them. Otherwise, the first count segments are
+ * converted in order. If offsets is not NULL, it points to the page
+ * offset to use for each segment, indexed like jobs. Otherwise, each
+ * segment is given the offset returned by guess_offset() when it is
+ * started. Segments are started in order but finished in whatever
+ * order their conversions finish. A conversion which runs past the
+ * segment deadline is killed and started again after a delay, up to
+ * the configured number of retries. Once nothing is left to start, a
+ * straggling conversion may race a duplicate started by
+ * hedge_stragglers(); the first to finish is kept and the other is
+ * killed. If anything fails, every running conversion is killed and
+ * reaped and the validators kept to publish the segments in the render
+ * cache are freed before the error is passed on. The values of state and jobs
+ * must not be NULL.
+ */
+static void render_pass(struct render_state* state, struct render_job* jobs,
+		size_t n, const size_t* order, size_t count,
+		const unsigned long int* offsets)
+{
+	struct error_trap trap;
+	struct error_trap* outer = get_error_trap(); /* trap to pass errors to */
+	struct supervisor* sup = NULL; /* conversions of this pass */
+	struct render_job** retries = NULL; /* killed segments to start again */
+	struct child* loser = NULL; /* losing conversion of a finished race */
+	size_t retry_count = 0; /* number of elements in retries */
+	size_t next = 0; /* next segment to start */
+	size_t done = 0; /* number of finished segments */
+
+	RT_NOT_NULL(state);
+	RT_NOT_NULL(jobs);
+
+	sup = (struct supervisor*) require_mem(sizeof(*sup));
+	init_supervisor(sup);
+	retries = (struct render_job**) require_cmem(count, sizeof(*retries));
+
+	/* The jobs must outlive any conversion of a pass that fails */
+	if(setjmp(trap.env) != 0) {
+		abort_pass(state, sup);
+		drop_pending(jobs, n);
+		free(retries);
+		free(sup);
+		set_error_trap(outer);
+		rethrow_error(trap.code);
+	}
+
+	set_error_trap(&trap);
+
+	for(next = 0; next < count; ++next)
+		jobs[order != NULL ? order[next] : next].attempts = 0;
+
+	next = 0;
+
+	while(done < count) {
+		struct child* child = NULL;
+		struct render_job* job = NULL;
+		DWORD timeout = INFINITE;
+		DWORD now = GetTickCount();
+
+		while(sup->count < state->parallel) {
+			struct render_job* retry = NULL;
+			size_t i = 0;
+
+			/*
+			 * Killed segments go first once their delay has passed. The
+			 * subtraction wraps around once the retry time is reached.
+			 */
+			for(i = 0; i < retry_count; ++i) {
+				DWORD wait = retries[i]->retry_at - now;
+
+				if(wait == 0 || wait > RENDER_RETRY_BACKOFF_MAX_MS) {
+					retry = retries[i];
+					retries[i] = retries[--retry_count];
+					break;
+				}
+
+				if(wait < timeout)
+					timeout = wait;
+			}
+
+			if(retry == NULL && next >= count)
+				break;
+
+			/*
+			 * A segment whose HTML is still being prefetched would only
+			 * wait for it in a slot, unless nothing else is running.
+			 */
+			if(retry == NULL && sup->count > 0) {
+				struct render_job* waiting = &jobs[order != NULL ?
+						order[next] : next];
+
+				if(!is_prefetched(waiting->prefetch, state->info,
+						waiting->sections, waiting->section_count)) {
+					if(RENDER_ADMIT_POLL_MS < timeout)
+						timeout = RENDER_ADMIT_POLL_MS;
+
+					break;
+				}
+			}
+
+			if(!admit_render(state, sup)) {
+				if(retry != NULL)
+					retries[retry_count++] = retry;
+
+				if(RENDER_ADMIT_POLL_MS < timeout)
+					timeout = RENDER_ADMIT_POLL_MS;
+
+				break;
+			}
+
+			if(retry != NULL) {
+				start_render(sup, retry, retry->offset, state->info);
+			} else {
+				i = order != NULL ? order[next] : next;
+				start_render(sup, &jobs[i], offsets != NULL ? offsets[i] :
+						guess_offset(jobs, n, i), state->info);
+				++next;
+			}
+		}
+
+		/*
+		 * Once nothing is left to start, a free slot is better spent on
+		 * a duplicate of a straggler than left idle.
+		 */
+		if(state->hedge_percent > 0 && next >= count && retry_count == 0) {
+			DWORD wait = hedge_stragglers(state, sup, jobs, n);
+
+			if(wait < timeout)
+				timeout = wait;
+		}
+
+		/* Wake up in time for the nearest segment deadline */
+		if(state->timeout > 0) {
+			for(child = sup->running; child != NULL; child = child->next) {
+				struct render_job* running = (struct render_job*) child->data;
+				DWORD elapsed = now - running->started;
+				DWORD wait = elapsed < state->timeout ?
+						state->timeout - elapsed : 0;
+
+				if(child == running->primary && wait < timeout)
+					timeout = wait;
+			}
+		}
+
+		child = wait_child(sup, timeout);
+
+		if(child == NULL) {
+			if(timeout == INFINITE)
+				errorout(E_CMD, _T("Lost track of %s"), pdf_getter_exe);
+
+			kill_overdue(state, sup);
+			continue;
+		}
+
+		reserve_memory(state, sup);
+
+		/* Expect later conversions to need as much as the largest one */
+		if(child->peak_memory > state->expected)
+			state->expected = child->peak_memory;
+
+		job = (struct render_job*) child->data;
+
+		if(job->abandoned && child != job->primary) {
+			discard_render(job, child);
+			job->abandoned = 0;
+			continue;
+		}
+
+		if(job->racing) {
+			struct child* other = child == &job->child ? &job->hedge :
+					&job->child;
+
+			job->racing = 0;
+
+			if(child->status != 0 || (child == job->primary
+					&& job->timed_out)) {
+				/* The other conversion carries on alone */
+				writelog(kVERBOSE, _T("A conversion of segment '%s' failed ")
+						_T("with status %lu; keeping the other\n"),
+						job->segment.segment, child->status);
+
+				if(child == job->primary) {
+					swap_targets(job);
+					job->primary = other;
+					job->started = job->hedge_started;
+					job->timed_out = 0;
+				}
+
+				discard_render(job, child);
+				continue;
+			}
+
+			if(child != job->primary) {
+				writelog(kNORM, _T("Duplicate of segment '%s' finished ")
+						_T("first\n"), job->segment.segment);
+				swap_targets(job);
+				job->primary = child;
+				job->started = job->hedge_started;
+				job->timed_out = 0;
+			}
+
+			kill_child(other, ERROR_CANCELLED);
+			job->abandoned = 1;
+		}
+
+		if(job->timed_out) {
+			DWORD backoff = RENDER_RETRY_BACKOFF_MAX_MS;
+
+			release_child(child);
+
+			if(job->attempts > state->retries)
+				errorout(E_TIMEOUT, _T("Segment '%s' timed out %lu times"),
+						job->segment.segment, job->attempts);
+
+			/* Shifting by the attempts alone overflows after a few */
+			if(job->attempts > 0
+					&& job->attempts <= RENDER_RETRY_BACKOFF_DOUBLINGS)
+				backoff = RENDER_RETRY_BACKOFF_MS << (job->attempts - 1);
+
+			if(backoff > RENDER_RETRY_BACKOFF_MAX_MS)
+				backoff = RENDER_RETRY_BACKOFF_MAX_MS;
+
+			writelog(kNORM, _T("Retrying segment '%s' in %lu ms\n"),
+					job->segment.segment, (unsigned long int) backoff);
+			job->retry_at = GetTickCount() + backoff;
+			retries[retry_count++] = job;
+			continue;
+		}
+
+		finish_render(job, child, state->info);
+
+		if(job->attempts > 1)
+			writelog(kNORM, _T("Segment '%s' succeeded on attempt %lu\n"),
+					job->segment.segment, job->attempts);
+
+		++done;
+		pass_ready(state, jobs, n);
+	}
+
+	/* The losers of the last races may still be dying */
+	while((loser = wait_child(sup, INFINITE)) != NULL) {
+		struct render_job* job = (struct render_job*) loser->data;
+
+		discard_render(job, loser);
+		job->abandoned = 0;
+	}
+
+	set_error_trap(outer);
+	reserve_memory(state, sup);
+	free(retries);
+	destroy_supervisor(sup);
+	free(sup);
+}
+
+/*
+ * Give the ready procedure of the structure pointed to by state, if
+ * any, each of the n segments in the array pointed to by jobs that is
+ * final and was not given to it yet, in order, after setting its final
+ * offset and outline_offset members. A segment is final once it is
+ * finished at the offset that follows the segments before it, or at
+ * any offset if it is converted without one, and they are final too;
+ * nothing converts it again after that. The values of state and jobs
+ * must not be NULL.
+ */
+static void pass_ready(struct render_state* state, struct render_job* jobs,
+		size_t n)
+{
+	RT_NOT_NULL(state);
+	RT_NOT_NULL(jobs);
+
+	while(state->ready < n && jobs[state->ready].finished) {
+		struct render_job* job = &jobs[state->ready];
+
+		if(!(job->options & kPDF_OFFSET))
+			job->offset = state->ready_pages;
+		else if(job->offset != state->ready_pages)
+			break;
+
+		/* The outline of a segment converted without one lacks it */
+		job->outline_offset = job->options & kPDF_OFFSET ? 0 : job->offset;
+		++state->ready;
+		state->ready_pages += job->pages;
+
+		if(state->ready_proc != NULL)
+			state->ready_proc(job, state->ready_arg);
+	}
+}
+
+/*
+ * Split the final unit pointed to by unit into its segments, which are
+ * in the array of jobs of the batch_ready structure pointed to by arg,
+ * and give each of them to its procedure, in order. The values of unit
+ * and arg must not be NULL.
+ */
+static void batch_ready(struct render_job* unit, void* arg)
+{
+	struct batch_ready* batch = (struct batch_ready*) arg;
+	struct render_job* members = NULL;
+	size_t i = 0;
+
+	RT_NOT_NULL(unit);
+	RT_NOT_NULL(batch);
+
+	members = &batch->jobs[unit->sections - batch->sections];
+	split_batch(unit, members);
+
+	for(i = 0; i < unit->section_count && batch->proc != NULL; ++i)
+		batch->proc(&members[i], batch->arg);
+}
+
+/*
+ * Kill each running conversion of the given supervisor that has run
+ * longer than the segment deadline in the structure pointed to by
+ * state. A duplicate started by hedge_stragglers() is not checked
+ * until it is the only conversion of its segment left. The killed
+ * conversions are still reaped by wait_child(). The values of state and
+ * sup must not be NULL.
+ */
+static void kill_overdue(struct render_state* state, struct supervisor* sup)
+{
+	struct child* child = NULL;
+	DWORD now = GetTickCount();
+
+	RT_NOT_NULL(state);
+	RT_NOT_NULL(sup);
+
+	if(state->timeout == 0)
+		return;
+
+	for(child = sup->running; child != NULL; child = child->next) {
+		struct render_job* job = (struct render_job*) child->data;
+
+		if(child != job->primary || job->timed_out
+				|| now - job->started < state->timeout)
+			continue;
+
+		writelog(kNORM, _T("Segment '%s' attempt %lu exceeded %lu ms; ")
+				_T("killing process %lu\n"), job->segment.segment,
+				job->attempts, (unsigned long int) state->timeout, child->pid);
+		job->timed_out = 1;
+		kill_child(child, WAIT_TIMEOUT);
+	}
+}
+
+/*
+ * Kill each running conversion of the given supervisor, which belongs
+ * to a pass with the settings in the structure pointed to by state
+ * that failed, reap them all, including work that cannot be killed and
+ * is waited for instead, and destroy the supervisor, so that nothing
+ * is left using the jobs of the pass. The memory they reserved is
+ * given back. The values of state and sup must not be NULL.
+ */
+static void abort_pass(struct render_state* state, struct supervisor* sup)
+{
+	struct child* child = NULL;
+
+	RT_NOT_NULL(state);
+	RT_NOT_NULL(sup);
+
+	for(child = sup->running; child != NULL; child = child->next)
+		kill_child(child, ERROR_CANCELLED);
+
+	while((child = wait_child(sup, INFINITE)) != NULL)
+		release_child(child);
+
+	reserve_memory(state, sup);
+	destroy_supervisor(sup);
+}
+
+/*
+ * Return nonzero if another conversion may be started as a child of the
+ * given supervisor with the settings in the structure pointed to by
+ * state. A conversion can always start if none of the job is running,
+ * so that no job waits for the others to finish. Otherwise, the memory
+ * reserved by the running conversions of every job, as
+ * reserve_memory() counts it, plus the expected memory of a conversion
+ * must fit in the budget of this job, and the system must have the
+ * expected memory available. If there is no budget, every conversion
+ * is allowed, but those running still count against the budgets of
+ * other jobs. The values of state and sup must not be NULL.
+ */
+static int admit_render(struct render_state* state, struct supervisor* sup)
+{
+	MEMORYSTATUSEX status;
+	SIZE_T expected = 0;
+	SIZE_T reserved = 0;
+
+	RT_NOT_NULL(state);
+	RT_NOT_NULL(sup);
+
+	sample_children(sup);
+	reserved = reserve_memory(state, sup);
+
+	if(state->budget == 0 || sup->count == 0) {
+		state->holding = 0;
+		return 1;
+	}
+
+	expected = state->expected > 0 ? state->expected : RENDER_MEMORY_GUESS;
+	status.dwLength = sizeof(status);
+
+	if(reserved + expected <= state->budget
+			&& (!GlobalMemoryStatusEx(&status)
+				|| status.ullAvailPhys >= expected)) {
+		state->holding = 0;
+		return 1;
+	}
+
+	if(!state->holding)
+		writelog(kVERBOSE, _T("Holding conversions: %lu running here, ")
+				_T("about %lu MB of %lu MB reserved by every job\n"),
+				(unsigned long int) sup->count,
+				(unsigned long int) (reserved / (1024 * 1024)),
+				(unsigned long int) (state->budget / (1024 * 1024)));
+
+	state->holding = 1;
+	return 0;
+}
+
+/*
+ * Count the memory needed by the running conversions of the given
+ * supervisor as reserved by the job with the settings in the structure
+ * pointed to by state, in place of what it reserved before, and return
+ * the memory reserved by every job in the process. Each conversion is
+ * assumed to need the larger of its working set when last sampled and
+ * the expected memory of a conversion. The values of state and sup
+ * must not be NULL.
+ */
+static SIZE_T reserve_memory(struct render_state* state,
+		struct supervisor* sup)
+{
+	struct child* child = NULL;
+	SIZE_T expected = 0;
+	SIZE_T reserved = 0;
+	SIZE_T total = 0;
+
+	RT_NOT_NULL(state);
+	RT_NOT_NULL(sup);
+
+	if(!InitOnceExecuteOnce(&admission.once, start_admission, NULL, NULL))
+		errorout(E_CMD, _T("Failed to start memory admission"));
+
+	expected = state->expected > 0 ? state->expected : RENDER_MEMORY_GUESS;
+
+	for(child = sup->running; child != NULL; child = child->next)
+		reserved += child->memory > expected ? child->memory : expected;
+
+	EnterCriticalSection(&admission.lock);
+	admission.reserved = admission.reserved - state->reserved + reserved;
+	state->reserved = reserved;
+	total = admission.reserved;
+	LeaveCriticalSection(&admission.lock);
+
+	return total;
+}
+
+/*
+ * Initialize the memory reserved by every job, which is none. This is
+ * an InitOnceExecuteOnce() callback; its parameters are unused.
+ */
+static BOOL CALLBACK start_admission(PINIT_ONCE once, PVOID param,
+		PVOID* context)
+{
+	InitializeCriticalSection(&admission.lock);
+	admission.reserved = 0;
+
+	return TRUE;
+}
+
+/*
+ * Start a duplicate conversion as a child of the given supervisor for
+ * each straggler among the n segments in the array pointed to by jobs
+ * and return the number of milliseconds until the next running
+ * conversion becomes a straggler, or INFINITE if none will. A
+ * conversion is a straggler once it has run hedge_percent percent of
+ * the expected time of its segment. That is the remembered time if the
+ * segment has one, and otherwise the given percentile of the times of
+ * the segments finished so far. Each conversion gets at most one
+ * duplicate, and duplicates are subject to the same limits as other
+ * conversions. The values of state, sup and jobs must not be NULL.
+ */
+static DWORD hedge_stragglers(struct render_state* state,
+		struct supervisor* sup, const struct render_job* jobs, size_t n)
+{
+	struct child* child = NULL;
+	unsigned long int typical = 0;
+	DWORD timeout = INFINITE;
+	DWORD now = GetTickCount();
+
+	RT_NOT_NULL(state);
+	RT_NOT_NULL(sup);
+	RT_NOT_NULL(jobs);
+
+	typical = typical_millis(jobs, n, state->hedge_percentile);
+
+	for(child = sup->running; child != NULL; child = child->next) {
+		struct render_job* job = (struct render_job*) child->data;
+		unsigned long int expected = job->expected_millis > 0 ?
+				job->expected_millis : typical;
+		DWORD elapsed = now - job->started;
+		DWORD limit = 0;
+
+		if(child != job->primary || job->hedged || job->timed_out
+				|| expected == 0)
+			continue;
+
+		limit = (DWORD) (expected / 100 * state->hedge_percent
+				+ expected % 100 * state->hedge_percent / 100);
+
+		if(elapsed < limit) {
+			if(limit - elapsed < timeout)
+				timeout = limit - elapsed;
+
+			continue;
+		}
+
+		/* A slot opening up wakes the caller anyway */
+		if(sup->count >= state->parallel)
+			continue;
+
+		if(!admit_render(state, sup)) {
+			if(RENDER_ADMIT_POLL_MS < timeout)
+				timeout = RENDER_ADMIT_POLL_MS;
+
+			continue;
+		}
+
+		writelog(kNORM, _T("Segment '%s' has run %lu ms of an expected ")
+				_T("%lu ms; starting a duplicate\n"), job->segment.segment,
+				(unsigned long int) elapsed, expected);
+		start_hedge(sup, job, state->info);
+	}
+
+	return timeout;
+}
+
+/*
+ * Return the given percentile of the conversion times of the finished
+ * segments among the n segments in the array pointed to by jobs, or 0
+ * if none is finished. The value of jobs must not be NULL.
+ */
+static unsigned long int typical_millis(const struct render_job* jobs,
+		size_t n, unsigned long int percentile)
+{
+	unsigned long int* millis = NULL;
+	unsigned long int typical = 0;
+	size_t count = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(jobs);
+
+	millis = (unsigned long int*) require_cmem(n, sizeof(*millis));
+
+	for(i = 0; i < n; ++i) {
+		if(jobs[i].finished)
+			millis[count++] = jobs[i].millis;
+	}
+
+	if(count > 0) {
+		qsort(millis, count, sizeof(*millis), compare_millis);
+		i = (count * percentile + 99) / 100;
+		typical = millis[i > 0 ? i - 1 : 0];
+	}
+
+	free(millis);
+	return typical;
+}
+
+/*
+ * Compare the unsigned long integers pointed to by a and b for qsort(),
+ * from the smallest to the largest.
+ */
+static int compare_millis(const void* a, const void* b)
+{
+	unsigned long int x = *(const unsigned long int*) a;
+	unsigned long int y = *(const unsigned long int*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Return a page offset for the segment at index i in the array of n
+ * segments pointed to by jobs. Finished segments before it count with
+ * their actual number of pages. Unfinished ones count with their
+ * remembered number of pages if they have one, and otherwise with the
+ * average number of pages of all finished segments. The value of jobs
+ * must not be NULL.
+ */
+static unsigned long int guess_offset(const struct render_job* jobs,
+		size_t n, size_t i)
+{
+	unsigned long int known_pages = 0; /* pages in finished segments */
+	unsigned long int known = 0; /* number of finished segments */
+	unsigned long int guess = 1; /* pages assumed for unfinished ones */
+	unsigned long int offset = 0;
+	size_t j = 0;
+
+	RT_NOT_NULL(jobs);
+
+	for(j = 0; j < n; ++j) {
+		if(jobs[j].finished) {
+			known_pages += jobs[j].pages;
+			++known;
+		}
+	}
+
+	if(known > 0 && known_pages / known > 1)
+		guess = (known_pages + known / 2) / known;
+
+	for(j = 0; j < i; ++j) {
+		if(jobs[j].finished)
+			offset += jobs[j].pages;
+		else if(jobs[j].expected_pages > 0)
+			offset += jobs[j].expected_pages;
+		else
+			offset += guess;
+	}
+
+	return offset;
+}
+
+/*
+ * Start an asynchronous conversion of the segment described by the
+ * structure pointed to by job with the given page offset as a child of
+ * the given supervisor. If the render cache was already searched for
+ * it at that offset, by look_up_units() or an earlier attempt, the
+ * conversion starts without searching again. Otherwise, the cache is
+ * searched first. Either way, the validators to publish it with are
+ * kept in the pending member of job. The values of sup, job and info
+ * must not be NULL.
+ */
+static void start_render(struct supervisor* sup, struct render_job* job,
+		unsigned long int offset, const struct pdf_info* info)
+{
+	RT_NOT_NULL(job);
+
+	writelog(kDEBUG, _T("Starting segment '%s' at offset %lu\n"),
+			job->segment.segment, offset);
+	job->offset = offset;
+	job->finished = 0;
+	job->timed_out = 0;
+	job->started = GetTickCount();
+	job->primary = &job->child;
+	job->hedged = 0;
+	job->racing = 0;
+	++job->attempts;
+
+	/* A killed conversion is never published, but its search holds */
+	if(job->checked && (offset == job->checked_offset
+			|| !(job->options & kPDF_OFFSET))) {
+		job->cached_pages = 0;
+		start_segment_pdf(sup, &job->child, job, &job->target_id,
+				&job->outline_id, offset, info, job->sections,
+				job->section_count, job->options, job->prefetch,
+				job->pending);
+		return;
+	}
+
+	free_pending(job->pending);
+	job->pending = NULL;
+	job->checked = 0;
+	do_segment_to_pdf_async(sup, &job->child, job, &job->target_id,
+			&job->outline_id, offset, info, job->sections,
+			job->section_count, job->options, job->prefetch,
+			&job->cached_pages, &job->pending);
+	job->checked = job->cached_pages == 0;
+	job->checked_offset = offset;
+}
+
+/*
+ * Start a duplicate of the running conversion of the segment described
+ * by the structure pointed to by job as a child of the given
+ * supervisor. The duplicate uses the same page offset but its own temp
+ * files, whose IDs are kept in the spare_target_id and spare_outline_id
+ * members until one of the conversions wins. The values of sup, job
+ * and info must not be NULL.
+ */
+static void start_hedge(struct supervisor* sup, struct render_job* job,
+		const struct pdf_info* info)
+{
+	struct child* hedge = NULL;
+
+	RT_NOT_NULL(job);
+
+	hedge = job->primary == &job->child ? &job->hedge : &job->child;
+	job->hedge_started = GetTickCount();
+	job->hedged = 1;
+	job->racing = 1;
+	job->spare_target_id = 0;
+	job->spare_outline_id = 0;
+	do_segment_to_pdf_async(sup, hedge, job, &job->spare_target_id,
+			&job->spare_outline_id, job->offset, info, job->sections,
+			job->section_count, job->options, job->prefetch, NULL, NULL);
+}
+
+/*
+ * Check the given finished conversion of the segment described by the
+ * structure pointed to by job and count the pages it produced. A PDF
+ * taken from the render cache of the structure pointed to by info keeps
+ * the number of pages cached with it and its remembered conversion
+ * time. Any other PDF is published in that cache with the validators
+ * kept by start_render(). The values of job, child and info must not be
+ * NULL.
+ */
+static void finish_render(struct render_job* job, struct child* child,
+		const struct pdf_info* info)
+{
+	TCHAR target[MAX_PATH + 1] = _T("");
+	struct cache_pending* pending = NULL;
+
+	RT_NOT_NULL(job);
+
+	job->millis = GetTickCount() - job->started;
+	check_child(child, E_PDFGETTER, pdf_getter_exe);
+	release_child(child);
+	job->finished = 1;
+
+	if(job->cached_pages > 0) {
+		job->pages = job->cached_pages;
+		job->millis = job->expected_millis;
+		return;
+	}
+
+	require_tmp_file(target, &job->target_id);
+	get_number_of_pages(&job->pages, target);
+	pending = job->pending;
+	job->pending = NULL;
+	job->checked = 0;
+	keep_segment_pdf(job->target_id, job->outline_id, job->offset, info,
+			job->sections, job->section_count, job->options, job->pages,
+			pending);
+}
+
+/*
+ * Return the indices of the n segments in the array pointed to by jobs
+ * ordered from the longest expected conversion time to the shortest.
+ * Segments without a remembered time are expected to take the average
+ * of the remembered ones. Segments with the same expected time keep
+ * their order. The value of jobs must not be NULL. The pointer returned
+ * must be passed to free().
+ */
+static size_t* order_by_cost(const struct render_job* jobs, size_t n)
+{
+	struct render_cost* costs = NULL;
+	size_t* order = NULL;
+	unsigned long int known_millis = 0;
+	unsigned long int known = 0;
+	unsigned long int average = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(jobs);
+
+	for(i = 0; i < n; ++i) {
+		if(jobs[i].expected_millis > 0) {
+			known_millis += jobs[i].expected_millis;
+			++known;
+		}
+	}
+
+	if(known > 0)
+		average = known_millis / known;
+
+	costs = (struct render_cost*) require_cmem(n, sizeof(*costs));
+	order = (size_t*) require_cmem(n, sizeof(*order));
+
+	for(i = 0; i < n; ++i) {
+		costs[i].index = i;
+		costs[i].millis = jobs[i].expected_millis > 0 ?
+				jobs[i].expected_millis : average;
+	}
+
+	qsort(costs, n, sizeof(*costs), compare_cost);
+
+	for(i = 0; i < n; ++i)
+		order[i] = costs[i].index;
+
+	free(costs);
+	return order;
+}
+
+/*
+ * Compare the render_cost structures pointed to by a and b for qsort()
+ * so that longer times come first and equal times keep their order.
+ * The values of a and b must not be NULL.
+ */
+static int compare_cost(const void* a, const void* b)
+{
+	const struct render_cost* cost_a = (const struct render_cost*) a;
+	const struct render_cost* cost_b = (const struct render_cost*) b;
+
+	if(cost_a->millis != cost_b->millis)
+		return cost_a->millis > cost_b->millis ? -1 : 1;
+
+	if(cost_a->index != cost_b->index)
+		return cost_a->index < cost_b->index ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Release the given reaped conversion of the segment described by the
+ * structure pointed to by job after it lost a race, and remove the temp
+ * files named by the spare_target_id and spare_outline_id members. The
+ * values of job and child must not be NULL.
+ */
+static void discard_render(struct render_job* job, struct child* child)
+{
+	TCHAR path[MAX_PATH + 1] = _T("");
+
+	RT_NOT_NULL(job);
+
+	release_child(child);
+
+	if(job->spare_target_id != 0) {
+		require_tmp_file(path, &job->spare_target_id);
+		remove_tmp_file(path);
+		job->spare_target_id = 0;
+	}
+
+	if(job->spare_outline_id != 0) {
+		require_tmp_file(path, &job->spare_outline_id);
+		remove_tmp_file(path);
+		job->spare_outline_id = 0;
+	}
+}
+
+/*
+ * Free the validators kept to publish each of the n segments in the
+ * array pointed to by jobs whose conversion will not be published. The
+ * value of jobs must not be NULL.
+ */
+static void drop_pending(struct render_job* jobs, size_t n)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(jobs);
+
+	for(i = 0; i < n; ++i) {
+		free_pending(jobs[i].pending);
+		jobs[i].pending = NULL;
+	}
+}
+
+/*
+ * Exchange the temp files of the two conversions of the segment
+ * described by the structure pointed to by job. The value of job must
+ * not be NULL.
+ */
+static void swap_targets(struct render_job* job)
+{
+	UINT id = 0;
+
+	RT_NOT_NULL(job);
+
+	id = job->target_id;
+	job->target_id = job->spare_target_id;
+	job->spare_target_id = id;
+	id = job->outline_id;
+	job->outline_id = job->spare_outline_id;
+	job->spare_outline_id = id;
+}
+
+/*
+ * Return nonzero if the segments described by the structures pointed
+ * to by a and b can be converted by the same instance of the PDF
+ * getter. The values of a and b must not be NULL.
+ */
+static int same_layout(const struct render_job* a, const struct render_job* b)
+{
+	RT_NOT_NULL(a);
+	RT_NOT_NULL(b);
+
+	return a->options == b->options
+			&& _tcscmp(a->segment.size, b->segment.size) == 0
+			&& _tcscmp(a->segment.orientation, b->segment.orientation) == 0;
+}
+
+/*
+ * Return the query strings of the n segments in the array pointed to by
+ * sections separated by spaces. The value of sections must not be
+ * NULL. The pointer returned must be passed to free().
+ */
+static LPTSTR join_segments(const struct pdf_segment_info* sections,
+		size_t n)
+{
+	LPTSTR joined = NULL;
+	size_t len = 1;
+	size_t i = 0;
+
+	RT_NOT_NULL(sections);
+
+	for(i = 0; i < n; ++i)
+		len += _tcslen(sections[i].segment) + 1;
+
+	joined = (LPTSTR) require_cmem(len, sizeof(*joined));
+
+	for(i = 0; i < n; ++i) {
+		if(i > 0)
+			_tcscat(joined, _T(" "));
+
+		_tcscat(joined, sections[i].segment);
+	}
+
+	return joined;
+}
+
+/*
+ * Give each of the segments converted by the unit pointed to by unit
+ * its page offset, number of pages and outline. The array pointed to by
+ * members holds the segments of the unit in order. Each top-level item
+ * of the outline dump of the unit starts the outline of the next
+ * segment and its page is the first page of that segment. The first
+ * segment takes over the PDF of the unit and the temp files prepared
+ * for the PDFs of the others are removed. The values of unit and
+ * members must not be NULL.
+ */
+static void split_batch(struct render_job* unit, struct render_job* members)
+{
+	FILE* outline = NULL; /* outline dump of the unit */
+	FILE* part = NULL; /* outline of the current segment */
+	unsigned long int* starts = NULL; /* first page of each segment */
+	size_t found = 0; /* number of segments found in the outline */
+	size_t i = 0;
+	int depth = 0; /* number of open items */
+	int in_item = 0; /* nonzero inside the start tag of an item */
+	char line[BUFSIZ] = "";
+	TCHAR path[MAX_PATH + 1] = _T("");
+
+	RT_NOT_NULL(unit);
+	RT_NOT_NULL(members);
+
+	if(unit->section_count == 1) {
+		members->offset = unit->offset;
+		members->outline_offset = unit->outline_offset;
+		members->pages = unit->pages;
+		members->target_id = unit->target_id;
+		members->outline_id = unit->outline_id;
+		members->finished = 1;
+		return;
+	}
+
+	starts = (unsigned long int*) require_cmem(unit->section_count,
+			sizeof(*starts));
+	require_tmp_file(path, &unit->outline_id);
+	outline = require_open_file(path, _T("rb"));
+
+	/* Titles are escaped, so the first '>' ends the start tag */
+	while(fgets(line, sizeof(line), outline) != NULL) {
+		char* tag = strstr(line, "<item ");
+
+		if(tag != NULL && depth == 0) {
+			TCHAR part_path[MAX_PATH + 1] = _T("");
+			char* page = strstr(tag, " page=\"");
+
+			if(page == NULL || found == unit->section_count)
+				errorout(E_PDF, _T("Failed to split outline of segments ")
+						_T("'%s'"), unit->segment.segment);
+
+			starts[found] = strtoul(page + 7, NULL, 10);
+
+			if(part != NULL)
+				release_file(part);
+
+			require_tmp_file(part_path, &members[found++].outline_id);
+			part = require_open_file(part_path, _T("wb"));
+		}
+
+		if(tag != NULL || in_item) {
+			char* end = strchr(tag != NULL ? tag : line, '>');
+
+			in_item = end == NULL;
+
+			if(end != NULL && (end == line || end[-1] != '/'))
+				++depth;
+		}
+
+		if(strstr(line, "</item>") != NULL)
+			--depth;
+
+		if(part != NULL && fputs(line, part) == EOF)
+			errorout(E_BADF, _T("Failed to write outline"));
+	}
+
+	if(part != NULL)
+		release_file(part);
+
+	release_file(outline);
+	remove_tmp_file(path);
+
+	if(found != unit->section_count)
+		errorout(E_PDF, _T("Found %lu of %lu segments in the outline of ")
+				_T("'%s'"), (unsigned long int) found,
+				(unsigned long int) unit->section_count,
+				unit->segment.segment);
+
+	for(i = 0; i < found; ++i) {
+		unsigned long int end = i + 1 < found ? starts[i + 1] - starts[0] :
+				unit->pages;
+
+		if(starts[i] < starts[0] || end < starts[i] - starts[0])
+			errorout(E_PDF, _T("Outline pages of '%s' are out of order"),
+					unit->segment.segment);
+
+		members[i].offset = unit->offset + (starts[i] - starts[0]);
+		members[i].pages = end - (starts[i] - starts[0]);
+		members[i].outline_offset = unit->outline_offset;
+		members[i].finished = 1;
+
+		if(i > 0) {
+			require_tmp_file(path, &members[i].target_id);
+			remove_tmp_file(path);
+			members[i].target_id = 0;
+		}
+	}
+
+	members->target_id = unit->target_id;
+	free(starts);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "stdafx.h"
+#include "parse.h"
+#include "proc.h"
+
+struct prefetch;
+struct cache_pending;
+
+/* State of a single segment conversion */
+struct render_job {
+	struct pdf_segment_info segment; /* segment information */
+	const struct pdf_segment_info* sections; /* segments converted */
+	size_t section_count; /* number of elements in sections */
+	struct child child; /* running PDF getter, if any */
+	struct child hedge; /* duplicate PDF getter for a straggler, if any */
+	struct child* primary; /* getter writing to target_id and outline_id */
+	struct prefetch* prefetch; /* downloads of segment HTML, or NULL */
+	struct cache_pending* pending; /* validators to cache it with, or NULL */
+	unsigned long int offset; /* page offset of the last conversion */
+	unsigned long int pages; /* pages in the converted segment */
+	unsigned long int outline_offset; /* pages missing from outline pages */
+	unsigned long int expected_pages; /* remembered pages, or 0 if unknown */
+	unsigned long int expected_millis; /* remembered time, or 0 if unknown */
+	unsigned long int millis; /* time taken by the last conversion */
+	unsigned long int cached_pages; /* pages of a cached PDF, or 0 */
+	unsigned long int checked_offset; /* offset the cache was searched at */
+	unsigned long int attempts; /* conversions started in this pass */
+	DWORD started; /* tick count when the last conversion started */
+	DWORD retry_at; /* tick count at which to retry a killed conversion */
+	DWORD hedge_started; /* tick count when the duplicate started */
+	UINT target_id; /* ID of the segment PDF temp file */
+	UINT outline_id; /* ID of the outline dump temp file */
+	UINT spare_target_id; /* ID of the duplicate PDF temp file */
+	UINT spare_outline_id; /* ID of the duplicate outline temp file */
+	int options; /* combination of html_to_pdf_options enums */
+	int finished; /* nonzero once pages is set */
+	int checked; /* nonzero if pending is from searching at checked_offset */
+	int timed_out; /* nonzero if the last conversion was killed */
+	int hedged; /* nonzero if a duplicate started for this conversion */
+	int racing; /* nonzero while both getters are running */
+	int abandoned; /* nonzero while a losing getter is still running */
+};
+
+/* Procedure given each converted PDF once every one before it is too */
+typedef void (*render_ready_proc)(struct render_job*, void*);
+
+void render_segments(struct render_job*, size_t, const struct pdf_info*,
+		render_ready_proc, void*);
@@ -0,0 +1,331 @@
+#include "stdafx.h"
+#include "renderer.h"
+#include "util.h"
+#include "log.h"
+
+/* Most pages the stub renderer produces for a single source */
+#define STUB_MAX_PAGES 4
+
+/* A conversion done by the stub renderer */
+struct stub_render {
+	struct child* child; /* child standing for the conversion */
+	LPTSTR* sources; /* sources to convert */
+	LPTSTR target; /* path to the PDF to write */
+	LPTSTR outline; /* path to the outline to write, or NULL */
+	size_t count; /* number of elements in sources */
+	unsigned long int offset; /* page offset of the first source */
+	int landscape; /* nonzero for landscape pages */
+};
+
+static unsigned __stdcall stub_thread(void*);
+static unsigned long int stub_pages(LPCTSTR);
+static void write_stub_pdf(LPCTSTR, unsigned long int, int);
+static void write_stub_outline(LPCTSTR, const unsigned long int*, size_t,
+		unsigned long int);
+
+/* Every backend in this build; the first one is the default */
+static const struct renderer renderers[] = {
+	{ _T("Process"), do_wkhtmltopdf_start, describe_wkhtmltopdf, 0, 0 },
+#ifdef HAVE_WKHTMLTOX
+	{ _T("Library"), start_library_render, describe_library_render, 1, 1 },
+#endif
+	{ _T("Stub"), start_stub_render, describe_stub_render, 0, 0 }
+};
+
+/*
+ * Return the backend with the given name, or the default backend if
+ * name is NULL. Names are compared without regard to case. Execution is
+ * terminated if this build has no backend with the given name.
+ */
+const struct renderer* get_renderer(LPCTSTR name)
+{
+	size_t i = 0;
+
+	if(name == NULL)
+		return &renderers[0];
+
+	for(i = 0; i < LENGTHOF(renderers); ++i)
+		if(_tcsicmp(renderers[i].name, name) == 0)
+			return &renderers[i];
+
+	errorout(E_ARG, _T("Unknown renderer '%s'"), name);
+	return NULL;
+}
+
+/*
+ * Return a copy of each source in the structure pointed to by cmd_info
+ * and store their number in the value pointed to by count. With
+ * kPDF_BATCH, the source member holds several quoted sources separated
+ * by spaces. Otherwise, it is a single source. The values of cmd_info
+ * and count must not be NULL. The array returned must be passed to
+ * free_sources().
+ */
+LPTSTR* split_sources(const struct wkhtmltopdf_cmd_info* cmd_info,
+		size_t* count)
+{
+	LPTSTR* sources = NULL;
+	LPCTSTR cursor = NULL;
+	size_t quotes = 0;
+
+	RT_NOT_NULL(cmd_info);
+	RT_NOT_NULL(cmd_info->source);
+	RT_NOT_NULL(count);
+
+	if(!(cmd_info->options & kPDF_BATCH)) {
+		sources = (LPTSTR*) require_cmem(1, sizeof(*sources));
+		sources[0] = require_dup_str(cmd_info->source);
+		*count = 1;
+		return sources;
+	}
+
+	for(cursor = cmd_info->source; *cursor != _T('\0'); ++cursor)
+		if(*cursor == _T('"'))
+			++quotes;
+
+	sources = (LPTSTR*) require_cmem(quotes / 2 + 1, sizeof(*sources));
+	*count = 0;
+	cursor = _tcschr(cmd_info->source, _T('"'));
+
+	while(cursor != NULL) {
+		LPCTSTR end = _tcschr(cursor + 1, _T('"'));
+
+		if(end == NULL)
+			errorout(E_STR, _T("Unbalanced quotes in sources"));
+
+		sources[*count] = require_strf(_T("%.*s"), (int) (end - cursor - 1),
+				cursor + 1);
+		++*count;
+		cursor = _tcschr(end + 1, _T('"'));
+	}
+
+	return sources;
+}
+
+/*
+ * Release the array of count sources returned by split_sources(). The
+ * value of sources must not be NULL.
+ */
+void free_sources(LPTSTR* sources, size_t count)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(sources);
+
+	for(i = 0; i < count; ++i)
+		free(sources[i]);
+
+	free(sources);
+}
+
+/*
+ * Start a conversion by the stub renderer as the given child of the
+ * given supervisor with the given caller data. Instead of loading its
+ * sources, the stub writes a blank PDF with a number of pages derived
+ * from each source URL and an outline with one section per source, so
+ * that the same instruction file always produces the same document.
+ * It is meant for testing and measuring everything around the PDF
+ * getter. The values of sup, child and cmd_info must not be NULL.
+ */
+void start_stub_render(struct supervisor* sup, struct child* child,
+		void* data, const struct wkhtmltopdf_cmd_info* cmd_info)
+{
+	struct stub_render* render = NULL;
+	HANDLE thread = NULL;
+
+	RT_NOT_NULL(cmd_info);
+	RT_NOT_NULL(cmd_info->target);
+
+	render = (struct stub_render*) require_cmem(1, sizeof(*render));
+	render->child = child;
+	render->sources = split_sources(cmd_info, &render->count);
+	render->target = require_dup_str(cmd_info->target);
+	render->offset = cmd_info->options & kPDF_OFFSET ? cmd_info->pages : 0;
+	render->landscape = cmd_info->options & kPDF_ORIENTATION
+			&& _tcsicmp(cmd_info->orientation, _T("Landscape")) == 0;
+
+	if(cmd_info->options & kPDF_DUMP) {
+		RT_NOT_NULL(cmd_info->outline_target);
+
+		render->outline = require_dup_str(cmd_info->outline_target);
+	}
+
+	start_child_work(sup, child, data);
+	thread = (HANDLE) _beginthreadex(NULL, 0, stub_thread, render, 0, NULL);
+
+	if(thread == 0)
+		errorout(E_CMD, _T("Failed to start stub renderer thread"));
+
+	CloseHandle(thread);
+}
+
+/*
+ * Return a description of the stub renderer. Its output only depends on
+ * its sources and options, so the description is fixed. The string
+ * returned must be passed to free().
+ */
+LPTSTR describe_stub_render(void)
+{
+	return require_strf(_T("Stub %d"), STUB_MAX_PAGES);
+}
+
+/*
+ * Do the conversion described by the stub_render structure pointed to
+ * by arg and release it. An error fails the conversion with the error
+ * code as its status, like a PDF getter that exited with it, instead of
+ * ending the process. The value of arg must not be NULL.
+ */
+static unsigned __stdcall stub_thread(void* arg)
+{
+	struct error_trap trap;
+	struct stub_render* render = (struct stub_render*) arg;
+	struct child* child = NULL;
+	unsigned long int* pages = NULL; /* pages of each source */
+	unsigned long int total_pages = 0;
+	size_t i = 0;
+
+	RT_NOT_NULL(render);
+
+	child = render->child;
+
+	if(setjmp(trap.env) != 0) {
+		free_sources(render->sources, render->count);
+		free(render->target);
+		free(render->outline);
+		free(render);
+		finish_child(child, (DWORD) trap.code,
+				"The stub renderer failed to write its output");
+		return trap.code;
+	}
+
+	set_error_trap(&trap);
+	pages = (unsigned long int*) require_cmem(render->count, sizeof(*pages));
+
+	for(i = 0; i < render->count; ++i) {
+		pages[i] = stub_pages(render->sources[i]);
+		total_pages += pages[i];
+	}
+
+	write_stub_pdf(render->target, total_pages, render->landscape);
+
+	if(render->outline != NULL)
+		write_stub_outline(render->outline, pages, render->count,
+				render->offset);
+
+	free(pages);
+	free_sources(render->sources, render->count);
+	free(render->target);
+	free(render->outline);
+	free(render);
+	set_error_trap(NULL);
+	finish_child(child, 0, NULL);
+	return 0;
+}
+
+/*
+ * Return the number of pages the stub renderer produces for the given
+ * source, between 1 and STUB_MAX_PAGES. The value of source must not be
+ * NULL.
+ */
+static unsigned long int stub_pages(LPCTSTR source)
+{
+	unsigned long int hash = 2166136261UL; /* FNV-1a */
+
+	RT_NOT_NULL(source);
+
+	for(; *source != _T('\0'); ++source)
+		hash = ((hash ^ (unsigned long int) *source) * 16777619UL)
+				& 0xFFFFFFFFUL;
+
+	return 1 + hash % STUB_MAX_PAGES;
+}
+
+/*
+ * Write a PDF with the given number of blank letter-sized pages to the
+ * file at the given path. The pages are turned sideways if landscape is
+ * nonzero. The value of path must not be NULL.
+ */
+static void write_stub_pdf(LPCTSTR path, unsigned long int pages,
+		int landscape)
+{
+	FILE* pdf = NULL;
+	long int* offsets = NULL; /* position of each object */
+	long int xref = 0;
+	unsigned long int i = 0;
+
+	RT_NOT_NULL(path);
+
+	pdf = require_open_file(path, _T("wb"));
+	offsets = (long int*) require_cmem(pages + 3, sizeof(*offsets));
+	fputs("%PDF-1.4\n", pdf);
+	offsets[1] = ftell(pdf);
+	fputs("1 0 obj\n<< /Type /Catalog /Pages 2 0 R >>\nendobj\n", pdf);
+	offsets[2] = ftell(pdf);
+	fprintf(pdf, "2 0 obj\n<< /Type /Pages\n/Count %lu\n/Kids [", pages);
+
+	for(i = 0; i < pages; ++i)
+		fprintf(pdf, " %lu 0 R", i + 3);
+
+	fputs(" ] >>\nendobj\n", pdf);
+
+	for(i = 0; i < pages; ++i) {
+		offsets[i + 3] = ftell(pdf);
+		fprintf(pdf, "%lu 0 obj\n<< /Type /Page /Parent 2 0 R ", i + 3);
+		fprintf(pdf, "/MediaBox [0 0 %d %d] >>\nendobj\n",
+				landscape ? 792 : 612, landscape ? 612 : 792);
+	}
+
+	xref = ftell(pdf);
+	fprintf(pdf, "xref\n0 %lu\n0000000000 65535 f \n", pages + 3);
+
+	for(i = 1; i < pages + 3; ++i)
+		fprintf(pdf, "%010ld 00000 n \n", offsets[i]);
+
+	fprintf(pdf, "trailer\n<< /Size %lu /Root 1 0 R >>\nstartxref\n%ld\n"
+			"%%%%EOF\n", pages + 3, xref);
+
+	if(ferror(pdf))
+		errorout(E_BADF, _T("Failed to write stub PDF"));
+
+	free(offsets);
+	release_file(pdf);
+}
+
+/*
+ * Write an outline in the format of the --dump-outline option of
+ * wkhtmltopdf to the file at the given path. Each of the count sources,
+ * whose numbers of pages are in the array pointed to by pages, gets a
+ * top-level item on its first page and a single section below it. The
+ * first source starts after the given page offset. The values of path
+ * and pages must not be NULL.
+ */
+static void write_stub_outline(LPCTSTR path, const unsigned long int* pages,
+		size_t count, unsigned long int offset)
+{
+	FILE* outline = NULL;
+	size_t i = 0;
+
+	RT_NOT_NULL(path);
+	RT_NOT_NULL(pages);
+
+	outline = require_open_file(path, _T("wb"));
+	fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<outline xmlns=\"http://wkhtmltopdf.org/outline\">\n", outline);
+
+	for(i = 0; i < count; ++i) {
+		fprintf(outline, "  <item title=\"\" page=\"%lu\" link=\"\" "
+				"backLink=\"\">\n", offset);
+		fprintf(outline, "    <item title=\"%lu.0\xc2\xa0Section %lu\" "
+				"page=\"%lu\" link=\"\" backLink=\"\"/>\n",
+				(unsigned long int) i + 1, (unsigned long int) i + 1,
+				offset + 1);
+		fputs("  </item>\n", outline);
+		offset += pages[i];
+	}
+
+	fputs("</outline>\n", outline);
+
+	if(ferror(outline))
+		errorout(E_BADF, _T("Failed to write stub outline"));
+
+	release_file(outline);
+}
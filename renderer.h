@@ -0,0 +1,43 @@
+#pragma once
+
+#include "stdafx.h"
+#include "proc.h"
+#include "wkhtmltopdf_cmd.h"
+
+/*
+ * Starts converting the sources of a wkhtmltopdf_cmd_info structure to
+ * its target as the given child of the given supervisor. The page count
+ * is read from the target and, with kPDF_DUMP, the outline from the
+ * outline target, so every backend reports them the same way.
+ */
+typedef void (*render_proc)(struct supervisor*, struct child*, void*,
+		const struct wkhtmltopdf_cmd_info*);
+
+/*
+ * Returns a description of the build a backend converts with, which
+ * changes whenever its output may change. The string returned must be
+ * passed to free().
+ */
+typedef LPTSTR (*describe_proc)(void);
+
+/* A way of converting HTML sources to PDF */
+struct renderer {
+	LPCTSTR name; /* value of sRenderer selecting this backend */
+	render_proc start; /* starts a conversion */
+	describe_proc describe; /* describes the build converting */
+	int unkillable; /* nonzero if a hung conversion cannot be stopped */
+	int serial; /* nonzero if its conversions never overlap */
+};
+
+const struct renderer* get_renderer(LPCTSTR);
+LPTSTR* split_sources(const struct wkhtmltopdf_cmd_info*, size_t*);
+void free_sources(LPTSTR*, size_t);
+void start_stub_render(struct supervisor*, struct child*, void*,
+		const struct wkhtmltopdf_cmd_info*);
+LPTSTR describe_stub_render(void);
+
+#ifdef HAVE_WKHTMLTOX
+void start_library_render(struct supervisor*, struct child*, void*,
+		const struct wkhtmltopdf_cmd_info*);
+LPTSTR describe_library_render(void);
+#endif
@@ -0,0 +1,404 @@
+#include "stdafx.h"
+#include "serve.h"
+#include "task.h"
+#include "util.h"
+#include "log.h"
+
+/* Size of the buffers of each pipe instance, in bytes */
+#define SERVE_BUFFER 4096
+
+/* Time in milliseconds a client has to send its request */
+#define SERVE_REQUEST_MS 10000
+
+/* Clients connected and waiting for a worker, at most */
+#define SERVE_QUEUE_MAX 64
+
+/* A connected client waiting for a worker */
+struct connection {
+	struct connection* next; /* next waiting client */
+	HANDLE pipe; /* pipe instance connected to the client */
+};
+
+/* Clients accepted by serve() and the workers handling them */
+struct server {
+	CRITICAL_SECTION lock; /* protects head, tail and count */
+	CONDITION_VARIABLE queued; /* signaled when a client is queued */
+	CONDITION_VARIABLE taken; /* signaled when a worker takes a client */
+	struct connection* head; /* oldest waiting client */
+	struct connection* tail; /* newest waiting client */
+	size_t count; /* number of waiting clients */
+	job_proc proc; /* runs the job of a client */
+};
+
+static int accept_client(HANDLE, OVERLAPPED*);
+static unsigned __stdcall serve_worker(void*);
+static void handle_connection(struct server*, HANDLE);
+static enum error_code run_trapped(job_proc, LPCTSTR, LPTSTR*);
+static LPTSTR read_request(HANDLE, OVERLAPPED*);
+static void write_reply(HANDLE, OVERLAPPED*, enum error_code, LPCTSTR);
+static BOOL finish_io(HANDLE, OVERLAPPED*, BOOL, DWORD, DWORD*);
+
+/*
+ * Accept jobs on the local named pipe with the given name and run each
+ * of them with proc on a pool of the given number of worker threads,
+ * or one per processor if workers is zero. A client connects, writes
+ * the path of an instruction file followed by a newline within
+ * SERVE_REQUEST_MS milliseconds and reads back a line with the error
+ * code of the job, a tab and the path of the PDF it wrote, or nothing
+ * after the tab if it failed. Both lines are UTF-8. At most
+ * SERVE_QUEUE_MAX clients wait for a worker; others are not accepted
+ * until one is taken. Execution is terminated if another process
+ * already owns the pipe name. The log, the renderer backend, the task
+ * pool, the memory budget of the renderers and the rest of the process
+ * are shared by every job. The task pool has a thread per processor,
+ * and one more per worker, since the segments stage of each job holds
+ * one while its segments are converted. An error in a job, or its
+ * deadline, fails only that job, once proc has killed its children and
+ * removed its temp files. Clients should call WaitNamedPipe() if every
+ * instance is busy. This procedure only returns by terminating
+ * execution. The values of name and proc must not be NULL.
+ */
+void serve(LPCTSTR name, unsigned long int workers, job_proc proc)
+{
+	struct server server;
+	OVERLAPPED overlapped;
+	LPTSTR path = NULL;
+	DWORD first = FILE_FLAG_FIRST_PIPE_INSTANCE; /* until one exists */
+	unsigned long int i = 0;
+
+	RT_NOT_NULL(name);
+	RT_NOT_NULL(proc);
+
+	if(workers == 0)
+		workers = get_processor_count();
+
+	path = require_strf(_T("\\\\.\\pipe\\%s"), name);
+	InitializeCriticalSection(&server.lock);
+	InitializeConditionVariable(&server.queued);
+	InitializeConditionVariable(&server.taken);
+	server.head = NULL;
+	server.tail = NULL;
+	server.count = 0;
+	server.proc = proc;
+	start_task_pool(workers + get_processor_count());
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if(overlapped.hEvent == NULL)
+		errorout(E_CMD, _T("Failed to create event (%lu)"), GetLastError());
+
+	for(i = 0; i < workers; ++i) {
+		HANDLE thread = (HANDLE) _beginthreadex(NULL, 0, serve_worker,
+				&server, 0, NULL);
+
+		if(thread == 0)
+			errorout(E_CMD, _T("Failed to start worker thread"));
+
+		CloseHandle(thread);
+	}
+
+	writelog(kNORM, _T("Serving on '%s' with %lu workers\n"), path, workers);
+
+	for(;;) {
+		struct connection* conn = NULL;
+		HANDLE pipe = NULL;
+
+		/* Clients beyond the queue wait for an instance instead */
+		EnterCriticalSection(&server.lock);
+
+		while(server.count >= SERVE_QUEUE_MAX)
+			SleepConditionVariableCS(&server.taken, &server.lock, INFINITE);
+
+		LeaveCriticalSection(&server.lock);
+		pipe = CreateNamedPipe(path, PIPE_ACCESS_DUPLEX
+				| FILE_FLAG_OVERLAPPED | first, PIPE_TYPE_BYTE
+				| PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+				PIPE_UNLIMITED_INSTANCES, SERVE_BUFFER, SERVE_BUFFER, 0,
+				NULL);
+
+		if(pipe == INVALID_HANDLE_VALUE && first != 0
+				&& GetLastError() == ERROR_ACCESS_DENIED)
+			errorout(E_CMD, _T("Pipe '%s' is already in use"), path);
+
+		if(pipe == INVALID_HANDLE_VALUE)
+			errorout(E_CMD, _T("Failed to create pipe '%s' (%lu)"), path,
+					GetLastError());
+
+		first = 0;
+
+		if(!accept_client(pipe, &overlapped)) {
+			writelog(kNORM, _T("Failed to accept a client (%lu)\n"),
+					GetLastError());
+			CloseHandle(pipe);
+			continue;
+		}
+
+		conn = (struct connection*) require_mem(sizeof(*conn));
+		conn->next = NULL;
+		conn->pipe = pipe;
+		EnterCriticalSection(&server.lock);
+
+		if(server.tail != NULL)
+			server.tail->next = conn;
+		else
+			server.head = conn;
+
+		server.tail = conn;
+		++server.count;
+		WakeConditionVariable(&server.queued);
+		LeaveCriticalSection(&server.lock);
+	}
+}
+
+/*
+ * Wait for a client to connect to the given pipe instance, which was
+ * created for overlapped I/O, with the given overlapped structure, and
+ * return nonzero once one has, or zero with the error in
+ * GetLastError(). The value of overlapped must not be NULL.
+ */
+static int accept_client(HANDLE pipe, OVERLAPPED* overlapped)
+{
+	DWORD bytes = 0;
+
+	RT_NOT_NULL(overlapped);
+
+	if(ConnectNamedPipe(pipe, overlapped))
+		return 1;
+
+	/* A client that connected first does not signal the event */
+	if(GetLastError() == ERROR_PIPE_CONNECTED)
+		return 1;
+
+	return finish_io(pipe, overlapped, FALSE, INFINITE, &bytes);
+}
+
+/*
+ * Handle the clients queued in the server structure pointed to by arg,
+ * one at a time, forever. The value of arg must not be NULL.
+ */
+static unsigned __stdcall serve_worker(void* arg)
+{
+	struct server* server = (struct server*) arg;
+
+	RT_NOT_NULL(server);
+
+	for(;;) {
+		struct connection* conn = NULL;
+		HANDLE pipe = NULL;
+
+		EnterCriticalSection(&server->lock);
+
+		while(server->head == NULL)
+			SleepConditionVariableCS(&server->queued, &server->lock, INFINITE);
+
+		conn = server->head;
+		server->head = conn->next;
+
+		if(server->head == NULL)
+			server->tail = NULL;
+
+		--server->count;
+		WakeConditionVariable(&server->taken);
+		LeaveCriticalSection(&server->lock);
+		pipe = conn->pipe;
+		free(conn);
+		handle_connection(server, pipe);
+	}
+}
+
+/*
+ * Read a job from the client connected to the given pipe, run it and
+ * reply with its outcome. The pipe is closed afterwards. The value of
+ * server must not be NULL.
+ */
+static void handle_connection(struct server* server, HANDLE pipe)
+{
+	OVERLAPPED overlapped;
+	LPTSTR request = NULL; /* path to the instruction file */
+	LPTSTR target = NULL; /* path to the PDF written by the job */
+	enum error_code code = E_ARG;
+
+	RT_NOT_NULL(server);
+
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if(overlapped.hEvent == NULL) {
+		writelog(kNORM, _T("Failed to create event (%lu)\n"),
+				GetLastError());
+		CloseHandle(pipe);
+		return;
+	}
+
+	request = read_request(pipe, &overlapped);
+
+	if(request != NULL) {
+		DWORD start = GetTickCount();
+
+		writelog(kNORM, _T("Starting job '%s'\n"), request);
+		code = run_trapped(server->proc, request, &target);
+		writelog(kNORM, _T("Job '%s' finished with status %d in %lu ms\n"),
+				request, code, (unsigned long int) (GetTickCount() - start));
+	}
+
+	write_reply(pipe, &overlapped, code, code == E_SUCCESS ? target : NULL);
+	FlushFileBuffers(pipe);
+	DisconnectNamedPipe(pipe);
+	CloseHandle(pipe);
+	CloseHandle(overlapped.hEvent);
+	free(request);
+	free(target);
+}
+
+/*
+ * Run proc with the given path and target and return its result. If it
+ * calls errorout(), the error code is returned instead of exiting. The
+ * values of proc, path and target must not be NULL.
+ */
+static enum error_code run_trapped(job_proc proc, LPCTSTR path,
+		LPTSTR* target)
+{
+	struct error_trap trap;
+	enum error_code code = E_SUCCESS;
+
+	RT_NOT_NULL(proc);
+
+	if(setjmp(trap.env) != 0)
+		return trap.code;
+
+	set_error_trap(&trap);
+	code = proc(path, target);
+	set_error_trap(NULL);
+	return code;
+}
+
+/*
+ * Read a line of UTF-8 from the given pipe with the given overlapped
+ * structure and return it without its line ending, or NULL if the
+ * client disconnected first, or did not send a whole line within
+ * SERVE_REQUEST_MS milliseconds, or the line is empty or longer than
+ * SERVE_REQUEST_MAX bytes. Anything after the line is ignored. The
+ * pointer returned must be passed to free(). The value of overlapped
+ * must not be NULL.
+ */
+static LPTSTR read_request(HANDLE pipe, OVERLAPPED* overlapped)
+{
+	char line[SERVE_REQUEST_MAX + 1] = "";
+	char* end = NULL; /* line feed ending the line, once read */
+	size_t len = 0;
+	DWORD start = GetTickCount();
+	int timed_out = 0; /* nonzero if the client took too long */
+
+	RT_NOT_NULL(overlapped);
+
+	while(end == NULL && len < SERVE_REQUEST_MAX) {
+		DWORD read = 0;
+		DWORD elapsed = GetTickCount() - start;
+		BOOL started = FALSE;
+
+		if(elapsed >= SERVE_REQUEST_MS) {
+			timed_out = 1;
+			break;
+		}
+
+		started = ReadFile(pipe, &line[len],
+				(DWORD) (SERVE_REQUEST_MAX - len), NULL, overlapped);
+
+		if(!finish_io(pipe, overlapped, started,
+				SERVE_REQUEST_MS - elapsed, &read)) {
+			timed_out = GetLastError() == ERROR_TIMEOUT;
+			break;
+		}
+
+		if(read == 0)
+			break;
+
+		end = (char*) memchr(&line[len], '\n', read);
+		len += read;
+	}
+
+	if(end == NULL && len == SERVE_REQUEST_MAX) {
+		writelog(kNORM, _T("Rejected a request longer than %lu bytes\n"),
+				(unsigned long int) SERVE_REQUEST_MAX);
+		return NULL;
+	}
+
+	if(end == NULL) {
+		if(timed_out)
+			writelog(kNORM, _T("Dropped a client that sent no request ")
+					_T("within %lu ms\n"),
+					(unsigned long int) SERVE_REQUEST_MS);
+
+		return NULL;
+	}
+
+	len = (size_t) (end - line);
+
+	if(len > 0 && line[len - 1] == '\r')
+		--len;
+
+	line[len] = '\0';
+
+	return len > 0 ? require_from_utf8(line) : NULL;
+}
+
+/*
+ * Write the given error code and target path to the client connected
+ * to the given pipe as a line of UTF-8, with the given overlapped
+ * structure. If target is NULL, nothing is written after the tab. A
+ * client that went away or does not read within SERVE_REQUEST_MS
+ * milliseconds is logged. The value of overlapped must not be NULL.
+ */
+static void write_reply(HANDLE pipe, OVERLAPPED* overlapped,
+		enum error_code code, LPCTSTR target)
+{
+	LPTSTR reply = NULL;
+	char* utf8 = NULL;
+	DWORD written = 0;
+	BOOL started = FALSE;
+
+	RT_NOT_NULL(overlapped);
+
+	reply = require_strf(_T("%d\t%s\n"), code, target != NULL ? target :
+			_T(""));
+	utf8 = require_utf8(reply);
+	started = WriteFile(pipe, utf8, (DWORD) strlen(utf8), NULL, overlapped);
+
+	if(!finish_io(pipe, overlapped, started, SERVE_REQUEST_MS, &written))
+		writelog(kNORM, _T("Failed to reply to a client (%lu)\n"),
+				GetLastError());
+
+	free(utf8);
+	free(reply);
+}
+
+/*
+ * Wait up to timeout milliseconds for the operation on the given pipe
+ * with the given overlapped structure to finish, where started is what
+ * the call starting it returned, and store the number of bytes it
+ * transferred in the value pointed to by bytes. Return nonzero if it
+ * succeeded, or zero with the error in GetLastError(). An operation
+ * still pending at the timeout is cancelled, and fails with
+ * ERROR_TIMEOUT. The value of timeout may be INFINITE. The values of
+ * overlapped and bytes must not be NULL.
+ */
+static BOOL finish_io(HANDLE pipe, OVERLAPPED* overlapped, BOOL started,
+		DWORD timeout, DWORD* bytes)
+{
+	RT_NOT_NULL(overlapped);
+	RT_NOT_NULL(bytes);
+
+	*bytes = 0;
+
+	if(!started && GetLastError() != ERROR_IO_PENDING)
+		return FALSE;
+
+	if(WaitForSingleObject(overlapped->hEvent, timeout) == WAIT_TIMEOUT) {
+		CancelIoEx(pipe, overlapped);
+		GetOverlappedResult(pipe, overlapped, bytes, TRUE);
+		SetLastError(ERROR_TIMEOUT);
+		return FALSE;
+	}
+
+	return GetOverlappedResult(pipe, overlapped, bytes, FALSE);
+}
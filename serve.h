@@ -0,0 +1,16 @@
+#pragma once
+
+#include "stdafx.h"
+#include "log.h"
+
+/* Longest request accepted by serve(), in bytes */
+#define SERVE_REQUEST_MAX (MAX_PATH * 4)
+
+/*
+ * Runs the instruction file at the given path. On success, it sets the
+ * given pointer to a copy of the path of the PDF it wrote, which the
+ * caller passes to free().
+ */
+typedef enum error_code (*job_proc)(LPCTSTR, LPTSTR*);
+
+void serve(LPCTSTR, unsigned long int, job_proc);
@@ -9,6 +9,8 @@
 
 #include <stdio.h>
 #include <tchar.h>
+#include <WinSock2.h>
+#include <WS2tcpip.h>
 #include <Windows.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -18,12 +20,15 @@
 #include <errno.h>
 #include <io.h>
 #include <Psapi.h>
+#include <bcrypt.h>
 #include <strsafe.h>
 #include <locale.h>
 #include <assert.h>
 #include <math.h>
 #include <time.h>
 #include <fcntl.h>
+#include <process.h>
+#include <setjmp.h>
 
 /*
  * Determine the number of elements in an array. NOTE: this is not valid
@@ -0,0 +1,441 @@
+#include "stdafx.h"
+#include "task.h"
+#include "util.h"
+#include "log.h"
+
+/* Worker threads shared by every running task graph */
+static struct {
+	INIT_ONCE once; /* initializes the members below */
+	CRITICAL_SECTION lock; /* protects the graphs and every running graph */
+	CONDITION_VARIABLE queued; /* signaled when a task is ready */
+	struct task_graph* graphs; /* running graphs, linked by next */
+} pool = { INIT_ONCE_STATIC_INIT };
+
+static BOOL CALLBACK start_pool(PINIT_ONCE, PVOID, PVOID*);
+static unsigned __stdcall task_worker(void*);
+static struct task* take_task(struct task_graph*);
+static void run_ready(struct task*);
+static enum error_code run_task(struct task*);
+static void release_dependents(struct task_graph*, struct task*);
+
+/*
+ * Start the worker threads that run the tasks of every graph in this
+ * process, the given number of them, or one per processor if workers
+ * is zero. Only the first call has an effect, and run_task_graph()
+ * makes one with zero if nothing did before.
+ */
+void start_task_pool(unsigned long int workers)
+{
+	if(!InitOnceExecuteOnce(&pool.once, start_pool, &workers, NULL))
+		errorout(E_CMD, _T("Failed to start the task pool"));
+}
+
+/*
+ * Initialize the given task_graph structure with no tasks. The value
+ * of graph must not be NULL. The structure must be passed to
+ * destroy_task_graph().
+ */
+void init_task_graph(struct task_graph* graph)
+{
+	RT_NOT_NULL(graph);
+
+	start_task_pool(0);
+	InitializeConditionVariable(&graph->changed);
+	graph->next = NULL;
+	graph->tasks = NULL;
+	graph->ready = NULL;
+	graph->task_count = 0;
+	graph->ready_count = 0;
+	graph->remaining = 0;
+	graph->running = 0;
+	graph->failed_task = NULL;
+	graph->failed = E_SUCCESS;
+	graph->trapped = 0;
+	graph->group = NULL;
+}
+
+/*
+ * Add a task with the given name to the given graph and return a
+ * pointer to it. When the task runs, proc is called with arg. The task
+ * has no dependencies until they are added with add_task_dependency().
+ * If proc is NULL, the task is never run; it stands for work done
+ * elsewhere, such as by another task, and finishes when finish_task()
+ * is called for it. Such a task cannot have dependencies. The values
+ * of graph and name must not be NULL. Tasks must not be added while the
+ * graph is running.
+ */
+struct task* add_task(struct task_graph* graph, LPCTSTR name, task_proc proc,
+		void* arg)
+{
+	struct task* task = NULL;
+	struct task** tasks = NULL;
+
+	RT_NOT_NULL(graph);
+	RT_NOT_NULL(name);
+
+	task = (struct task*) require_mem(sizeof(*task));
+	tasks = (struct task**) realloc(graph->tasks,
+			(graph->task_count + 1) * sizeof(*tasks));
+
+	if(tasks == NULL)
+		errorout(E_MALLOC, _T("Failed to allocate memory"));
+
+	task->graph = graph;
+	task->dependents = NULL;
+	task->dependent_count = 0;
+	task->pending = 0;
+	task->name = name;
+	task->proc = proc;
+	task->arg = arg;
+	graph->tasks = tasks;
+	graph->tasks[graph->task_count++] = task;
+	return task;
+}
+
+/*
+ * Make the given task wait for the given dependency to finish before it
+ * runs. Both tasks must belong to the same graph. The values of task
+ * and dependency must not be NULL.
+ */
+void add_task_dependency(struct task* task, struct task* dependency)
+{
+	struct task** dependents = NULL;
+
+	RT_NOT_NULL(task);
+	RT_NOT_NULL(dependency);
+
+	if(task->proc == NULL)
+		errorout(E_ARG, _T("Task '%s' is finished elsewhere and cannot ")
+				_T("wait for '%s'"), task->name, dependency->name);
+
+	dependents = (struct task**) realloc(dependency->dependents,
+			(dependency->dependent_count + 1) * sizeof(*dependents));
+
+	if(dependents == NULL)
+		errorout(E_MALLOC, _T("Failed to allocate memory"));
+
+	dependency->dependents = dependents;
+	dependency->dependents[dependency->dependent_count++] = task;
+	++task->pending;
+}
+
+/*
+ * Finish the given task, which was added without a procedure, so that
+ * the tasks depending on it may run. This procedure may be called from
+ * any thread while the graph is running, including from a task of the
+ * same graph, and must be called exactly once for the task. The graph
+ * does not finish running until it is. The value of task must not be
+ * NULL.
+ */
+void finish_task(struct task* task)
+{
+	struct task_graph* graph = NULL;
+
+	RT_NOT_NULL(task);
+
+	graph = task->graph;
+	writelog(kDEBUG, _T("Finished task '%s'\n"), task->name);
+	EnterCriticalSection(&pool.lock);
+	release_dependents(graph, task);
+	LeaveCriticalSection(&pool.lock);
+}
+
+/*
+ * Fail the given graph with the given error code as if the task with
+ * the given name had, so that none of its tasks start from then on,
+ * and wake the thread running it. Tasks already running are left to
+ * finish, and the graph only stops once they have. The first failure
+ * of a graph is the one its caller sees. This procedure may be called
+ * from any thread, before or while the graph runs. The values of graph
+ * and name must not be NULL, and code must not be E_SUCCESS.
+ */
+void cancel_task_graph(struct task_graph* graph, enum error_code code,
+		LPCTSTR name)
+{
+	RT_NOT_NULL(graph);
+	RT_NOT_NULL(name);
+
+	EnterCriticalSection(&pool.lock);
+
+	if(graph->failed == E_SUCCESS) {
+		graph->failed = code;
+		graph->failed_task = name;
+	}
+
+	WakeAllConditionVariable(&graph->changed);
+	LeaveCriticalSection(&pool.lock);
+}
+
+/*
+ * Run every task in the given graph on the workers of the task pool,
+ * which it shares with every other running graph, and on the calling
+ * thread, which runs tasks of this graph while it waits, so that a
+ * task running a graph of its own never waits for a free worker. Each
+ * task starts as soon as all of its dependencies have finished. This
+ * procedure blocks until every task has finished. Tasks start children
+ * in the group of the calling thread, whose children are killed if a
+ * task fails. If the calling thread has an error trap, a task that
+ * fails, or cancel_task_graph(), stops new tasks from starting, and
+ * once the running ones have finished, the error is passed to
+ * errorout() on the calling thread. The graph must not contain a
+ * cycle. The value of graph must not be NULL.
+ */
+void run_task_graph(struct task_graph* graph)
+{
+	struct task_graph** link = NULL;
+	size_t i = 0;
+
+	RT_NOT_NULL(graph);
+
+	if(graph->task_count == 0)
+		return;
+
+	graph->ready = (struct task**) require_cmem(graph->task_count,
+			sizeof(*graph->ready));
+	graph->ready_count = 0;
+	graph->remaining = graph->task_count;
+	graph->running = 0;
+	graph->trapped = get_error_trap() != NULL;
+	graph->group = get_child_group();
+
+	for(i = 0; i < graph->task_count; ++i)
+		if(graph->tasks[i]->pending == 0 && graph->tasks[i]->proc != NULL)
+			graph->ready[graph->ready_count++] = graph->tasks[i];
+
+	if(graph->ready_count == 0)
+		errorout(E_ARG, _T("Task graph has no task without dependencies"));
+
+	EnterCriticalSection(&pool.lock);
+	graph->next = pool.graphs;
+	pool.graphs = graph;
+	WakeAllConditionVariable(&pool.queued);
+
+	while(graph->running > 0
+			|| (graph->remaining > 0 && graph->failed == E_SUCCESS)) {
+		struct task* task = take_task(graph);
+
+		if(task != NULL)
+			run_ready(task);
+		else
+			SleepConditionVariableCS(&graph->changed, &pool.lock, INFINITE);
+	}
+
+	for(link = &pool.graphs; *link != graph; link = &(*link)->next)
+		;
+
+	*link = graph->next;
+	graph->next = NULL;
+	LeaveCriticalSection(&pool.lock);
+	free(graph->ready);
+	graph->ready = NULL;
+
+	if(graph->failed != E_SUCCESS)
+		errorout(graph->failed, _T("Task '%s' failed"), graph->failed_task);
+}
+
+/*
+ * Release the memory used by the given graph and its tasks. Pointers to
+ * the tasks must not be used after calling this procedure. The value
+ * of graph must not be NULL.
+ */
+void destroy_task_graph(struct task_graph* graph)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(graph);
+
+	for(i = 0; i < graph->task_count; ++i) {
+		free(graph->tasks[i]->dependents);
+		free(graph->tasks[i]);
+	}
+
+	free(graph->tasks);
+	graph->tasks = NULL;
+	graph->task_count = 0;
+}
+
+/*
+ * Return the number of processors available to this process. The value
+ * returned is at least 1.
+ */
+unsigned long int get_processor_count(void)
+{
+	SYSTEM_INFO sys_info;
+
+	GetSystemInfo(&sys_info);
+
+	return sys_info.dwNumberOfProcessors > 0 ?
+			sys_info.dwNumberOfProcessors : 1;
+}
+
+/*
+ * Initialize the task pool and start the number of workers pointed to
+ * by param, or one per processor if it is zero. A worker that cannot
+ * be started is left out; the thread running a graph runs its tasks
+ * anyway. This is an InitOnceExecuteOnce() callback; its other
+ * parameters are unused.
+ */
+static BOOL CALLBACK start_pool(PINIT_ONCE once, PVOID param,
+		PVOID* context)
+{
+	unsigned long int workers = *(unsigned long int*) param;
+	unsigned long int i = 0;
+
+	InitializeCriticalSection(&pool.lock);
+	InitializeConditionVariable(&pool.queued);
+	pool.graphs = NULL;
+
+	if(workers == 0)
+		workers = get_processor_count();
+
+	for(i = 0; i < workers; ++i) {
+		HANDLE thread = (HANDLE) _beginthreadex(NULL, 0, task_worker, NULL,
+				0, NULL);
+
+		if(thread == 0) {
+			writelog(kNORM, _T("Started %lu of %lu task workers\n"), i,
+					workers);
+			break;
+		}
+
+		CloseHandle(thread);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Run the ready tasks of every graph in the task pool as they become
+ * ready, forever. The value of arg is unused.
+ */
+static unsigned __stdcall task_worker(void* arg)
+{
+	EnterCriticalSection(&pool.lock);
+
+	for(;;) {
+		struct task* task = take_task(NULL);
+
+		if(task != NULL)
+			run_ready(task);
+		else
+			SleepConditionVariableCS(&pool.queued, &pool.lock, INFINITE);
+	}
+}
+
+/*
+ * Take a ready task of the given graph, or of any graph in the task
+ * pool if graph is NULL, and return a pointer to it, or NULL if there
+ * is none. Graphs which failed have no ready tasks. The task must be
+ * passed to run_ready(). The lock of the pool must be held.
+ */
+static struct task* take_task(struct task_graph* graph)
+{
+	struct task_graph* curr = graph != NULL ? graph : pool.graphs;
+
+	for(; curr != NULL; curr = graph != NULL ? NULL : curr->next) {
+		if(curr->failed != E_SUCCESS || curr->ready_count == 0)
+			continue;
+
+		++curr->running;
+		return curr->ready[--curr->ready_count];
+	}
+
+	return NULL;
+}
+
+/*
+ * Run the given task, taken by take_task(), without the lock of the
+ * task pool, which must be held. Finishing it makes each of its
+ * dependents whose other dependencies have finished ready, and failing
+ * it fails its graph and kills the children of its group. The value of
+ * task must not be NULL.
+ */
+static void run_ready(struct task* task)
+{
+	struct task_graph* graph = NULL;
+	enum error_code code = E_SUCCESS;
+
+	RT_NOT_NULL(task);
+
+	graph = task->graph;
+	LeaveCriticalSection(&pool.lock);
+
+	writelog(kDEBUG, _T("Starting task '%s'\n"), task->name);
+	code = run_task(task);
+	writelog(kDEBUG, _T("Finished task '%s'\n"), task->name);
+
+	EnterCriticalSection(&pool.lock);
+	--graph->running;
+
+	if(code != E_SUCCESS && graph->failed == E_SUCCESS) {
+		graph->failed = code;
+		graph->failed_task = task->name;
+	}
+
+	/* The tasks still running need not finish what has already failed */
+	if(code != E_SUCCESS && graph->group != NULL)
+		cancel_child_group(graph->group, code);
+
+	if(code == E_SUCCESS)
+		release_dependents(graph, task);
+	else
+		WakeAllConditionVariable(&graph->changed);
+}
+
+/*
+ * Run the given task with the child group of its graph and return
+ * E_SUCCESS. If its graph is trapped, an error in the task is caught
+ * and its code is returned instead of exiting. The error trap and
+ * child group of the calling thread are restored either way. The value
+ * of task must not be NULL.
+ */
+static enum error_code run_task(struct task* task)
+{
+	struct error_trap trap;
+	struct error_trap* outer = get_error_trap(); /* trap to restore */
+	struct child_group* group = get_child_group(); /* group to restore */
+
+	RT_NOT_NULL(task);
+
+	set_child_group(task->graph->group);
+
+	if(!task->graph->trapped) {
+		task->proc(task->arg);
+		set_child_group(group);
+		return E_SUCCESS;
+	}
+
+	if(setjmp(trap.env) != 0) {
+		set_error_trap(outer);
+		set_child_group(group);
+		return trap.code;
+	}
+
+	set_error_trap(&trap);
+	task->proc(task->arg);
+	set_error_trap(outer);
+	set_child_group(group);
+	return E_SUCCESS;
+}
+
+/*
+ * Count the given finished task out of the given graph and make each of
+ * its dependents whose other dependencies have finished ready. The lock
+ * of the graph must be held. The values of graph and task must not be
+ * NULL.
+ */
+static void release_dependents(struct task_graph* graph, struct task* task)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(graph);
+	RT_NOT_NULL(task);
+
+	for(i = 0; i < task->dependent_count; ++i)
+		if(--task->dependents[i]->pending == 0)
+			graph->ready[graph->ready_count++] = task->dependents[i];
+
+	--graph->remaining;
+	WakeAllConditionVariable(&pool.queued);
+	WakeAllConditionVariable(&graph->changed);
+}
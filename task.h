@@ -0,0 +1,47 @@
+#pragma once
+
+#include "stdafx.h"
+#include "proc.h"
+#include "log.h"
+
+/* Procedure that performs the work of a task */
+typedef void (*task_proc)(void*);
+
+struct task_graph;
+
+/* A unit of work and the tasks waiting for it */
+struct task {
+	struct task_graph* graph; /* graph the task belongs to */
+	struct task** dependents; /* tasks which depend on this one */
+	LPCTSTR name; /* name of the task for the log */
+	task_proc proc; /* procedure to run, or NULL if finished elsewhere */
+	void* arg; /* argument passed to proc */
+	size_t dependent_count; /* number of elements in dependents */
+	size_t pending; /* dependencies which have not finished */
+};
+
+/* A set of tasks and the dependencies between them, locked by the pool */
+struct task_graph {
+	struct task_graph* next; /* next running graph of the task pool */
+	CONDITION_VARIABLE changed; /* signaled when a task is ready or done */
+	struct task** tasks; /* every task in the graph */
+	struct task** ready; /* tasks whose dependencies have finished */
+	size_t task_count; /* number of elements in tasks */
+	size_t ready_count; /* number of elements in ready */
+	size_t remaining; /* tasks which have not finished */
+	size_t running; /* tasks being run by a thread */
+	LPCTSTR failed_task; /* name of the task which failed, if any */
+	enum error_code failed; /* error of the failed task, or E_SUCCESS */
+	int trapped; /* nonzero if task errors are passed to the caller */
+	struct child_group* group; /* group of children its tasks start */
+};
+
+void start_task_pool(unsigned long int);
+void init_task_graph(struct task_graph*);
+struct task* add_task(struct task_graph*, LPCTSTR, task_proc, void*);
+void add_task_dependency(struct task*, struct task*);
+void finish_task(struct task*);
+void cancel_task_graph(struct task_graph*, enum error_code, LPCTSTR);
+void run_task_graph(struct task_graph*);
+void destroy_task_graph(struct task_graph*);
+unsigned long int get_processor_count(void);
@@ -0,0 +1,159 @@
+"""Check render cache revalidation against a loopback HTTP stand-in.
+
+Usage: python revalidate.py path\\to\\HTMLToPDFHelper.exe
+
+The helper converts two segments three times with the Stub renderer,
+which never loads its sources, so the only requests the stand-in sees
+are the checks of the render cache. The first run must cache both
+segments. The second must be answered 304 Not Modified for both and
+reuse both. Before the third, one segment changes, so it must be
+answered 200 OK and converted again while the other is reused. No run
+may ask for a body.
+"""
+
+import http.server
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+
+SEGMENTS = ("seg1", "seg2")
+
+
+class StandIn(http.server.ThreadingHTTPServer):
+    """Serves each segment with an ETag that changes with its version."""
+
+    def __init__(self):
+        super().__init__(("127.0.0.1", 0), Handler)
+        self.versions = dict.fromkeys(SEGMENTS, 1)
+        self.requests = []
+        self.lock = threading.Lock()
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    def do_HEAD(self):
+        self.answer(False)
+
+    def do_GET(self):
+        self.answer(True)
+
+    def answer(self, body):
+        name = self.path.lstrip("/").split("?")[0]
+        version = self.server.versions.get(name)
+        tag = '"%s-%d"' % (name, version or 0)
+
+        if version is None:
+            status = 404
+        elif self.headers.get("If-None-Match") == tag:
+            status = 304
+        else:
+            status = 200
+
+        with self.server.lock:
+            self.server.requests.append((self.command, name, status))
+
+        data = b"<p>%s</p>" % tag.encode()
+        self.send_response(status)
+        self.send_header("ETag", tag)
+
+        if status == 200:
+            self.send_header("Content-Type", "text/html")
+            self.send_header("Content-Length", str(len(data)))
+
+        self.end_headers()
+
+        if body and status == 200:
+            self.wfile.write(data)
+
+    def log_message(self, *args):
+        pass
+
+
+def write_instructions(path, port, work):
+    lines = [
+        "iSegments=%d" % len(SEGMENTS),
+        "sBaseURL=http://127.0.0.1:%d/" % port,
+        "sTargetPath=%s" % os.path.join(work, "out.pdf"),
+        "sRenderer=Stub",
+        "sRenderCachePath=%s" % os.path.join(work, "cache"),
+        "iRevalidateCache=1",
+        "sTableOfContentsOptions=Don't show",
+        "sHeaderFooterOptions=Don't show",
+        "end",
+    ]
+
+    for name in SEGMENTS:
+        lines += ["sSegmentURL=%s" % name, "end"]
+
+    with open(path, "w") as f:
+        f.write("\n".join(lines) + "\n")
+
+
+def entries(work):
+    """Return the file ID of each cache entry, which a miss replaces."""
+    cache = os.path.join(work, "cache")
+    return {name: os.stat(os.path.join(cache, name)).st_ino
+            for name in os.listdir(cache) if name.endswith(".entry")}
+
+
+def run(exe, instructions, server, expected):
+    server.requests.clear()
+    subprocess.run([exe, instructions], check=True)
+    seen = sorted(server.requests)
+
+    if seen != sorted(expected):
+        sys.exit("expected requests %s, got %s" % (sorted(expected), seen))
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit(__doc__)
+
+    exe = os.path.abspath(sys.argv[1])
+    work = tempfile.mkdtemp()
+    server = StandIn()
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+
+    try:
+        instructions = os.path.join(work, "job.txt")
+        write_instructions(instructions, server.server_address[1], work)
+
+        run(exe, instructions, server,
+                [("HEAD", name, 200) for name in SEGMENTS])
+        cold = entries(work)
+
+        if len(cold) != len(SEGMENTS):
+            sys.exit("expected %d cache entries, got %d"
+                    % (len(SEGMENTS), len(cold)))
+
+        print("ok: first run cached every segment")
+
+        run(exe, instructions, server,
+                [("HEAD", name, 304) for name in SEGMENTS])
+
+        if entries(work) != cold:
+            sys.exit("an unchanged segment was converted again")
+
+        print("ok: 304 Not Modified reused every segment")
+
+        server.versions[SEGMENTS[0]] += 1
+        run(exe, instructions, server,
+                [("HEAD", SEGMENTS[0], 200)]
+                + [("HEAD", name, 304) for name in SEGMENTS[1:]])
+        warm = entries(work)
+        replaced = [name for name in cold if warm.get(name) != cold[name]]
+
+        if len(replaced) != 1 or set(warm) != set(cold):
+            sys.exit("expected one segment converted again, got %d"
+                    % len(replaced))
+
+        print("ok: 200 OK converted the changed segment again")
+    finally:
+        server.shutdown()
+        shutil.rmtree(work, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()
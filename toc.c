@@ -4,64 +4,122 @@
 #include "util.h"
 #include "wkhtmltopdf_cmd.h"
 #include "log.h"
-
-static void skip_bin_data(FILE*);
+#include "pdf.h"
+#include "font.h"
+
+/* Margin of a page without one, in millimeters, like the PDF getter */
+#define TOC_MARGIN 10.0
+
+/* Font size without one, in CSS pixels, like a browser */
+#define TOC_FONT_SIZE 16.0
+
+/* Distance between baselines, in ems */
+#define TOC_LEADING 1.5
+
+/* Space around the dot leader of a title, in ems */
+#define TOC_GAP 0.5
+
+/* Dots of a dot leader, repeated as often as they fit */
+#define TOC_DOTS ". "
+
+/* A page size the PDF getter knows, in points, upright */
+struct toc_paper {
+	LPCTSTR name; /* name given to the PDF getter */
+	double width; /* width in points */
+	double height; /* height in points */
+};
+
+/* Pages of a table of contents being typeset by write_toc_pdf() */
+struct toc_layout {
+	struct pdf_writer writer; /* the PDF written */
+	struct pdf_font font; /* the document font */
+	struct pdf_buffer content; /* content of the current page */
+	struct pdf_obj* kids; /* references to the pages written */
+	unsigned long int pages_num; /* root of the page tree */
+	unsigned long int font_num; /* font dictionary of font */
+	double width; /* width of the page in points */
+	double height; /* height of the page in points */
+	double left; /* x of the left margin */
+	double right; /* x of the right margin */
+	double top; /* y of the top margin */
+	double bottom; /* y of the bottom margin */
+	double size; /* font size in points */
+	double y; /* baseline of the current line */
+	int open; /* nonzero while a page is being filled */
+};
+
+/* Page sizes the PDF getter knows, by the names it knows them by */
+static const struct toc_paper papers[] = {
+	{ _T("A0"), 2383.94, 3370.39 },
+	{ _T("A1"), 1683.78, 2383.94 },
+	{ _T("A2"), 1190.55, 1683.78 },
+	{ _T("A3"), 841.89, 1190.55 },
+	{ _T("A4"), 595.28, 841.89 },
+	{ _T("A5"), 419.53, 595.28 },
+	{ _T("A6"), 297.64, 419.53 },
+	{ _T("B4"), 708.66, 1000.63 },
+	{ _T("B5"), 498.90, 708.66 },
+	{ _T("Executive"), 522.0, 756.0 },
+	{ _T("Folio"), 595.28, 935.43 },
+	{ _T("Ledger"), 1224.0, 792.0 },
+	{ _T("Legal"), 612.0, 1008.0 },
+	{ _T("Letter"), 612.0, 792.0 },
+	{ _T("Tabloid"), 792.0, 1224.0 }
+};
+
+static unsigned long int get_toc_indentation(LPCTSTR);
+static void unescape_toc_title(LPTSTR);
+static void read_page_size(const struct pdf_info*, double*, double*);
+static void start_toc_line(struct toc_layout*);
+static void finish_toc_page(struct toc_layout*);
+static void show_toc_text(struct toc_layout*, double, const char*, size_t);
+static size_t fit_toc_text(const struct toc_layout*, const char*, size_t,
+		double);
 
 /*
- * NOTE: This method is unreliable. See this StackOverflow question:
- * http://stackoverflow.com/questions/14644353/
- *
- * This procedure reads the PDF with the given name and hopefully
- * returns the number of pages it has. It searches for "/Count " in the
- * file and assumes the following number is the number of pages. This
- * will not work for every PDF (as noted above), but it seems to work
- * with the PDFs generated by wkhtmltopdf. If the procedure succeeds
- * (i.e. finds a number which may be the number of pages as determined
- * by the method explained above), the number of pages is stored in the
- * value pointed to by pages. Otherwise, execution is terminated. The
- * value of neither pages nor pdf_name may be NULL.
+ * This procedure reads the PDF with the given name and stores the
+ * number of pages it has in the value pointed to by pages. The file is
+ * mapped into memory and only the objects on the way from its trailer
+ * through /Root and /Pages to /Count are parsed, so both classic
+ * cross-reference tables and cross-reference streams work. If there is
+ * no such count, execution is terminated. The value of neither pages
+ * nor pdf_name may be NULL.
  */
 void get_number_of_pages(unsigned long int* pages, LPCTSTR pdf_name)
 {
-	FILE* pdf = NULL;
-	static TCHAR pages_line[] = _T("/Count ");
-	static TCHAR stream_start[] = _T("stream\n");
-	static const size_t pages_line_len = LENGTHOF(pages_line) - 1;
-	static const size_t stream_start_len = LENGTHOF(stream_start) - 1;
-	TCHAR line[BUFSIZ] = _T("");
+	struct pdf_doc doc;
+	struct pdf_obj* root = NULL;
+	struct pdf_obj* tree = NULL;
+	struct pdf_obj* count = NULL;
+	int found = 0;
 
 	RT_NOT_NULL(pdf_name);
 	RT_NOT_NULL(pages);
 
-	pdf = require_open_file(pdf_name, _T("r"));
-
-	while(_fgetts(line, LENGTHOF(line), pdf) != NULL) {
-		if(_tcsncmp(stream_start, line, stream_start_len) == 0) {
-			skip_bin_data(pdf);
-			continue;
-		}
+	open_pdf(&doc, pdf_name);
+	root = load_pdf_value(&doc, get_pdf_key(doc.trailer, "Root"));
+	tree = load_pdf_value(&doc, get_pdf_key(root, "Pages"));
+	count = load_pdf_value(&doc, get_pdf_key(tree, "Count"));
 
-		if(_tcsncmp(pages_line, line, pages_line_len) == 0) {
-			LPCTSTR pages_number = _tcstok(line + pages_line_len, _T(" "));
+	if(count != NULL && count->type == kPDF_OBJ_INT
+			&& count->u.integer >= 0) {
+		*pages = (unsigned long int) count->u.integer;
+		found = 1;
+	}
 
-			if(pages_number != NULL) {
-				LPTSTR end = NULL;
+	if(count != NULL)
+		free_pdf_object(count);
 
-				errno = 0;
-				*pages = _tcstoul(pages_number, &end, 10);
+	if(tree != NULL)
+		free_pdf_object(tree);
 
-				if(*pages != ULONG_MAX || errno != ERANGE) {
-					release_file(pdf);
-					return;
-				}
-			}
-		}
+	if(root != NULL)
+		free_pdf_object(root);
 
-		if(_tcschr(line, _T('\n')) == NULL)
-			skip_line(pdf);
-	}
+	close_pdf(&doc);
 
-	errorout(E_PDF, _T("Failed to get number of pages from segment"));
+	if(!found)
+		errorout(E_PDF, _T("Failed to get number of pages from segment"));
 }
 
 /*
@@ -138,26 +196,12 @@ void write_toc_start(FILE* fd, LPCTSTR font, LPCTSTR size)
  */
 void write_toc_item(FILE* fd, LPCTSTR name, unsigned long int page)
 {
-	LPTSTR name_dup = NULL;
-	LPTSTR section_number = NULL;
 	unsigned long indentation = 0;
 
 	RT_NOT_NULL(fd);
 	RT_NOT_NULL(name);
 
-	name_dup = require_dup_str(name);
-	section_number = _tcstok(name_dup, _T("\xa0\x00"));
-
-	if(section_number == NULL)
-		errorout(E_STR, _T("Failed to identify section number"));
-
-	section_number = _tcstok(section_number, _T("."));
-
-	while((section_number = _tcstok(NULL, _T("."))) != NULL)
-		if(_tcscmp(section_number, _T("0")) != 0)
-			indentation += 1;
-
-	free(name_dup);
+	indentation = get_toc_indentation(name);
 
 	if(_ftprintf(fd,
 			_T("%s<div style=\"line-height:0.5;margin-left:%luem;\">&nbsp;")
@@ -182,48 +226,6 @@ void write_toc_end(FILE* fd)
 		errorout(E_BADF, _T("Failed to write TOC"));
 }
 
-/*
- * This procedure reads the given PDF until the current stream section
- * is finished. The value of file must not be NULL.
- */
-static void skip_bin_data(FILE* file)
-{
-	FILE* file_b = NULL;
-	int c = EOF;
-	TCHAR name[MAX_PATH + 1] = _T("");
-	static const char endstream_str[] = "endstream\n";
-
-	RT_NOT_NULL(file);
-
-	/* Reopen file in binary mode */
-	GetFinalPathNameByHandle((HANDLE) _get_osfhandle(fileno(file)), name,
-			LENGTHOF(name) - 1, FILE_NAME_NORMALIZED);
-	file_b = require_open_file(name, _T("rb"));
-	fseek(file_b, ftell(file), SEEK_SET);
-
-	do {
-		c = getc(file_b);
-
-		if(c == 'e') {
-			long int pos = ftell(file_b);
-			char tag[LENGTHOF(endstream_str)] = "";
-
-			ungetc(c, file_b);
-			fread(tag, sizeof(tag) - 1, sizeof(tag[0]), file_b);
-
-			if(strncmp(tag, endstream_str,
-					LENGTHOF(tag) - 1) != 0) {
-				fseek(file_b, pos, SEEK_SET);
-			} else {
-				break;
-			}
-		}
-	} while(c != EOF);
-				
-	fseek(file, ftell(file_b), SEEK_SET);
-	release_file(file_b);
-}
-
 /*
  * Opens a pipe to the PDF getter command for writing the TOC HTML. The
  * structure pointed to by info contains the necessary information about
@@ -253,9 +255,12 @@ FILE* open_toc_stream(UINT* outline_pdf_id, const struct pdf_info* info)
 	toc_cmd_info.size = info->cover_page.size;
 	toc_cmd_info.orientation = info->cover_page.orientation;
 	toc_cmd_info.margins = info->margins;
+	toc_cmd_info.proxy = NULL; /* the TOC is read from stdin */
 	toc_cmd_info.options = kPDF_TOC;
 
-	if(info->hf_opts == kPDF_HF_SHOW || info->hf_opts == kPDF_HF_SPECIAL) {
+	/* Stamped headers and footers are drawn by the merge instead */
+	if((info->hf_opts == kPDF_HF_SHOW || info->hf_opts == kPDF_HF_SPECIAL)
+			&& !info->stamp_headers) {
 		if(info->session != NULL)
 			session_str = require_strf(_T("&SESSION_OVERRIDE=%s"),
 				info->session);
@@ -290,3 +295,462 @@ FILE* open_toc_stream(UINT* outline_pdf_id, const struct pdf_info* info)
 
 	return outline_html_file;
 }
+
+/*
+ * Add the given title of a table of contents and the number of the
+ * page it is on to the list pointed to by list, for write_toc_pdf().
+ * The title is escaped as in the outline dump, and is indented by its
+ * section number as write_toc_item() indents it. The values of list
+ * and name must not be NULL.
+ */
+void add_toc_entry(struct toc_list* list, LPCTSTR name,
+		unsigned long int page)
+{
+	struct toc_entry* entry = NULL;
+	LPTSTR title = NULL;
+
+	RT_NOT_NULL(list);
+	RT_NOT_NULL(name);
+
+	title = require_dup_str(name);
+	unescape_toc_title(title);
+	list->entries = (struct toc_entry*) require_realloc(list->entries,
+			list->count + 1, sizeof(*list->entries));
+	entry = &list->entries[list->count++];
+	entry->title = encode_pdf_text(title);
+	entry->page = page;
+	entry->indentation = get_toc_indentation(name);
+	free(title);
+}
+
+/*
+ * Typeset the table of contents in the list pointed to by list as a
+ * new PDF at the given target path, the way the HTML written by
+ * write_toc_start(), write_toc_item() and write_toc_end() looks once
+ * the PDF getter converts it, but without starting one. Pages have the
+ * size, orientation and margins of the cover page in the structure
+ * pointed to by info, and text is set in its document font and size.
+ * Each title is indented one em for each level of its section number
+ * and wrapped at spaces if it is too long for its line. Page numbers
+ * are aligned on the right margin and dot leaders lead to them. The
+ * values of target, list and info must not be NULL.
+ */
+void write_toc_pdf(LPCTSTR target, const struct toc_list* list,
+		const struct pdf_info* info)
+{
+	struct toc_layout layout;
+	struct pdf_obj* pages = NULL; /* root of the page tree */
+	struct pdf_obj* catalog = NULL;
+	unsigned long int catalog_num = 0;
+	LPTSTR family = NULL; /* font family to use */
+	double number_width = 0.0; /* width of the widest page number */
+	double gap = 0.0; /* space around the dot leaders */
+	double pitch = 0.0; /* width of TOC_DOTS */
+	size_t i = 0;
+	static const char heading[] = "Table of Contents";
+
+	RT_NOT_NULL(target);
+	RT_NOT_NULL(list);
+	RT_NOT_NULL(info);
+
+	memset(&layout, 0, sizeof(layout));
+	read_page_size(info, &layout.width, &layout.height);
+	layout.left = read_pdf_length(info->margins.left, TOC_MARGIN, FONT_MM);
+	layout.right = layout.width - read_pdf_length(info->margins.right,
+			TOC_MARGIN, FONT_MM);
+	layout.top = layout.height - read_pdf_length(info->margins.top, TOC_MARGIN,
+			FONT_MM);
+	layout.bottom = read_pdf_length(info->margins.bottom, TOC_MARGIN, FONT_MM);
+	layout.size = read_pdf_length(info->font_size, TOC_FONT_SIZE, FONT_PX);
+
+	if(layout.right - layout.left < layout.size
+			|| layout.top - layout.bottom < layout.size * TOC_LEADING)
+		errorout(E_ARG, _T("Margins leave no room for the table of ")
+				_T("contents"));
+
+	family = get_pdf_font_family(info->font_family);
+	load_pdf_font(&layout.font, family);
+	free(family);
+
+	open_pdf_writer(&layout.writer, target, (int) info->compress_level, 0);
+	layout.pages_num = reserve_pdf_object(&layout.writer);
+	layout.font_num = write_pdf_font(&layout.writer, &layout.font);
+	layout.kids = new_pdf_object(kPDF_OBJ_ARRAY);
+	gap = TOC_GAP * layout.size;
+	pitch = measure_pdf_text(&layout.font, TOC_DOTS, strlen(TOC_DOTS),
+			layout.size);
+
+	/* Leaders line up if they all end where the widest number starts */
+	for(i = 0; i < list->count; ++i) {
+		char number[32] = "";
+		double width = 0.0;
+
+		sprintf(number, "%lu", list->entries[i].page);
+		width = measure_pdf_text(&layout.font, number, strlen(number),
+				layout.size);
+
+		if(width > number_width)
+			number_width = width;
+	}
+
+	start_toc_line(&layout);
+	show_toc_text(&layout, (layout.left + layout.right - measure_pdf_text(
+			&layout.font, heading, strlen(heading), layout.size)) / 2,
+			heading, strlen(heading));
+	start_toc_line(&layout);
+
+	for(i = 0; i < list->count; ++i) {
+		const struct toc_entry* entry = &list->entries[i];
+		const char* title = entry->title;
+		size_t len = strlen(title);
+		char number[32] = "";
+		double x = layout.left + entry->indentation * layout.size;
+		double lead_end = layout.right - number_width - gap;
+		double lead_start = 0.0;
+		unsigned long int dots = 0;
+
+		/* Leave deep titles room for a few words */
+		if(x > layout.left + (lead_end - layout.left) / 2)
+			x = layout.left + (lead_end - layout.left) / 2;
+
+		start_toc_line(&layout);
+
+		for(;;) {
+			size_t fit = fit_toc_text(&layout, title, len, lead_end - gap - x);
+
+			if(fit == len)
+				break;
+
+			show_toc_text(&layout, x, title, fit);
+			start_toc_line(&layout);
+
+			for(title += fit, len -= fit; len > 0 && *title == ' '; --len)
+				++title;
+		}
+
+		show_toc_text(&layout, x, title, len);
+		lead_start = x + measure_pdf_text(&layout.font, title, len,
+				layout.size) + gap;
+
+		if(pitch > 0.0 && lead_end > lead_start)
+			dots = (unsigned long int) ((lead_end - lead_start) / pitch);
+
+		if(dots > 0) {
+			char* leader = (char*) require_cmem(dots, strlen(TOC_DOTS));
+			size_t leader_len = 0;
+			unsigned long int j = 0;
+
+			for(j = 0; j < dots; ++j) {
+				memcpy(leader + leader_len, TOC_DOTS, strlen(TOC_DOTS));
+				leader_len += strlen(TOC_DOTS);
+			}
+
+			show_toc_text(&layout, lead_end - dots * pitch, leader,
+					leader_len);
+			free(leader);
+		}
+
+		sprintf(number, "%lu", entry->page);
+		show_toc_text(&layout, layout.right - measure_pdf_text(&layout.font,
+				number, strlen(number), layout.size), number, strlen(number));
+	}
+
+	finish_toc_page(&layout);
+
+	pages = new_pdf_object(kPDF_OBJ_DICT);
+	set_pdf_key(pages, "Type", new_pdf_name("Pages"));
+	set_pdf_key(pages, "Count", new_pdf_int((long int)
+			layout.kids->u.array.count));
+	set_pdf_key(pages, "Kids", layout.kids);
+	write_pdf_object(&layout.writer, layout.pages_num, pages);
+	free_pdf_object(pages);
+
+	catalog_num = reserve_pdf_object(&layout.writer);
+	catalog = new_pdf_object(kPDF_OBJ_DICT);
+	set_pdf_key(catalog, "Type", new_pdf_name("Catalog"));
+	set_pdf_key(catalog, "Pages", new_pdf_ref(layout.pages_num));
+	write_pdf_object(&layout.writer, catalog_num, catalog);
+	free_pdf_object(catalog);
+	close_pdf_writer(&layout.writer, catalog_num);
+	writelog(kVERBOSE, _T("Typeset %lu titles of the table of contents\n"),
+			(unsigned long int) list->count);
+}
+
+/*
+ * Free the titles in the list pointed to by list and empty it. The
+ * value of list must not be NULL.
+ */
+void destroy_toc_list(struct toc_list* list)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(list);
+
+	for(i = 0; i < list->count; ++i)
+		free(list->entries[i].title);
+
+	free(list->entries);
+	list->entries = NULL;
+	list->count = 0;
+}
+
+/*
+ * Return the number of levels the given title of a table of contents
+ * is below the top level. The title starts with its section number,
+ * such as 2.1.0, followed by a no-break space, and each part of the
+ * number after the first that is not 0 is a level. The value of name
+ * must not be NULL.
+ */
+static unsigned long int get_toc_indentation(LPCTSTR name)
+{
+	LPTSTR name_dup = NULL;
+	LPTSTR section_number = NULL;
+	unsigned long int indentation = 0;
+
+	RT_NOT_NULL(name);
+
+	name_dup = require_dup_str(name);
+	section_number = _tcstok(name_dup, _T("\xa0\x00"));
+
+	if(section_number == NULL)
+		errorout(E_STR, _T("Failed to identify section number"));
+
+	section_number = _tcstok(section_number, _T("."));
+
+	while((section_number = _tcstok(NULL, _T("."))) != NULL)
+		if(_tcscmp(section_number, _T("0")) != 0)
+			indentation += 1;
+
+	free(name_dup);
+	return indentation;
+}
+
+/*
+ * Replace the XML character and entity references in the given title
+ * from the outline dump with the characters they stand for. Unknown
+ * references are left as they are. The value of title must not be
+ * NULL.
+ */
+static void unescape_toc_title(LPTSTR title)
+{
+	static const struct {
+		LPCTSTR name; /* reference without its ampersand */
+		TCHAR c; /* character it stands for */
+	} entities[] = { { _T("amp;"), _T('&') }, { _T("lt;"), _T('<') },
+			{ _T("gt;"), _T('>') }, { _T("quot;"), _T('"') },
+			{ _T("apos;"), _T('\'') } };
+	LPTSTR in = title;
+	LPTSTR out = title;
+	size_t i = 0;
+
+	RT_NOT_NULL(title);
+
+	while(*in != _T('\0')) {
+		if(*in != _T('&')) {
+			*out++ = *in++;
+			continue;
+		}
+
+		for(i = 0; i < LENGTHOF(entities); ++i)
+			if(_tcsncmp(in + 1, entities[i].name,
+					_tcslen(entities[i].name)) == 0)
+				break;
+
+		if(i < LENGTHOF(entities)) {
+			*out++ = entities[i].c;
+			in += 1 + _tcslen(entities[i].name);
+		} else if(in[1] == _T('#')) {
+			LPTSTR end = NULL;
+			unsigned long int c = in[2] == _T('x') ?
+					_tcstoul(in + 3, &end, 16) : _tcstoul(in + 2, &end, 10);
+
+			if(*end == _T(';') && c > 0 && c <= 0xffff) {
+				*out++ = (TCHAR) c;
+				in = end + 1;
+			} else {
+				*out++ = *in++;
+			}
+		} else {
+			*out++ = *in++;
+		}
+	}
+
+	*out = _T('\0');
+}
+
+/*
+ * Store the width and height in points of the pages of the cover page
+ * in the structure pointed to by info in the values pointed to by width
+ * and height. Pages the PDF getter would make A4 are A4. The values of
+ * info, width and height must not be NULL.
+ */
+static void read_page_size(const struct pdf_info* info, double* width,
+		double* height)
+{
+	const struct toc_paper* paper = &papers[4]; /* A4 */
+	size_t i = 0;
+
+	RT_NOT_NULL(info);
+	RT_NOT_NULL(width);
+	RT_NOT_NULL(height);
+
+	if(info->cover_page.size != NULL) {
+		for(i = 0; i < LENGTHOF(papers); ++i)
+			if(_tcsicmp(info->cover_page.size, papers[i].name) == 0)
+				break;
+
+		if(i < LENGTHOF(papers))
+			paper = &papers[i];
+		else
+			writelog(kNORM, _T("Unknown page size '%s'; using A4\n"),
+					info->cover_page.size);
+	}
+
+	*width = paper->width;
+	*height = paper->height;
+
+	if(info->cover_page.orientation != NULL
+			&& _tcsicmp(info->cover_page.orientation, _T("Landscape")) == 0) {
+		*width = paper->height;
+		*height = paper->width;
+	}
+}
+
+/*
+ * Move to the next line of the given layout, starting a new page if
+ * the line would go past the bottom margin or if no page is started.
+ * The value of layout must not be NULL.
+ */
+static void start_toc_line(struct toc_layout* layout)
+{
+	char buf[64] = "";
+
+	RT_NOT_NULL(layout);
+
+	if(layout->open) {
+		layout->y -= layout->size * TOC_LEADING;
+
+		if(layout->y + layout->font.descent * layout->size / 1000
+				>= layout->bottom)
+			return;
+
+		finish_toc_page(layout);
+	}
+
+	layout->open = 1;
+	layout->y = layout->top - layout->font.ascent * layout->size / 1000;
+	sprintf(buf, "BT\n/F1 %.2f Tf\n", layout->size);
+	append_pdf_buffer(&layout->content, buf, strlen(buf));
+}
+
+/*
+ * Write the page being filled in the given layout, if there is one,
+ * to its PDF. The value of layout must not be NULL.
+ */
+static void finish_toc_page(struct toc_layout* layout)
+{
+	struct pdf_obj* page = NULL;
+	struct pdf_obj* box = NULL;
+	struct pdf_obj* resources = NULL;
+	struct pdf_obj* fonts = NULL;
+	struct pdf_obj* stream = NULL;
+	unsigned long int page_num = 0;
+	unsigned long int content_num = 0;
+
+	RT_NOT_NULL(layout);
+
+	if(!layout->open)
+		return;
+
+	append_pdf_buffer(&layout->content, "ET\n", 3);
+	stream = new_pdf_object(kPDF_OBJ_STREAM);
+	stream->u.stream.dict = new_pdf_object(kPDF_OBJ_DICT);
+	stream->u.stream.data = layout->content.data;
+	stream->u.stream.len = layout->content.len;
+	content_num = reserve_pdf_object(&layout->writer);
+	write_pdf_object(&layout->writer, content_num, stream);
+	free_pdf_object(stream);
+
+	/* Page sizes are whole points, as the PDF getter writes them */
+	box = new_pdf_object(kPDF_OBJ_ARRAY);
+	append_pdf_item(box, new_pdf_int(0));
+	append_pdf_item(box, new_pdf_int(0));
+	append_pdf_item(box, new_pdf_int((long int) (layout->width + 0.5)));
+	append_pdf_item(box, new_pdf_int((long int) (layout->height + 0.5)));
+	fonts = new_pdf_object(kPDF_OBJ_DICT);
+	set_pdf_key(fonts, "F1", new_pdf_ref(layout->font_num));
+	resources = new_pdf_object(kPDF_OBJ_DICT);
+	set_pdf_key(resources, "Font", fonts);
+
+	page_num = reserve_pdf_object(&layout->writer);
+	page = new_pdf_object(kPDF_OBJ_DICT);
+	set_pdf_key(page, "Type", new_pdf_name("Page"));
+	set_pdf_key(page, "Parent", new_pdf_ref(layout->pages_num));
+	set_pdf_key(page, "MediaBox", box);
+	set_pdf_key(page, "Resources", resources);
+	set_pdf_key(page, "Contents", new_pdf_ref(content_num));
+	write_pdf_object(&layout->writer, page_num, page);
+	free_pdf_object(page);
+	append_pdf_item(layout->kids, new_pdf_ref(page_num));
+
+	free(layout->content.data);
+	memset(&layout->content, 0, sizeof(layout->content));
+	layout->open = 0;
+}
+
+/*
+ * Show the first len bytes of the given text on the current line of
+ * the given layout, starting at the given x. The values of layout and
+ * text must not be NULL.
+ */
+static void show_toc_text(struct toc_layout* layout, double x,
+		const char* text, size_t len)
+{
+	char buf[64] = "";
+
+	RT_NOT_NULL(layout);
+	RT_NOT_NULL(text);
+
+	if(len == 0)
+		return;
+
+	sprintf(buf, "1 0 0 1 %.2f %.2f Tm ", x, layout->y);
+	append_pdf_buffer(&layout->content, buf, strlen(buf));
+	append_pdf_text(&layout->content, text, len);
+}
+
+/*
+ * Return how many of the first len bytes of the given text fit in the
+ * given width in the font of the given layout. If not all of them fit,
+ * the text is broken after the last space that fits, or wherever it
+ * must be if none does, but never before its first byte. The values of
+ * layout and text must not be NULL.
+ */
+static size_t fit_toc_text(const struct toc_layout* layout, const char* text,
+		size_t len, double width)
+{
+	size_t fit = 0;
+	size_t space = 0; /* bytes up to the last space that fits, or 0 */
+	double used = 0.0;
+
+	RT_NOT_NULL(layout);
+	RT_NOT_NULL(text);
+
+	for(fit = 0; fit < len; ++fit) {
+		used += measure_pdf_text(&layout->font, &text[fit], 1, layout->size);
+
+		if(used > width)
+			break;
+
+		if(text[fit] == ' ')
+			space = fit;
+	}
+
+	if(fit == len)
+		return len;
+
+	if(space > 0)
+		return space;
+
+	return fit > 0 ? fit : 1;
+}
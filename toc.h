@@ -1,6 +1,20 @@
 #pragma once 
 
 #include "stdafx.h"
+#include "parse.h"
+
+/* A title of a table of contents typeset by write_toc_pdf() */
+struct toc_entry {
+	char* title; /* the title, encoded by encode_pdf_text() */
+	unsigned long int page; /* page number shown for it */
+	unsigned long int indentation; /* levels below the top level */
+};
+
+/* The titles of a table of contents, in order */
+struct toc_list {
+	struct toc_entry* entries; /* the titles */
+	size_t count; /* number of elements in entries */
+};
 
 void get_number_of_pages(unsigned long int*, LPCTSTR);
 void get_toc_item(LPTSTR, size_t, unsigned long int*, FILE*);
@@ -8,3 +22,6 @@ void write_toc_start(FILE*, LPCTSTR, LPCTSTR);
 void write_toc_item(FILE*, LPCTSTR, unsigned long int);
 void write_toc_end(FILE*);
 FILE* open_toc_stream(UINT* outline_pdf_id, const struct pdf_info* info);
+void add_toc_entry(struct toc_list*, LPCTSTR, unsigned long int);
+void write_toc_pdf(LPCTSTR, const struct toc_list*, const struct pdf_info*);
+void destroy_toc_list(struct toc_list*);
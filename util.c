@@ -33,6 +33,26 @@ void* require_cmem(size_t nmemb, size_t size)
 	return ret;
 }
 
+/*
+ * Resize the memory pointed to by ptr to hold nmemb elements of the
+ * given size and terminate execution if it is not successful. The value
+ * of ptr may be NULL. The pointer returned must be passed to free().
+ */
+void* require_realloc(void* ptr, size_t nmemb, size_t size)
+{
+	void* ret = NULL;
+
+	if(size != 0 && nmemb > (size_t) -1 / size)
+		errorout(E_MALLOC, _T("Failed to allocate memory"));
+
+	ret = realloc(ptr, nmemb * size);
+
+	if(ret == NULL && nmemb * size != 0)
+		errorout(E_MALLOC, _T("Failed to allocate memory"));
+
+	return ret;
+}
+
 /*
  * Generate a temporary file name with the given ID and terminate
  * execution if it is not successful. The ID that is used to generate
@@ -120,6 +140,64 @@ LPTSTR require_dup_str(LPCTSTR s)
 	return require_strf(_T("%s"), s);
 }
 
+/*
+ * Return a copy of the given string encoded as UTF-8. If it is not
+ * successful, execution is terminated. The value of s must not be NULL.
+ * The pointer returned must be passed to free().
+ */
+char* require_utf8(LPCTSTR s)
+{
+	char* ret = NULL;
+	int len = 0;
+
+	RT_NOT_NULL(s);
+
+#ifdef _UNICODE
+	len = WideCharToMultiByte(CP_UTF8, 0, s, -1, NULL, 0, NULL, NULL);
+
+	if(len == 0)
+		errorout(E_STR, _T("Failed to convert '%s' to UTF-8"), s);
+
+	ret = (char*) require_mem(len);
+	WideCharToMultiByte(CP_UTF8, 0, s, -1, ret, len, NULL, NULL);
+#else
+	len = (int) strlen(s) + 1;
+	ret = (char*) require_mem(len);
+	memcpy(ret, s, len);
+#endif
+
+	return ret;
+}
+
+/*
+ * Return a copy of the given UTF-8 string as a string of TCHARs. If it
+ * is not successful, execution is terminated. The value of s must not
+ * be NULL. The pointer returned must be passed to free().
+ */
+LPTSTR require_from_utf8(const char* s)
+{
+	LPTSTR ret = NULL;
+	int len = 0;
+
+	RT_NOT_NULL(s);
+
+#ifdef _UNICODE
+	len = MultiByteToWideChar(CP_UTF8, 0, s, -1, NULL, 0);
+
+	if(len == 0)
+		errorout(E_STR, _T("Failed to convert a string from UTF-8"));
+
+	ret = (LPTSTR) require_cmem(len, sizeof(*ret));
+	MultiByteToWideChar(CP_UTF8, 0, s, -1, ret, len);
+#else
+	len = (int) strlen(s) + 1;
+	ret = (LPTSTR) require_mem(len);
+	memcpy(ret, s, len);
+#endif
+
+	return ret;
+}
+
 /*
  * Allocate a string based on the given format and arguments using
  * dynamic memory and return the pointer to the new string. If it is not
@@ -269,6 +347,27 @@ void skip_line(FILE* fd)
 		;
 }
 
+/*
+ * Let WinInet open at least the given number of connections to each
+ * server at once, for the whole process. A higher limit set before is
+ * kept.
+ */
+void raise_conn_limit(DWORD conns)
+{
+	static const DWORD options[] = { INTERNET_OPTION_MAX_CONNS_PER_SERVER,
+			INTERNET_OPTION_MAX_CONNS_PER_1_0_SERVER };
+	size_t i = 0;
+
+	for(i = 0; i < LENGTHOF(options); ++i) {
+		DWORD current = 0;
+		DWORD size = sizeof(current);
+
+		if(!InternetQueryOption(NULL, options[i], &current, &size)
+				|| current < conns)
+			InternetSetOption(NULL, options[i], &conns, sizeof(conns));
+	}
+}
+
 /*
  * Removes the file with the given name. Returns 0 if successful,
  * Otherwise, it returns -1. The value of name must not be NULL.
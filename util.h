@@ -33,16 +33,20 @@
 
 void* require_mem(size_t);
 void* require_cmem(size_t, size_t);
+void* require_realloc(void*, size_t, size_t);
 void (require_tmp_file)(LPTSTR, UINT*);
 void (get_tmp_file)(LPTSTR, UINT*);
 FILE* (require_open_file)(LPCTSTR, LPCTSTR);
 LPTSTR require_dup_str(LPCTSTR);
+char* require_utf8(LPCTSTR);
+LPTSTR require_from_utf8(const char*);
 LPTSTR require_strf(LPCTSTR, ...);
 LPTSTR require_vstrf(LPCTSTR, va_list);
 unsigned long int require_strtoul(LPCTSTR, LPTSTR*, int);
 double require_strtod(LPCTSTR, LPTSTR*);
 FILE* require_log(LPCTSTR);
 void skip_line(FILE*);
+void raise_conn_limit(DWORD);
 int (remove_tmp_file)(LPCTSTR);
 int (release_file)(FILE*);
 FILE* (open_file)(LPCTSTR, LPCTSTR);
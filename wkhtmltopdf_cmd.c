@@ -2,12 +2,24 @@
 #include "stdafx.h"
 #include "wkhtmltopdf_cmd.h"
 #include "cmd.h"
+#include "proc.h"
+#include "renderer.h"
+#include "cache.h"
+#include "prefetch.h"
+#include "proxy.h"
+#include "toc.h"
 #include "util.h"
 #include "log.h"
 
 LPCTSTR pdf_getter_exe = _T("wkhtmltopdf");
 
 static void generate_cmd_str(LPTSTR, const struct wkhtmltopdf_cmd_info*);
+static void fill_cmd_info(struct wkhtmltopdf_cmd_info*, LPCTSTR, LPCTSTR,
+		unsigned long int, const struct pdf_info*,
+		const struct pdf_segment_info*, size_t, int);
+static LPTSTR join_sources(const struct pdf_info*,
+		const struct pdf_segment_info*, size_t, struct prefetch*,
+		struct cache_pending*);
 
 /*
  * Execute a synchronous instance of wkhtmltopdf. The values pointed to
@@ -20,54 +32,126 @@ static void generate_cmd_str(LPTSTR, const struct wkhtmltopdf_cmd_info*);
  * values of target_id, info and segment must not be NULL. The value of
  * outline_id must not be NULL if options specifies kPDF_DUMP. The
  * values pointed to by target_id and outline_id are set appropriately
- * to the IDs that are used to generate the temporary files.
+ * to the IDs that are used to generate the temporary files. The PDF is
+ * taken from the render cache of info if it is there and published in
+ * it otherwise.
  */
 void do_segment_to_pdf(UINT* target_id, UINT* outline_id,
 		unsigned long int pages, const struct pdf_info* info,
 		const struct pdf_segment_info* segment, int options) 
 {
-	FILE* pipe = NULL;
-	int status = 0;
-	
-	do_segment_to_pdf_async(&pipe, target_id, outline_id, pages, info, segment,
-			options);
-	status = _pclose(pipe);
-
-	if(status != 0)
-		errorout(E_PDFGETTER, _T("%s exited with status %d"), pdf_getter_exe,
-				status);
+	struct supervisor sup;
+	struct child child;
+	struct child* reaped = NULL;
+	struct cache_pending* pending = NULL; /* validators for the cache */
+	unsigned long int cached_pages = 0;
+
+	init_supervisor(&sup);
+	do_segment_to_pdf_async(&sup, &child, NULL, target_id, outline_id, pages,
+			info, segment, 1, options, NULL, &cached_pages, &pending);
+	reaped = wait_child(&sup, INFINITE);
+
+	/* The validators of a failed conversion are never published */
+	if(reaped != &child || child.status != 0)
+		free_pending(pending);
+
+	if(reaped != &child)
+		errorout(E_CMD, _T("Lost track of %s"), pdf_getter_exe);
+
+	check_child(&child, E_PDFGETTER, pdf_getter_exe);
+	release_child(&child);
+	destroy_supervisor(&sup);
+
+	if(cached_pages == 0 && info->render_cache_path != NULL) {
+		TCHAR target[MAX_PATH + 1] = _T("");
+
+		require_tmp_file(target, target_id);
+		get_number_of_pages(&cached_pages, target);
+		keep_segment_pdf(*target_id, outline_id != NULL ? *outline_id : 0,
+				pages, info, segment, 1, options, cached_pages, pending);
+	}
 }
 
 /*
  * Execute an asynchronous instance of wkhtmltopdf. The values pointed
  * to by target_id and outline_id are used to generate the temporary
  * file names. The value of pages is used as the page offset for the
- * segment. The structures pointed to by info and segment are used to
- * provide information about the current segment. The value of options
- * is a bitwise combination of html_to_pdf_options enumerations that
- * indicates the arguments that should be passed to the executable. The
- * values of target_id, info, pipe and segment must not be NULL. The
- * value of outline_id must not be NULL if options specifies kPDF_DUMP.
- * The values of target_id and outline_id are set appropriately to the
- * IDs that are used to generate the temporary files. The value pointed
- * to by pipe is set to the FILE pointer returned by _tpopen(). That
- * FILE pointer must be passed to _pclose().
+ * segment. The structure pointed to by info and the array of count
+ * segments pointed to by section are used to provide information about
+ * the current segments. Several segments are converted into a single
+ * PDF, each starting on a new page, and must share a size and an
+ * orientation. The value of options is a bitwise combination of
+ * html_to_pdf_options enumerations that indicates the arguments that
+ * should be passed to the executable. The values of sup, child,
+ * target_id, info and segment must not be NULL. The value of outline_id
+ * must not be NULL if options specifies kPDF_DUMP. The values of
+ * target_id and outline_id are set appropriately to the IDs that are
+ * used to generate the temporary files. The instance is started as the
+ * given child of the given supervisor with the given caller data by the
+ * renderer backend named in info. If the conversion is in the render
+ * cache of info, as find_segment_pdf() tells, it is copied to the
+ * temporary files instead, the child finishes at once and the value
+ * pointed to by cached_pages is set to its number of pages. Otherwise,
+ * that value is set to 0 and the value pointed to by pending to the
+ * validators to publish the PDF with. The values of cached_pages and
+ * pending may be NULL. The value of prefetch and those validators are
+ * passed on to start_segment_pdf(). The child must be reaped with
+ * wait_child() and passed to release_child().
+ */
+void do_segment_to_pdf_async(struct supervisor* sup, struct child* child,
+		void* data, UINT* target_id, UINT* outline_id,
+		unsigned long int pages, const struct pdf_info* info,
+		const struct pdf_segment_info* section, size_t count, int options,
+		struct prefetch* prefetch, unsigned long int* cached_pages,
+		struct cache_pending** pending)
+{
+	unsigned long int found_pages = 0;
+
+	if(find_segment_pdf(target_id, outline_id, pages, info, section, count,
+			options, &found_pages, pending)) {
+		start_child_work(sup, child, data);
+		finish_child(child, 0, NULL);
+	} else {
+		start_segment_pdf(sup, child, data, target_id, outline_id, pages,
+				info, section, count, options, prefetch,
+				pending != NULL ? *pending : NULL);
+	}
+
+	if(cached_pages != NULL)
+		*cached_pages = found_pages;
+}
+
+/*
+ * Look for the conversion of the array of count segments pointed to by
+ * section that do_segment_to_pdf_async() would start with the same
+ * arguments in the render cache of the structure pointed to by info.
+ * If it is there, it is copied to the temporary files named by the
+ * values pointed to by target_id and outline_id, which are set as
+ * do_segment_to_pdf_async() describes, the value pointed to by
+ * cached_pages is set to its number of pages and nonzero is returned.
+ * Otherwise, that value is set to 0, zero is returned and the value
+ * pointed to by pending is set to the validators to publish the PDF
+ * with, as fetch_render() describes. Checking the sources again may
+ * wait for their servers, so this is best done before the conversion
+ * is due to start. The values of target_id, info, section and
+ * cached_pages must not be NULL. The value of outline_id must not be
+ * NULL if options specifies kPDF_DUMP. The value of pending may be
+ * NULL.
  */
-void do_segment_to_pdf_async(FILE** pipe, UINT* target_id, UINT* outline_id,
+int find_segment_pdf(UINT* target_id, UINT* outline_id,
 		unsigned long int pages, const struct pdf_info* info,
-		const struct pdf_segment_info* section, int options)
+		const struct pdf_segment_info* section, size_t count, int options,
+		unsigned long int* cached_pages, struct cache_pending** pending)
 {
 	struct wkhtmltopdf_cmd_info cmd_info;
-	LPTSTR session_str = NULL;
-	LPTSTR source = NULL;
-	LPTSTR footer_url = NULL;
-	LPTSTR header_url = NULL;
 	TCHAR outline_path[MAX_PATH + 1] = _T("");
 	TCHAR target_path[MAX_PATH + 1] = _T("");
+	int found = 0;
 
 	RT_NOT_NULL(target_id);
 	RT_NOT_NULL(info);
 	RT_NOT_NULL(section);
+	RT_NOT_NULL(cached_pages);
 	RT_NOT_NULL(info->base_url);
 
 	if(options & kPDF_DUMP) {
@@ -76,46 +160,103 @@ void do_segment_to_pdf_async(FILE** pipe, UINT* target_id, UINT* outline_id,
 		require_tmp_file(outline_path, outline_id);
 	}
 
-	cmd_info.footer_url = NULL;
-	cmd_info.header_url = NULL;
 	require_tmp_file(target_path, target_id);
+	fill_cmd_info(&cmd_info, target_path, outline_path, pages, info, section,
+			count, options);
+	found = fetch_render(info, get_renderer(info->renderer), &cmd_info,
+			cached_pages, pending);
 
-	if(info->session != NULL)
-		session_str = require_strf(_T("&SESSION_OVERRIDE=%s"), info->session);
-	else
-		session_str = require_strf(_T(""));
+	if(!found)
+		*cached_pages = 0;
 
-	if(options & kPDF_FIRST_PAGE && info->hf_opts == kPDF_HF_SPECIAL) {
-		if(options & kPDF_FOOTER)
-			cmd_info.footer_url = info->first_footer_url;
+	free((LPTSTR) cmd_info.source);
+	return found;
+}
 
-		if(options & kPDF_HEADER)
-			cmd_info.header_url = info->first_header_url;
-	} else {
-		if(options & kPDF_FOOTER)
-			cmd_info.footer_url = info->footer_url;
+/*
+ * Start the conversion described by the arguments as
+ * do_segment_to_pdf_async() does, without looking for it in the render
+ * cache, which find_segment_pdf() was already asked. If prefetch is not
+ * NULL, the renderer is given the local copy of each segment it
+ * downloaded instead of the URL, which may wait for the download to
+ * finish, and the validators of that segment in the structure pointed
+ * to by pending, which may be NULL, are replaced by those of the copy.
+ * The render cache still goes by the URL. The values of sup, child,
+ * target_id, info and section must not be NULL. The value of outline_id
+ * must not be NULL if options specifies kPDF_DUMP. The child must be
+ * reaped with wait_child() and passed to release_child().
+ */
+void start_segment_pdf(struct supervisor* sup, struct child* child,
+		void* data, UINT* target_id, UINT* outline_id,
+		unsigned long int pages, const struct pdf_info* info,
+		const struct pdf_segment_info* section, size_t count, int options,
+		struct prefetch* prefetch, struct cache_pending* pending)
+{
+	struct wkhtmltopdf_cmd_info cmd_info;
+	TCHAR outline_path[MAX_PATH + 1] = _T("");
+	TCHAR target_path[MAX_PATH + 1] = _T("");
 
-		if(options & kPDF_HEADER)
-			cmd_info.header_url = info->header_url;
+	RT_NOT_NULL(target_id);
+	RT_NOT_NULL(info);
+	RT_NOT_NULL(section);
+	RT_NOT_NULL(info->base_url);
+
+	if(options & kPDF_DUMP) {
+		RT_NOT_NULL(outline_id);
+
+		require_tmp_file(outline_path, outline_id);
+	}
+
+	require_tmp_file(target_path, target_id);
+	fill_cmd_info(&cmd_info, target_path, outline_path, pages, info, section,
+			count, options);
+
+	if(prefetch != NULL) {
+		free((LPTSTR) cmd_info.source);
+		cmd_info.source = join_sources(info, section, count, prefetch,
+				pending);
+	}
+
+	get_renderer(info->renderer)->start(sup, child, data, &cmd_info);
+	free((LPTSTR) cmd_info.source);
+}
+
+/*
+ * Publish the finished conversion of the array of count segments
+ * pointed to by section, which has page_count pages, in the render
+ * cache of the structure pointed to by info with the validators pointed
+ * to by pending, which are freed. The values of target_id, outline_id,
+ * pages, info, section, count and options must be those the conversion
+ * was started with by do_segment_to_pdf_async(), which gave pending.
+ * Nothing is published if the render_cache_path member of info is
+ * NULL. The values of info and section must not be NULL.
+ */
+void keep_segment_pdf(UINT target_id, UINT outline_id,
+		unsigned long int pages, const struct pdf_info* info,
+		const struct pdf_segment_info* section, size_t count, int options,
+		unsigned long int page_count, struct cache_pending* pending)
+{
+	struct wkhtmltopdf_cmd_info cmd_info;
+	TCHAR outline_path[MAX_PATH + 1] = _T("");
+	TCHAR target_path[MAX_PATH + 1] = _T("");
+
+	RT_NOT_NULL(info);
+	RT_NOT_NULL(section);
+
+	if(info->render_cache_path == NULL) {
+		free_pending(pending);
+		return;
 	}
 
-	source = require_strf(_T("%s%s%s"), info->base_url != NULL ?
-				info->base_url : _T(""), section->segment, session_str);
-	free(session_str);
-	cmd_info.source = source;
-	cmd_info.exe = pdf_getter_exe;
-	cmd_info.options = options;
-	cmd_info.orientation = section->orientation;
-	cmd_info.outline_target = outline_path;
-	cmd_info.pages = pages;
-	cmd_info.size = section->size;
-	cmd_info.target = target_path;
-	cmd_info.margins = info->margins;
-
-	do_wkhtmltopdf_execute(pipe, &cmd_info);
-	free(source);
-	free(footer_url);
-	free(header_url);
+	if(options & kPDF_DUMP)
+		require_tmp_file(outline_path, &outline_id);
+
+	require_tmp_file(target_path, &target_id);
+	fill_cmd_info(&cmd_info, target_path, outline_path, pages, info, section,
+			count, options);
+	publish_render(info, get_renderer(info->renderer), &cmd_info,
+			page_count, pending);
+	free((LPTSTR) cmd_info.source);
 }
 
 /*
@@ -146,6 +287,32 @@ void do_wkhtmltopdf_execute(FILE** pipe,
 		errorout(E_CMD, _T("Failed to execute %s (%d)"), pdf_getter_exe, err);
 }
 
+/*
+ * Start an instance of wkhtmltopdf as the given child of the given
+ * supervisor with the given caller data. The structure pointed to by
+ * cmd_info is used to provide information about the command to be
+ * executed and its arguments. The values of sup, child and cmd_info
+ * must not be NULL. The child must be reaped with wait_child() and
+ * passed to release_child().
+ */
+void do_wkhtmltopdf_start(struct supervisor* sup, struct child* child,
+		void* data, const struct wkhtmltopdf_cmd_info* cmd_info)
+{
+	LPTSTR cmd_base = (LPTSTR) require_cmem(sizeof(*cmd_base), CMD_MAX_LEN);
+	enum cmd_err err = CMD_ERR_SUCCESS;
+
+	RT_NOT_NULL(sup);
+	RT_NOT_NULL(child);
+	RT_NOT_NULL(cmd_info);
+
+	generate_cmd_str(cmd_base, cmd_info);
+	err = start_child(sup, child, data, _T("%s"), cmd_base);
+	free(cmd_base);
+
+	if(err != CMD_ERR_SUCCESS)
+		errorout(E_CMD, _T("Failed to execute %s (%d)"), pdf_getter_exe, err);
+}
+
 /*
  * Generate a wkhtmltopdf command from the given options. The structure
  * pointed to by cmd_info specifies which arguments and information to
@@ -175,6 +342,16 @@ static void generate_cmd_str(LPTSTR cmd,
 	max_len -= ret;
 	cmd += ret;
 
+	if(cmd_info->proxy != NULL) {
+		ret = _sntprintf(cmd, max_len, _T(" --proxy %s"), cmd_info->proxy);
+
+		if(ret >= max_len || ret < 0)
+			goto fail;
+
+		max_len -= ret;
+		cmd += ret;
+	}
+
 	if(cmd_info->options & kPDF_NO_OUTLINE) {
 		ret = _sntprintf(cmd, max_len, _T(" --no-outline"));
 
@@ -288,8 +465,9 @@ static void generate_cmd_str(LPTSTR cmd,
 		cmd += ret;
 	}
 
-	ret = _sntprintf(cmd, max_len, _T(" \"%s\" %s"),
-			cmd_info->source, cmd_info->target);
+	ret = _sntprintf(cmd, max_len, cmd_info->options & kPDF_BATCH ?
+			_T(" %s %s") : _T(" \"%s\" %s"), cmd_info->source,
+			cmd_info->target);
 
 	if(ret < max_len && ret >= 0)
 		return;
@@ -299,3 +477,129 @@ fail:
 			_T("Failed to create format string for PDF getter"),
 			cmd_info->options);
 }
+
+/*
+ * Return a description of the wkhtmltopdf executable that is run,
+ * which is its path, size and last write time, so that it changes when
+ * the executable is replaced. If it cannot be found, its name is used.
+ * The string returned must be passed to free().
+ */
+LPTSTR describe_wkhtmltopdf(void)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attrs;
+	TCHAR path[MAX_PATH + 1] = _T("");
+	DWORD len = 0;
+
+	len = SearchPath(NULL, pdf_getter_exe, _T(".exe"), LENGTHOF(path), path,
+			NULL);
+
+	if(len == 0 || len >= LENGTHOF(path)
+			|| !GetFileAttributesEx(path, GetFileExInfoStandard, &attrs))
+		return require_dup_str(pdf_getter_exe);
+
+	return require_strf(_T("%s %lu:%lu %lu:%lu"), path,
+			attrs.nFileSizeHigh, attrs.nFileSizeLow,
+			attrs.ftLastWriteTime.dwHighDateTime,
+			attrs.ftLastWriteTime.dwLowDateTime);
+}
+
+/*
+ * Fill in the structure pointed to by cmd_info for converting the array
+ * of count segments pointed to by section to the files at the given
+ * paths, as described by do_segment_to_pdf_async(). The source member
+ * is allocated and must be passed to free(). The values of cmd_info,
+ * target_path, outline_path, info and section must not be NULL.
+ */
+static void fill_cmd_info(struct wkhtmltopdf_cmd_info* cmd_info,
+		LPCTSTR target_path, LPCTSTR outline_path, unsigned long int pages,
+		const struct pdf_info* info, const struct pdf_segment_info* section,
+		size_t count, int options)
+{
+	RT_NOT_NULL(cmd_info);
+	RT_NOT_NULL(info);
+	RT_NOT_NULL(section);
+
+	cmd_info->footer_url = NULL;
+	cmd_info->header_url = NULL;
+
+	if(options & kPDF_FIRST_PAGE && info->hf_opts == kPDF_HF_SPECIAL) {
+		if(options & kPDF_FOOTER)
+			cmd_info->footer_url = info->first_footer_url;
+
+		if(options & kPDF_HEADER)
+			cmd_info->header_url = info->first_header_url;
+	} else {
+		if(options & kPDF_FOOTER)
+			cmd_info->footer_url = info->footer_url;
+
+		if(options & kPDF_HEADER)
+			cmd_info->header_url = info->header_url;
+	}
+
+	cmd_info->source = join_sources(info, section, count, NULL, NULL);
+	cmd_info->exe = pdf_getter_exe;
+	cmd_info->options = count > 1 ? options | kPDF_BATCH : options;
+	cmd_info->orientation = section->orientation;
+	cmd_info->outline_target = outline_path;
+	cmd_info->pages = pages;
+	cmd_info->proxy = get_proxy_url(info);
+	cmd_info->size = section->size;
+	cmd_info->target = target_path;
+	cmd_info->margins = info->margins;
+}
+
+/*
+ * Return the sources of the array of count segments pointed to by
+ * section as the PDF getter takes them: a single URL, or several quoted
+ * ones passed as one (kPDF_BATCH). If prefetch is not NULL, the local
+ * copy of each segment it downloaded is given instead of its URL,
+ * waiting for downloads in progress, and its validators replace those
+ * of the segment in the structure pointed to by pending, which may be
+ * NULL. The pointer returned must be passed to free(). The values of
+ * info and section must not be NULL.
+ */
+static LPTSTR join_sources(const struct pdf_info* info,
+		const struct pdf_segment_info* section, size_t count,
+		struct prefetch* prefetch, struct cache_pending* pending)
+{
+	LPTSTR source = require_strf(_T(""));
+	size_t i = 0;
+
+	for(i = 0; i < count; ++i) {
+		LPTSTR url = get_segment_url(info, &section[i]);
+		LPCTSTR etag = NULL;
+		LPCTSTR modified = NULL;
+		LPCTSTR local = wait_prefetched(prefetch, url, &etag, &modified);
+		LPTSTR sources = require_strf(count > 1 ? _T("%s%s\"%s\"") :
+				_T("%s%s%s"), source, i > 0 ? _T(" ") : _T(""),
+				local != NULL ? local : url);
+
+		if(local != NULL)
+			replace_validators(pending, i, etag, modified);
+
+		free(url);
+		free(source);
+		source = sources;
+	}
+
+	return source;
+}
+
+/*
+ * Return the URL the PDF getter loads for the given segment: the base
+ * URL of the structure pointed to by info followed by the segment and,
+ * if there is one, the session as a SESSION_OVERRIDE parameter. The
+ * pointer returned must be passed to free(). The values of info and
+ * section must not be NULL.
+ */
+LPTSTR get_segment_url(const struct pdf_info* info,
+		const struct pdf_segment_info* section)
+{
+	RT_NOT_NULL(info);
+	RT_NOT_NULL(section);
+
+	return require_strf(_T("%s%s%s%s"),
+			info->base_url != NULL ? info->base_url : _T(""), section->segment,
+			info->session != NULL ? _T("&SESSION_OVERRIDE=") : _T(""),
+			info->session != NULL ? info->session : _T(""));
+}
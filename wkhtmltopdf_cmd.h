@@ -2,6 +2,7 @@
 
 #include "stdafx.h"
 #include "parse.h"
+#include "proc.h"
 
 enum html_to_pdf_options {
 	kPDF_NONE = 0, /* no effect */
@@ -15,6 +16,7 @@ enum html_to_pdf_options {
 	kPDF_HEADER = 1 << 7, /* indicate a header is present */
 	kPDF_MARGINS = 1 << 8, /* indicate margins are present */
 	kPDF_FIRST_PAGE = 1 << 9, /* indicate this is the first page */
+	kPDF_BATCH = 1 << 10, /* indicate the source holds quoted sources */
 
 	/* normal body page preset */
 	kPDF_NORM = kPDF_NO_OUTLINE | kPDF_DUMP | kPDF_OFFSET | kPDF_ORIENTATION
@@ -39,6 +41,7 @@ struct wkhtmltopdf_cmd_info {
 	LPCTSTR footer_url; /* full footer URL */
 	LPCTSTR header_url; /* full header URL */
 	LPCTSTR orientation; /* orientation string */
+	LPCTSTR proxy; /* URL of the proxy to load through, or NULL */
 	LPCTSTR size; /* size string */
 	LPCTSTR source; /* full source URL */
 	LPCTSTR target; /* path to output file */
@@ -46,10 +49,30 @@ struct wkhtmltopdf_cmd_info {
 	int options; /* combination of html_to_pdf_options enums */
 };
 
+struct prefetch;
+struct cache_pending;
+
 extern LPCTSTR pdf_getter_exe; /* path to the PDF getter executable */
 
 void do_segment_to_pdf(UINT*, UINT*, unsigned long int, const struct pdf_info*,
 		const struct pdf_segment_info*, int);
-void do_segment_to_pdf_async(FILE**, UINT*, UINT*, unsigned long int,
-		const struct pdf_info*, const struct pdf_segment_info*, int);
+void do_segment_to_pdf_async(struct supervisor*, struct child*, void*, UINT*,
+		UINT*, unsigned long int, const struct pdf_info*,
+		const struct pdf_segment_info*, size_t, int, struct prefetch*,
+		unsigned long int*, struct cache_pending**);
+int find_segment_pdf(UINT*, UINT*, unsigned long int, const struct pdf_info*,
+		const struct pdf_segment_info*, size_t, int, unsigned long int*,
+		struct cache_pending**);
+void start_segment_pdf(struct supervisor*, struct child*, void*, UINT*,
+		UINT*, unsigned long int, const struct pdf_info*,
+		const struct pdf_segment_info*, size_t, int, struct prefetch*,
+		struct cache_pending*);
+void keep_segment_pdf(UINT, UINT, unsigned long int, const struct pdf_info*,
+		const struct pdf_segment_info*, size_t, int, unsigned long int,
+		struct cache_pending*);
 void do_wkhtmltopdf_execute(FILE**, const struct wkhtmltopdf_cmd_info*);
+void do_wkhtmltopdf_start(struct supervisor*, struct child*, void*,
+		const struct wkhtmltopdf_cmd_info*);
+LPTSTR describe_wkhtmltopdf(void);
+LPTSTR get_segment_url(const struct pdf_info*,
+		const struct pdf_segment_info*);
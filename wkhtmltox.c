@@ -0,0 +1,310 @@
+#include "stdafx.h"
+
+#ifdef HAVE_WKHTMLTOX
+
+#include <wkhtmltox/pdf.h>
+#include "renderer.h"
+#include "util.h"
+#include "log.h"
+
+#pragma comment(lib, "wkhtmltox.lib")
+
+/* A conversion queued for the in-process engine */
+struct library_render {
+	struct library_render* next; /* next queued conversion */
+	struct child* child; /* child standing for the conversion */
+	char** sources; /* sources to convert */
+	char* target; /* path to the PDF to write */
+	char* outline; /* path to the outline to write, or NULL */
+	char* header; /* header URL, or NULL */
+	char* footer; /* footer URL, or NULL */
+	char* size; /* paper size, or NULL */
+	char* orientation; /* page orientation, or NULL */
+	char* proxy; /* URL of the proxy to load through, or NULL */
+	char* margins[6]; /* top, bottom, left, right, header and footer */
+	size_t count; /* number of elements in sources */
+	unsigned long int offset; /* page offset of the first source */
+	int options; /* combination of html_to_pdf_options enums */
+};
+
+/* Conversions waiting for the engine thread */
+static struct {
+	INIT_ONCE once; /* starts the engine thread */
+	CRITICAL_SECTION lock; /* protects the members below */
+	CONDITION_VARIABLE queued; /* signaled when a conversion is queued */
+	struct library_render* head; /* oldest queued conversion */
+	struct library_render* tail; /* newest queued conversion */
+} engine = { INIT_ONCE_STATIC_INIT };
+
+static BOOL CALLBACK start_engine(PINIT_ONCE, PVOID, PVOID*);
+static unsigned __stdcall engine_thread(void*);
+static DWORD convert(const struct library_render*);
+static void free_render(struct library_render*);
+
+/*
+ * Queue a conversion by the in-process wkhtmltox engine as the given
+ * child of the given supervisor with the given caller data. The engine
+ * is initialized once and converts on a single thread of its own,
+ * since the library does not allow anything else, so conversions with
+ * this backend never overlap, whatever iParallelRenders asks for. That
+ * thread is started by the first conversion. The values of sup, child
+ * and cmd_info must not be NULL.
+ */
+void start_library_render(struct supervisor* sup, struct child* child,
+		void* data, const struct wkhtmltopdf_cmd_info* cmd_info)
+{
+	struct library_render* render = NULL;
+	LPTSTR* sources = NULL;
+	size_t i = 0;
+
+	RT_NOT_NULL(cmd_info);
+	RT_NOT_NULL(cmd_info->target);
+
+	if(!InitOnceExecuteOnce(&engine.once, start_engine, NULL, NULL))
+		errorout(E_CMD, _T("Failed to start the wkhtmltox engine"));
+
+	render = (struct library_render*) require_cmem(1, sizeof(*render));
+	render->child = child;
+	sources = split_sources(cmd_info, &render->count);
+	render->sources = (char**) require_cmem(render->count,
+			sizeof(*render->sources));
+
+	for(i = 0; i < render->count; ++i)
+		render->sources[i] = require_utf8(sources[i]);
+
+	free_sources(sources, render->count);
+	render->target = require_utf8(cmd_info->target);
+	render->options = cmd_info->options;
+	render->offset = cmd_info->pages;
+
+	if(cmd_info->options & kPDF_DUMP)
+		render->outline = require_utf8(cmd_info->outline_target);
+
+	if(cmd_info->options & kPDF_HEADER)
+		render->header = require_utf8(cmd_info->header_url);
+
+	if(cmd_info->options & kPDF_FOOTER)
+		render->footer = require_utf8(cmd_info->footer_url);
+
+	if(cmd_info->options & kPDF_SIZE)
+		render->size = require_utf8(cmd_info->size);
+
+	if(cmd_info->options & kPDF_ORIENTATION)
+		render->orientation = require_utf8(cmd_info->orientation);
+
+	if(cmd_info->proxy != NULL)
+		render->proxy = require_utf8(cmd_info->proxy);
+
+	if(cmd_info->options & kPDF_MARGINS) {
+		render->margins[0] = require_utf8(cmd_info->margins.top);
+		render->margins[1] = require_utf8(cmd_info->margins.bottom);
+		render->margins[2] = require_utf8(cmd_info->margins.left);
+		render->margins[3] = require_utf8(cmd_info->margins.right);
+		render->margins[4] = require_utf8(cmd_info->margins.header);
+		render->margins[5] = require_utf8(cmd_info->margins.footer);
+	}
+
+	start_child_work(sup, child, data);
+	EnterCriticalSection(&engine.lock);
+
+	if(engine.tail != NULL)
+		engine.tail->next = render;
+	else
+		engine.head = render;
+
+	engine.tail = render;
+	WakeConditionVariable(&engine.queued);
+	LeaveCriticalSection(&engine.lock);
+}
+
+/*
+ * Return a description of the in-process engine, which is the version
+ * of the wkhtmltox library it was loaded from. The string returned
+ * must be passed to free().
+ */
+LPTSTR describe_library_render(void)
+{
+	return require_strf(_T("wkhtmltox %hs"), wkhtmltopdf_version());
+}
+
+/*
+ * Initialize the queue of the engine and start its thread. This is an
+ * InitOnceExecuteOnce() callback; its parameters are unused.
+ */
+static BOOL CALLBACK start_engine(PINIT_ONCE once, PVOID param,
+		PVOID* context)
+{
+	HANDLE thread = NULL;
+
+	InitializeCriticalSection(&engine.lock);
+	InitializeConditionVariable(&engine.queued);
+	thread = (HANDLE) _beginthreadex(NULL, 0, engine_thread, NULL, 0, NULL);
+
+	if(thread == 0)
+		return FALSE;
+
+	CloseHandle(thread);
+	return TRUE;
+}
+
+/*
+ * Initialize the wkhtmltox engine and then do each queued conversion in
+ * turn, forever. If the engine cannot be initialized, every conversion
+ * fails instead, so that only the jobs using it do. The engine is torn
+ * down when the process exits. The value of arg is unused.
+ */
+static unsigned __stdcall engine_thread(void* arg)
+{
+	int started = wkhtmltopdf_init(0); /* nonzero if the engine works */
+
+	if(started)
+		writelog(kVERBOSE, _T("Started wkhtmltox %hs\n"),
+				wkhtmltopdf_version());
+	else
+		writelog(kNORM, _T("Failed to initialize wkhtmltox\n"));
+
+	for(;;) {
+		struct library_render* render = NULL;
+		struct child* child = NULL;
+		DWORD status = 0;
+
+		EnterCriticalSection(&engine.lock);
+
+		while(engine.head == NULL)
+			SleepConditionVariableCS(&engine.queued, &engine.lock, INFINITE);
+
+		render = engine.head;
+		engine.head = render->next;
+
+		if(engine.head == NULL)
+			engine.tail = NULL;
+
+		LeaveCriticalSection(&engine.lock);
+		child = render->child;
+		status = started ? convert(render) : 1;
+		free_render(render);
+
+		if(!started)
+			finish_child(child, status, "wkhtmltox failed to initialize");
+		else
+			finish_child(child, status, status != 0 ?
+					"wkhtmltox failed to convert the page" : NULL);
+	}
+}
+
+/*
+ * Do the conversion described by the structure pointed to by render
+ * with the same settings the process backend passes on the command
+ * line. Return 0 on success, or the HTTP error code of the failure if
+ * there is one, or 1. The value of render must not be NULL.
+ */
+static DWORD convert(const struct library_render* render)
+{
+	static const char* margin_names[] = { "margin.top", "margin.bottom",
+			"margin.left", "margin.right" };
+	wkhtmltopdf_global_settings* global = NULL;
+	wkhtmltopdf_converter* converter = NULL;
+	int http_code = 0;
+	int ok = 0;
+	size_t i = 0;
+	char offset[32] = "";
+
+	RT_NOT_NULL(render);
+
+	global = wkhtmltopdf_create_global_settings();
+	wkhtmltopdf_set_global_setting(global, "out", render->target);
+
+	if(render->options & kPDF_NO_OUTLINE)
+		wkhtmltopdf_set_global_setting(global, "outline", "false");
+
+	if(render->outline != NULL)
+		wkhtmltopdf_set_global_setting(global, "dumpOutline", render->outline);
+
+	if(render->options & kPDF_OFFSET) {
+		sprintf(offset, "%lu", render->offset);
+		wkhtmltopdf_set_global_setting(global, "pageOffset", offset);
+	}
+
+	if(render->orientation != NULL)
+		wkhtmltopdf_set_global_setting(global, "orientation",
+				render->orientation);
+
+	if(render->size != NULL)
+		wkhtmltopdf_set_global_setting(global, "size.paperSize", render->size);
+
+	for(i = 0; i < LENGTHOF(margin_names); ++i)
+		if(render->margins[i] != NULL)
+			wkhtmltopdf_set_global_setting(global, margin_names[i],
+					render->margins[i]);
+
+	converter = wkhtmltopdf_create_converter(global);
+
+	for(i = 0; i < render->count; ++i) {
+		wkhtmltopdf_object_settings* object =
+				wkhtmltopdf_create_object_settings();
+
+		wkhtmltopdf_set_object_setting(object, "page", render->sources[i]);
+		wkhtmltopdf_set_object_setting(object,
+				"web.enableIntelligentShrinking", "false");
+
+		if(render->header != NULL)
+			wkhtmltopdf_set_object_setting(object, "header.htmlUrl",
+					render->header);
+
+		if(render->footer != NULL)
+			wkhtmltopdf_set_object_setting(object, "footer.htmlUrl",
+					render->footer);
+
+		if(render->proxy != NULL)
+			wkhtmltopdf_set_object_setting(object, "load.proxy",
+					render->proxy);
+
+		if(render->margins[4] != NULL)
+			wkhtmltopdf_set_object_setting(object, "header.spacing",
+					render->margins[4]);
+
+		if(render->margins[5] != NULL)
+			wkhtmltopdf_set_object_setting(object, "footer.spacing",
+					render->margins[5]);
+
+		wkhtmltopdf_add_object(converter, object, NULL);
+	}
+
+	ok = wkhtmltopdf_convert(converter);
+	http_code = wkhtmltopdf_http_error_code(converter);
+	wkhtmltopdf_destroy_converter(converter);
+
+	if(ok)
+		return 0;
+
+	return http_code > 0 ? (DWORD) http_code : 1;
+}
+
+/*
+ * Release the structure pointed to by render and everything it owns.
+ * The value of render must not be NULL.
+ */
+static void free_render(struct library_render* render)
+{
+	size_t i = 0;
+
+	RT_NOT_NULL(render);
+
+	for(i = 0; i < render->count; ++i)
+		free(render->sources[i]);
+
+	for(i = 0; i < LENGTHOF(render->margins); ++i)
+		free(render->margins[i]);
+
+	free(render->sources);
+	free(render->target);
+	free(render->outline);
+	free(render->header);
+	free(render->footer);
+	free(render->size);
+	free(render->orientation);
+	free(render->proxy);
+	free(render);
+}
+
+#endif /* HAVE_WKHTMLTOX */